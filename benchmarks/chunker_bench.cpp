@@ -0,0 +1,119 @@
+// Chunker benchmark: single-thread throughput of each candidate scan
+// engine the CPU supports, next to memcpy for the memory bandwidth, after
+// checking its cut points against the scalar engine. Also reports the
+// chunk size distribution and how many chunks survive an insertion.
+//
+//   g++ -std=c++14 -O2 benchmarks/chunker_bench.cpp -o chunker_bench
+//   ./chunker_bench [megabytes per run]
+
+#include "../common/chunker.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static double Seconds(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Chunk lengths of data fed in buffers of bufferSize, as FileHasher does
+static vector<size_t> SplitAll(Chunker& chunker, const vector<uint8_t>& data, size_t bufferSize) {
+    vector<size_t> lengths;
+    size_t offset = 0;
+    while (offset < data.size()) {
+        size_t size = min(bufferSize, data.size() - offset);
+        bool atEnd = offset + size == data.size();
+        offset += chunker.Split(data.data() + offset, size, atEnd, lengths);
+    }
+    return lengths;
+}
+
+// Chunk contents as strings, to compare two versions of the data
+static set<string> Chunks(const vector<uint8_t>& data, const vector<size_t>& lengths) {
+    set<string> chunks;
+    size_t offset = 0;
+    for (size_t length : lengths) {
+        chunks.insert(string((const char*)data.data() + offset, length));
+        offset += length;
+    }
+    return chunks;
+}
+
+int main(int argc, char* argv[]) {
+    size_t megabytes = argc > 1 ? (size_t)atoi(argv[1]) : 1024;
+    const size_t BUFFER_SIZE = 4 * 1024 * 1024;  // Same read size as FileHasher::ChunkAndHash
+
+    vector<uint8_t> data(64 * 1024 * 1024);
+    uint64_t seed = 12345;  // xorshift64: no repeats within the buffer
+    for (size_t i = 0; i < data.size(); i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        data[i] = (uint8_t)(seed >> 32);
+    }
+
+    Chunker::SetEngine(ChunkerEngine::Scalar);
+    Chunker reference;
+    vector<size_t> expected = SplitAll(reference, data, BUFFER_SIZE);
+
+    // memcpy of the same volume, for the bandwidth the engines compete with
+    vector<uint8_t> copy(BUFFER_SIZE);
+    auto start = chrono::steady_clock::now();
+    for (size_t done = 0; done < megabytes * 1024 * 1024; done += BUFFER_SIZE) {
+        memcpy(copy.data(), data.data() + done % data.size(), BUFFER_SIZE);
+    }
+    double copySeconds = Seconds(start);
+    printf("%-10s %12s %10s\n", "engine", "GB/s/core", "status");
+    printf("%-10s %12.2f %10s\n", "memcpy", (double)megabytes * 1024 * 1024 / copySeconds / 1e9, "-");
+
+    const ChunkerEngine engines[] = {ChunkerEngine::Scalar, ChunkerEngine::Avx2};
+    for (ChunkerEngine engine : engines) {
+        if (!Chunker::SetEngine(engine)) {
+            printf("%-10s %12s %10s\n", Chunker::EngineName(engine), "-", "n/a");
+            continue;
+        }
+
+        Chunker chunker;
+        bool correct = SplitAll(chunker, data, BUFFER_SIZE) == expected &&
+                       SplitAll(chunker, data, BUFFER_SIZE - 12345) == expected;
+
+        vector<size_t> lengths;
+        start = chrono::steady_clock::now();
+        for (size_t done = 0; done < megabytes * 1024 * 1024; done += BUFFER_SIZE) {
+            lengths.clear();
+            chunker.Split(data.data() + done % data.size(), BUFFER_SIZE, false, lengths);
+        }
+        double seconds = Seconds(start);
+        printf("%-10s %12.2f %10s\n", Chunker::EngineName(engine),
+               (double)megabytes * 1024 * 1024 / seconds / 1e9, correct ? "ok" : "MISMATCH");
+    }
+
+    size_t smallest = expected[0], largest = 0;
+    for (size_t length : expected) {
+        smallest = min(smallest, length);
+        largest = max(largest, length);
+    }
+    printf("\nchunks: %zu, mean %zu bytes, min %zu, max %zu (configured %zu/%zu/%zu)\n", expected.size(),
+           data.size() / expected.size(), smallest, largest, reference.MinSize(), reference.AvgSize(),
+           reference.MaxSize());
+
+    // Insert 100 bytes in the middle: only the chunks around it change
+    vector<uint8_t> edited(data.begin(), data.begin() + data.size() / 2);
+    edited.insert(edited.end(), 100, 'x');
+    edited.insert(edited.end(), data.begin() + data.size() / 2, data.end());
+    Chunker::SetEngine(Chunker::BestEngine());
+    Chunker chunker;
+    set<string> before = Chunks(data, expected);
+    vector<size_t> editedLengths = SplitAll(chunker, edited, BUFFER_SIZE);
+    size_t shared = 0;
+    for (const string& chunk : Chunks(edited, editedLengths)) {
+        shared += before.count(chunk);
+    }
+    printf("after a 100-byte insertion: %zu of %zu chunks unchanged\n", shared, editedLengths.size());
+    return 0;
+}
@@ -0,0 +1,175 @@
+// Path map benchmark: PathMap against std::map<string, Digest>, the index
+// type it replaces, on synthetic paths shaped like a source tree. Reports
+// insert, lookup (hits in scattered order, then misses) and sorted export
+// time, and the resident memory each structure adds (Linux only).
+//
+//   g++ -std=c++14 -O2 benchmarks/path_map_bench.cpp -o path_map_bench
+//   ./path_map_bench [millions of paths]
+//
+// PathMap runs first: its blocks are large allocations that go back to the
+// system when it is freed, so the std::map measurement starts clean.
+
+#include "../common/digest.h"
+#include "../common/path_map.h"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+
+#ifdef __linux__
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+static double Seconds(chrono::steady_clock::time_point start) {
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+// Resident set size in bytes; 0 where it cannot be read
+static long long ResidentBytes() {
+#ifdef __linux__
+    FILE* file = fopen("/proc/self/statm", "r");
+    long long pages = 0, resident = 0;
+    if (file) {
+        if (fscanf(file, "%lld %lld", &pages, &resident) != 2) resident = 0;
+        fclose(file);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+#else
+    return 0;
+#endif
+}
+
+// Path number i: 64 users, 256 projects each, files spread over modules
+static void MakePath(size_t i, bool missing, string& path) {
+    char buffer[128];
+    snprintf(buffer, sizeof(buffer), "home/user%02zu/project%03zu/src/module%04zu/%s%zu.cpp", i % 64, (i / 64) % 256,
+             (i / 16384) % 10000, missing ? "missing_" : "file_", i);
+    path = buffer;
+}
+
+static Digest MakeDigest(size_t i) {
+    Digest digest;
+    for (size_t j = 0; j < Digest::SIZE; j++) {
+        digest.bytes[j] = (uint8_t)(i >> ((j % 8) * 8)) ^ (uint8_t)j;
+    }
+    return digest;
+}
+
+// Visits 0..count-1 in a scattered order (a stride coprime to count)
+static size_t Scatter(size_t k, size_t count) {
+    return (size_t)((k * 2654435761ULL) % count);
+}
+
+struct Result {
+    double insertSeconds;
+    double hitSeconds;
+    double missSeconds;
+    double exportSeconds;
+    long long bytes;
+    size_t errors;
+};
+
+static void Print(const char* name, size_t count, const Result& result) {
+    printf("%-10s %10.0f %10.0f %10.0f %10.2f %10.1f %8zu\n", name, result.insertSeconds * 1e9 / count,
+           result.hitSeconds * 1e9 / count, result.missSeconds * 1e9 / count, result.exportSeconds,
+           (double)result.bytes / count, result.errors);
+}
+
+static Result RunPathMap(size_t count) {
+    Result result = {};
+    string path;
+    long long before = ResidentBytes();
+    PathMap<Digest> paths;
+
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++) {
+        MakePath(i, false, path);
+        paths[path] = MakeDigest(i);
+    }
+    result.insertSeconds = Seconds(start);
+    result.bytes = ResidentBytes() - before;
+
+    start = chrono::steady_clock::now();
+    for (size_t k = 0; k < count; k++) {
+        size_t i = Scatter(k, count);
+        MakePath(i, false, path);
+        const Digest* digest = paths.Find(path);
+        result.errors += !digest || *digest != MakeDigest(i);
+    }
+    result.hitSeconds = Seconds(start);
+
+    start = chrono::steady_clock::now();
+    for (size_t k = 0; k < count; k++) {
+        MakePath(Scatter(k, count), true, path);
+        result.errors += paths.Find(path) != nullptr;
+    }
+    result.missSeconds = Seconds(start);
+
+    start = chrono::steady_clock::now();
+    size_t exported = 0;
+    for (const PathMap<Digest>::Entry* entry : paths.Sorted()) {
+        exported += entry->keySize;
+    }
+    result.exportSeconds = Seconds(start);
+    result.errors += exported == 0;
+    return result;
+}
+
+static Result RunStdMap(size_t count) {
+    Result result = {};
+    string path;
+    long long before = ResidentBytes();
+    map<string, Digest> paths;
+
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++) {
+        MakePath(i, false, path);
+        paths[path] = MakeDigest(i);
+    }
+    result.insertSeconds = Seconds(start);
+    result.bytes = ResidentBytes() - before;
+
+    start = chrono::steady_clock::now();
+    for (size_t k = 0; k < count; k++) {
+        size_t i = Scatter(k, count);
+        MakePath(i, false, path);
+        auto it = paths.find(path);
+        result.errors += it == paths.end() || it->second != MakeDigest(i);
+    }
+    result.hitSeconds = Seconds(start);
+
+    start = chrono::steady_clock::now();
+    for (size_t k = 0; k < count; k++) {
+        MakePath(Scatter(k, count), true, path);
+        result.errors += paths.find(path) != paths.end();
+    }
+    result.missSeconds = Seconds(start);
+
+    start = chrono::steady_clock::now();
+    size_t exported = 0;
+    for (const auto& entry : paths) {
+        exported += entry.first.size();
+    }
+    result.exportSeconds = Seconds(start);
+    result.errors += exported == 0;
+    return result;
+}
+
+int main(int argc, char* argv[]) {
+    size_t count = (argc > 1 ? (size_t)atoi(argv[1]) : 10) * 1000000;
+    if (count == 0 || count % 2654435761ULL == 0) {
+        fprintf(stderr, "usage: path_map_bench [millions of paths]\n");
+        return 1;
+    }
+
+    printf("%zu paths\n", count);
+    printf("%-10s %10s %10s %10s %10s %10s %8s\n", "structure", "insert ns", "hit ns", "miss ns", "export s",
+           "bytes/path", "errors");
+    Print("PathMap", count, RunPathMap(count));
+    Print("std::map", count, RunStdMap(count));
+    return 0;
+}
@@ -0,0 +1,127 @@
+// SHA-256 engine microbenchmark: single-thread throughput of every engine
+// the CPU supports, after checking it against the scalar reference, and
+// of the multi-buffer batch engines on many small messages.
+//
+//   g++ -std=c++14 -O2 benchmarks/sha256_bench.cpp -o sha256_bench
+//   ./sha256_bench [megabytes per run]
+
+#include "../common/sha256.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static string Hex(const uint8_t digest[Sha256::DIGEST_SIZE]) {
+    static const char digits[] = "0123456789abcdef";
+    string hex;
+    for (size_t i = 0; i < Sha256::DIGEST_SIZE; i++) {
+        hex += digits[digest[i] >> 4];
+        hex += digits[digest[i] & 15];
+    }
+    return hex;
+}
+
+static string HashHex(const void* data, size_t size) {
+    Sha256 hasher;
+    hasher.Update(data, size);
+    uint8_t digest[Sha256::DIGEST_SIZE];
+    hasher.Final(digest);
+    return Hex(digest);
+}
+
+int main(int argc, char* argv[]) {
+    size_t megabytes = argc > 1 ? (size_t)atoi(argv[1]) : 2048;
+    const size_t BUFFER_SIZE = 1024 * 1024;  // Same read size as FileHasher
+
+    vector<uint8_t> buffer(BUFFER_SIZE);
+    uint32_t seed = 12345;
+    for (size_t i = 0; i < buffer.size(); i++) {
+        seed = seed * 1103515245 + 12345;
+        buffer[i] = (uint8_t)(seed >> 16);
+    }
+
+    // Reference results from the scalar engine
+    Sha256::SetEngine(Sha256Engine::Scalar);
+    const string abc = "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad";
+    string reference = HashHex(buffer.data(), buffer.size());
+    string referenceOdd = HashHex(buffer.data() + 1, 1000003);
+
+    printf("%-8s %12s %10s\n", "engine", "GB/s/core", "status");
+    const Sha256Engine engines[] = {Sha256Engine::Scalar, Sha256Engine::Avx2, Sha256Engine::ShaNi};
+    for (Sha256Engine engine : engines) {
+        if (!Sha256::SetEngine(engine)) {
+            printf("%-8s %12s %10s\n", Sha256::EngineName(engine), "-", "n/a");
+            continue;
+        }
+
+        bool correct = HashHex("abc", 3) == abc &&
+                       HashHex(buffer.data(), buffer.size()) == reference &&
+                       HashHex(buffer.data() + 1, 1000003) == referenceOdd;
+
+        Sha256 hasher;
+        auto start = chrono::steady_clock::now();
+        for (size_t i = 0; i < megabytes; i++) {
+            hasher.Update(buffer.data(), buffer.size());
+        }
+        uint8_t digest[Sha256::DIGEST_SIZE];
+        hasher.Final(digest);
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+        double gbPerSecond = (double)megabytes * BUFFER_SIZE / seconds / 1e9;
+        printf("%-8s %12.2f %10s\n", Sha256::EngineName(engine), gbPerSecond, correct ? "ok" : "MISMATCH");
+    }
+
+    // Batches of small messages, as produced by small files
+    Sha256::SetEngine(Sha256::BestEngine());
+    const size_t messageSizes[] = {512, 4096, 16384};
+    printf("\n%-12s %8s %12s %10s\n", "batch", "msg size", "GB/s/core", "status");
+    const Sha256BatchEngine batchEngines[] = {Sha256BatchEngine::Single, Sha256BatchEngine::Avx2,
+                                              Sha256BatchEngine::Avx512};
+    for (size_t messageSize : messageSizes) {
+        const size_t COUNT = 64;
+        vector<const void*> messages(COUNT);
+        vector<size_t> sizes(COUNT);
+        vector<string> expected(COUNT);
+        for (size_t i = 0; i < COUNT; i++) {
+            // Uneven lengths so lanes finish at different blocks
+            sizes[i] = messageSize - (i * 37) % (messageSize / 2);
+            messages[i] = buffer.data() + i * 97;
+            expected[i] = HashHex(messages[i], sizes[i]);
+        }
+        size_t batchBytes = 0;
+        for (size_t size : sizes) batchBytes += size;
+
+        for (Sha256BatchEngine engine : batchEngines) {
+            if (!Sha256::SetBatchEngine(engine)) {
+                printf("%-12s %8zu %12s %10s\n", Sha256::EngineName(engine), messageSize, "-", "n/a");
+                continue;
+            }
+
+            vector<uint8_t> digests(COUNT * Sha256::DIGEST_SIZE);
+            uint8_t (*out)[Sha256::DIGEST_SIZE] = (uint8_t (*)[Sha256::DIGEST_SIZE])digests.data();
+            Sha256::HashMany(messages.data(), sizes.data(), COUNT, out);
+            bool correct = true;
+            for (size_t i = 0; i < COUNT; i++) {
+                correct = correct && Hex(out[i]) == expected[i];
+            }
+
+            size_t rounds = megabytes * BUFFER_SIZE / batchBytes + 1;
+            auto start = chrono::steady_clock::now();
+            for (size_t i = 0; i < rounds; i++) {
+                Sha256::HashMany(messages.data(), sizes.data(), COUNT, out);
+            }
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+            double gbPerSecond = (double)rounds * batchBytes / seconds / 1e9;
+            printf("%-12s %8zu %12.2f %10s\n", Sha256::EngineName(engine), messageSize, gbPerSecond,
+                   correct ? "ok" : "MISMATCH");
+        }
+    }
+
+    printf("\ndefault engine: %s, batch: %s\n", Sha256::EngineName(Sha256::BestEngine()),
+           Sha256::EngineName(Sha256::BestBatchEngine()));
+    return 0;
+}
@@ -0,0 +1,130 @@
+// Store layout benchmark: latency of committing and looking up blobs as
+// the store grows, for the flat layout and one and two fan-out levels.
+//
+// Blobs are empty files committed the way DeduplicationStore does it
+// (create in a staging directory, then rename without replace). Lookups
+// stat existing and missing blob names at random.
+//
+//   g++ -std=c++14 -O2 benchmarks/store_layout_bench.cpp -o store_layout_bench
+//   ./store_layout_bench <scratch dir> [max blobs]
+//
+// The scratch directory must not exist; it is left behind for inspection.
+
+#include "../common/filesystem.h"
+#include "../common/digest.h"
+#include "../common/store_layout.h"
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+static uint64_t NextRandom(uint64_t& state) {
+    uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static Digest RandomDigest(uint64_t& state) {
+    Digest digest;
+    for (size_t i = 0; i < Digest::SIZE; i += 8) {
+        uint64_t value = NextRandom(state);
+        for (size_t j = 0; j < 8; j++) {
+            digest.bytes[i + j] = (uint8_t)(value >> (j * 8));
+        }
+    }
+    return digest;
+}
+
+static double NowSeconds() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        printf("Usage: %s <scratch dir> [max blobs]\n", argv[0]);
+        return 1;
+    }
+    string scratch = NormalizePath(argv[1]);
+    size_t maxBlobs = argc > 2 ? (size_t)atol(argv[2]) : 1000000;
+    const size_t LOOKUPS = 20000;
+
+    if (FileSystem::MakeDirectory(scratch) != MkdirResult::Created) {
+        printf("Cannot create %s (it must not exist)\n", scratch.c_str());
+        return 1;
+    }
+
+    printf("%-8s %10s %12s %12s %12s\n", "layout", "blobs", "commit us", "hit us", "miss us");
+    for (int levels = 0; levels <= StoreLayout::MAX_LEVELS; levels++) {
+        string storePath = scratch + "fanout" + to_string(levels) + PATH_SEPARATOR;
+        Directory storeDir, stagingDir;
+        FileSystem::MakeDirectory(storePath);
+        FileSystem::MakeDirectory(storePath + ".staging");
+        if (!storeDir.Open(storePath) || !stagingDir.Open(storePath + ".staging")) {
+            printf("Cannot create %s\n", storePath.c_str());
+            return 1;
+        }
+
+        StoreLayout layout(levels);
+        vector<Digest> stored;
+        stored.reserve(maxBlobs);
+        uint64_t seed = 1;
+        uint64_t missSeed = 1ULL << 63;
+        uint64_t pickSeed = 7;
+
+        for (size_t target = 10000; ; target *= 2) {
+            if (target > maxBlobs) target = maxBlobs;
+
+            // Commit blobs up to the checkpoint
+            size_t added = target - stored.size();
+            double start = NowSeconds();
+            while (stored.size() < target) {
+                Digest digest = RandomDigest(seed);
+                File file;
+                if (!file.Create(stagingDir, "blob.tmp") || !file.Finish() ||
+                    !layout.MakeParents(storeDir, digest) ||
+                    stagingDir.RenameChildNoReplace("blob.tmp", storeDir, layout.BlobName(digest).c_str()) !=
+                        RenameResult::Renamed) {
+                    printf("Commit failed: %s\n", FileSystem::LastErrorString().c_str());
+                    return 1;
+                }
+                stored.push_back(digest);
+            }
+            double commitUs = added ? (NowSeconds() - start) * 1e6 / added : 0;
+
+            // Names are built outside the timed loops
+            vector<string> hits, misses;
+            for (size_t i = 0; i < LOOKUPS; i++) {
+                hits.push_back(layout.BlobName(stored[NextRandom(pickSeed) % stored.size()]));
+                misses.push_back(layout.BlobName(RandomDigest(missSeed)));
+            }
+
+            FileInfo info;
+            int found = 0;
+            start = NowSeconds();
+            for (const string& name : hits) found += storeDir.Stat(name.c_str(), info);
+            double hitUs = (NowSeconds() - start) * 1e6 / LOOKUPS;
+
+            start = NowSeconds();
+            for (const string& name : misses) found -= storeDir.Stat(name.c_str(), info);
+            double missUs = (NowSeconds() - start) * 1e6 / LOOKUPS;
+
+            if (found != (int)LOOKUPS) {
+                printf("Lookup mismatch\n");
+                return 1;
+            }
+            printf("%-8s %10zu %12.2f %12.2f %12.2f\n", levels == 0 ? "flat" : (levels == 1 ? "ab/" : "ab/cd/"),
+                   stored.size(), commitUs, hitUs, missUs);
+            fflush(stdout);
+
+            if (target == maxBlobs) break;
+        }
+    }
+
+    printf("\nScratch stores left in %s\n", scratch.c_str());
+    return 0;
+}
@@ -0,0 +1,332 @@
+#ifndef BACKUP_CHANGE_JOURNAL_H
+#define BACKUP_CHANGE_JOURNAL_H
+
+// Directories changed since the last backup, journaled by the change
+// watcher (common/change_watcher.h) so a run can read only those.
+//
+// The watcher appends records to .backup_changes.journal in the backup
+// root, in the framing of common/journal.h: one byte of kind, then a path
+// relative to the source root (with a trailing separator, empty for the
+// root). DIRECTORY means entries of that directory were added, removed or
+// changed; TREE means its whole subtree must be read (it was created or
+// moved in). Records are written in groups, each with one append and one
+// fsync, and a record is written once per journal however many events
+// repeat it, so a busy directory costs nothing after its first event.
+//
+// Every journal starts with a SOURCE record naming the watched root. A
+// watcher writes STARTED when it starts, since changes made before then
+// were not seen, and LOST when events were dropped or a directory could
+// not be watched; either makes the next run read everything.
+//
+// The watcher holds .backup_watcher.lock while it runs, so a run can tell
+// that nothing went unseen since the journal began, and keeps the root it
+// watches in .backup_watcher.source. It writes its first journal before it
+// starts watching, so while it runs a missing journal means that nothing
+// changed since the last run took one. A run takes the
+// journal by renaming it to .backup_changes.pending under
+// .backup_changes.lock, which the watcher holds for each append; the
+// watcher starts a new journal once it finds its own gone. The pending
+// file is removed after a successful run, and merged with the next
+// journal after a failed one.
+
+#include "filesystem.h"
+#include "journal.h"
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+class ChangeJournal {
+public:
+    // Record kinds
+    static const char SOURCE = 'S';
+    static const char STARTED = 'B';
+    static const char LOST = 'L';
+    static const char DIRECTORY = 'D';
+    static const char TREE = 'T';
+
+    // What Take found
+    enum class Result {
+        None,      // No watcher journals into this backup
+        Changes,   // Every change since the last run is listed
+        FullScan,  // Changes may have gone unseen
+    };
+
+private:
+    static const char* Magic() { return "BKCHNGJ1"; }
+    static const char* JournalName() { return ".backup_changes.journal"; }
+    static const char* PendingName() { return ".backup_changes.pending"; }
+    static const char* LockName() { return ".backup_changes.lock"; }
+    static const char* WatcherLockName() { return ".backup_watcher.lock"; }
+    static const char* WatcherSourceName() { return ".backup_watcher.source"; }
+
+    // Tries at the watcher lock before Claim gives up, and the wait between
+    static const int CLAIM_ATTEMPTS = 20;
+    static const int CLAIM_RETRY_MS = 10;
+
+    std::string rootPath;
+    std::string source;
+    FileLock watcherLock;                   // Held while watching
+    std::unordered_set<std::string> added;    // Records since the last Flush
+    std::unordered_set<std::string> written;  // Records in the current journal
+    bool incomplete;  // Some directory is not watched
+    bool damaged;     // A write failed; the journal may end in a torn record
+
+    static std::string Record(char kind, const std::string& path) {
+        return std::string(1, kind) + path;
+    }
+
+    static void Put(std::string& out, const std::string& record) {
+        Journal::Frame(out, record.data(), record.size());
+    }
+
+    // Cut a torn record off the end of the journal. The change lock must
+    // be held.
+    bool Repair(const Directory& root) {
+        FileInfo info;
+        if (!FileSystem::GetInfo(rootPath + JournalName(), info)) {
+            return true;
+        }
+        uint64_t length = Journal::Replay(root, JournalName(), Magic(), [](const char*, size_t) {});
+        if ((uint64_t)info.size == length) {
+            return true;
+        }
+        return length == 0 ? root.RemoveChild(JournalName())
+                           : Journal::Rewrite(root, JournalName(), Magic(), 8, length);
+    }
+
+    // Record the watched root for runs that find no journal. The change
+    // lock must be held.
+    bool WriteSource(const Directory& root) {
+        std::string data(Magic(), 8);
+        Put(data, Record(SOURCE, source));
+        std::string tempName = std::string(WatcherSourceName()) + ".tmp";
+        File out;
+        bool ok = out.Create(root, tempName.c_str()) && out.WriteAll(data.data(), data.size()) && out.Sync();
+        ok = out.Finish() && ok;
+        return ok && root.RenameChild(tempName.c_str(), root, WatcherSourceName());
+    }
+
+    // Whether the running watcher watches sourceRoot. The change lock
+    // must be held.
+    bool WatchesSource(const Directory& root, const std::string& sourceRoot) const {
+        bool same = false;
+        Journal::Replay(root, WatcherSourceName(), Magic(), [&](const char* data, size_t size) {
+            same = size > 0 && data[0] == SOURCE && std::string(data + 1, size - 1) == sourceRoot;
+        });
+        return same;
+    }
+
+    // Flush with the change lock held
+    bool FlushLocked(const Directory& root) {
+        if (damaged) {
+            if (!Repair(root)) {
+                return false;
+            }
+            damaged = false;
+            written.clear();
+        }
+
+        FileInfo info;
+        bool exists = FileSystem::GetInfo(rootPath + JournalName(), info);
+        std::string data;
+        if (!exists) {
+            // A run took the journal. Everything added since the last Flush
+            // goes into the new one, since that run may have read those
+            // directories before they changed.
+            written.clear();
+            data.assign(Magic(), 8);
+            Put(data, Record(SOURCE, source));
+            written.insert(Record(SOURCE, source));
+            if (incomplete) {
+                Put(data, Record(LOST, std::string()));
+                written.insert(Record(LOST, std::string()));
+            }
+        }
+        for (const std::string& record : added) {
+            if (written.insert(record).second) {
+                Put(data, record);
+            }
+        }
+        if (data.empty()) {
+            added.clear();
+            return true;
+        }
+
+        File out;
+        bool ok = (exists ? out.OpenAppend(root, JournalName()) : out.Create(root, JournalName())) &&
+                  out.WriteAll(data.data(), data.size()) && out.Sync();
+        ok = out.Finish() && ok;
+        if (!ok) {
+            damaged = true;
+            return false;
+        }
+        added.clear();
+        return true;
+    }
+
+public:
+    explicit ChangeJournal(const std::string& backupRoot) : incomplete(false), damaged(false) {
+        rootPath = NormalizePath(backupRoot);
+    }
+
+    // Become the watcher of sourceRoot; false if another watcher runs or
+    // the backup root cannot be written
+    bool Claim(const std::string& sourceRoot) {
+        Directory root;
+        if (!root.Open(rootPath)) {
+            return false;
+        }
+        // A backup run testing for a watcher holds the lock for a moment;
+        // only one still held after a few tries belongs to another watcher
+        bool claimed = watcherLock.Lock(rootPath + WatcherLockName(), false);
+        for (int attempt = 1; !claimed && attempt < CLAIM_ATTEMPTS; attempt++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds((int)CLAIM_RETRY_MS));
+            claimed = watcherLock.Lock(rootPath + WatcherLockName(), false);
+        }
+        if (!claimed) {
+            return false;
+        }
+        FileLock lock;
+        if (!lock.Lock(rootPath + LockName(), true) || !Repair(root)) {
+            watcherLock.Unlock();
+            return false;
+        }
+        source = sourceRoot;
+        written.clear();
+        added.clear();
+        added.insert(Record(SOURCE, source));
+        added.insert(Record(STARTED, std::string()));
+        if (!WriteSource(root) || !FlushLocked(root)) {
+            watcherLock.Unlock();
+            return false;
+        }
+        return true;
+    }
+
+    // Record a change (DIRECTORY, TREE or LOST); written by the next Flush
+    void Add(char kind, const std::string& path) {
+        added.insert(Record(kind, path));
+    }
+
+    // Whether some directory is not watched; every journal then says LOST
+    void SetIncomplete(bool notWatched) {
+        if (notWatched && !incomplete) {
+            Add(LOST, std::string());
+        }
+        incomplete = notWatched;
+    }
+
+    // Write the records added since the last Flush; false if the journal
+    // cannot be written, in which case they are kept for the next one
+    bool Flush() {
+        if (added.empty()) {
+            return true;
+        }
+        Directory root;
+        FileLock lock;
+        return root.Open(rootPath) && lock.Lock(rootPath + LockName(), true) && FlushLocked(root);
+    }
+
+    // Take the changes journaled since the last run of sourceRoot. With
+    // Changes, records lists each DIRECTORY and TREE record as (kind,
+    // path); with FullScan, reason says why the journal cannot be trusted.
+    // A running watcher that journaled nothing since the last run gives
+    // Changes with no records. Call Finish after a successful run.
+    Result Take(const std::string& sourceRoot, std::vector<std::pair<char, std::string>>& records,
+                std::string& reason) {
+        records.clear();
+        Directory root;
+        if (!root.Open(rootPath)) {
+            return Result::None;
+        }
+
+        // Changes since the journal began were all seen only if the
+        // watcher is still running
+        bool watching = FileLock::IsHeld(rootPath + WatcherLockName());
+
+        FileInfo info;
+        if (!watching && !FileSystem::GetInfo(rootPath + JournalName(), info) &&
+            !FileSystem::GetInfo(rootPath + PendingName(), info)) {
+            return Result::None;
+        }
+
+        {
+            FileLock lock;
+            if (!lock.Lock(rootPath + LockName(), true)) {
+                reason = "the change journal cannot be locked";
+                return Result::FullScan;
+            }
+            bool journaled = FileSystem::GetInfo(rootPath + JournalName(), info);
+            if (!journaled && !FileSystem::GetInfo(rootPath + PendingName(), info)) {
+                // The watcher writes a journal with its first change
+                if (WatchesSource(root, sourceRoot)) {
+                    return Result::Changes;
+                }
+                reason = "the change watcher watches another source";
+                return Result::FullScan;
+            }
+            if (journaled) {
+                bool moved;
+                if (FileSystem::GetInfo(rootPath + PendingName(), info)) {
+                    // A failed run left its changes; add the new ones
+                    std::string merged(Magic(), 8);
+                    auto keep = [&merged](const char* data, size_t size) { Journal::Frame(merged, data, size); };
+                    Journal::Replay(root, PendingName(), Magic(), keep);
+                    Journal::Replay(root, JournalName(), Magic(), keep);
+                    std::string tempName = std::string(PendingName()) + ".tmp";
+                    File out;
+                    moved = out.Create(root, tempName.c_str()) && out.WriteAll(merged.data(), merged.size()) &&
+                            out.Sync();
+                    moved = out.Finish() && moved && root.RenameChild(tempName.c_str(), root, PendingName()) &&
+                            root.RemoveChild(JournalName());
+                } else {
+                    moved = root.RenameChild(JournalName(), root, PendingName());
+                }
+                if (!moved) {
+                    reason = "the change journal cannot be taken";
+                    return Result::FullScan;
+                }
+            }
+        }
+
+        bool sameSource = true, started = false, lost = false;
+        Journal::Replay(root, PendingName(), Magic(), [&](const char* data, size_t size) {
+            if (size == 0) {
+                return;
+            }
+            std::string path(data + 1, size - 1);
+            switch (data[0]) {
+                case SOURCE: sameSource = sameSource && path == sourceRoot; break;
+                case STARTED: started = true; break;
+                case LOST: lost = true; break;
+                case DIRECTORY:
+                case TREE: records.push_back(std::make_pair(data[0], std::move(path))); break;
+            }
+        });
+        if (!watching) {
+            reason = "the change watcher is not running";
+        } else if (!sameSource) {
+            reason = "the change watcher watches another source";
+        } else if (started) {
+            reason = "the change watcher started after the last run";
+        } else if (lost) {
+            reason = "the change watcher missed changes";
+        } else {
+            return Result::Changes;
+        }
+        records.clear();
+        return Result::FullScan;
+    }
+
+    // The run after Take succeeded: its changes are done with
+    bool Finish() {
+        Directory root;
+        return root.Open(rootPath) && root.RemoveChild(PendingName());
+    }
+};
+
+#endif
@@ -0,0 +1,285 @@
+#ifndef BACKUP_CHANGE_WATCHER_H
+#define BACKUP_CHANGE_WATCHER_H
+
+// Change notifications for a source tree, reported as the directories
+// whose entries changed (what is kept of them is in change_journal.h).
+//
+// On Linux this is inotify, one watch per directory: Open watches the
+// whole tree, a directory created or moved in is watched when its event
+// arrives, and one moved out is dropped. (fanotify can mark a whole
+// filesystem at once, but needs CAP_SYS_ADMIN.) A directory that cannot
+// be watched, usually because fs.inotify.max_user_watches is reached,
+// leaves the watcher incomplete; an overflow of the kernel's event queue
+// (fs.inotify.max_queued_events) loses events. The journal records both as
+// LOST, so the next backup reads everything. On Windows one
+// ReadDirectoryChangesW call covers the whole tree, and an overflow of its
+// buffer is reported the same way. Other systems cannot watch.
+//
+// Symlinks are not followed, as the backup does not follow them into
+// directories.
+
+#include "change_journal.h"
+#include "filesystem.h"
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <map>
+#include <unordered_map>
+#endif
+
+class ChangeWatcher {
+private:
+    std::string rootPath;
+
+#ifdef _WIN32
+    HANDLE hDir;
+    HANDLE hEvent;
+    OVERLAPPED overlapped;
+    static const size_t NOTIFY_BUFFER_SIZE = 64 * 1024;  // The most a network share accepts
+
+    std::vector<DWORD> buffer;  // FILE_NOTIFY_INFORMATION records are DWORD-aligned
+    bool reading;
+
+    // Ask for the next batch of changes
+    bool Read() {
+        overlapped = OVERLAPPED();
+        overlapped.hEvent = hEvent;
+        DWORD filter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_SIZE |
+                       FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_CREATION;
+        reading = ReadDirectoryChangesW(hDir, buffer.data(), (DWORD)(buffer.size() * sizeof(DWORD)), TRUE,
+                                        filter, NULL, &overlapped, NULL) != 0;
+        return reading;
+    }
+
+    static std::string Narrow(const WCHAR* name, int length) {
+        int size = WideCharToMultiByte(CP_ACP, 0, name, length, NULL, 0, NULL, NULL);
+        std::string narrow(size > 0 ? (size_t)size : 0, '\0');
+        if (size > 0) {
+            WideCharToMultiByte(CP_ACP, 0, name, length, &narrow[0], size, NULL, NULL);
+        }
+        return narrow;
+    }
+
+public:
+    ChangeWatcher() : hDir(INVALID_HANDLE_VALUE), hEvent(NULL), overlapped(), reading(false) {}
+
+    ~ChangeWatcher() {
+        if (hDir != INVALID_HANDLE_VALUE) {
+            CancelIo(hDir);
+            if (reading) {
+                DWORD bytes;
+                GetOverlappedResult(hDir, &overlapped, &bytes, TRUE);
+            }
+            CloseHandle(hDir);
+        }
+        if (hEvent) CloseHandle(hEvent);
+    }
+
+    // Start watching the tree under root; false if it cannot be watched
+    bool Open(const std::string& root) {
+        rootPath = NormalizePath(root);
+        hDir = CreateFileA(rootPath.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                           NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+        hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+        buffer.resize(NOTIFY_BUFFER_SIZE / sizeof(DWORD));
+        return hDir != INVALID_HANDLE_VALUE && hEvent != NULL && Read();
+    }
+
+    // Whether every directory is watched
+    bool Complete() const { return reading; }
+
+    // Wait up to timeoutMs for changes and pass each to report(kind, path),
+    // with a ChangeJournal kind and a relative directory path
+    template <typename Report>
+    void Poll(int timeoutMs, Report report) {
+        if (!reading) {
+            Sleep((DWORD)timeoutMs);
+            return;
+        }
+        if (WaitForSingleObject(hEvent, (DWORD)timeoutMs) != WAIT_OBJECT_0) {
+            return;
+        }
+        DWORD bytes = 0;
+        reading = false;
+        if (!GetOverlappedResult(hDir, &overlapped, &bytes, FALSE) || bytes == 0) {
+            // The buffer overflowed (ERROR_NOTIFY_ENUM_DIR)
+            report(ChangeJournal::LOST, std::string());
+        } else {
+            const char* next = (const char*)buffer.data();
+            for (;;) {
+                const FILE_NOTIFY_INFORMATION* info = (const FILE_NOTIFY_INFORMATION*)next;
+                std::string path = Narrow(info->FileName, (int)(info->FileNameLength / sizeof(WCHAR)));
+                size_t slash = path.find_last_of(PATH_SEPARATOR);
+                std::string directory = slash == std::string::npos ? std::string() : path.substr(0, slash + 1);
+                if (info->Action == FILE_ACTION_ADDED || info->Action == FILE_ACTION_RENAMED_NEW_NAME) {
+                    DWORD attributes = GetFileAttributesA((rootPath + path).c_str());
+                    if (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) &&
+                        !(attributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+                        report(ChangeJournal::TREE, path + PATH_SEPARATOR);
+                    }
+                }
+                report(ChangeJournal::DIRECTORY, directory);
+                if (info->NextEntryOffset == 0) {
+                    break;
+                }
+                next += info->NextEntryOffset;
+            }
+        }
+        if (!Read()) {
+            report(ChangeJournal::LOST, std::string());
+        }
+    }
+
+#elif defined(__linux__)
+    static const uint32_t WATCH_MASK = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM |
+                                       IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR |
+                                       IN_DONT_FOLLOW | IN_EXCL_UNLINK;
+
+    static const size_t BUFFER_SIZE = 256 * 1024;
+
+    int fd;
+    std::unordered_map<int, std::string> watched;  // Watch -> relative directory path
+    std::map<std::string, int> watches;            // The same, by path, so a subtree is a range
+    std::vector<char> buffer;
+    size_t unwatched;  // Directories that could not be watched
+
+    // Watch a directory and everything under it
+    void WatchTree(const std::string& path) {
+        std::vector<std::string> stack(1, path);
+        while (!stack.empty()) {
+            std::string directory = std::move(stack.back());
+            stack.pop_back();
+            int wd = inotify_add_watch(fd, (rootPath + directory).c_str(), WATCH_MASK);
+            if (wd < 0) {
+                if (errno != ENOENT && errno != ENOTDIR) {
+                    unwatched++;
+                }
+                continue;
+            }
+            // A directory watched already (moved back in) keeps its watch
+            auto known = watched.find(wd);
+            if (known != watched.end()) {
+                watches.erase(known->second);
+            }
+            watched[wd] = directory;
+            watches[directory] = wd;
+
+            Directory dir;
+            if (!dir.Open(rootPath + directory)) {
+                continue;
+            }
+            DirectoryReader reader(dir);
+            DirEntry entry;
+            while (reader.Next(entry)) {
+                if (!IsDotEntry(entry.name) && reader.GetType(entry) == EntryType::Directory) {
+                    stack.push_back(directory + std::string(entry.name, entry.nameLength) + PATH_SEPARATOR);
+                }
+            }
+        }
+    }
+
+    // Stop watching a directory and everything under it
+    void UnwatchTree(const std::string& path) {
+        auto it = watches.lower_bound(path);
+        while (it != watches.end() && it->first.compare(0, path.size(), path) == 0) {
+            inotify_rm_watch(fd, it->second);
+            watched.erase(it->second);
+            it = watches.erase(it);
+        }
+    }
+
+    template <typename Report>
+    void Handle(const struct inotify_event& event, Report& report) {
+        if (event.mask & IN_Q_OVERFLOW) {
+            report(ChangeJournal::LOST, std::string());
+            return;
+        }
+        auto it = watched.find(event.wd);
+        if (it == watched.end()) {
+            return;
+        }
+        std::string directory = it->second;
+        if (event.mask & IN_IGNORED) {
+            auto byPath = watches.find(directory);
+            if (byPath != watches.end() && byPath->second == event.wd) {
+                watches.erase(byPath);
+            }
+            watched.erase(it);
+            return;
+        }
+        if (event.len == 0) {
+            // The directory itself; only the root's own fate matters
+            if (directory.empty() && (event.mask & (IN_DELETE_SELF | IN_MOVE_SELF))) {
+                report(ChangeJournal::LOST, std::string());
+            }
+            return;
+        }
+        if (event.mask & IN_ISDIR) {
+            std::string child = directory + event.name + PATH_SEPARATOR;
+            if (event.mask & (IN_CREATE | IN_MOVED_TO)) {
+                // Entries made before the watch is in place are read with the tree
+                report(ChangeJournal::TREE, child);
+                WatchTree(child);
+            } else if (event.mask & IN_MOVED_FROM) {
+                UnwatchTree(child);
+            }
+        }
+        report(ChangeJournal::DIRECTORY, directory);
+    }
+
+public:
+    ChangeWatcher() : fd(-1), unwatched(0) {}
+
+    ~ChangeWatcher() {
+        if (fd >= 0) close(fd);
+    }
+
+    // Start watching the tree under root; false if it cannot be watched
+    bool Open(const std::string& root) {
+        rootPath = NormalizePath(root);
+        fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        buffer.resize(BUFFER_SIZE);
+        WatchTree(std::string());
+        return watches.count(std::string()) != 0;
+    }
+
+    // Whether every directory is watched
+    bool Complete() const { return unwatched == 0; }
+
+    // Wait up to timeoutMs for changes and pass each to report(kind, path),
+    // with a ChangeJournal kind and a relative directory path
+    template <typename Report>
+    void Poll(int timeoutMs, Report report) {
+        struct pollfd ready = {fd, POLLIN, 0};
+        if (poll(&ready, 1, timeoutMs) <= 0) {
+            return;
+        }
+        ssize_t n = read(fd, buffer.data(), buffer.size());
+        for (ssize_t pos = 0; pos < n;) {
+            const struct inotify_event* event = (const struct inotify_event*)(buffer.data() + pos);
+            pos += (ssize_t)(sizeof(struct inotify_event) + event->len);
+            Handle(*event, report);
+        }
+    }
+
+#else
+public:
+    bool Open(const std::string& root) {
+        rootPath = NormalizePath(root);
+        return false;
+    }
+
+    bool Complete() const { return false; }
+
+    template <typename Report>
+    void Poll(int, Report) {}
+#endif
+};
+
+#endif
@@ -0,0 +1,294 @@
+#ifndef BACKUP_CHUNKER_H
+#define BACKUP_CHUNKER_H
+
+// Content-defined chunking (FastCDC).
+//
+// A gear hash, h = (h << 1) + GEAR[byte], rolls over the data; since each
+// step shifts the oldest byte further out, h depends on the last 32 bytes
+// only. A chunk ends after a byte whose hash has all mask bits clear. As
+// in FastCDC, no cut is made in the first minSize bytes, a stricter mask
+// (two bits more than log2(avgSize)) applies up to avgSize and a looser
+// one (two bits fewer) after it, and chunks are cut at maxSize at the
+// latest. Boundaries depend only on nearby content, so an insertion moves
+// the cuts around it and leaves the rest of the file's chunks unchanged.
+//
+// Because the hash only covers a fixed window, it can be computed for
+// every position independently of where chunks start. The buffer is split
+// into segments scanned in parallel (SIMD lanes with AVX2, interleaved
+// scalar streams otherwise) into bitmaps of candidate positions, and cut
+// points are then picked from the bitmaps by scanning set bits.
+//
+// GEAR and the masks define where chunks are cut. Changing them makes
+// every chunk of every file new, so they must stay as they are.
+
+#include "sha256.h"
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+// Record a candidate position: every hash that passes the strict mask also
+// passes the loose one
+inline void ChunkerMark(uint32_t hash, size_t i, uint32_t strictMask, uint64_t* strictHits, uint64_t* looseHits) {
+    looseHits[i >> 6] |= 1ULL << (i & 63);
+    if ((hash & strictMask) == 0) {
+        strictHits[i >> 6] |= 1ULL << (i & 63);
+    }
+}
+
+// Gear hash state after the up to 31 bytes before position start
+inline uint32_t ChunkerWarmUp(const uint8_t* data, size_t start, const uint32_t* gear) {
+    uint32_t hash = 0;
+    for (size_t i = start < 31 ? 0 : start - 31; i < start; i++) {
+        hash = (hash << 1) + gear[data[i]];
+    }
+    return hash;
+}
+
+// Portable scan: four interleaved streams, so the dependency chains of
+// the hashes overlap
+inline void ChunkerScanScalar(const uint8_t* data, size_t size, const uint32_t* gear, uint32_t strictMask,
+                              uint32_t looseMask, uint64_t* strictHits, uint64_t* looseHits) {
+    size_t segment = size / 4;
+    const uint8_t* p0 = data;
+    const uint8_t* p1 = data + segment;
+    const uint8_t* p2 = data + segment * 2;
+    const uint8_t* p3 = data + segment * 3;
+    uint32_t h0 = 0;
+    uint32_t h1 = ChunkerWarmUp(data, segment, gear);
+    uint32_t h2 = ChunkerWarmUp(data, segment * 2, gear);
+    uint32_t h3 = ChunkerWarmUp(data, segment * 3, gear);
+
+    for (size_t i = 0; i < segment; i++) {
+        h0 = (h0 << 1) + gear[p0[i]];
+        h1 = (h1 << 1) + gear[p1[i]];
+        h2 = (h2 << 1) + gear[p2[i]];
+        h3 = (h3 << 1) + gear[p3[i]];
+        if ((h0 & looseMask) && (h1 & looseMask) && (h2 & looseMask) && (h3 & looseMask)) {
+            continue;
+        }
+        if (!(h0 & looseMask)) ChunkerMark(h0, i, strictMask, strictHits, looseHits);
+        if (!(h1 & looseMask)) ChunkerMark(h1, segment + i, strictMask, strictHits, looseHits);
+        if (!(h2 & looseMask)) ChunkerMark(h2, segment * 2 + i, strictMask, strictHits, looseHits);
+        if (!(h3 & looseMask)) ChunkerMark(h3, segment * 3 + i, strictMask, strictHits, looseHits);
+    }
+
+    // The last stream continues into the remainder
+    for (size_t i = segment * 4; i < size; i++) {
+        h3 = (h3 << 1) + gear[data[i]];
+        if (!(h3 & looseMask)) ChunkerMark(h3, i, strictMask, strictHits, looseHits);
+    }
+}
+
+#ifdef BACKUP_SHA256_X86
+#include "chunker_x86.h"
+#endif
+
+// Candidate scan implementations
+enum class ChunkerEngine {
+    Scalar,
+    Avx2
+};
+
+class Chunker {
+public:
+    static const size_t DEFAULT_MIN_SIZE = 16 * 1024;
+    static const size_t DEFAULT_AVG_SIZE = 64 * 1024;
+    static const size_t DEFAULT_MAX_SIZE = 256 * 1024;
+    static const size_t SMALLEST_MIN_SIZE = 64;          // Past the hash window
+    static const size_t LARGEST_MAX_SIZE = 8 * 1024 * 1024;
+
+private:
+    typedef void (*ScanFunction)(const uint8_t* data, size_t size, const uint32_t* gear, uint32_t strictMask,
+                                 uint32_t looseMask, uint64_t* strictHits, uint64_t* looseHits);
+
+    size_t minSize;
+    size_t avgSize;
+    size_t maxSize;
+    uint32_t strictMask;
+    uint32_t looseMask;
+    std::vector<uint64_t> strictHits;  // Bit i: a chunk may end after byte i
+    std::vector<uint64_t> looseHits;
+
+    // Fixed pseudo-random table (splitmix64 from a constant seed)
+    struct GearTable {
+        uint32_t values[256];
+
+        GearTable() {
+            uint64_t state = 0x6765617263646331ULL;
+            for (int i = 0; i < 256; i++) {
+                uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+                z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+                z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+                values[i] = (uint32_t)((z ^ (z >> 31)) >> 32);
+            }
+        }
+    };
+
+    static const uint32_t* Gear() {
+        static const GearTable table;
+        return table.values;
+    }
+
+    // The top bits of the hash, which cover the whole window
+    static uint32_t TopBits(int bits) {
+        return bits <= 0 ? 0 : (bits >= 32 ? 0xffffffffu : ~0u << (32 - bits));
+    }
+
+    static int Log2(size_t value) {
+        int bits = 0;
+        while (value > 1) {
+            value >>= 1;
+            bits++;
+        }
+        return bits;
+    }
+
+    static int CountTrailingZeros(uint64_t value) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward64(&index, value);
+        return (int)index;
+#else
+        return __builtin_ctzll(value);
+#endif
+    }
+
+    // First set bit in [from, to), or to
+    static size_t FindHit(const std::vector<uint64_t>& bits, size_t from, size_t to) {
+        if (from >= to) {
+            return to;
+        }
+        size_t word = from >> 6;
+        uint64_t value = bits[word] & (~0ULL << (from & 63));
+        size_t lastWord = (to - 1) >> 6;
+        while (value == 0) {
+            if (++word > lastWord) {
+                return to;
+            }
+            value = bits[word];
+        }
+        size_t position = (word << 6) + (size_t)CountTrailingZeros(value);
+        return position < to ? position : to;
+    }
+
+    static ScanFunction EngineFunction(ChunkerEngine engine) {
+        switch (engine) {
+#ifdef BACKUP_SHA256_X86
+        case ChunkerEngine::Avx2: return ChunkerScanAvx2;
+#endif
+        default: return ChunkerScanScalar;
+        }
+    }
+
+    // Engine in use; detected on first use
+    static ChunkerEngine& ActiveEngine() {
+        static ChunkerEngine engine = BestEngine();
+        return engine;
+    }
+
+    static ScanFunction& ActiveFunction() {
+        static ScanFunction function = EngineFunction(ActiveEngine());
+        return function;
+    }
+
+public:
+    Chunker(size_t minBytes = DEFAULT_MIN_SIZE, size_t avgBytes = DEFAULT_AVG_SIZE,
+            size_t maxBytes = DEFAULT_MAX_SIZE)
+        : minSize(minBytes), avgSize(avgBytes), maxSize(maxBytes) {
+        int bits = Log2(avgSize);
+        strictMask = TopBits(bits + 2);
+        looseMask = TopBits(bits - 2);
+    }
+
+    // Sizes the chunker accepts: SMALLEST_MIN_SIZE <= min <= avg <= max <=
+    // LARGEST_MAX_SIZE
+    static bool ValidSizes(size_t minBytes, size_t avgBytes, size_t maxBytes) {
+        return minBytes >= SMALLEST_MIN_SIZE && minBytes <= avgBytes && avgBytes <= maxBytes &&
+               maxBytes <= LARGEST_MAX_SIZE;
+    }
+
+    size_t MinSize() const { return minSize; }
+    size_t AvgSize() const { return avgSize; }
+    size_t MaxSize() const { return maxSize; }
+
+    // Split data, which starts at a chunk boundary, appending the chunk
+    // lengths. Unless atEnd, the data may continue, and a tail whose end
+    // cannot be decided yet is left over; returns the bytes covered by
+    // the chunks appended.
+    size_t Split(const uint8_t* data, size_t size, bool atEnd, std::vector<size_t>& lengths) {
+        size_t words = size / 64 + 1;
+        strictHits.assign(words, 0);
+        looseHits.assign(words, 0);
+        ActiveFunction()(data, size, Gear(), strictMask, looseMask, strictHits.data(), looseHits.data());
+
+        size_t start = 0;
+        while (start < size) {
+            size_t remaining = size - start;
+            if (remaining <= minSize) {
+                if (!atEnd) break;
+                lengths.push_back(remaining);
+                start = size;
+                break;
+            }
+
+            // Cut after byte i: strict mask before avgSize, loose after
+            size_t normal = start + avgSize - 1;
+            size_t limit = start + maxSize - 1;
+            size_t end = normal < size ? normal : size;
+            size_t cut = FindHit(strictHits, start + minSize - 1, end);
+            if (cut == end && end == normal) {
+                end = limit < size ? limit : size;
+                cut = FindHit(looseHits, normal, end);
+            }
+
+            size_t length;
+            if (cut < end) {
+                length = cut - start + 1;
+            } else if (end == limit) {
+                length = maxSize;
+            } else if (atEnd) {
+                length = remaining;
+            } else {
+                break;  // No cut within the data so far
+            }
+            lengths.push_back(length);
+            start += length;
+        }
+        return start;
+    }
+
+    // True if the CPU can run the given engine
+    static bool IsSupported(ChunkerEngine engine) {
+#ifdef BACKUP_SHA256_X86
+        static const Sha256CpuFeatures features = Sha256CpuFeatures::Detect();
+        return engine != ChunkerEngine::Avx2 || features.avx2;
+#else
+        return engine == ChunkerEngine::Scalar;
+#endif
+    }
+
+    static ChunkerEngine BestEngine() {
+        return IsSupported(ChunkerEngine::Avx2) ? ChunkerEngine::Avx2 : ChunkerEngine::Scalar;
+    }
+
+    static ChunkerEngine GetEngine() { return ActiveEngine(); }
+
+    // Switch engines; not thread-safe, call before chunking starts
+    static bool SetEngine(ChunkerEngine engine) {
+        if (!IsSupported(engine)) return false;
+        ActiveEngine() = engine;
+        ActiveFunction() = EngineFunction(engine);
+        return true;
+    }
+
+    static const char* EngineName(ChunkerEngine engine) {
+        return engine == ChunkerEngine::Avx2 ? "AVX2 x8" : "scalar x4";
+    }
+};
+
+#endif
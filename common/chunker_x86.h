@@ -0,0 +1,61 @@
+#ifndef BACKUP_CHUNKER_X86_H
+#define BACKUP_CHUNKER_X86_H
+
+// x86 candidate scan for chunker.h. Do not include directly.
+//
+// Eight segments of the buffer are hashed at once, one per 32-bit AVX2
+// lane. Each step gathers four bytes per lane and looks their gear values
+// up with gathers as well; lanes with a candidate are rare and handled in
+// scalar code. Compiled with a target attribute like sha256_x86.h.
+
+#include <cstddef>
+#include <cstdint>
+#include <immintrin.h>
+
+BACKUP_TARGET("avx2")
+inline void ChunkerScanAvx2(const uint8_t* data, size_t size, const uint32_t* gear, uint32_t strictMask,
+                            uint32_t looseMask, uint64_t* strictHits, uint64_t* looseHits) {
+    const int LANES = 8;
+    size_t segment = (size / LANES) & ~(size_t)3;  // Whole 4-byte loads
+
+    uint32_t hashes[LANES];
+    for (int lane = 0; lane < LANES; lane++) {
+        hashes[lane] = ChunkerWarmUp(data, segment * lane, gear);
+    }
+
+    __m256i hash = _mm256_loadu_si256((const __m256i*)hashes);
+    const __m256i loose = _mm256_set1_epi32((int)looseMask);
+    const __m256i byteMask = _mm256_set1_epi32(0xff);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                               _mm256_set1_epi32((int)segment));
+    const int* table = (const int*)gear;
+
+    for (size_t i = 0; i < segment; i += 4) {
+        __m256i bytes = _mm256_i32gather_epi32((const int*)(data + i), offsets, 1);
+        for (int k = 0; k < 4; k++) {
+            __m256i index = _mm256_and_si256(_mm256_srli_epi32(bytes, 8 * k), byteMask);
+            hash = _mm256_add_epi32(_mm256_slli_epi32(hash, 1), _mm256_i32gather_epi32(table, index, 4));
+            __m256i hit = _mm256_cmpeq_epi32(_mm256_and_si256(hash, loose), zero);
+            int lanes = _mm256_movemask_ps(_mm256_castsi256_ps(hit));
+            if (lanes != 0) {
+                _mm256_storeu_si256((__m256i*)hashes, hash);
+                for (int lane = 0; lane < LANES; lane++) {
+                    if ((lanes >> lane) & 1) {
+                        ChunkerMark(hashes[lane], segment * lane + i + k, strictMask, strictHits, looseHits);
+                    }
+                }
+            }
+        }
+    }
+
+    // The last lane continues into the remainder
+    _mm256_storeu_si256((__m256i*)hashes, hash);
+    uint32_t last = hashes[LANES - 1];
+    for (size_t i = segment * LANES; i < size; i++) {
+        last = (last << 1) + gear[data[i]];
+        if (!(last & looseMask)) ChunkerMark(last, i, strictMask, strictHits, looseHits);
+    }
+}
+
+#endif
@@ -0,0 +1,323 @@
+#ifndef BACKUP_COMPRESSION_H
+#define BACKUP_COMPRESSION_H
+
+// Blob compression.
+//
+// LZ4 is built in (block format, compatible with liblz4): a greedy
+// single-probe compressor that runs at several hundred MB/s, and a
+// bounds-checked decompressor. zstd, for a better ratio, comes from
+// libzstd when built with -DBACKUP_WITH_ZSTD (and -lzstd).
+//
+// Compressed data is the raw size (u32, little-endian) followed by the
+// codec's output. Which codec a blob uses is stored next to it; Codec
+// values are written to disk and must not change.
+//
+// Before compressing, the byte entropy of the first 4 KiB is measured.
+// Data that is already compressed (JPEG, ZIP, video) is close to 8 bits
+// per byte and is stored as it is without trying.
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef BACKUP_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+enum class Codec : uint32_t {
+    None = 0,
+    Lz4 = 1,
+    Zstd = 2
+};
+
+// ---------------------------------------------------------------- LZ4
+
+// Largest possible LZ4 block for size input bytes
+inline size_t Lz4Bound(size_t size) {
+    return size + size / 255 + 16;
+}
+
+inline uint32_t Lz4Read32(const uint8_t* p) {
+    uint32_t value;
+    memcpy(&value, p, 4);
+    return value;
+}
+
+// Literal or match length continuation bytes
+inline uint8_t* Lz4PutLength(uint8_t* out, size_t length) {
+    while (length >= 255) {
+        *out++ = 255;
+        length -= 255;
+    }
+    *out++ = (uint8_t)length;
+    return out;
+}
+
+// One sequence: literals, then a match (none for the last sequence)
+inline uint8_t* Lz4PutSequence(uint8_t* out, const uint8_t* literals, size_t literalLength,
+                               size_t offset, size_t matchLength) {
+    uint8_t* token = out++;
+    *token = (uint8_t)((literalLength >= 15 ? 15 : literalLength) << 4);
+    if (literalLength >= 15) {
+        out = Lz4PutLength(out, literalLength - 15);
+    }
+    memcpy(out, literals, literalLength);
+    out += literalLength;
+    if (offset == 0) {
+        return out;
+    }
+
+    *out++ = (uint8_t)offset;
+    *out++ = (uint8_t)(offset >> 8);
+    size_t length = matchLength - 4;
+    *token |= (uint8_t)(length >= 15 ? 15 : length);
+    if (length >= 15) {
+        out = Lz4PutLength(out, length - 15);
+    }
+    return out;
+}
+
+// Compress into out, which must hold Lz4Bound(size) bytes; returns the
+// compressed size
+inline size_t Lz4Compress(const uint8_t* in, size_t size, uint8_t* out) {
+    const size_t MIN_MATCH = 4;
+    const size_t LAST_LITERALS = 5;   // The block ends with literals
+    const size_t MATCH_START_LIMIT = 12;  // No match starts in the last 12 bytes
+    const size_t MAX_OFFSET = 65535;
+
+    uint8_t* start = out;
+    size_t anchor = 0;
+    if (size > MATCH_START_LIMIT) {
+        // Table sized to the input, so small blobs do not clear 256 KiB
+        int bits = 10;
+        while (bits < 16 && ((size_t)1 << bits) < size) {
+            bits++;
+        }
+        thread_local std::vector<uint32_t> table;
+        table.assign((size_t)1 << bits, 0);
+        auto hash = [bits](uint32_t value) { return (value * 2654435761u) >> (32 - bits); };
+
+        size_t matchEnd = size - LAST_LITERALS;
+        size_t position = 1;
+        table[hash(Lz4Read32(in))] = 0;
+        while (position + MATCH_START_LIMIT <= size) {
+            uint32_t value = Lz4Read32(in + position);
+            uint32_t& slot = table[hash(value)];
+            size_t candidate = slot;
+            slot = (uint32_t)position;
+            if (position - candidate > MAX_OFFSET || Lz4Read32(in + candidate) != value) {
+                position += 1 + ((position - anchor) >> 6);  // Skip faster through literals
+                continue;
+            }
+
+            // Extend the match backwards into the literals, then forwards
+            while (position > anchor && candidate > 0 && in[position - 1] == in[candidate - 1]) {
+                position--;
+                candidate--;
+            }
+            size_t length = MIN_MATCH;
+            while (position + length < matchEnd && in[position + length] == in[candidate + length]) {
+                length++;
+            }
+
+            out = Lz4PutSequence(out, in + anchor, position - anchor, position - candidate, length);
+            position += length;
+            anchor = position;
+            if (position + MATCH_START_LIMIT <= size) {
+                table[hash(Lz4Read32(in + position - 2))] = (uint32_t)(position - 2);
+            }
+        }
+    }
+    out = Lz4PutSequence(out, in + anchor, size - anchor, 0, 0);
+    return (size_t)(out - start);
+}
+
+// Decompress exactly outSize bytes; false if the input is malformed
+inline bool Lz4Decompress(const uint8_t* in, size_t inSize, uint8_t* out, size_t outSize) {
+    const uint8_t* inEnd = in + inSize;
+    size_t written = 0;
+    while (in < inEnd) {
+        uint8_t token = *in++;
+        size_t literalLength = token >> 4;
+        if (literalLength == 15) {
+            uint8_t more;
+            do {
+                if (in >= inEnd) return false;
+                more = *in++;
+                literalLength += more;
+            } while (more == 255);
+        }
+        if (literalLength > (size_t)(inEnd - in) || literalLength > outSize - written) {
+            return false;
+        }
+        memcpy(out + written, in, literalLength);
+        in += literalLength;
+        written += literalLength;
+        if (in == inEnd) {
+            break;  // Last sequence
+        }
+
+        if (inEnd - in < 2) return false;
+        size_t offset = (size_t)in[0] | (size_t)in[1] << 8;
+        in += 2;
+        size_t matchLength = token & 15;
+        if (matchLength == 15) {
+            uint8_t more;
+            do {
+                if (in >= inEnd) return false;
+                more = *in++;
+                matchLength += more;
+            } while (more == 255);
+        }
+        matchLength += 4;
+        if (offset == 0 || offset > written || matchLength > outSize - written) {
+            return false;
+        }
+        // Byte by byte when the match overlaps what it produces
+        uint8_t* target = out + written;
+        const uint8_t* source = target - offset;
+        if (offset >= matchLength) {
+            memcpy(target, source, matchLength);
+        } else {
+            for (size_t i = 0; i < matchLength; i++) target[i] = source[i];
+        }
+        written += matchLength;
+    }
+    return written == outSize;
+}
+
+// ---------------------------------------------------------------- Codecs
+
+class Compressor {
+private:
+    static const size_t PROBE_SIZE = 4096;
+    static const size_t HEADER_SIZE = 4;  // Raw size
+
+public:
+    static const int DEFAULT_ZSTD_LEVEL = 3;
+
+    // Whether this build can write and read the codec
+    static bool IsAvailable(Codec codec) {
+#ifdef BACKUP_WITH_ZSTD
+        return codec == Codec::None || codec == Codec::Lz4 || codec == Codec::Zstd;
+#else
+        return codec == Codec::None || codec == Codec::Lz4;
+#endif
+    }
+
+    static const char* Name(Codec codec) {
+        switch (codec) {
+        case Codec::Lz4: return "lz4";
+        case Codec::Zstd: return "zstd";
+        default: return "none";
+        }
+    }
+
+    static bool Parse(const std::string& name, Codec& codec) {
+        if (name == "none") codec = Codec::None;
+        else if (name == "lz4") codec = Codec::Lz4;
+        else if (name == "zstd") codec = Codec::Zstd;
+        else return false;
+        return true;
+    }
+
+    // Entropy of the first block, in bits per byte, above 7.5: already
+    // compressed or encrypted
+    static bool LooksCompressed(const void* data, size_t size) {
+        size_t sample = size < PROBE_SIZE ? size : PROBE_SIZE;
+        if (sample < 256) {
+            return false;  // Too little to tell; compression will show
+        }
+        uint32_t counts[256] = {0};
+        const uint8_t* bytes = static_cast<const uint8_t*>(data);
+        for (size_t i = 0; i < sample; i++) {
+            counts[bytes[i]]++;
+        }
+        double entropy = 0;
+        for (uint32_t count : counts) {
+            if (count > 0) {
+                double p = (double)count / sample;
+                entropy -= p * std::log2(p);
+            }
+        }
+        return entropy > 7.5;
+    }
+
+    // Compress data into out; false if the codec is unavailable or the
+    // result would not be at least 1/16 smaller, in which case the data
+    // should be stored as it is
+    static bool Compress(Codec codec, int level, const void* data, size_t size, std::string& out) {
+        if (codec == Codec::None || !IsAvailable(codec) || size > 0xffffffffu) {
+            return false;
+        }
+
+        size_t bound = HEADER_SIZE;
+        if (codec == Codec::Lz4) {
+            bound += Lz4Bound(size);
+        }
+#ifdef BACKUP_WITH_ZSTD
+        if (codec == Codec::Zstd) {
+            bound += ZSTD_compressBound(size);
+        }
+#endif
+        out.resize(bound);
+        uint8_t* header = (uint8_t*)&out[0];
+        for (int i = 0; i < 4; i++) {
+            header[i] = (uint8_t)(size >> (i * 8));
+        }
+
+        size_t compressed = 0;
+        if (codec == Codec::Lz4) {
+            compressed = Lz4Compress(static_cast<const uint8_t*>(data), size, header + HEADER_SIZE);
+        }
+#ifdef BACKUP_WITH_ZSTD
+        if (codec == Codec::Zstd) {
+            compressed = ZSTD_compress(header + HEADER_SIZE, bound - HEADER_SIZE, data, size, level);
+            if (ZSTD_isError(compressed)) {
+                return false;
+            }
+        }
+#else
+        (void)level;
+#endif
+        if (HEADER_SIZE + compressed > size - size / 16) {
+            return false;
+        }
+        out.resize(HEADER_SIZE + compressed);
+        return true;
+    }
+
+    // Undo Compress; codec None copies the data
+    static bool Decompress(Codec codec, const void* data, size_t size, std::string& out) {
+        const uint8_t* in = static_cast<const uint8_t*>(data);
+        if (codec == Codec::None) {
+            out.assign((const char*)in, size);
+            return true;
+        }
+        if (size < HEADER_SIZE || !IsAvailable(codec)) {
+            return false;
+        }
+
+        size_t rawSize = 0;
+        for (int i = 0; i < 4; i++) {
+            rawSize |= (size_t)in[i] << (i * 8);
+        }
+        out.resize(rawSize);
+        uint8_t* target = rawSize > 0 ? (uint8_t*)&out[0] : nullptr;
+        if (codec == Codec::Lz4) {
+            return Lz4Decompress(in + HEADER_SIZE, size - HEADER_SIZE, target, rawSize);
+        }
+#ifdef BACKUP_WITH_ZSTD
+        if (codec == Codec::Zstd) {
+            size_t result = ZSTD_decompress(target, rawSize, in + HEADER_SIZE, size - HEADER_SIZE);
+            return !ZSTD_isError(result) && result == rawSize;
+        }
+#endif
+        return false;
+    }
+};
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef BACKUP_CONSOLE_H
+#define BACKUP_CONSOLE_H
+
+// Line-atomic console output for parallel workers.
+//
+//   ConsoleLine(cout) << "  [NEW] " << path << endl;
+//
+// The message is buffered and written to the target stream in one piece
+// when the temporary is destroyed, so lines from different threads never
+// interleave.
+
+#include <mutex>
+#include <ostream>
+#include <sstream>
+
+inline std::mutex& ConsoleMutex() {
+    static std::mutex consoleMutex;
+    return consoleMutex;
+}
+
+class ConsoleLine {
+private:
+    std::ostream& target;
+    std::ostringstream buffer;
+
+public:
+    explicit ConsoleLine(std::ostream& stream) : target(stream) {}
+
+    ~ConsoleLine() {
+        std::lock_guard<std::mutex> lock(ConsoleMutex());
+        target << buffer.str();
+    }
+
+    ConsoleLine(const ConsoleLine&) = delete;
+    ConsoleLine& operator=(const ConsoleLine&) = delete;
+
+    template <typename T>
+    ConsoleLine& operator<<(const T& value) {
+        buffer << value;
+        return *this;
+    }
+
+    // Manipulators such as endl
+    ConsoleLine& operator<<(std::ostream& (*manipulator)(std::ostream&)) {
+        buffer << manipulator;
+        return *this;
+    }
+};
+
+#endif
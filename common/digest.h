@@ -0,0 +1,102 @@
+#ifndef BACKUP_DIGEST_H
+#define BACKUP_DIGEST_H
+
+// 32-byte SHA-256 digest as a value type.
+//
+// Digests are kept in binary everywhere (maps, queues, index files) and
+// only turned into hex for content file names and console output. An
+// all-zero digest means "no digest".
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <ostream>
+#include <string>
+
+struct Digest {
+    static const size_t SIZE = 32;
+    static const size_t HEX_SIZE = SIZE * 2;
+
+    uint8_t bytes[SIZE];
+
+    Digest() { memset(bytes, 0, SIZE); }
+
+    explicit Digest(const uint8_t data[SIZE]) { memcpy(bytes, data, SIZE); }
+
+    bool IsEmpty() const {
+        static const uint8_t zero[SIZE] = {};
+        return memcmp(bytes, zero, SIZE) == 0;
+    }
+
+    void Clear() { memset(bytes, 0, SIZE); }
+
+    // Digests are uniformly distributed, so any 8 bytes make a good hash
+    size_t Hash() const {
+        uint64_t value;
+        memcpy(&value, bytes, sizeof(value));
+        return (size_t)value;
+    }
+
+    // Lowercase hex into out[HEX_SIZE] (not terminated)
+    void ToHex(char* out) const {
+        static const char digits[] = "0123456789abcdef";
+        for (size_t i = 0; i < SIZE; i++) {
+            out[i * 2] = digits[bytes[i] >> 4];
+            out[i * 2 + 1] = digits[bytes[i] & 15];
+        }
+    }
+
+    std::string ToHex() const {
+        std::string hex(HEX_SIZE, '0');
+        ToHex(&hex[0]);
+        return hex;
+    }
+
+    // Parse exactly HEX_SIZE hex digits (either case); false if malformed
+    static bool FromHex(const char* hex, size_t length, Digest& digest) {
+        if (length != HEX_SIZE) {
+            return false;
+        }
+        for (size_t i = 0; i < SIZE; i++) {
+            int high = HexValue(hex[i * 2]);
+            int low = HexValue(hex[i * 2 + 1]);
+            if (high < 0 || low < 0) {
+                return false;
+            }
+            digest.bytes[i] = (uint8_t)(high << 4 | low);
+        }
+        return true;
+    }
+
+    static bool FromHex(const std::string& hex, Digest& digest) {
+        return FromHex(hex.data(), hex.size(), digest);
+    }
+
+    bool operator==(const Digest& other) const { return memcmp(bytes, other.bytes, SIZE) == 0; }
+    bool operator!=(const Digest& other) const { return !(*this == other); }
+    bool operator<(const Digest& other) const { return memcmp(bytes, other.bytes, SIZE) < 0; }
+
+private:
+    static int HexValue(char c) {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    }
+};
+
+inline std::ostream& operator<<(std::ostream& stream, const Digest& digest) {
+    char hex[Digest::HEX_SIZE];
+    digest.ToHex(hex);
+    return stream.write(hex, Digest::HEX_SIZE);
+}
+
+namespace std {
+template <>
+struct hash<Digest> {
+    size_t operator()(const Digest& digest) const { return digest.Hash(); }
+};
+}
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef BACKUP_DIGEST_SET_H
+#define BACKUP_DIGEST_SET_H
+
+// Compact set of digests: an open-addressing table with linear probing.
+//
+// Slots hold the 32-byte digests themselves, with the all-zero digest
+// marking a free slot, so there are no per-entry allocations or pointers.
+// Digests are uniformly distributed and index the table directly. The
+// table doubles when it is 70% full. Not thread-safe.
+
+#include "digest.h"
+#include <cstddef>
+#include <vector>
+
+class DigestSet {
+private:
+    static const size_t MIN_CAPACITY = 1024;
+
+    std::vector<Digest> slots;
+    size_t mask;
+    size_t count;
+
+    // Slot holding the digest, or the free slot where it belongs
+    size_t Find(const Digest& digest) const {
+        size_t i = digest.Hash() & mask;
+        while (!slots[i].IsEmpty() && slots[i] != digest) {
+            i = (i + 1) & mask;
+        }
+        return i;
+    }
+
+    void Rehash(size_t capacity) {
+        std::vector<Digest> old(capacity);
+        old.swap(slots);
+        mask = capacity - 1;
+        for (const Digest& digest : old) {
+            if (!digest.IsEmpty()) {
+                slots[Find(digest)] = digest;
+            }
+        }
+    }
+
+public:
+    DigestSet() : slots(MIN_CAPACITY), mask(MIN_CAPACITY - 1), count(0) {}
+
+    size_t Size() const { return count; }
+
+    bool Contains(const Digest& digest) const {
+        return !digest.IsEmpty() && !slots[Find(digest)].IsEmpty();
+    }
+
+    // Add a digest; false if it was present already (or is empty)
+    bool Insert(const Digest& digest) {
+        if (digest.IsEmpty()) {
+            return false;
+        }
+        size_t i = Find(digest);
+        if (!slots[i].IsEmpty()) {
+            return false;
+        }
+        slots[i] = digest;
+        count++;
+        if (count * 10 >= slots.size() * 7) {
+            Rehash(slots.size() * 2);
+        }
+        return true;
+    }
+
+    // Make room for n digests without rehashing
+    void Reserve(size_t n) {
+        size_t capacity = slots.size();
+        while (n * 10 >= capacity * 7) {
+            capacity *= 2;
+        }
+        if (capacity != slots.size()) {
+            Rehash(capacity);
+        }
+    }
+
+    void Clear() {
+        std::vector<Digest>(MIN_CAPACITY).swap(slots);
+        mask = MIN_CAPACITY - 1;
+        count = 0;
+    }
+
+    // Call f(digest) for every digest, in table order
+    template <typename Function>
+    void ForEach(Function f) const {
+        for (const Digest& digest : slots) {
+            if (!digest.IsEmpty()) {
+                f(digest);
+            }
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,414 @@
+#ifndef BACKUP_FILE_HASHER_H
+#define BACKUP_FILE_HASHER_H
+
+#include "filesystem.h"
+#include "sha256.h"
+#include "digest.h"
+#include "chunker.h"
+#include "io_ring.h"
+#include <cstring>
+#include <string>
+#include <vector>
+
+// SHA-256 Hasher Class
+class FileHasher {
+public:
+    // Read size per call; large reads keep the SIMD hash engines busy
+    static const size_t BUFFER_SIZE = 1024 * 1024;
+
+    // Read size when chunking: many chunks per read, so they are hashed
+    // together with the multi-buffer engine
+    static const size_t CHUNK_BUFFER_SIZE = 4 * 1024 * 1024;
+
+private:
+    // Hashing context of the calling thread, reset for each file
+    static Sha256& ThreadHasher() {
+        thread_local Sha256 hasher;
+        hasher.Reset();
+        return hasher;
+    }
+
+    // Read buffer of the calling thread, reused across files
+    static char* ThreadBuffer() {
+        thread_local std::vector<char> buffer(BUFFER_SIZE);
+        return buffer.data();
+    }
+
+    // Chunking buffer of the calling thread; it must hold two maximum-size
+    // chunks so every read ends at least one
+    static std::vector<char>& ThreadChunkBuffer(size_t maxChunk) {
+        thread_local std::vector<char> buffer;
+        size_t size = CHUNK_BUFFER_SIZE > 2 * maxChunk ? CHUNK_BUFFER_SIZE : 2 * maxChunk;
+        if (buffer.size() < size) {
+            buffer.resize(size);
+        }
+        return buffer;
+    }
+
+    // Finish the hash into a digest
+    static Digest Finish(Sha256& hasher) {
+        Digest digest;
+        hasher.Final(digest.bytes);
+        return digest;
+    }
+
+public:
+    // Calculate SHA-256 hash of a file; returns an empty digest on error.
+    // If info is given it receives the metadata of the opened file.
+    static Digest CalculateHash(const Directory& dir, const char* name, FileInfo* info = nullptr) {
+        File file;
+        if (!file.OpenRead(dir, name)) {
+            return Digest();
+        }
+        if (info && !file.GetInfo(*info)) {
+            return Digest();
+        }
+
+        Sha256& hasher = ThreadHasher();
+        char* buffer = ThreadBuffer();
+        long long bytesRead = 0;
+        while ((bytesRead = file.Read(buffer, BUFFER_SIZE)) > 0) {
+            hasher.Update(buffer, (size_t)bytesRead);
+        }
+        if (bytesRead < 0) {
+            return Digest();
+        }
+        return Finish(hasher);
+    }
+
+    // Copy a file and hash it in the same pass, so the source is read only
+    // once. Where the filesystem can, the copy is a reflink of the source
+    // instead, and the reflink is read for the hash: the data is read
+    // once and never written, and the digest is of exactly what was kept
+    // even if the source changes meanwhile. The copy keeps the source's
+    // permissions and timestamps; on error it is removed and an empty
+    // digest is returned.
+    // If info is given it receives the metadata of the opened source, and
+    // method the way the data went (Clone or Buffered).
+    static Digest CopyAndHash(const Directory& srcDir, const char* srcName,
+                                   const Directory& dstDir, const char* dstName,
+                                   FileInfo* info = nullptr, CopyMethod* method = nullptr) {
+        File source;
+        if (!source.OpenRead(srcDir, srcName)) {
+            return Digest();
+        }
+        if (info && !source.GetInfo(*info)) {
+            return Digest();
+        }
+
+        File target;
+        if (!target.Create(dstDir, dstName)) {
+            return Digest();
+        }
+
+        Sha256& hasher = ThreadHasher();
+        char* buffer = ThreadBuffer();
+        long long bytesRead = 0;
+        bool ok = true;
+        File clone;
+        bool cloned = target.CloneFrom(source) && clone.OpenRead(dstDir, dstName);
+        File& input = cloned ? clone : source;
+        while (ok && (bytesRead = input.Read(buffer, BUFFER_SIZE)) > 0) {
+            hasher.Update(buffer, (size_t)bytesRead);
+            ok = cloned || target.WriteAll(buffer, (size_t)bytesRead);
+        }
+        ok = ok && bytesRead == 0;
+        if (method) {
+            *method = cloned ? CopyMethod::Clone : CopyMethod::Buffered;
+        }
+
+        if (ok) {
+            target.CopyAttributesFrom(source);
+        }
+        if (!target.Finish()) {
+            ok = false;
+        }
+
+        if (!ok) {
+            dstDir.RemoveChild(dstName);
+            return Digest();
+        }
+        return Finish(hasher);
+    }
+
+    // Read a whole file into content and hash it; for files that are
+    // stored from memory. Returns an empty digest on error.
+    // If info is given it receives the metadata of the opened file.
+    static Digest ReadAndHash(const Directory& dir, const char* name, std::string& content,
+                              FileInfo* info = nullptr) {
+        File file;
+        FileInfo opened;
+        if (!file.OpenRead(dir, name) || !file.GetInfo(opened)) {
+            return Digest();
+        }
+
+        // Sized from the metadata; grows if the file does
+        content.resize((size_t)opened.size + 1);
+        size_t used = 0;
+        long long bytesRead = 0;
+        while ((bytesRead = file.Read(&content[used], content.size() - used)) > 0) {
+            used += (size_t)bytesRead;
+            if (used == content.size()) {
+                content.resize(content.size() * 2);
+            }
+        }
+        if (bytesRead < 0) {
+            return Digest();
+        }
+        content.resize(used);
+
+        Sha256& hasher = ThreadHasher();
+        hasher.Update(content.data(), content.size());
+        if (info) {
+            *info = opened;
+        }
+        return Finish(hasher);
+    }
+
+    // Split a file into content-defined chunks and hash each of them.
+    // onChunk(digest, data, size) is called for every chunk in file order
+    // and returns false to stop. chunks receives the chunk digests. Returns
+    // the digest of the file's chunk list (SHA-256 over the chunk digests),
+    // or an empty digest on error.
+    // If info is given it receives the metadata of the opened file.
+    template <typename Function>
+    static Digest ChunkAndHash(const Directory& dir, const char* name, Chunker& chunker,
+                               std::vector<Digest>& chunks, FileInfo* info, Function onChunk) {
+        static const size_t GROUP = 16;  // Chunks hashed per HashMany call
+        chunks.clear();
+        File file;
+        if (!file.OpenRead(dir, name)) {
+            return Digest();
+        }
+        if (info && !file.GetInfo(*info)) {
+            return Digest();
+        }
+
+        std::vector<char>& buffer = ThreadChunkBuffer(chunker.MaxSize());
+        std::vector<size_t> lengths;
+        size_t filled = 0;
+        bool atEnd = false;
+        while (!atEnd) {
+            while (filled < buffer.size()) {
+                long long bytesRead = file.Read(&buffer[filled], buffer.size() - filled);
+                if (bytesRead < 0) {
+                    return Digest();
+                }
+                if (bytesRead == 0) {
+                    atEnd = true;
+                    break;
+                }
+                filled += (size_t)bytesRead;
+            }
+
+            const uint8_t* data = (const uint8_t*)buffer.data();
+            lengths.clear();
+            size_t used = chunker.Split(data, filled, atEnd, lengths);
+
+            size_t offset = 0;
+            for (size_t first = 0; first < lengths.size(); first += GROUP) {
+                size_t count = lengths.size() - first < GROUP ? lengths.size() - first : GROUP;
+                const void* starts[GROUP];
+                uint8_t digests[GROUP][Sha256::DIGEST_SIZE];
+                size_t start = offset;
+                for (size_t i = 0; i < count; i++) {
+                    starts[i] = data + start;
+                    start += lengths[first + i];
+                }
+                Sha256::HashMany(starts, &lengths[first], count, digests);
+                for (size_t i = 0; i < count; i++) {
+                    Digest digest(digests[i]);
+                    if (!onChunk(digest, data + offset, lengths[first + i])) {
+                        return Digest();
+                    }
+                    chunks.push_back(digest);
+                    offset += lengths[first + i];
+                }
+            }
+
+            memmove(&buffer[0], &buffer[used], filled - used);
+            filled -= used;
+        }
+
+        Sha256& hasher = ThreadHasher();
+        for (const Digest& chunk : chunks) {
+            hasher.Update(chunk.bytes, Digest::SIZE);
+        }
+        return Finish(hasher);
+    }
+};
+
+// Small files read and hashed as a group. Files are read when the batch
+// is flushed, all of them with one io_uring submission where the kernel
+// supports it (common/io_ring.h), and one at a time otherwise; then they
+// are hashed together with the multi-buffer SHA-256 engine, and the
+// content stays available for storing. Per-file setup, not hashing,
+// dominates for small files, so this replaces many short CopyAndHash
+// calls.
+class FileHashBatch {
+public:
+    static const long long SMALL_FILE_SIZE = 16 * 1024;
+    static const size_t CAPACITY = IoRing::MAX_BATCH;
+
+    // What Flush made of a file
+    enum class Status {
+        Hashed,
+        TooLarge,  // Grew past SMALL_FILE_SIZE; use FileHasher::CopyAndHash instead
+        Failed
+    };
+
+private:
+    struct Entry {
+        const Directory* dir = nullptr;
+        std::string name;
+        bool known = false;  // info was given to Add
+        FileInfo info;
+        std::string content;
+        Digest hash;
+        Status status = Status::Failed;
+    };
+
+    std::vector<Entry> entries;  // Reused between batches to keep buffers
+    size_t count;
+    IoRing ring;
+
+    // Read a file on its own; its metadata is taken from the open file, so
+    // a TooLarge file reports its current size
+    static Status Read(Entry& entry) {
+        File source;
+        if (!source.OpenRead(*entry.dir, entry.name.c_str()) || !source.GetInfo(entry.info)) {
+            return Status::Failed;
+        }
+        if (entry.info.size > SMALL_FILE_SIZE) {
+            return Status::TooLarge;
+        }
+
+        // Read to end of file; one byte of slack detects growth
+        entry.content.resize((size_t)SMALL_FILE_SIZE + 1);
+        size_t used = 0;
+        long long bytesRead = 0;
+        while (used < entry.content.size() &&
+               (bytesRead = source.Read(&entry.content[used], entry.content.size() - used)) > 0) {
+            used += (size_t)bytesRead;
+        }
+        if (bytesRead < 0) {
+            return Status::Failed;
+        }
+        if (used > (size_t)SMALL_FILE_SIZE) {
+            // Grew while it was read
+            source.GetInfo(entry.info);
+            return Status::TooLarge;
+        }
+        entry.content.resize(used);
+        entry.info.size = (long long)used;
+        return Status::Hashed;
+    }
+
+    // Read the files whose metadata is known through the ring. Each file
+    // gets one read, which is only taken as the whole file if it returned
+    // exactly the size from the stat: a network or FUSE filesystem may
+    // return less, and a file that grew since has a stale size. A file it
+    // cannot read, or not in one read, is left Failed, to be read on its
+    // own.
+    void ReadAll() {
+        const Directory* dirs[CAPACITY] = {};
+        const char* names[CAPACITY] = {};
+        size_t indexes[CAPACITY];
+        long long lengths[CAPACITY];
+        size_t queued = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (entries[i].known) {
+                dirs[queued] = entries[i].dir;
+                names[queued] = entries[i].name.c_str();
+                indexes[queued++] = i;
+            }
+        }
+        ring.ReadMany(dirs, names, queued, lengths);
+        for (size_t q = 0; q < queued; q++) {
+            Entry& entry = entries[indexes[q]];
+            if (lengths[q] != entry.info.size) {  // Also an error, which is negative
+                continue;
+            }
+            entry.content.assign(ring.Buffer(q), (size_t)lengths[q]);
+            entry.status = Status::Hashed;
+        }
+    }
+
+public:
+    FileHashBatch() : entries(CAPACITY), count(0) {
+        ring.Open(CAPACITY, (size_t)SMALL_FILE_SIZE + 1);
+    }
+
+    size_t Size() const { return count; }
+    bool IsFull() const { return count >= CAPACITY; }
+
+    // Whether files are read through io_uring
+    bool UsesRing() const { return ring.IsOpen(); }
+
+    // The batch's ring, for other batched I/O on the same thread
+    IoRing& Ring() { return ring; }
+
+    // Add a small file to be read by Flush; srcDir must stay open until
+    // then. info, if given, is the file's metadata from a stat taken
+    // before this call: it lets the ring read the file without a stat of
+    // its own, and is what Info reports if the ring read it (a file read
+    // on its own reports the metadata of the open file). A file that
+    // changes after that stat then has a cache key older than its
+    // content, which makes the next run hash it again rather than trust
+    // it.
+    void Add(const Directory& srcDir, const char* srcName, const FileInfo* info = nullptr) {
+        Entry& entry = entries[count++];
+        entry.dir = &srcDir;
+        entry.name = srcName;
+        entry.known = info != nullptr;
+        if (info) {
+            entry.info = *info;
+        }
+        entry.status = Status::Failed;
+    }
+
+    // Read and hash all files; afterwards Result(i) says what became of
+    // entry i, and Hash(i) is its digest if it was hashed
+    void Flush() {
+        if (ring.IsOpen()) {
+            ReadAll();
+        }
+        const void* data[CAPACITY] = {};
+        size_t sizes[CAPACITY] = {};
+        size_t indexes[CAPACITY];
+        uint8_t digests[CAPACITY][Sha256::DIGEST_SIZE];
+        size_t hashed = 0;
+        for (size_t i = 0; i < count; i++) {
+            Entry& entry = entries[i];
+            if (entry.status == Status::Failed) {
+                entry.status = Read(entry);
+            }
+            entry.hash.Clear();
+            if (entry.status == Status::Hashed) {
+                data[hashed] = entry.content.data();
+                sizes[hashed] = entry.content.size();
+                indexes[hashed++] = i;
+            }
+        }
+        Sha256::HashMany(data, sizes, hashed, digests);
+        for (size_t h = 0; h < hashed; h++) {
+            entries[indexes[h]].hash = Digest(digests[h]);
+        }
+    }
+
+    Status Result(size_t i) const { return entries[i].status; }
+    const Digest& Hash(size_t i) const { return entries[i].hash; }
+    const FileInfo& Info(size_t i) const { return entries[i].info; }
+
+    // Hand the content of entry i over to the caller
+    std::string TakeContent(size_t i) {
+        std::string content;
+        content.swap(entries[i].content);
+        return content;
+    }
+
+    // Start a new batch
+    void Clear() { count = 0; }
+};
+
+#endif
@@ -0,0 +1,113 @@
+#ifndef BACKUP_FILESYSTEM_H
+#define BACKUP_FILESYSTEM_H
+
+// Filesystem abstraction shared by all backup phases.
+//
+// The backend is selected at compile time: Win32 (FindFirstFileA/CopyFileA)
+// on Windows, native POSIX (openat/getdents64/fstatat, and reflinks or
+// copy_file_range for copies) everywhere else. Both backends expose the same classes:
+//
+//   Directory        - an open directory; children are resolved relative to it
+//   DirectoryReader  - enumerates the entries of a Directory
+//   File             - an open regular file (read or write)
+//   MappedFile       - a whole file mapped read-only into memory
+//   FileLock         - an exclusive lock on a file, held across processes
+//   FileSystem       - static helpers (mkdir, copy, stat by path, errors)
+//
+// Names passed to Directory/File methods are plain entry names (no
+// separators); they are resolved against the directory handle so no full
+// path is rebuilt per file.
+
+#include <cstddef>
+#include <string>
+
+// Kind of directory entry
+enum class EntryType {
+    Unknown,
+    File,
+    Directory,
+    Symlink,
+    Other
+};
+
+// Metadata of a file or directory
+struct FileInfo {
+    EntryType type = EntryType::Unknown;
+    long long size = 0;
+    long long mtimeNs = 0;  // Last modification, nanoseconds since Unix epoch
+    long long ctimeNs = 0;  // Status change (POSIX) or creation (Windows)
+    unsigned long long device = 0;
+    unsigned long long inode = 0;
+};
+
+// Result of a directory creation attempt
+enum class MkdirResult {
+    Created,
+    AlreadyExists,
+    ParentMissing,
+    Failed
+};
+
+// Result of a rename that must not replace an existing target
+enum class RenameResult {
+    Renamed,
+    TargetExists,
+    Failed
+};
+
+// How a copy moved the data, cheapest first
+enum class CopyMethod {
+    Clone,      // Reflink: the copy shares the source's blocks (FICLONE)
+    CopyRange,  // copy_file_range, inside the kernel
+    SendFile,   // sendfile, inside the kernel
+    Buffered,   // read/write through user space
+    System,     // CopyFileA
+};
+
+const int COPY_METHOD_COUNT = 5;
+
+inline const char* CopyMethodName(CopyMethod method) {
+    switch (method) {
+        case CopyMethod::Clone: return "reflink";
+        case CopyMethod::CopyRange: return "copy_file_range";
+        case CopyMethod::SendFile: return "sendfile";
+        case CopyMethod::Buffered: return "read/write";
+        case CopyMethod::System: return "CopyFileA";
+    }
+    return "";
+}
+
+// One entry returned by DirectoryReader::Next
+struct DirEntry {
+    const char* name = nullptr;  // View into the reader's buffer, valid until the next call to Next()
+    size_t nameLength = 0;
+    EntryType type = EntryType::Unknown;  // Unknown when the backend could not classify without a stat
+};
+
+#ifdef _WIN32
+const char PATH_SEPARATOR = '\\';
+#else
+const char PATH_SEPARATOR = '/';
+#endif
+
+// Ensure path ends with the platform separator
+inline std::string NormalizePath(const std::string& path) {
+    std::string normalized = path;
+    if (!normalized.empty() && normalized.back() != PATH_SEPARATOR) {
+        normalized += PATH_SEPARATOR;
+    }
+    return normalized;
+}
+
+// Skip "." and ".."
+inline bool IsDotEntry(const char* name) {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
+
+#ifdef _WIN32
+#include "filesystem_win32.h"
+#else
+#include "filesystem_posix.h"
+#endif
+
+#endif
@@ -0,0 +1,775 @@
+#ifndef BACKUP_FILESYSTEM_POSIX_H
+#define BACKUP_FILESYSTEM_POSIX_H
+
+// Native POSIX backend for filesystem.h. Do not include directly.
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+#ifndef FICLONE
+#define FICLONE _IOW(0x94, 9, int)
+#endif
+#endif
+
+#ifdef __APPLE__
+#define BACKUP_ST_ATIM st_atimespec
+#define BACKUP_ST_MTIM st_mtimespec
+#define BACKUP_ST_CTIM st_ctimespec
+#else
+#define BACKUP_ST_ATIM st_atim
+#define BACKUP_ST_MTIM st_mtim
+#define BACKUP_ST_CTIM st_ctim
+#endif
+
+// Convert struct stat to FileInfo
+inline void FillFileInfo(const struct stat& st, FileInfo& info) {
+    if (S_ISREG(st.st_mode)) {
+        info.type = EntryType::File;
+    } else if (S_ISDIR(st.st_mode)) {
+        info.type = EntryType::Directory;
+    } else if (S_ISLNK(st.st_mode)) {
+        info.type = EntryType::Symlink;
+    } else {
+        info.type = EntryType::Other;
+    }
+    info.size = st.st_size;
+    info.mtimeNs = (long long)st.BACKUP_ST_MTIM.tv_sec * 1000000000LL + st.BACKUP_ST_MTIM.tv_nsec;
+    info.ctimeNs = (long long)st.BACKUP_ST_CTIM.tv_sec * 1000000000LL + st.BACKUP_ST_CTIM.tv_nsec;
+    info.device = st.st_dev;
+    info.inode = st.st_ino;
+}
+
+// Open directory handle; children are resolved with the *at() syscalls
+class Directory {
+private:
+    int fd;
+    std::string path;  // Display path, always ends with a separator
+
+public:
+    Directory() : fd(-1) {}
+    ~Directory() { Close(); }
+
+    Directory(const Directory&) = delete;
+    Directory& operator=(const Directory&) = delete;
+
+    Directory(Directory&& other) : fd(other.fd), path(std::move(other.path)) {
+        other.fd = -1;
+    }
+
+    Directory& operator=(Directory&& other) {
+        if (this != &other) {
+            Close();
+            fd = other.fd;
+            path = std::move(other.path);
+            other.fd = -1;
+        }
+        return *this;
+    }
+
+    // Open a directory by path
+    bool Open(const std::string& dirPath) {
+        Close();
+        path = NormalizePath(dirPath);
+        fd = open(dirPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        return fd >= 0;
+    }
+
+    // Open a subdirectory relative to parent (symlinks are not followed)
+    bool OpenChild(const Directory& parent, const char* name) {
+        Close();
+        path = parent.path + name + PATH_SEPARATOR;
+        fd = openat(parent.fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+        return fd >= 0;
+    }
+
+    // Create a subdirectory
+    MkdirResult MakeChild(const char* name) const {
+        if (mkdirat(fd, name, 0755) == 0) {
+            return MkdirResult::Created;
+        }
+        if (errno == EEXIST) {
+            struct stat st;
+            if (fstatat(fd, name, &st, 0) == 0 && S_ISDIR(st.st_mode)) {
+                return MkdirResult::AlreadyExists;
+            }
+            errno = EEXIST;
+            return MkdirResult::Failed;
+        }
+        return errno == ENOENT ? MkdirResult::ParentMissing : MkdirResult::Failed;
+    }
+
+    // Get metadata of a child entry
+    bool Stat(const char* name, FileInfo& info, bool followLinks = false) const {
+        struct stat st;
+        if (fstatat(fd, name, &st, followLinks ? 0 : AT_SYMLINK_NOFOLLOW) != 0) {
+            return false;
+        }
+        FillFileInfo(st, info);
+        return true;
+    }
+
+    // Get metadata of the directory itself
+    bool GetInfo(FileInfo& info) const {
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            return false;
+        }
+        FillFileInfo(st, info);
+        return true;
+    }
+
+    // Remove a child file
+    bool RemoveChild(const char* name) const {
+        return unlinkat(fd, name, 0) == 0;
+    }
+
+    // Remove an empty child directory
+    bool RemoveChildDirectory(const char* name) const {
+        return unlinkat(fd, name, AT_REMOVEDIR) == 0;
+    }
+
+    // Rename a child, possibly into another directory
+    bool RenameChild(const char* name, const Directory& targetDir, const char* targetName) const {
+        return renameat(fd, name, targetDir.fd, targetName) == 0;
+    }
+
+    // Rename a child only if targetName does not exist yet (atomic)
+    RenameResult RenameChildNoReplace(const char* name, const Directory& targetDir, const char* targetName) const {
+#if defined(__linux__) && defined(SYS_renameat2)
+        if (syscall(SYS_renameat2, fd, name, targetDir.fd, targetName, RENAME_NOREPLACE) == 0) {
+            return RenameResult::Renamed;
+        }
+        if (errno == EEXIST) return RenameResult::TargetExists;
+        if (errno != EINVAL && errno != ENOSYS) return RenameResult::Failed;
+#endif
+        // No renameat2: a hard link also fails atomically on an existing target
+        if (linkat(fd, name, targetDir.fd, targetName, 0) == 0) {
+            unlinkat(fd, name, 0);
+            return RenameResult::Renamed;
+        }
+        return errno == EEXIST ? RenameResult::TargetExists : RenameResult::Failed;
+    }
+
+    // Flush every file of this directory's filesystem to the device
+    bool SyncFileSystem() const {
+#ifdef __linux__
+        return syncfs(fd) == 0;
+#else
+        sync();
+        return true;
+#endif
+    }
+
+    bool IsOpen() const { return fd >= 0; }
+    int Fd() const { return fd; }
+    const std::string& Path() const { return path; }
+
+    void Close() {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+};
+
+// Map a dirent d_type to EntryType (DT_UNKNOWN means "stat required")
+inline EntryType EntryTypeFromDType(unsigned char type) {
+    switch (type) {
+        case DT_REG: return EntryType::File;
+        case DT_DIR: return EntryType::Directory;
+        case DT_LNK: return EntryType::Symlink;
+        case DT_UNKNOWN: return EntryType::Unknown;
+        default: return EntryType::Other;
+    }
+}
+
+// Enumerates the entries of a Directory.
+//
+// On Linux entries are fetched with getdents64 in large batches; names are
+// handed out as pointers into the batch buffer and classified from d_type,
+// so no per-entry allocation or stat is needed.
+class DirectoryReader {
+private:
+    const Directory& dir;
+#ifdef __linux__
+    // Raw getdents64 records
+    struct LinuxDirent64 {
+        unsigned long long d_ino;
+        long long d_off;
+        unsigned short d_reclen;
+        unsigned char d_type;
+        char d_name[1];
+    };
+
+    std::unique_ptr<char[]> buffer;  // Not zero-initialised
+    size_t bufferSize;
+    long bufferUsed;
+    long bufferPos;
+    int fd;
+#else
+    DIR* handle;
+#endif
+
+public:
+    static const size_t DEFAULT_BUFFER_SIZE = 64 * 1024;
+
+    explicit DirectoryReader(const Directory& directory, size_t batchBytes = DEFAULT_BUFFER_SIZE)
+        : dir(directory) {
+#ifdef __linux__
+        bufferSize = batchBytes;
+        buffer.reset(new char[bufferSize]);
+        bufferUsed = 0;
+        bufferPos = 0;
+        // Enumerate through the directory's own descriptor, from the start
+        fd = dir.Fd();
+        if (fd >= 0) lseek(fd, 0, SEEK_SET);
+#else
+        (void)batchBytes;
+        handle = nullptr;
+        int fd = openat(dir.Fd(), ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd >= 0) {
+            handle = fdopendir(fd);
+            if (!handle) close(fd);
+        }
+#endif
+    }
+
+    ~DirectoryReader() {
+#ifndef __linux__
+        if (handle) closedir(handle);
+#endif
+    }
+
+    DirectoryReader(const DirectoryReader&) = delete;
+    DirectoryReader& operator=(const DirectoryReader&) = delete;
+
+    bool IsOpen() const {
+#ifdef __linux__
+        return fd >= 0;
+#else
+        return handle != nullptr;
+#endif
+    }
+
+    // Advance to the next entry; returns false at the end or on error
+    bool Next(DirEntry& entry) {
+#ifdef __linux__
+        if (fd < 0) return false;
+        if (bufferPos >= bufferUsed) {
+            long n;
+            do {
+                n = syscall(SYS_getdents64, fd, buffer.get(), bufferSize);
+            } while (n < 0 && errno == EINTR);
+            if (n <= 0) return false;
+            bufferUsed = n;
+            bufferPos = 0;
+        }
+        LinuxDirent64* record = reinterpret_cast<LinuxDirent64*>(buffer.get() + bufferPos);
+        bufferPos += record->d_reclen;
+        entry.name = record->d_name;
+        entry.nameLength = strlen(record->d_name);
+        entry.type = EntryTypeFromDType(record->d_type);
+        return true;
+#else
+        if (!handle) return false;
+        struct dirent* record = readdir(handle);
+        if (!record) return false;
+        entry.name = record->d_name;
+        entry.nameLength = strlen(record->d_name);
+#ifdef DT_UNKNOWN
+        entry.type = EntryTypeFromDType(record->d_type);
+#else
+        entry.type = EntryType::Unknown;
+#endif
+        return true;
+#endif
+    }
+
+    // Classify an entry, issuing a stat only when d_type is not conclusive.
+    // Symlinks to regular files count as files (like CopyFileA).
+    EntryType GetType(const DirEntry& entry) const {
+        if (entry.type != EntryType::Unknown && entry.type != EntryType::Symlink) {
+            return entry.type;
+        }
+        FileInfo info;
+        if (!GetInfo(entry, info)) return EntryType::Unknown;
+        return info.type;
+    }
+
+    // Get metadata for an entry returned by Next(). Symlinks to regular
+    // files report the target; other symlinks stay Symlink.
+    bool GetInfo(const DirEntry& entry, FileInfo& info) const {
+        if (!dir.Stat(entry.name, info)) return false;
+        if (info.type == EntryType::Symlink) {
+            FileInfo target;
+            if (dir.Stat(entry.name, target, true) && target.type == EntryType::File) {
+                info = target;
+            }
+        }
+        return true;
+    }
+};
+
+// Open regular file
+class File {
+private:
+    int fd;
+
+public:
+    File() : fd(-1) {}
+    ~File() { Close(); }
+
+    File(const File&) = delete;
+    File& operator=(const File&) = delete;
+
+    File(File&& other) : fd(other.fd) { other.fd = -1; }
+
+    File& operator=(File&& other) {
+        if (this != &other) {
+            Close();
+            fd = other.fd;
+            other.fd = -1;
+        }
+        return *this;
+    }
+
+    // Open an existing file for reading
+    bool OpenRead(const Directory& dir, const char* name) {
+        Close();
+        fd = openat(dir.Fd(), name, O_RDONLY | O_CLOEXEC);
+        return fd >= 0;
+    }
+
+    bool OpenRead(const std::string& path) {
+        Close();
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        return fd >= 0;
+    }
+
+    // Create (or truncate) a file for writing
+    bool Create(const Directory& dir, const char* name, int mode = 0644) {
+        Close();
+        fd = openat(dir.Fd(), name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+        return fd >= 0;
+    }
+
+    bool Create(const std::string& path, int mode = 0644) {
+        Close();
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, mode);
+        return fd >= 0;
+    }
+
+    // Create a file that must not exist yet; fails if it does
+    bool CreateNew(const Directory& dir, const char* name, int mode = 0644) {
+        Close();
+        fd = openat(dir.Fd(), name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+        return fd >= 0;
+    }
+
+    // Open an existing file for appending
+    bool OpenAppend(const Directory& dir, const char* name) {
+        Close();
+        fd = openat(dir.Fd(), name, O_WRONLY | O_APPEND | O_CLOEXEC);
+        return fd >= 0;
+    }
+
+    // Read up to size bytes; returns bytes read, 0 at end of file, -1 on error
+    long long Read(void* buffer, size_t size) {
+        ssize_t n;
+        do {
+            n = read(fd, buffer, size);
+        } while (n < 0 && errno == EINTR);
+        return n;
+    }
+
+    // Read exactly size bytes at offset without moving the file position;
+    // false on error or if the file ends first
+    bool ReadAt(void* buffer, size_t size, long long offset) const {
+        char* data = static_cast<char*>(buffer);
+        while (size > 0) {
+            ssize_t n = pread(fd, data, size, (off_t)offset);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            data += n;
+            size -= n;
+            offset += n;
+        }
+        return true;
+    }
+
+    // Write the whole buffer
+    bool WriteAll(const void* buffer, size_t size) {
+        const char* data = static_cast<const char*>(buffer);
+        while (size > 0) {
+            ssize_t n = write(fd, data, size);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    // Write the whole buffer at offset without moving the file position
+    bool WriteAt(const void* buffer, size_t size, long long offset) {
+        const char* data = static_cast<const char*>(buffer);
+        while (size > 0) {
+            ssize_t n = pwrite(fd, data, size, (off_t)offset);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            data += n;
+            size -= n;
+            offset += n;
+        }
+        return true;
+    }
+
+    bool GetInfo(FileInfo& info) const {
+        struct stat st;
+        if (fstat(fd, &st) != 0) return false;
+        FillFileInfo(st, info);
+        return true;
+    }
+
+    // Give this file the permissions and timestamps of source
+    bool CopyAttributesFrom(const File& source) {
+        struct stat st;
+        if (fstat(source.fd, &st) != 0) return false;
+        struct timespec times[2];
+        times[0] = st.BACKUP_ST_ATIM;
+        times[1] = st.BACKUP_ST_MTIM;
+        return fchmod(fd, st.st_mode & 07777) == 0 && futimens(fd, times) == 0;
+    }
+
+    // Make this (empty) file a reflink of source, sharing its blocks
+    // instead of copying them; false if the filesystem cannot (not
+    // copy-on-write, or not the same filesystem)
+    bool CloneFrom(const File& source) {
+#ifdef __linux__
+        return ioctl(fd, FICLONE, source.fd) == 0;
+#else
+        (void)source;
+        return false;
+#endif
+    }
+
+    // Flush written data to the device
+    bool Sync() {
+        return fsync(fd) == 0;
+    }
+
+    // Close and report write-back errors
+    bool Finish() {
+        int result = close(fd);
+        fd = -1;
+        return result == 0;
+    }
+
+    bool IsOpen() const { return fd >= 0; }
+    int Fd() const { return fd; }
+
+    void Close() {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+};
+
+// Read-only mapping of a whole file
+class MappedFile {
+private:
+    void* data;
+    size_t size;
+
+public:
+    MappedFile() : data(nullptr), size(0) {}
+    ~MappedFile() { Close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Map an existing file; an empty file maps to no data
+    bool Open(const std::string& path) {
+        Close();
+        int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0;
+        if (ok && st.st_size > 0) {
+            void* mapped = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            ok = mapped != MAP_FAILED;
+            if (ok) {
+                data = mapped;
+                size = (size_t)st.st_size;
+            }
+        }
+        close(fd);  // The mapping stays valid
+        return ok;
+    }
+
+    const unsigned char* Data() const { return static_cast<const unsigned char*>(data); }
+    size_t Size() const { return size; }
+
+    void Close() {
+        if (data) {
+            munmap(data, size);
+            data = nullptr;
+            size = 0;
+        }
+    }
+};
+
+// Exclusive lock on a file, shared between processes; the kernel drops it
+// when the holder exits, however it exits
+class FileLock {
+private:
+    int fd;
+
+public:
+    FileLock() : fd(-1) {}
+    ~FileLock() { Unlock(); }
+
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+
+    // Lock the file at path, creating it if needed. Without wait, false
+    // at once if another process holds it.
+    bool Lock(const std::string& path, bool wait) {
+        Unlock();
+        fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        while (flock(fd, LOCK_EX | (wait ? 0 : LOCK_NB)) != 0) {
+            if (errno != EINTR) {
+                Unlock();
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void Unlock() {
+        if (fd >= 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    // Whether another process holds the lock at path. A missing file is
+    // not held and is not created; the test takes the lock shared, and
+    // only for a moment.
+    static bool IsHeld(const std::string& path) {
+        int probe = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (probe < 0) {
+            return false;
+        }
+        int result;
+        while ((result = flock(probe, LOCK_SH | LOCK_NB)) != 0 && errno == EINTR) {
+        }
+        bool held = result != 0 && errno == EWOULDBLOCK;
+        close(probe);
+        return held;
+    }
+};
+
+// Static filesystem helpers
+class FileSystem {
+public:
+    // Get metadata by path (follows symlinks)
+    static bool GetInfo(const std::string& path, FileInfo& info) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) return false;
+        FillFileInfo(st, info);
+        return true;
+    }
+
+    // Delete a file by path
+    static bool RemoveFile(const std::string& path) {
+        return unlink(path.c_str()) == 0;
+    }
+
+    // Create a single directory
+    static MkdirResult MakeDirectory(const std::string& path) {
+        if (mkdir(path.c_str(), 0755) == 0) {
+            return MkdirResult::Created;
+        }
+        if (errno == EEXIST) {
+            struct stat st;
+            if (stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
+                return MkdirResult::AlreadyExists;
+            }
+            errno = EEXIST;
+            return MkdirResult::Failed;
+        }
+        return errno == ENOENT ? MkdirResult::ParentMissing : MkdirResult::Failed;
+    }
+
+    // Copy a file between directories, preserving mode and timestamps.
+    // Data is moved the cheapest way the filesystems allow (see CopyData).
+    // If sourceInfo is given it receives the metadata of the opened source,
+    // and method the way the data went.
+    static bool Copy(const Directory& srcDir, const char* srcName,
+                     const Directory& dstDir, const char* dstName,
+                     FileInfo* sourceInfo = nullptr, CopyMethod* method = nullptr) {
+        int in = openat(srcDir.Fd(), srcName, O_RDONLY | O_CLOEXEC);
+        if (in < 0) return false;
+
+        struct stat st;
+        if (fstat(in, &st) != 0) {
+            int savedErrno = errno;
+            close(in);
+            errno = savedErrno;
+            return false;
+        }
+        if (sourceInfo) FillFileInfo(st, *sourceInfo);
+
+        int out = openat(dstDir.Fd(), dstName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                         st.st_mode & 0777);
+        if (out < 0) {
+            int savedErrno = errno;
+            close(in);
+            errno = savedErrno;
+            return false;
+        }
+
+        CopyMethod used;
+        bool ok = CopyData(in, out, used);
+        int savedErrno = errno;
+        if (method) *method = used;
+
+        if (ok) {
+            fchmod(out, st.st_mode & 07777);
+            struct timespec times[2];
+            times[0] = st.BACKUP_ST_ATIM;
+            times[1] = st.BACKUP_ST_MTIM;
+            futimens(out, times);
+        }
+
+        if (close(out) != 0 && ok) {
+            ok = false;
+            savedErrno = errno;
+        }
+        close(in);
+
+        if (!ok) {
+            unlinkat(dstDir.Fd(), dstName, 0);
+            errno = savedErrno;
+        }
+        return ok;
+    }
+
+    // Absolute form of a directory path with links resolved, ending in
+    // the separator, so that a directory has one name however it is
+    // reached; path itself if it cannot be resolved
+    static std::string CanonicalPath(const std::string& path) {
+        char* resolved = realpath(path.c_str(), nullptr);
+        if (!resolved) return path;
+        std::string canonical = NormalizePath(resolved);
+        free(resolved);
+        return canonical;
+    }
+
+    // Id of this process, for names no other process uses
+    static unsigned long ProcessId() {
+        return (unsigned long)getpid();
+    }
+
+    // Describe the last error (errno)
+    static std::string LastErrorString() {
+        int errorCode = errno;
+        if (errorCode == 0) return "No error";
+        return std::string(strerror(errorCode));
+    }
+
+private:
+    // Run a kernel-side copy call until the end of the input. Returns 1
+    // when done, -1 on error, and 0 if the call does not work for these
+    // files and nothing was copied, so another way can be tried.
+    template <typename Call>
+    static int KernelCopy(Call call) {
+        bool copiedAny = false;
+        for (;;) {
+            ssize_t n = call();
+            if (n > 0) {
+                copiedAny = true;
+                continue;
+            }
+            if (n == 0) return 1;
+            if (errno == EINTR) continue;
+            if (copiedAny || (errno != EXDEV && errno != ENOSYS && errno != EINVAL &&
+                              errno != EOPNOTSUPP && errno != EPERM)) {
+                return -1;
+            }
+            return 0;
+        }
+    }
+
+    // Copy all bytes from in to out (both positioned at offset 0), the
+    // cheapest way that works: a reflink shares the blocks on a
+    // copy-on-write filesystem (btrfs, XFS), copy_file_range and then
+    // sendfile keep the data in the kernel, and read/write is the last
+    // resort. method receives the way that was taken.
+    static bool CopyData(int in, int out, CopyMethod& method) {
+#ifdef __linux__
+        method = CopyMethod::Clone;
+        if (ioctl(out, FICLONE, in) == 0) return true;
+
+        method = CopyMethod::CopyRange;
+        int result = KernelCopy([&] { return copy_file_range(in, nullptr, out, nullptr, 1 << 30, 0); });
+        if (result != 0) return result > 0;
+
+        method = CopyMethod::SendFile;
+        result = KernelCopy([&] { return sendfile(out, in, nullptr, 1 << 30); });
+        if (result != 0) return result > 0;
+#endif
+        method = CopyMethod::Buffered;
+        static const size_t BUFFER_SIZE = 256 * 1024;
+        std::vector<char> buffer(BUFFER_SIZE);
+        for (;;) {
+            ssize_t n = read(in, buffer.data(), buffer.size());
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            if (n == 0) return true;
+            const char* data = buffer.data();
+            while (n > 0) {
+                ssize_t written = write(out, data, n);
+                if (written < 0) {
+                    if (errno == EINTR) continue;
+                    return false;
+                }
+                data += written;
+                n -= written;
+            }
+        }
+    }
+};
+
+#endif
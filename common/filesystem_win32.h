@@ -0,0 +1,602 @@
+#ifndef BACKUP_FILESYSTEM_WIN32_H
+#define BACKUP_FILESYSTEM_WIN32_H
+
+// Win32 backend for filesystem.h. Do not include directly.
+
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// MinGW compatibility
+#ifndef INVALID_HANDLE_VALUE
+#define INVALID_HANDLE_VALUE ((HANDLE)(LONG_PTR)-1)
+#endif
+
+// Convert FILETIME to nanoseconds since Unix epoch
+inline long long FileTimeToUnixNs(const FILETIME& ft) {
+    ULARGE_INTEGER ull;
+    ull.LowPart = ft.dwLowDateTime;
+    ull.HighPart = ft.dwHighDateTime;
+    return (long long)(ull.QuadPart - 116444736000000000ULL) * 100LL;
+}
+
+// Fill FileInfo from attribute data
+inline void FillFileInfo(DWORD attribs, DWORD sizeHigh, DWORD sizeLow,
+                         const FILETIME& lastWrite, const FILETIME& creation, FileInfo& info) {
+    if (attribs & FILE_ATTRIBUTE_DIRECTORY) {
+        info.type = EntryType::Directory;
+    } else if (attribs & FILE_ATTRIBUTE_DEVICE) {
+        info.type = EntryType::Other;
+    } else {
+        info.type = EntryType::File;
+    }
+    LARGE_INTEGER size;
+    size.LowPart = sizeLow;
+    size.HighPart = sizeHigh;
+    info.size = size.QuadPart;
+    info.mtimeNs = FileTimeToUnixNs(lastWrite);
+    info.ctimeNs = FileTimeToUnixNs(creation);
+    info.device = 0;
+    info.inode = 0;
+}
+
+// Create a single directory by path
+inline MkdirResult Win32MakeDirectory(const std::string& path) {
+    if (CreateDirectoryA(path.c_str(), NULL)) {
+        return MkdirResult::Created;
+    }
+    DWORD error = GetLastError();
+    if (error == ERROR_ALREADY_EXISTS) {
+        DWORD attribs = GetFileAttributesA(path.c_str());
+        if (attribs != INVALID_FILE_ATTRIBUTES && (attribs & FILE_ATTRIBUTE_DIRECTORY)) {
+            return MkdirResult::AlreadyExists;
+        }
+        SetLastError(error);
+        return MkdirResult::Failed;
+    }
+    return error == ERROR_PATH_NOT_FOUND ? MkdirResult::ParentMissing : MkdirResult::Failed;
+}
+
+// Open directory; Win32 has no directory-relative calls, so children are
+// addressed by path
+class Directory {
+private:
+    std::string path;  // Always ends with a separator
+    bool open;
+
+    bool CheckIsDirectory() {
+        DWORD attribs = GetFileAttributesA(path.c_str());
+        open = attribs != INVALID_FILE_ATTRIBUTES && (attribs & FILE_ATTRIBUTE_DIRECTORY);
+        return open;
+    }
+
+public:
+    Directory() : open(false) {}
+
+    Directory(const Directory&) = delete;
+    Directory& operator=(const Directory&) = delete;
+
+    Directory(Directory&& other) : path(std::move(other.path)), open(other.open) {
+        other.open = false;
+    }
+
+    Directory& operator=(Directory&& other) {
+        if (this != &other) {
+            path = std::move(other.path);
+            open = other.open;
+            other.open = false;
+        }
+        return *this;
+    }
+
+    // Open a directory by path
+    bool Open(const std::string& dirPath) {
+        path = NormalizePath(dirPath);
+        return CheckIsDirectory();
+    }
+
+    // Open a subdirectory relative to parent
+    bool OpenChild(const Directory& parent, const char* name) {
+        path = parent.path + name + PATH_SEPARATOR;
+        return CheckIsDirectory();
+    }
+
+    // Create a subdirectory
+    MkdirResult MakeChild(const char* name) const {
+        return Win32MakeDirectory(path + name);
+    }
+
+    // Get metadata of a child entry
+    bool Stat(const char* name, FileInfo& info, bool followLinks = false) const {
+        (void)followLinks;
+        WIN32_FILE_ATTRIBUTE_DATA data;
+        if (!GetFileAttributesExA((path + name).c_str(), GetFileExInfoStandard, &data)) {
+            return false;
+        }
+        FillFileInfo(data.dwFileAttributes, data.nFileSizeHigh, data.nFileSizeLow,
+                     data.ftLastWriteTime, data.ftCreationTime, info);
+        return true;
+    }
+
+    // Get metadata of the directory itself
+    bool GetInfo(FileInfo& info) const {
+        WIN32_FILE_ATTRIBUTE_DATA data;
+        if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data)) {
+            return false;
+        }
+        FillFileInfo(data.dwFileAttributes, data.nFileSizeHigh, data.nFileSizeLow,
+                     data.ftLastWriteTime, data.ftCreationTime, info);
+        return true;
+    }
+
+    // Remove a child file
+    bool RemoveChild(const char* name) const {
+        return DeleteFileA((path + name).c_str()) != 0;
+    }
+
+    // Remove an empty child directory
+    bool RemoveChildDirectory(const char* name) const {
+        return RemoveDirectoryA((path + name).c_str()) != 0;
+    }
+
+    // Rename a child, possibly into another directory
+    bool RenameChild(const char* name, const Directory& targetDir, const char* targetName) const {
+        return MoveFileExA((path + name).c_str(), (targetDir.path + targetName).c_str(),
+                           MOVEFILE_REPLACE_EXISTING) != 0;
+    }
+
+    // Rename a child only if targetName does not exist yet (atomic)
+    RenameResult RenameChildNoReplace(const char* name, const Directory& targetDir, const char* targetName) const {
+        if (MoveFileExA((path + name).c_str(), (targetDir.path + targetName).c_str(), 0)) {
+            return RenameResult::Renamed;
+        }
+        DWORD error = GetLastError();
+        return (error == ERROR_ALREADY_EXISTS || error == ERROR_FILE_EXISTS)
+                   ? RenameResult::TargetExists : RenameResult::Failed;
+    }
+
+    // Flush every file of this directory's volume to the device. This
+    // takes a volume handle, which needs administrator rights.
+    bool SyncFileSystem() const {
+        char volume[MAX_PATH];
+        if (!GetVolumePathNameA(path.c_str(), volume, MAX_PATH)) {
+            return false;
+        }
+        // \\.\C: is the volume; \\.\C:\ would be its root directory
+        std::string device = std::string("\\\\.\\") + volume;
+        if (device.back() == '\\') {
+            device.pop_back();
+        }
+        HANDLE volumeHandle = CreateFileA(device.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                                          OPEN_EXISTING, 0, NULL);
+        if (volumeHandle == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        bool ok = FlushFileBuffers(volumeHandle) != 0;
+        CloseHandle(volumeHandle);
+        return ok;
+    }
+
+    bool IsOpen() const { return open; }
+    const std::string& Path() const { return path; }
+
+    void Close() { open = false; }
+};
+
+// Enumerates the entries of a Directory with FindFirstFileA/FindNextFileA
+class DirectoryReader {
+private:
+    HANDLE hFind;
+    WIN32_FIND_DATAA findData;
+    bool first;
+
+public:
+    static const size_t DEFAULT_BUFFER_SIZE = 64 * 1024;
+
+    explicit DirectoryReader(const Directory& dir, size_t batchBytes = DEFAULT_BUFFER_SIZE) : first(true) {
+        (void)batchBytes;
+        std::string searchPath = dir.Path() + "*";
+        hFind = FindFirstFileA(searchPath.c_str(), &findData);
+    }
+
+    ~DirectoryReader() {
+        if (hFind != INVALID_HANDLE_VALUE) {
+            FindClose(hFind);
+        }
+    }
+
+    DirectoryReader(const DirectoryReader&) = delete;
+    DirectoryReader& operator=(const DirectoryReader&) = delete;
+
+    bool IsOpen() const { return hFind != INVALID_HANDLE_VALUE; }
+
+    // Advance to the next entry; returns false at the end or on error
+    bool Next(DirEntry& entry) {
+        if (hFind == INVALID_HANDLE_VALUE) return false;
+        if (first) {
+            first = false;
+        } else if (!FindNextFileA(hFind, &findData)) {
+            return false;
+        }
+        entry.name = findData.cFileName;
+        entry.nameLength = strlen(findData.cFileName);
+        if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            entry.type = EntryType::Directory;
+        } else if (findData.dwFileAttributes & FILE_ATTRIBUTE_DEVICE) {
+            entry.type = EntryType::Other;
+        } else {
+            entry.type = EntryType::File;
+        }
+        return true;
+    }
+
+    // Classify an entry (always known from the find data)
+    EntryType GetType(const DirEntry& entry) const {
+        return entry.type;
+    }
+
+    // Get metadata for the current entry (already returned by FindNextFileA)
+    bool GetInfo(const DirEntry& entry, FileInfo& info) const {
+        (void)entry;
+        FillFileInfo(findData.dwFileAttributes, findData.nFileSizeHigh, findData.nFileSizeLow,
+                     findData.ftLastWriteTime, findData.ftCreationTime, info);
+        return true;
+    }
+};
+
+// Open regular file
+class File {
+private:
+    HANDLE hFile;
+
+public:
+    File() : hFile(INVALID_HANDLE_VALUE) {}
+    ~File() { Close(); }
+
+    File(const File&) = delete;
+    File& operator=(const File&) = delete;
+
+    File(File&& other) : hFile(other.hFile) { other.hFile = INVALID_HANDLE_VALUE; }
+
+    File& operator=(File&& other) {
+        if (this != &other) {
+            Close();
+            hFile = other.hFile;
+            other.hFile = INVALID_HANDLE_VALUE;
+        }
+        return *this;
+    }
+
+    // Open an existing file for reading
+    bool OpenRead(const Directory& dir, const char* name) {
+        return OpenRead(dir.Path() + name);
+    }
+
+    bool OpenRead(const std::string& path) {
+        Close();
+        hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        return hFile != INVALID_HANDLE_VALUE;
+    }
+
+    // Create (or truncate) a file for writing
+    bool Create(const Directory& dir, const char* name, int mode = 0644) {
+        return Create(dir.Path() + name, mode);
+    }
+
+    bool Create(const std::string& path, int mode = 0644) {
+        (void)mode;
+        Close();
+        hFile = CreateFileA(path.c_str(), GENERIC_WRITE, 0, NULL,
+                            CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        return hFile != INVALID_HANDLE_VALUE;
+    }
+
+    // Create a file that must not exist yet; fails if it does
+    bool CreateNew(const Directory& dir, const char* name, int mode = 0644) {
+        (void)mode;
+        Close();
+        hFile = CreateFileA((dir.Path() + name).c_str(), GENERIC_WRITE, 0, NULL,
+                            CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+        return hFile != INVALID_HANDLE_VALUE;
+    }
+
+    // Open an existing file for appending
+    bool OpenAppend(const Directory& dir, const char* name) {
+        Close();
+        hFile = CreateFileA((dir.Path() + name).c_str(), FILE_APPEND_DATA, 0, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        return hFile != INVALID_HANDLE_VALUE;
+    }
+
+    // Read up to size bytes; returns bytes read, 0 at end of file, -1 on error
+    long long Read(void* buffer, size_t size) {
+        DWORD bytesRead = 0;
+        if (!ReadFile(hFile, buffer, (DWORD)size, &bytesRead, NULL)) {
+            return -1;
+        }
+        return bytesRead;
+    }
+
+    // Read exactly size bytes at offset; false on error or if the file
+    // ends first. Moves the file position on a synchronous handle.
+    bool ReadAt(void* buffer, size_t size, long long offset) const {
+        char* data = static_cast<char*>(buffer);
+        while (size > 0) {
+            OVERLAPPED overlapped = {};
+            overlapped.Offset = (DWORD)offset;
+            overlapped.OffsetHigh = (DWORD)(offset >> 32);
+            DWORD bytesRead = 0;
+            if (!ReadFile(hFile, data, (DWORD)size, &bytesRead, &overlapped) || bytesRead == 0) {
+                return false;
+            }
+            data += bytesRead;
+            size -= bytesRead;
+            offset += bytesRead;
+        }
+        return true;
+    }
+
+    // Write the whole buffer
+    bool WriteAll(const void* buffer, size_t size) {
+        const char* data = static_cast<const char*>(buffer);
+        while (size > 0) {
+            DWORD written = 0;
+            if (!WriteFile(hFile, data, (DWORD)size, &written, NULL)) {
+                return false;
+            }
+            data += written;
+            size -= written;
+        }
+        return true;
+    }
+
+    // Write the whole buffer at offset. Moves the file position on a
+    // synchronous handle.
+    bool WriteAt(const void* buffer, size_t size, long long offset) {
+        const char* data = static_cast<const char*>(buffer);
+        while (size > 0) {
+            OVERLAPPED overlapped = {};
+            overlapped.Offset = (DWORD)offset;
+            overlapped.OffsetHigh = (DWORD)(offset >> 32);
+            DWORD written = 0;
+            if (!WriteFile(hFile, data, (DWORD)size, &written, &overlapped)) {
+                return false;
+            }
+            data += written;
+            size -= written;
+            offset += written;
+        }
+        return true;
+    }
+
+    bool GetInfo(FileInfo& info) const {
+        BY_HANDLE_FILE_INFORMATION data;
+        if (!GetFileInformationByHandle(hFile, &data)) return false;
+        FillFileInfo(data.dwFileAttributes, data.nFileSizeHigh, data.nFileSizeLow,
+                     data.ftLastWriteTime, data.ftCreationTime, info);
+        info.device = data.dwVolumeSerialNumber;
+        info.inode = ((unsigned long long)data.nFileIndexHigh << 32) | data.nFileIndexLow;
+        return true;
+    }
+
+    // Give this file the attributes and timestamps of source
+    bool CopyAttributesFrom(const File& source) {
+        FILETIME created, accessed, written;
+        if (!GetFileTime(source.hFile, &created, &accessed, &written)) return false;
+        return SetFileTime(hFile, &created, &accessed, &written) != 0;
+    }
+
+    // Make this (empty) file share source's blocks; not done here, the
+    // data is copied instead
+    bool CloneFrom(const File& source) {
+        (void)source;
+        return false;
+    }
+
+    // Flush written data to the device
+    bool Sync() {
+        return FlushFileBuffers(hFile) != 0;
+    }
+
+    // Close and report write-back errors
+    bool Finish() {
+        BOOL ok = CloseHandle(hFile);
+        hFile = INVALID_HANDLE_VALUE;
+        return ok != 0;
+    }
+
+    bool IsOpen() const { return hFile != INVALID_HANDLE_VALUE; }
+    HANDLE Handle() const { return hFile; }
+
+    void Close() {
+        if (hFile != INVALID_HANDLE_VALUE) {
+            CloseHandle(hFile);
+            hFile = INVALID_HANDLE_VALUE;
+        }
+    }
+};
+
+// Read-only mapping of a whole file. The file cannot be replaced while it
+// is mapped.
+class MappedFile {
+private:
+    void* data;
+    size_t size;
+
+public:
+    MappedFile() : data(nullptr), size(0) {}
+    ~MappedFile() { Close(); }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    // Map an existing file; an empty file maps to no data
+    bool Open(const std::string& path) {
+        Close();
+        HANDLE hFile = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                                   OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER fileSize;
+        bool ok = GetFileSizeEx(hFile, &fileSize) != 0;
+        if (ok && fileSize.QuadPart > 0) {
+            HANDLE hMapping = CreateFileMappingA(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+            void* view = hMapping ? MapViewOfFile(hMapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+            ok = view != NULL;
+            if (ok) {
+                data = view;
+                size = (size_t)fileSize.QuadPart;
+            }
+            if (hMapping) CloseHandle(hMapping);  // The view keeps the mapping alive
+        }
+        CloseHandle(hFile);
+        return ok;
+    }
+
+    const unsigned char* Data() const { return static_cast<const unsigned char*>(data); }
+    size_t Size() const { return size; }
+
+    void Close() {
+        if (data) {
+            UnmapViewOfFile(data);
+            data = nullptr;
+            size = 0;
+        }
+    }
+};
+
+// Exclusive lock on a file, shared between processes; the system drops it
+// when the holder exits, however it exits
+class FileLock {
+private:
+    HANDLE hFile;
+
+public:
+    FileLock() : hFile(INVALID_HANDLE_VALUE) {}
+    ~FileLock() { Unlock(); }
+
+    FileLock(const FileLock&) = delete;
+    FileLock& operator=(const FileLock&) = delete;
+
+    // Lock the file at path, creating it if needed. Without wait, false
+    // at once if another process holds it.
+    bool Lock(const std::string& path, bool wait) {
+        Unlock();
+        hFile = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                            NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (hFile == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        OVERLAPPED overlapped = {};
+        DWORD flags = LOCKFILE_EXCLUSIVE_LOCK | (wait ? 0 : LOCKFILE_FAIL_IMMEDIATELY);
+        if (!LockFileEx(hFile, flags, 0, 1, 0, &overlapped)) {
+            Unlock();
+            return false;
+        }
+        return true;
+    }
+
+    void Unlock() {
+        if (hFile != INVALID_HANDLE_VALUE) {
+            CloseHandle(hFile);  // Releases the lock
+            hFile = INVALID_HANDLE_VALUE;
+        }
+    }
+
+    // Whether another process holds the lock at path. A missing file is
+    // not held and is not created; the test takes the lock shared, and
+    // only for a moment.
+    static bool IsHeld(const std::string& path) {
+        HANDLE probe = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                   NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (probe == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        OVERLAPPED overlapped = {};
+        bool held = !LockFileEx(probe, LOCKFILE_FAIL_IMMEDIATELY, 0, 1, 0, &overlapped) &&
+                    GetLastError() == ERROR_LOCK_VIOLATION;
+        CloseHandle(probe);
+        return held;
+    }
+};
+
+// Static filesystem helpers
+class FileSystem {
+public:
+    // Get metadata by path
+    static bool GetInfo(const std::string& path, FileInfo& info) {
+        WIN32_FILE_ATTRIBUTE_DATA data;
+        if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &data)) {
+            return false;
+        }
+        FillFileInfo(data.dwFileAttributes, data.nFileSizeHigh, data.nFileSizeLow,
+                     data.ftLastWriteTime, data.ftCreationTime, info);
+        return true;
+    }
+
+    // Delete a file by path
+    static bool RemoveFile(const std::string& path) {
+        return DeleteFileA(path.c_str()) != 0;
+    }
+
+    // Create a single directory
+    static MkdirResult MakeDirectory(const std::string& path) {
+        return Win32MakeDirectory(path);
+    }
+
+    // Copy a file between directories.
+    // If sourceInfo is given it receives the metadata of the source, and
+    // method the way the data went (always CopyFileA's own).
+    static bool Copy(const Directory& srcDir, const char* srcName,
+                     const Directory& dstDir, const char* dstName,
+                     FileInfo* sourceInfo = nullptr, CopyMethod* method = nullptr) {
+        std::string source = srcDir.Path() + srcName;
+        std::string dest = dstDir.Path() + dstName;
+        if (sourceInfo && !GetInfo(source, *sourceInfo)) {
+            return false;
+        }
+        if (method) *method = CopyMethod::System;
+        return CopyFileA(source.c_str(), dest.c_str(), FALSE) != 0;
+    }
+
+    // Absolute form of a directory path, ending in the separator, so that
+    // a directory has one name however it is reached; path itself if it
+    // cannot be resolved
+    static std::string CanonicalPath(const std::string& path) {
+        DWORD size = GetFullPathNameA(path.c_str(), 0, nullptr, nullptr);
+        if (size == 0) return path;
+        std::vector<char> buffer(size);
+        DWORD length = GetFullPathNameA(path.c_str(), size, buffer.data(), nullptr);
+        if (length == 0 || length >= size) return path;
+        return NormalizePath(std::string(buffer.data(), length));
+    }
+
+    // Id of this process, for names no other process uses
+    static unsigned long ProcessId() {
+        return (unsigned long)GetCurrentProcessId();
+    }
+
+    // Convert error code to string
+    static std::string LastErrorString() {
+        DWORD errorCode = GetLastError();
+        if (errorCode == 0) return "No error";
+
+        LPSTR buffer = nullptr;
+        size_t size = FormatMessageA(
+            FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM,
+            NULL, errorCode, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
+            (LPSTR)&buffer, 0, NULL);
+
+        std::string message(buffer, size);
+        LocalFree(buffer);
+        return message;
+    }
+};
+
+#endif
@@ -0,0 +1,285 @@
+#ifndef BACKUP_HASH_CACHE_H
+#define BACKUP_HASH_CACHE_H
+
+// Persistent cache of file digests from the previous run.
+//
+// A file whose device, inode, size, mtime and ctime all match the cached
+// entry is assumed unchanged and its digest is reused without reading the
+// data. Entries are kept as a sorted array: the previous run's entries
+// are looked up without locks, and the current run's are collected and
+// become the next cache file, so files that disappeared drop out.
+//
+// Checkpoint appends the entries collected since the last one to a
+// journal (common/journal.h). Load reads it as well, so a run that was
+// interrupted still passes on what it hashed; Save replaces it with the
+// cache file. A resumed run keeps the previous entries too, since it
+// skips the files the interrupted run got done.
+
+#include "filesystem.h"
+#include "digest.h"
+#include "io_ring.h"
+#include "record_file.h"
+#include "journal.h"
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct HashCacheKey {
+    unsigned long long device = 0;
+    unsigned long long inode = 0;
+    long long size = 0;
+    long long mtimeNs = 0;
+    long long ctimeNs = 0;
+
+    static HashCacheKey FromInfo(const FileInfo& info) {
+        HashCacheKey key;
+        key.device = info.device;
+        key.inode = info.inode;
+        key.size = info.size;
+        key.mtimeNs = info.mtimeNs;
+        key.ctimeNs = info.ctimeNs;
+        return key;
+    }
+
+    // Without a file id the remaining fields do not identify a file
+    bool IsValid() const { return inode != 0; }
+
+    bool operator<(const HashCacheKey& other) const {
+        if (device != other.device) return device < other.device;
+        if (inode != other.inode) return inode < other.inode;
+        if (size != other.size) return size < other.size;
+        if (mtimeNs != other.mtimeNs) return mtimeNs < other.mtimeNs;
+        return ctimeNs < other.ctimeNs;
+    }
+
+    bool operator==(const HashCacheKey& other) const {
+        return device == other.device && inode == other.inode && size == other.size &&
+               mtimeNs == other.mtimeNs && ctimeNs == other.ctimeNs;
+    }
+};
+
+class HashCache {
+private:
+    struct Entry {
+        HashCacheKey key;
+        Digest digest;
+
+        bool operator<(const Entry& other) const { return key < other.key; }
+    };
+
+    // Files changed this close to the start of the run may change again
+    // within the same timestamp tick, so they are not cached
+    static const long long RACY_WINDOW_NS = 2000000000LL;
+
+    // Entries per journal record
+    static const size_t CHECKPOINT_BATCH = 4096;
+
+    std::string rootPath;
+    std::string cachePath;
+    std::vector<Entry> previous;  // Sorted, read-only during the run
+    std::vector<Entry> current;
+    std::mutex currentLock;
+    long long startNs;
+    Journal journal;
+    uint64_t journalLoaded;
+    size_t journaled;   // Entries of current in the journal
+    bool keepPrevious;  // Carry the previous entries over
+
+    // Binary format: "BKHCACH1", then per file
+    // device, inode, size, mtime_ns, ctime_ns (i64 each), digest (32 bytes).
+    // Journal records hold entries in the same layout.
+    static const char* Magic() { return "BKHCACH1"; }
+    static const char* CacheName() { return ".dedup_hash_cache.bin"; }
+    static const char* JournalName() { return ".dedup_hash_cache.journal"; }
+    static const char* JournalMagic() { return "BKHCJRN1"; }
+
+    static bool GetEntry(RecordReader& reader, Entry& entry) {
+        int64_t device, inode, size, mtimeNs, ctimeNs;
+        if (!reader.GetI64(device) || !reader.GetI64(inode) || !reader.GetI64(size) ||
+            !reader.GetI64(mtimeNs) || !reader.GetI64(ctimeNs) || !reader.GetDigest(entry.digest)) {
+            return false;
+        }
+        entry.key.device = (unsigned long long)device;
+        entry.key.inode = (unsigned long long)inode;
+        entry.key.size = size;
+        entry.key.mtimeNs = mtimeNs;
+        entry.key.ctimeNs = ctimeNs;
+        return true;
+    }
+
+    static void PutEntry(RecordBuffer& record, const Entry& entry) {
+        record.PutI64((int64_t)entry.key.device);
+        record.PutI64((int64_t)entry.key.inode);
+        record.PutI64(entry.key.size);
+        record.PutI64(entry.key.mtimeNs);
+        record.PutI64(entry.key.ctimeNs);
+        record.PutDigest(entry.digest);
+    }
+
+public:
+    HashCache(const std::string& backupRoot) : journalLoaded(0), journaled(0), keepPrevious(false) {
+        rootPath = NormalizePath(backupRoot);
+        cachePath = rootPath + CacheName();
+        startNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // Metadata that identifies a file for the cache. The directory stat is
+    // enough where it carries the file id (POSIX); otherwise the file is
+    // opened to read it (Win32).
+    static bool Identify(const Directory& dir, const char* name, FileInfo& info) {
+        if (!dir.Stat(name, info, true)) {
+            return false;
+        }
+        if (info.inode != 0) {
+            return true;
+        }
+        File file;
+        return file.OpenRead(dir, name) && file.GetInfo(info);
+    }
+
+    // Identify up to IoRing::MAX_BATCH files with one submission to ring;
+    // files it cannot stat, and all of them without a ring, are identified
+    // one at a time. found[i] says whether infos[i] was filled in.
+    static void IdentifyMany(IoRing& ring, const Directory* const* dirs, const char* const* names, size_t count,
+                             FileInfo* infos, bool* found) {
+        ring.StatMany(dirs, names, count, infos, found);
+        for (size_t i = 0; i < count; i++) {
+            if (!found[i]) {
+                found[i] = Identify(*dirs[i], names[i], infos[i]);
+            }
+        }
+    }
+
+    // Load the previous run's cache and what an interrupted run
+    // journaled; false if there is neither
+    bool Load() {
+        previous.clear();
+        journalLoaded = 0;
+
+        RecordReader reader;
+        bool found = reader.Open(cachePath, Magic());
+        Entry entry;
+        while (found && !reader.AtEnd() && GetEntry(reader, entry)) {  // Truncated: keep what was read
+            previous.push_back(entry);
+        }
+
+        Directory root;
+        if (root.Open(rootPath)) {
+            journalLoaded = Journal::Replay(root, JournalName(), JournalMagic(), [&](const char* data, size_t size) {
+                reader.Assign(data, size);
+                while (!reader.AtEnd() && GetEntry(reader, entry)) {
+                    previous.push_back(entry);
+                }
+            });
+        }
+
+        // Written sorted, but do not rely on it for lookups
+        if (!std::is_sorted(previous.begin(), previous.end())) {
+            std::sort(previous.begin(), previous.end());
+        }
+        return found || journalLoaded > 0;
+    }
+
+    // Start journaling checkpoints; resume carries the previous entries
+    // over into the next cache
+    bool BeginRun(bool resume) {
+        keepPrevious = resume;
+        Directory root;
+        return root.Open(rootPath) && journal.Open(root, JournalName(), JournalMagic(), journalLoaded, false);
+    }
+
+    // Journal the entries recorded since the last checkpoint and wait
+    // until they are on the device
+    bool Checkpoint() {
+        RecordBuffer record;
+        {
+            std::lock_guard<std::mutex> lock(currentLock);
+            for (; journaled < current.size(); journaled++) {
+                PutEntry(record, current[journaled]);
+                if ((journaled + 1) % CHECKPOINT_BATCH == 0) {
+                    journal.Append(record.Data());
+                    record.Clear();
+                }
+            }
+        }
+        if (!record.Data().empty()) {
+            journal.Append(record.Data());
+        }
+        return journal.Sync();
+    }
+
+    // Digest of an unchanged file from the previous run
+    bool Lookup(const HashCacheKey& key, Digest& digest) const {
+        if (!key.IsValid()) {
+            return false;
+        }
+        Entry probe;
+        probe.key = key;
+        auto it = std::lower_bound(previous.begin(), previous.end(), probe);
+        if (it == previous.end() || !(it->key == key)) {
+            return false;
+        }
+        digest = it->digest;
+        return true;
+    }
+
+    // Remember a file's digest for the next run
+    void Record(const HashCacheKey& key, const Digest& digest) {
+        if (!key.IsValid() || std::max(key.mtimeNs, key.ctimeNs) >= startNs - RACY_WINDOW_NS) {
+            return;
+        }
+        Entry entry;
+        entry.key = key;
+        entry.digest = digest;
+        std::lock_guard<std::mutex> lock(currentLock);
+        current.push_back(entry);
+    }
+
+    // Write this run's entries as the next cache, which replaces the
+    // journal
+    bool Save() {
+        std::lock_guard<std::mutex> lock(currentLock);
+        if (keepPrevious) {
+            current.insert(current.end(), previous.begin(), previous.end());
+        }
+        std::sort(current.begin(), current.end());
+        // Hard links are seen once per name
+        current.erase(std::unique(current.begin(), current.end(),
+                                  [](const Entry& a, const Entry& b) { return a.key == b.key; }),
+                      current.end());
+
+        // Written under a temporary name and renamed, so an interrupted save
+        // leaves the previous cache (and its journal) in place
+        journal.Close();
+        Directory root;
+        if (!root.Open(rootPath)) {
+            return false;
+        }
+        std::string tempName = std::string(CacheName()) + ".tmp";
+        RecordWriter writer;
+        if (!writer.Open(rootPath + tempName, Magic())) {
+            return false;
+        }
+        for (const Entry& entry : current) {
+            writer.PutI64((int64_t)entry.key.device);
+            writer.PutI64((int64_t)entry.key.inode);
+            writer.PutI64(entry.key.size);
+            writer.PutI64(entry.key.mtimeNs);
+            writer.PutI64(entry.key.ctimeNs);
+            writer.PutDigest(entry.digest);
+        }
+        if (!writer.Close(true) || !root.RenameChild(tempName.c_str(), root, CacheName())) {
+            root.RemoveChild(tempName.c_str());
+            return false;
+        }
+        root.RemoveChild(JournalName());
+        return true;
+    }
+
+    size_t PreviousCount() const { return previous.size(); }
+};
+
+#endif
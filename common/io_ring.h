@@ -0,0 +1,337 @@
+#ifndef BACKUP_IO_RING_H
+#define BACKUP_IO_RING_H
+
+// Batched file I/O through io_uring, for work made of many small files
+// (common/file_hasher.h, common/hash_cache.h).
+//
+// One call stats or reads a whole batch of files with a single
+// io_uring_enter, where the synchronous path makes several system calls
+// per file. Reads run as one chain per file: an open straight into a
+// slot of the ring's file table (a direct descriptor, never in the
+// process's table), a read of that slot into the file's registered
+// buffer, and a close of the slot. The chains are hard-linked, so each
+// step runs after the one before whatever its result. The kernel keeps
+// all of the batch in flight at once and, for files not in the page
+// cache, reads them in parallel on its own workers.
+//
+// A ring is owned by one thread. It needs Linux 5.17 (direct
+// descriptors and the features flag checked for them) and headers as
+// new; elsewhere, or if io_uring is disabled or registered buffers
+// exceed RLIMIT_MEMLOCK, Open fails and callers do the I/O themselves
+// (registered buffers are optional). A step that fails is reported per
+// file, so callers can retry it synchronously for the real error.
+
+#include "filesystem.h"
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#if defined(IORING_FEAT_CQE_SKIP) && defined(__NR_io_uring_setup)
+#define BACKUP_IO_URING 1
+#endif
+#endif
+
+class IoRing {
+public:
+    // Files per StatMany or ReadMany call
+    static const size_t MAX_BATCH = 64;
+
+#ifdef BACKUP_IO_URING
+private:
+    static const unsigned ENTRIES = 4 * MAX_BATCH;  // A read chain takes three
+    static const int MAX_STALLS = 64;  // Busy returns in a row before Run gives up
+    enum Step : uint64_t { STAT, OPEN, READ, CLOSE };
+
+    int ringFd;
+    void* ringMemory;
+    size_t ringSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+
+    unsigned* sqTail;
+    unsigned sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe* cqes;
+
+    std::vector<char> memory;  // The buffers, one after another
+    size_t bufferSize;
+    size_t bufferCount;
+    bool fixedBuffers;  // Registered with the kernel
+    std::vector<struct statx> statBuffers;
+
+    static int Setup(unsigned entries, struct io_uring_params& params) {
+        return (int)syscall(__NR_io_uring_setup, entries, &params);
+    }
+
+    int Enter(unsigned submit, unsigned wait) {
+        return (int)syscall(__NR_io_uring_enter, ringFd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0,
+                            nullptr, 0);
+    }
+
+    int Register(unsigned opcode, const void* arg, unsigned count) {
+        return (int)syscall(__NR_io_uring_register, ringFd, opcode, arg, count);
+    }
+
+    // Next free submission entry, cleared; the caller fills it in
+    struct io_uring_sqe& Prepare(uint8_t opcode, size_t file, Step step) {
+        unsigned tail = *sqTail;
+        unsigned index = tail & sqMask;
+        struct io_uring_sqe& sqe = sqes[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = opcode;
+        sqe.user_data = (uint64_t)file << 2 | step;
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        return sqe;
+    }
+
+    // Submit the prepared entries and pass each of the count completions
+    // to complete(file, step, result). If the ring fails it is closed, and
+    // the completions not seen count as failed. A ring that keeps refusing
+    // as busy (EAGAIN, EBUSY) without completing anything has failed too.
+    template <typename Function>
+    void Run(unsigned count, Function complete) {
+        unsigned submitted = 0, completed = 0;
+        int stalls = 0;
+        while (completed < count) {
+            int n = Enter(count - submitted, count - completed);
+            bool busy = n < 0 && (errno == EAGAIN || errno == EBUSY);
+            if (n < 0 && errno != EINTR && !busy) {
+                Close();
+                return;
+            }
+            if (n > 0) {
+                submitted += (unsigned)n;
+            }
+            unsigned head = *cqHead;
+            unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            bool progressed = head != tail;
+            for (; head != tail; head++) {
+                const struct io_uring_cqe& cqe = cqes[head & cqMask];
+                complete((size_t)(cqe.user_data >> 2), (Step)(cqe.user_data & 3), cqe.res);
+                completed++;
+            }
+            __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+            if (!busy || progressed) {
+                stalls = 0;
+            } else if (++stalls >= MAX_STALLS) {
+                Close();
+                return;
+            } else {
+                sched_yield();
+            }
+        }
+    }
+
+    static long long Nanoseconds(const struct statx_timestamp& time) {
+        return (long long)time.tv_sec * 1000000000LL + time.tv_nsec;
+    }
+
+    // The statx counterpart of FillFileInfo
+    static void FillInfo(const struct statx& st, FileInfo& info) {
+        mode_t mode = st.stx_mode;
+        if (S_ISREG(mode)) {
+            info.type = EntryType::File;
+        } else if (S_ISDIR(mode)) {
+            info.type = EntryType::Directory;
+        } else if (S_ISLNK(mode)) {
+            info.type = EntryType::Symlink;
+        } else {
+            info.type = EntryType::Other;
+        }
+        info.size = (long long)st.stx_size;
+        info.mtimeNs = Nanoseconds(st.stx_mtime);
+        info.ctimeNs = Nanoseconds(st.stx_ctime);
+        info.device = makedev(st.stx_dev_major, st.stx_dev_minor);
+        info.inode = st.stx_ino;
+    }
+
+    void Close() {
+        if (sqes) munmap(sqes, sqesSize);
+        if (ringMemory) munmap(ringMemory, ringSize);
+        if (ringFd >= 0) close(ringFd);
+        ringFd = -1;
+        ringMemory = nullptr;
+        sqes = nullptr;
+    }
+
+public:
+    IoRing()
+        : ringFd(-1), ringMemory(nullptr), ringSize(0), sqes(nullptr), sqesSize(0), bufferSize(0),
+          bufferCount(0), fixedBuffers(false) {}
+    ~IoRing() { Close(); }
+
+    IoRing(const IoRing&) = delete;
+    IoRing& operator=(const IoRing&) = delete;
+
+    // Set up the ring with count buffers of size bytes each for ReadMany;
+    // false if io_uring cannot be used
+    bool Open(size_t count, size_t size) {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ringFd = Setup(ENTRIES, params);
+        if (ringFd < 0) {
+            return false;
+        }
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_CQE_SKIP)) {
+            Close();
+            return false;
+        }
+
+        size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+        ringSize = sqSize > cqSize ? sqSize : cqSize;
+        void* ring = mmap(nullptr, ringSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                          IORING_OFF_SQ_RING);
+        if (ring == MAP_FAILED) {
+            Close();
+            return false;
+        }
+        ringMemory = ring;
+        sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+        void* entries = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                             IORING_OFF_SQES);
+        if (entries == MAP_FAILED) {
+            Close();
+            return false;
+        }
+        sqes = (struct io_uring_sqe*)entries;
+
+        char* base = (char*)ring;
+        sqTail = (unsigned*)(base + params.sq_off.tail);
+        sqMask = *(unsigned*)(base + params.sq_off.ring_mask);
+        sqArray = (unsigned*)(base + params.sq_off.array);
+        cqHead = (unsigned*)(base + params.cq_off.head);
+        cqTail = (unsigned*)(base + params.cq_off.tail);
+        cqMask = *(unsigned*)(base + params.cq_off.ring_mask);
+        cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+
+        // One empty file slot per buffer, filled by the opens
+        bufferCount = count < MAX_BATCH ? count : MAX_BATCH;
+        bufferSize = size;
+        std::vector<int> slots(bufferCount, -1);
+        if (Register(IORING_REGISTER_FILES, slots.data(), (unsigned)slots.size()) < 0) {
+            Close();
+            return false;
+        }
+        memory.resize(bufferCount * bufferSize);
+        std::vector<struct iovec> buffers(bufferCount);
+        for (size_t i = 0; i < bufferCount; i++) {
+            buffers[i].iov_base = Buffer(i);
+            buffers[i].iov_len = bufferSize;
+        }
+        fixedBuffers = Register(IORING_REGISTER_BUFFERS, buffers.data(), (unsigned)buffers.size()) == 0;
+        statBuffers.resize(MAX_BATCH);
+        return true;
+    }
+
+    bool IsOpen() const { return ringFd >= 0; }
+
+    // Whether this kernel can run a ring
+    static bool Available() {
+        IoRing ring;
+        return ring.Open(1, 1);
+    }
+
+    // Files per ReadMany call, each into its own buffer
+    size_t BufferCount() const { return bufferCount; }
+    char* Buffer(size_t i) { return memory.data() + i * bufferSize; }
+
+    // Get the metadata of up to MAX_BATCH files, following symlinks (as
+    // Directory::Stat with follow); found[i] is false where it failed
+    void StatMany(const Directory* const* dirs, const char* const* names, size_t count, FileInfo* infos,
+                  bool* found) {
+        for (size_t i = 0; i < count; i++) {
+            found[i] = false;
+        }
+        if (!IsOpen()) {
+            return;
+        }
+        for (size_t i = 0; i < count; i++) {
+            struct io_uring_sqe& sqe = Prepare(IORING_OP_STATX, i, STAT);
+            sqe.fd = dirs[i]->Fd();
+            sqe.addr = (uint64_t)(uintptr_t)names[i];
+            sqe.len = STATX_BASIC_STATS;
+            sqe.statx_flags = AT_STATX_SYNC_AS_STAT;
+            sqe.off = (uint64_t)(uintptr_t)&statBuffers[i];
+        }
+        Run((unsigned)count, [&](size_t file, Step, int result) {
+            found[file] = result == 0;
+            if (found[file]) {
+                FillInfo(statBuffers[file], infos[file]);
+            }
+        });
+    }
+
+    // Read up to BufferCount files into their buffers, up to the buffer
+    // size each; lengths[i] receives the bytes read, or -1 if the file
+    // could not be opened or read
+    void ReadMany(const Directory* const* dirs, const char* const* names, size_t count, long long* lengths) {
+        for (size_t i = 0; i < count; i++) {
+            lengths[i] = -1;
+        }
+        if (!IsOpen()) {
+            return;
+        }
+        for (size_t i = 0; i < count; i++) {
+            struct io_uring_sqe& opening = Prepare(IORING_OP_OPENAT, i, OPEN);
+            opening.fd = dirs[i]->Fd();
+            opening.addr = (uint64_t)(uintptr_t)names[i];
+            opening.open_flags = O_RDONLY;  // Direct descriptors take no O_CLOEXEC
+            opening.file_index = (uint32_t)i + 1;
+            opening.flags = IOSQE_IO_HARDLINK;
+
+            struct io_uring_sqe& reading = Prepare(fixedBuffers ? IORING_OP_READ_FIXED : IORING_OP_READ, i, READ);
+            reading.fd = (int)i;
+            reading.addr = (uint64_t)(uintptr_t)Buffer(i);
+            reading.len = (uint32_t)bufferSize;
+            reading.buf_index = fixedBuffers ? (uint16_t)i : 0;
+            reading.flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+
+            struct io_uring_sqe& closing = Prepare(IORING_OP_CLOSE, i, CLOSE);
+            closing.file_index = (uint32_t)i + 1;
+        }
+        std::vector<bool> opened(count);
+        Run((unsigned)(3 * count), [&](size_t file, Step step, int result) {
+            if (step == OPEN) {
+                opened[file] = result >= 0;
+            } else if (step == READ && result >= 0) {
+                lengths[file] = result;
+            }
+        });
+        for (size_t i = 0; i < count; i++) {
+            // The read's completion can arrive before the open's
+            if (!opened[i]) {
+                lengths[i] = -1;
+            }
+        }
+    }
+
+#else
+public:
+    bool Open(size_t, size_t) { return false; }
+    bool IsOpen() const { return false; }
+    static bool Available() { return false; }
+    size_t BufferCount() const { return 0; }
+    char* Buffer(size_t) { return nullptr; }
+    void StatMany(const Directory* const*, const char* const*, size_t count, FileInfo*, bool* found) {
+        for (size_t i = 0; i < count; i++) found[i] = false;
+    }
+    void ReadMany(const Directory* const*, const char* const*, size_t count, long long* lengths) {
+        for (size_t i = 0; i < count; i++) lengths[i] = -1;
+    }
+#endif
+};
+
+#endif
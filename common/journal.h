@@ -0,0 +1,276 @@
+#ifndef BACKUP_JOURNAL_H
+#define BACKUP_JOURNAL_H
+
+// Append-only journal of changes to a checkpoint file (a manifest or an
+// index), so a run writes what it changed instead of the whole file.
+//
+// The file starts with an 8-byte magic, followed by records framed as
+// payload length (u32), payload, and an FNV-1a checksum of the payload
+// (u32). Append only adds the record to an in-memory group; a background
+// thread writes the group and fsyncs it once GROUP_BYTES have gathered or
+// GROUP_INTERVAL_MS have passed, so one fsync covers many records. Sync
+// commits everything appended so far. A crash loses at most the group in
+// flight, and a torn last record fails its checksum and ends the replay.
+// A journal opened without autoCommit writes only on Sync, for records
+// that must not reach the device before the data they describe.
+//
+// Records must be idempotent (a record sets a value rather than changing
+// it): compaction writes a new checkpoint first and shortens the journal
+// afterwards, so after a crash in between, records already in the
+// checkpoint are replayed once more.
+
+#include "filesystem.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+class Journal {
+public:
+    static const size_t GROUP_BYTES = 1024 * 1024;
+    static const int GROUP_INTERVAL_MS = 200;
+
+    // Compact once the journal is past COMPACT_MIN_BYTES and a
+    // 1/COMPACT_RATIO of its checkpoint
+    static const uint64_t COMPACT_MIN_BYTES = 4 * 1024 * 1024;
+    static const uint64_t COMPACT_RATIO = 4;
+
+private:
+    static const size_t READ_SIZE = 1024 * 1024;
+
+    File file;
+    std::mutex lock;
+    std::condition_variable wake;       // Writer: a group is ready
+    std::condition_variable committed;  // Sync: the writer finished a group
+    std::string pending;                // Appended, not written yet
+    uint64_t appended;                  // File size once pending is written
+    uint64_t durable;                   // File size known to be on the device
+    bool syncRequested;
+    bool stopping;
+    bool failed;
+    bool autoCommit;
+    std::thread writer;
+
+    static uint32_t Checksum(const char* data, size_t size) {
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < size; i++) {
+            hash = (hash ^ (uint8_t)data[i]) * 16777619u;
+        }
+        return hash;
+    }
+
+    static void Put32(std::string& out, uint32_t value) {
+        for (int i = 0; i < 4; i++) out += (char)(value >> (i * 8));
+    }
+
+    static uint32_t Load32(const char* p) {
+        uint32_t value = 0;
+        for (int i = 0; i < 4; i++) value |= (uint32_t)(uint8_t)p[i] << (i * 8);
+        return value;
+    }
+
+    // Read a whole file; false if it cannot be opened or read
+    static bool ReadAll(const Directory& dir, const char* name, std::string& data) {
+        File in;
+        if (!in.OpenRead(dir, name)) {
+            return false;
+        }
+        data.clear();
+        std::vector<char> buffer(READ_SIZE);
+        long long bytesRead;
+        while ((bytesRead = in.Read(buffer.data(), buffer.size())) > 0) {
+            data.append(buffer.data(), (size_t)bytesRead);
+        }
+        return bytesRead == 0;
+    }
+
+    // Write groups until stopped; each group is one write and one fsync
+    void WriterLoop() {
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            wake.wait_for(guard, std::chrono::milliseconds((int)GROUP_INTERVAL_MS), [this] {
+                return stopping || syncRequested || (autoCommit && pending.size() >= GROUP_BYTES);
+            });
+            bool stop = stopping;
+            bool due = stop || syncRequested || autoCommit;
+            syncRequested = false;
+            if (due && !pending.empty()) {
+                std::string group;
+                group.swap(pending);
+                uint64_t end = appended;
+                guard.unlock();
+                bool ok = file.WriteAll(group.data(), group.size()) && file.Sync();
+                guard.lock();
+                failed = failed || !ok;
+                durable = end;
+            }
+            committed.notify_all();
+            if (stop) {
+                return;
+            }
+        }
+    }
+
+    void Stop() {
+        if (writer.joinable()) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopping = true;
+            }
+            wake.notify_one();
+            writer.join();
+        }
+    }
+
+public:
+    Journal() : appended(0), durable(0), syncRequested(false), stopping(false), failed(false), autoCommit(true) {}
+    ~Journal() { Close(); }
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    // Call visit(payload, size) for each intact record of a journal, in
+    // order. Returns the length of the intact part, which is 0 if the
+    // journal is missing or in another format.
+    template <typename Function>
+    static uint64_t Replay(const Directory& dir, const char* name, const char magic[8], Function visit) {
+        std::string data;
+        if (!ReadAll(dir, name, data) || data.size() < 8 || memcmp(data.data(), magic, 8) != 0) {
+            return 0;
+        }
+        size_t pos = 8;
+        while (data.size() - pos >= 8) {
+            uint32_t size = Load32(data.data() + pos);
+            if (data.size() - pos - 8 < size) {
+                break;
+            }
+            const char* payload = data.data() + pos + 4;
+            if (Load32(payload + size) != Checksum(payload, size)) {
+                break;
+            }
+            visit(payload, (size_t)size);
+            pos += 8 + (size_t)size;
+        }
+        return pos;
+    }
+
+    // Append payload to out as one record, for files written without a
+    // Journal (see common/change_journal.h)
+    static void Frame(std::string& out, const char* payload, size_t size) {
+        Put32(out, (uint32_t)size);
+        out.append(payload, size);
+        Put32(out, Checksum(payload, size));
+    }
+
+    // Replace a journal with the records in [begin, end) of its current
+    // contents (offsets as returned by Replay and Size); an empty range
+    // leaves an empty journal. Written under a temporary name and renamed,
+    // so a crash leaves one or the other. The journal must not be open.
+    static bool Rewrite(const Directory& dir, const char* name, const char magic[8], uint64_t begin,
+                        uint64_t end) {
+        std::string data;
+        std::string kept(magic, 8);
+        if (begin < end) {
+            if (!ReadAll(dir, name, data) || data.size() < end) {
+                return false;
+            }
+            kept.append(data, (size_t)begin, (size_t)(end - begin));
+        }
+        std::string tempName = std::string(name) + ".tmp";
+        File out;
+        bool ok = out.Create(dir, tempName.c_str()) && out.WriteAll(kept.data(), kept.size()) && out.Sync();
+        ok = out.Finish() && ok;
+        if (!ok || !dir.RenameChild(tempName.c_str(), dir, name)) {
+            dir.RemoveChild(tempName.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // Open a journal for appending. length is its intact length from
+    // Replay: 0 starts a new journal, and anything after it (a torn
+    // record) is cut off first. Without commit, records are written only
+    // by Sync and Close.
+    bool Open(const Directory& dir, const char* name, const char magic[8], uint64_t length, bool commit = true) {
+        Close();
+        bool fresh = length == 0;
+        if (fresh) {
+            length = 8;
+        }
+        FileInfo info;
+        if (fresh || !FileSystem::GetInfo(dir.Path() + name, info) || (uint64_t)info.size != length) {
+            if (!Rewrite(dir, name, magic, 8, length)) {
+                return false;
+            }
+        }
+        if (!file.OpenAppend(dir, name)) {
+            return false;
+        }
+        appended = durable = length;
+        syncRequested = stopping = failed = false;
+        autoCommit = commit;
+        writer = std::thread([this] { WriterLoop(); });
+        return true;
+    }
+
+    bool IsOpen() const { return file.IsOpen(); }
+
+    // Add a record; it is written with the next group
+    void Append(const std::string& payload) {
+        bool full;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            Frame(pending, payload.data(), payload.size());
+            appended += 8 + payload.size();
+            full = pending.size() >= GROUP_BYTES;
+        }
+        if (full && autoCommit) {
+            wake.notify_one();
+        }
+    }
+
+    // Journal length, counting records not written yet
+    uint64_t Size() {
+        std::lock_guard<std::mutex> guard(lock);
+        return appended;
+    }
+
+    // Wait until every record appended so far is on the device; false if
+    // a write failed
+    bool Sync() {
+        std::unique_lock<std::mutex> guard(lock);
+        if (!writer.joinable()) {
+            return false;
+        }
+        uint64_t target = appended;
+        while (durable < target && !failed) {
+            syncRequested = true;
+            wake.notify_one();
+            committed.wait(guard);
+        }
+        return !failed;
+    }
+
+    // Commit what is pending and close; false if any write failed
+    bool Close() {
+        if (!writer.joinable()) {
+            return !failed;
+        }
+        Stop();
+        bool ok = !failed && file.Finish();
+        file.Close();
+        return ok;
+    }
+
+    // Whether a journal of journalBytes should be folded into its
+    // checkpoint of checkpointBytes
+    static bool ShouldCompact(uint64_t journalBytes, uint64_t checkpointBytes) {
+        return journalBytes >= COMPACT_MIN_BYTES && journalBytes >= checkpointBytes / COMPACT_RATIO;
+    }
+};
+
+#endif
@@ -0,0 +1,502 @@
+#ifndef BACKUP_MANIFEST_FILE_H
+#define BACKUP_MANIFEST_FILE_H
+
+// Binary manifest, queried in place through a memory map.
+//
+// Entries are sorted by path (byte order, as std::string compares). Paths
+// are prefix-compressed: each stores the length of the prefix it shares
+// with the previous path and the rest of its bytes. Every RESTART_INTERVAL
+// entries the full path is stored instead, and the offsets of these
+// restart points let a lookup binary-search them and then decode at most
+// one block. Size, mtime and digest are fixed-width columns indexed by
+// entry number, so nothing is deserialized on open.
+//
+// A second, much smaller table summarizes each directory: its mtime,
+// ctime and entry count as last seen, and a digest of its subtree. Its
+// paths are stored whole, in order, and read into memory on load.
+//
+// Layout (little-endian):
+//
+//   header   "BKMANIF3", count (u64), restart interval (u32), reserved
+//            (u32), then the offsets of the sections below (u64 each)
+//            and the size of the path section (u64), then the directory
+//            count (u64), the offsets of the directory sections and the
+//            size of the directory path section (u64 each)
+//   sizes    i64 per entry
+//   mtimes   i64 per entry
+//   digests  32 bytes per entry
+//   restarts u64 per restart point, offset into the path section
+//   dirs     per directory: path offset into the directory path section
+//            (u64), mtime_ns, ctime_ns (i64 each), entry count (u64),
+//            digest (32 bytes)
+//   paths    per entry: shared prefix length and suffix length (LEB128
+//            varints), then the suffix bytes
+//   dirpaths directory paths, back to back
+//
+// "BKMANIF2" files, written by earlier versions, have the shorter header
+// and no directory table.
+//
+// The file is written through File::WriteAt, one buffered stream per
+// section; the entry and directory counts must be known up front. It is
+// synced before Close returns, since a journal of later changes may be cut
+// against it.
+
+#include "digest.h"
+#include "filesystem.h"
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+// What a manifest records about a directory
+struct DirectorySummary {
+    int64_t mtimeNs = 0;  // As last seen; 0 if it must be read again
+    int64_t ctimeNs = 0;
+    uint64_t entries = 0;  // Files and subdirectories listed
+    Digest digest;         // Of the subtree's files (see ManifestManager)
+};
+
+class ManifestFile {
+public:
+    static const uint32_t RESTART_INTERVAL = 16;
+    static const size_t HEADER_SIZE = 104;
+    static const size_t OLD_HEADER_SIZE = 72;    // "BKMANIF2"
+    static const size_t DIRECTORY_SIZE = 64;     // One record of the directory table
+
+private:
+    MappedFile map;
+    const unsigned char* data;
+    uint64_t count;
+    uint32_t interval;
+    uint64_t restartCount;
+    const unsigned char* sizes;
+    const unsigned char* mtimes;
+    const unsigned char* digests;
+    const unsigned char* restarts;
+    const unsigned char* paths;
+    uint64_t pathsSize;
+    bool hasDirectories;
+    uint64_t directoryCount;
+    const unsigned char* directories;
+    const unsigned char* directoryPaths;
+    uint64_t directoryPathsSize;
+
+    static uint64_t Load64(const unsigned char* p) {
+        uint64_t value = 0;
+        for (int i = 0; i < 8; i++) value |= (uint64_t)p[i] << (i * 8);
+        return value;
+    }
+
+    static uint32_t Load32(const unsigned char* p) {
+        uint32_t value = 0;
+        for (int i = 0; i < 4; i++) value |= (uint32_t)p[i] << (i * 8);
+        return value;
+    }
+
+    static bool GetVarint(const unsigned char* p, uint64_t end, uint64_t& offset, uint64_t& value) {
+        value = 0;
+        for (int shift = 0; shift < 64 && offset < end; shift += 7) {
+            unsigned char byte = p[offset++];
+            value |= (uint64_t)(byte & 0x7f) << shift;
+            if (!(byte & 0x80)) return true;
+        }
+        return false;
+    }
+
+    // Section [offset, offset + length) lies within the file
+    bool InFile(uint64_t offset, uint64_t length) const {
+        return offset <= map.Size() && length <= map.Size() - offset;
+    }
+
+    // Decode the entry at offset into path, which holds the previous
+    // entry's path; false if the data is damaged
+    bool DecodePath(uint64_t& offset, std::string& path) const {
+        uint64_t shared, suffix;
+        if (!GetVarint(paths, pathsSize, offset, shared) || !GetVarint(paths, pathsSize, offset, suffix) ||
+            shared > path.size() || suffix > pathsSize - offset) {
+            return false;
+        }
+        path.resize((size_t)shared);
+        path.append((const char*)paths + offset, (size_t)suffix);
+        offset += suffix;
+        return true;
+    }
+
+    // Full path stored at restart point r, as a pointer into the map
+    bool RestartKey(uint64_t r, const char*& key, size_t& length) const {
+        uint64_t offset = Load64(restarts + r * 8);
+        uint64_t shared, suffix;
+        if (!GetVarint(paths, pathsSize, offset, shared) || !GetVarint(paths, pathsSize, offset, suffix) ||
+            shared != 0 || suffix > pathsSize - offset) {
+            return false;
+        }
+        key = (const char*)paths + offset;
+        length = (size_t)suffix;
+        return true;
+    }
+
+public:
+    ManifestFile() { Close(); }
+
+    static const char* Magic() { return "BKMANIF3"; }
+    static const char* OldMagic() { return "BKMANIF2"; }
+
+    // Map a manifest and check its layout; false if it is missing, in
+    // another format or damaged
+    bool Open(const std::string& path) {
+        Close();
+        if (!map.Open(path) || map.Size() < OLD_HEADER_SIZE) {
+            Close();
+            return false;
+        }
+        bool current = memcmp(map.Data(), Magic(), 8) == 0;
+        if ((!current && memcmp(map.Data(), OldMagic(), 8) != 0) || (current && map.Size() < HEADER_SIZE)) {
+            Close();
+            return false;
+        }
+        const unsigned char* header = map.Data();
+        uint64_t entries = Load64(header + 8);
+        uint32_t restartInterval = Load32(header + 16);
+        uint64_t sizesOffset = Load64(header + 24);
+        uint64_t mtimesOffset = Load64(header + 32);
+        uint64_t digestsOffset = Load64(header + 40);
+        uint64_t restartsOffset = Load64(header + 48);
+        uint64_t pathsOffset = Load64(header + 56);
+        uint64_t pathsLength = Load64(header + 64);
+        if (restartInterval == 0 || entries > map.Size() / 8) {
+            Close();
+            return false;
+        }
+        uint64_t points = (entries + restartInterval - 1) / restartInterval;
+        if (!InFile(sizesOffset, entries * 8) || !InFile(mtimesOffset, entries * 8) ||
+            !InFile(digestsOffset, entries * Digest::SIZE) || !InFile(restartsOffset, points * 8) ||
+            !InFile(pathsOffset, pathsLength)) {
+            Close();
+            return false;
+        }
+        uint64_t dirCount = 0, dirOffset = 0, dirPathsOffset = 0, dirPathsLength = 0;
+        if (current) {
+            dirCount = Load64(header + 72);
+            dirOffset = Load64(header + 80);
+            dirPathsOffset = Load64(header + 88);
+            dirPathsLength = Load64(header + 96);
+            if (dirCount > map.Size() / DIRECTORY_SIZE || !InFile(dirOffset, dirCount * DIRECTORY_SIZE) ||
+                !InFile(dirPathsOffset, dirPathsLength)) {
+                Close();
+                return false;
+            }
+        }
+
+        data = header;
+        count = entries;
+        interval = restartInterval;
+        restartCount = points;
+        sizes = header + sizesOffset;
+        mtimes = header + mtimesOffset;
+        digests = header + digestsOffset;
+        restarts = header + restartsOffset;
+        paths = header + pathsOffset;
+        pathsSize = pathsLength;
+        hasDirectories = current;
+        directoryCount = dirCount;
+        directories = header + dirOffset;
+        directoryPaths = header + dirPathsOffset;
+        directoryPathsSize = dirPathsLength;
+        return true;
+    }
+
+    void Close() {
+        map.Close();
+        data = nullptr;
+        count = 0;
+        interval = RESTART_INTERVAL;
+        restartCount = 0;
+        sizes = mtimes = digests = restarts = paths = nullptr;
+        pathsSize = 0;
+        hasDirectories = false;
+        directoryCount = 0;
+        directories = directoryPaths = nullptr;
+        directoryPathsSize = 0;
+    }
+
+    bool IsOpen() const { return data != nullptr; }
+    size_t Count() const { return (size_t)count; }
+    size_t FileSize() const { return map.Size(); }
+
+    // Whether the file has a directory table (it is not "BKMANIF2")
+    bool HasDirectories() const { return hasDirectories; }
+    size_t DirectoryCount() const { return (size_t)directoryCount; }
+
+    // Directory number index; false if the data is damaged
+    bool GetDirectory(size_t index, std::string& path, DirectorySummary& summary) const {
+        const unsigned char* record = directories + index * DIRECTORY_SIZE;
+        uint64_t start = Load64(record);
+        uint64_t end = index + 1 < directoryCount ? Load64(record + DIRECTORY_SIZE) : directoryPathsSize;
+        if (start > end || end > directoryPathsSize) {
+            return false;
+        }
+        path.assign((const char*)directoryPaths + start, (size_t)(end - start));
+        summary.mtimeNs = (int64_t)Load64(record + 8);
+        summary.ctimeNs = (int64_t)Load64(record + 16);
+        summary.entries = Load64(record + 24);
+        memcpy(summary.digest.bytes, record + 32, Digest::SIZE);
+        return true;
+    }
+
+    // Number of restart points whose path is <= path; false if the data
+    // is damaged
+    bool CountRestarts(const std::string& path, uint64_t& points) const {
+        uint64_t low = 0, high = restartCount;
+        while (low < high) {
+            uint64_t middle = low + (high - low) / 2;
+            const char* key;
+            size_t length;
+            if (!RestartKey(middle, key, length)) {
+                return false;
+            }
+            int order = memcmp(key, path.data(), length < path.size() ? length : path.size());
+            if (order < 0 || (order == 0 && length <= path.size())) {
+                low = middle + 1;
+            } else {
+                high = middle;
+            }
+        }
+        points = low;
+        return true;
+    }
+
+    // Entry number of path; false if it is not listed. Safe to call from
+    // several threads.
+    bool Find(const std::string& path, size_t& index) const {
+        // Last restart point whose path is <= the one looked for
+        uint64_t low;
+        if (!CountRestarts(path, low) || low == 0) {
+            return false;
+        }
+
+        // Decode its block up to the path
+        uint64_t block = low - 1;
+        uint64_t offset = Load64(restarts + block * 8);
+        uint64_t end = (block + 1) * interval < count ? (block + 1) * interval : count;
+        thread_local std::string current;
+        current.clear();
+        for (uint64_t i = block * interval; i < end; i++) {
+            if (!DecodePath(offset, current)) {
+                return false;
+            }
+            int order = current.compare(path);
+            if (order == 0) {
+                index = (size_t)i;
+                return true;
+            }
+            if (order > 0) {
+                break;
+            }
+        }
+        return false;
+    }
+
+    int64_t GetSize(size_t index) const { return (int64_t)Load64(sizes + index * 8); }
+    int64_t GetMtime(size_t index) const { return (int64_t)Load64(mtimes + index * 8); }
+
+    Digest GetDigest(size_t index) const {
+        Digest digest;
+        memcpy(digest.bytes, digests + index * Digest::SIZE, Digest::SIZE);
+        return digest;
+    }
+
+    // Visits the entries in order, decoding each path once. Seek jumps
+    // ahead with the same binary search as Find.
+    class Cursor {
+    private:
+        const ManifestFile& file;
+        uint64_t next;
+        uint64_t offset;
+        std::string path;
+
+    public:
+        explicit Cursor(const ManifestFile& manifest) : file(manifest), next(0), offset(0) {}
+
+        // Advance to the next entry; false at the end or if the data is
+        // damaged
+        bool Next() {
+            if (next >= file.count || !file.DecodePath(offset, path)) {
+                return false;
+            }
+            next++;
+            return true;
+        }
+
+        // Move to the first entry whose path is >= key; false if there is
+        // none
+        bool Seek(const std::string& key) {
+            uint64_t points;
+            if (!file.CountRestarts(key, points)) {
+                next = file.count;
+                return false;
+            }
+            uint64_t block = points > 0 ? points - 1 : 0;
+            next = block * file.interval;
+            offset = block < file.restartCount ? Load64(file.restarts + block * 8) : 0;
+            path.clear();
+            while (Next()) {
+                if (path.compare(key) >= 0) {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        const std::string& Path() const { return path; }
+        size_t Index() const { return (size_t)(next - 1); }
+    };
+};
+
+class ManifestFileWriter {
+private:
+    static const size_t BUFFER_SIZE = 256 * 1024;  // Per section
+
+    // One section, buffered and written at its own offset
+    struct Section {
+        uint64_t offset = 0;
+        uint64_t written = 0;
+        std::string buffer;
+    };
+
+    File file;
+    uint64_t expected;
+    uint64_t count;
+    uint64_t expectedDirectories;
+    uint64_t directoryCount;
+    bool ok;
+    std::string previous;
+    Section sizes;
+    Section mtimes;
+    Section digests;
+    Section restarts;
+    Section directories;
+    Section paths;
+    std::string directoryPaths;  // Written after the paths, whose size is not known before
+
+    static void Put64(std::string& out, uint64_t value) {
+        for (int i = 0; i < 8; i++) out += (char)(value >> (i * 8));
+    }
+
+    static void Put32(std::string& out, uint32_t value) {
+        for (int i = 0; i < 4; i++) out += (char)(value >> (i * 8));
+    }
+
+    static void PutVarint(std::string& out, uint64_t value) {
+        while (value >= 0x80) {
+            out += (char)(value | 0x80);
+            value >>= 7;
+        }
+        out += (char)value;
+    }
+
+    void Flush(Section& section) {
+        if (ok && !section.buffer.empty()) {
+            ok = file.WriteAt(section.buffer.data(), section.buffer.size(),
+                              (long long)(section.offset + section.written));
+        }
+        section.written += section.buffer.size();
+        section.buffer.clear();
+    }
+
+    void FlushIfFull(Section& section) {
+        if (section.buffer.size() >= BUFFER_SIZE) Flush(section);
+    }
+
+public:
+    ManifestFileWriter() : expected(0), count(0), expectedDirectories(0), directoryCount(0), ok(false) {}
+
+    // Create the file for exactly entries entries and dirs directories
+    bool Open(const std::string& path, uint64_t entries, uint64_t dirs) {
+        ok = file.Create(path);
+        expected = entries;
+        count = 0;
+        expectedDirectories = dirs;
+        directoryCount = 0;
+        previous.clear();
+        directoryPaths.clear();
+        uint64_t points = (entries + ManifestFile::RESTART_INTERVAL - 1) / ManifestFile::RESTART_INTERVAL;
+        sizes.offset = ManifestFile::HEADER_SIZE;
+        mtimes.offset = sizes.offset + entries * 8;
+        digests.offset = mtimes.offset + entries * 8;
+        restarts.offset = digests.offset + entries * Digest::SIZE;
+        directories.offset = restarts.offset + points * 8;
+        paths.offset = directories.offset + dirs * ManifestFile::DIRECTORY_SIZE;
+        return ok;
+    }
+
+    // Add the next entry; paths must come in ascending order
+    void Add(const std::string& path, const Digest& digest, int64_t size, int64_t mtime) {
+        size_t shared = 0;
+        if (count % ManifestFile::RESTART_INTERVAL == 0) {
+            Put64(restarts.buffer, paths.written + paths.buffer.size());
+            FlushIfFull(restarts);
+        } else {
+            size_t limit = previous.size() < path.size() ? previous.size() : path.size();
+            while (shared < limit && previous[shared] == path[shared]) shared++;
+        }
+        PutVarint(paths.buffer, shared);
+        PutVarint(paths.buffer, path.size() - shared);
+        paths.buffer.append(path, shared, std::string::npos);
+        previous = path;
+
+        Put64(sizes.buffer, (uint64_t)size);
+        Put64(mtimes.buffer, (uint64_t)mtime);
+        digests.buffer.append((const char*)digest.bytes, Digest::SIZE);
+        FlushIfFull(paths);
+        FlushIfFull(sizes);
+        FlushIfFull(mtimes);
+        FlushIfFull(digests);
+        count++;
+    }
+
+    // Add the next directory; paths must come in ascending order
+    void AddDirectory(const std::string& path, const DirectorySummary& summary) {
+        Put64(directories.buffer, directoryPaths.size());
+        Put64(directories.buffer, (uint64_t)summary.mtimeNs);
+        Put64(directories.buffer, (uint64_t)summary.ctimeNs);
+        Put64(directories.buffer, summary.entries);
+        directories.buffer.append((const char*)summary.digest.bytes, Digest::SIZE);
+        directoryPaths += path;
+        FlushIfFull(directories);
+        directoryCount++;
+    }
+
+    // Write the header last and wait until the file is on the device;
+    // false if any write failed or a count differs from the one given to
+    // Open
+    bool Close() {
+        Flush(sizes);
+        Flush(mtimes);
+        Flush(digests);
+        Flush(restarts);
+        Flush(directories);
+        Flush(paths);
+        uint64_t directoryPathsOffset = paths.offset + paths.written;
+        if (ok && !directoryPaths.empty()) {
+            ok = file.WriteAt(directoryPaths.data(), directoryPaths.size(), (long long)directoryPathsOffset);
+        }
+
+        std::string header(ManifestFile::Magic(), 8);
+        Put64(header, count);
+        Put32(header, ManifestFile::RESTART_INTERVAL);
+        Put32(header, 0);
+        Put64(header, sizes.offset);
+        Put64(header, mtimes.offset);
+        Put64(header, digests.offset);
+        Put64(header, restarts.offset);
+        Put64(header, paths.offset);
+        Put64(header, paths.written);
+        Put64(header, directoryCount);
+        Put64(header, directories.offset);
+        Put64(header, directoryPathsOffset);
+        Put64(header, directoryPaths.size());
+        ok = ok && count == expected && directoryCount == expectedDirectories && file.WriteAt(header.data(), header.size(), 0) && file.Sync();
+        return file.Finish() && ok;
+    }
+};
+
+#endif
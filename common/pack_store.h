@@ -0,0 +1,431 @@
+#ifndef BACKUP_PACK_STORE_H
+#define BACKUP_PACK_STORE_H
+
+// Pack files: many small blobs appended into one large file.
+//
+// A pack, pack-NNNNNN.pack, is an 8-byte magic followed by records of
+//
+//   length (u32), flags (u32), digest (32 bytes), data (length bytes)
+//
+// where flags is the Codec the data is compressed with (compression.h)
+// and the digest is that of the uncompressed content. Each pack has an
+// index, pack-NNNNNN.idx, that lists (digest, offset, length, flags)
+// sorted by digest together with the pack size it covers. Records
+// describe themselves, so a pack whose index is missing or stale (a crash
+// between appending and writing the index) is recovered by reading it
+// through and checking each record's digest. A torn tail is left out of
+// the index, which still covers the whole file, and such a pack is never
+// appended to again.
+//
+// Writers append sequentially through one buffer; readers use pread at
+// the recorded offset.
+
+#include "filesystem.h"
+#include "digest.h"
+#include "record_file.h"
+#include "sha256.h"
+#include "compression.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Where a packed blob is
+struct PackLocation {
+    uint32_t pack = 0;
+    uint32_t length = 0;
+    uint32_t flags = 0;
+    long long offset = 0;  // Of the data, past the record header
+};
+
+class PackStore {
+public:
+    static const long long DEFAULT_PACK_SIZE = 256LL << 20;
+    static const long long MIN_PACK_SIZE = 64LL << 20;
+    static const long long MAX_PACK_SIZE = 512LL << 20;
+
+private:
+    struct Entry {
+        Digest digest;
+        PackLocation location;
+
+        bool operator<(const Entry& other) const { return digest < other.digest; }
+    };
+
+    static const size_t MAGIC_SIZE = 8;
+    static const size_t HEADER_SIZE = 8 + Digest::SIZE;
+    static const size_t BUFFER_SIZE = 1 << 20;
+    static const char* PackMagic() { return "BKPACK01"; }
+    static const char* IndexMagic() { return "BKPIDX01"; }
+
+    std::string packPath;
+    Directory packDir;
+    long long packSize;
+    std::vector<uint32_t> packIds;
+
+    // Pack being appended to; id 0 when none
+    std::mutex writeLock;
+    File current;
+    uint32_t currentId;
+    long long currentSize;  // Including what is still buffered
+    std::vector<Entry> currentEntries;
+    bool currentChanged;
+    std::string buffer;
+    uint32_t nextId;
+
+    // Read side, filled by LoadLocations
+    std::unordered_map<Digest, PackLocation> locations;
+    std::unordered_map<uint32_t, File> readers;
+    std::mutex readLock;
+
+    static std::string PackName(uint32_t id, const char* extension) {
+        char name[32];
+        snprintf(name, sizeof(name), "pack-%06u.%s", id, extension);
+        return name;
+    }
+
+    // pack-NNNNNN.pack -> NNNNNN
+    static bool ParsePackName(const char* name, size_t length, uint32_t& id) {
+        if (length != 16 || memcmp(name, "pack-", 5) != 0 || memcmp(name + 11, ".pack", 5) != 0) {
+            return false;
+        }
+        id = 0;
+        for (int i = 5; i < 11; i++) {
+            if (name[i] < '0' || name[i] > '9') return false;
+            id = id * 10 + (uint32_t)(name[i] - '0');
+        }
+        return id != 0;
+    }
+
+    static void PutU32(char* out, uint32_t value) {
+        for (int i = 0; i < 4; i++) out[i] = (char)(value >> (i * 8));
+    }
+
+    static uint32_t GetU32(const char* in) {
+        uint32_t value = 0;
+        for (int i = 0; i < 4; i++) value |= (uint32_t)(uint8_t)in[i] << (i * 8);
+        return value;
+    }
+
+    bool LoadIndex(uint32_t id, std::vector<Entry>& entries, long long& covered) {
+        RecordReader reader;
+        int64_t size = 0;
+        uint32_t count = 0;
+        if (!reader.Open(packPath + PackName(id, "idx"), IndexMagic()) ||
+            !reader.GetI64(size) || !reader.GetU32(count)) {
+            return false;
+        }
+        entries.clear();
+        entries.reserve(count);
+        for (uint32_t i = 0; i < count; i++) {
+            Entry entry;
+            int64_t offset;
+            if (!reader.GetDigest(entry.digest) || !reader.GetI64(offset) ||
+                !reader.GetU32(entry.location.length) || !reader.GetU32(entry.location.flags)) {
+                return false;
+            }
+            entry.location.pack = id;
+            entry.location.offset = offset;
+            entries.push_back(entry);
+        }
+        covered = size;
+        return true;
+    }
+
+    // Write the index through a temporary name, so it is never partial
+    bool WriteIndex(uint32_t id, std::vector<Entry>& entries, long long covered) {
+        std::sort(entries.begin(), entries.end());
+        std::string name = PackName(id, "idx");
+        std::string tempName = name + ".tmp";
+
+        RecordWriter writer;
+        if (!writer.Open(packPath + tempName, IndexMagic())) {
+            return false;
+        }
+        writer.PutI64(covered);
+        writer.PutU32((uint32_t)entries.size());
+        for (const Entry& entry : entries) {
+            writer.PutDigest(entry.digest);
+            writer.PutI64(entry.location.offset);
+            writer.PutU32(entry.location.length);
+            writer.PutU32(entry.location.flags);
+        }
+        if (!writer.Close() || !packDir.RenameChild(tempName.c_str(), packDir, name.c_str())) {
+            packDir.RemoveChild(tempName.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    // End of the last record an index lists
+    static long long RecordsEnd(const std::vector<Entry>& entries) {
+        long long end = MAGIC_SIZE;
+        for (const Entry& entry : entries) {
+            end = std::max(end, entry.location.offset + (long long)entry.location.length);
+        }
+        return end;
+    }
+
+    // Rebuild a pack's entries by reading its records; returns the size of
+    // the intact prefix
+    long long RecoverPack(uint32_t id, std::vector<Entry>& entries) {
+        entries.clear();
+        File file;
+        if (!file.OpenRead(packDir, PackName(id, "pack").c_str())) {
+            return 0;
+        }
+        char magic[MAGIC_SIZE];
+        FileInfo info;
+        if (!file.ReadAt(magic, MAGIC_SIZE, 0) || memcmp(magic, PackMagic(), MAGIC_SIZE) != 0 ||
+            !file.GetInfo(info)) {
+            return 0;
+        }
+
+        long long offset = MAGIC_SIZE;
+        char header[HEADER_SIZE];
+        std::string data;
+        std::string content;
+        Sha256 hasher;
+        for (;;) {
+            if (!file.ReadAt(header, HEADER_SIZE, offset)) {
+                break;
+            }
+            Entry entry;
+            entry.location.pack = id;
+            entry.location.length = GetU32(header);
+            entry.location.flags = GetU32(header + 4);
+            entry.location.offset = offset + HEADER_SIZE;
+            memcpy(entry.digest.bytes, header + 8, Digest::SIZE);
+
+            if (entry.location.offset + entry.location.length > info.size) {
+                break;
+            }
+            data.resize(entry.location.length);
+            if (entry.location.length > 0 && !file.ReadAt(&data[0], data.size(), entry.location.offset)) {
+                break;
+            }
+            // A codec this build cannot decode: trust the length
+            Codec codec = (Codec)entry.location.flags;
+            if (Compressor::IsAvailable(codec)) {
+                if (!Compressor::Decompress(codec, data.data(), data.size(), content)) {
+                    break;
+                }
+                Digest actual;
+                hasher.Reset();
+                hasher.Update(content.data(), content.size());
+                hasher.Final(actual.bytes);
+                if (actual != entry.digest) {
+                    break;
+                }
+            }
+            entries.push_back(entry);
+            offset = entry.location.offset + entry.location.length;
+        }
+        return offset;
+    }
+
+    bool FlushBuffer() {
+        bool ok = buffer.empty() || current.WriteAll(buffer.data(), buffer.size());
+        buffer.clear();
+        return ok;
+    }
+
+    // Write out and index the open pack
+    bool CloseCurrent() {
+        if (currentId == 0) {
+            return true;
+        }
+        bool ok = true;
+        if (current.IsOpen()) {
+            ok = FlushBuffer();
+            ok = current.Finish() && ok;
+        }
+        if (ok && currentChanged) {
+            ok = WriteIndex(currentId, currentEntries, currentSize);
+        }
+        currentId = 0;
+        currentEntries.clear();
+        currentChanged = false;
+        return ok;
+    }
+
+    bool StartPack() {
+        uint32_t id = nextId++;
+        if (!current.Create(packDir, PackName(id, "pack").c_str())) {
+            return false;
+        }
+        packIds.push_back(id);
+        currentId = id;
+        currentSize = MAGIC_SIZE;
+        currentEntries.clear();
+        currentChanged = true;
+        buffer.assign(PackMagic(), MAGIC_SIZE);
+        return true;
+    }
+
+public:
+    PackStore() : packSize(DEFAULT_PACK_SIZE), currentId(0), currentSize(0), currentChanged(false), nextId(1) {}
+
+    ~PackStore() { Close(); }
+
+    // Open (creating) the pack directory, recover packs left without a
+    // valid index, and pick the last pack for further appends if it has
+    // room. targetSize is clamped to MIN_PACK_SIZE..MAX_PACK_SIZE.
+    bool Open(const std::string& path, long long targetSize = DEFAULT_PACK_SIZE) {
+        packPath = NormalizePath(path);
+        packSize = targetSize < MIN_PACK_SIZE ? MIN_PACK_SIZE : (targetSize > MAX_PACK_SIZE ? MAX_PACK_SIZE : targetSize);
+        MkdirResult result = FileSystem::MakeDirectory(packPath);
+        if ((result != MkdirResult::Created && result != MkdirResult::AlreadyExists) || !packDir.Open(packPath)) {
+            return false;
+        }
+
+        packIds.clear();
+        DirectoryReader reader(packDir);
+        DirEntry entry;
+        uint32_t id;
+        while (reader.Next(entry)) {
+            if (ParsePackName(entry.name, entry.nameLength, id)) {
+                packIds.push_back(id);
+            }
+        }
+        std::sort(packIds.begin(), packIds.end());
+        nextId = packIds.empty() ? 1 : packIds.back() + 1;
+
+        std::vector<Entry> entries;
+        for (uint32_t packId : packIds) {
+            FileInfo info;
+            long long covered = -1;
+            if (!packDir.Stat(PackName(packId, "pack").c_str(), info) ||
+                (LoadIndex(packId, entries, covered) && covered == info.size)) {
+                continue;
+            }
+            RecoverPack(packId, entries);
+            WriteIndex(packId, entries, info.size);
+        }
+
+        // Continue the last pack if its index covers all of it and it ends
+        // in an intact record
+        if (!packIds.empty()) {
+            uint32_t last = packIds.back();
+            FileInfo info;
+            long long covered;
+            if (packDir.Stat(PackName(last, "pack").c_str(), info) && LoadIndex(last, entries, covered) &&
+                covered == info.size && RecordsEnd(entries) == info.size && info.size < packSize) {
+                currentId = last;
+                currentSize = info.size;
+                currentEntries = std::move(entries);
+            }
+        }
+        return true;
+    }
+
+    const Directory& GetDirectory() const { return packDir; }
+
+    // Append a blob. The caller makes sure each digest is appended once.
+    bool Append(const Digest& digest, const void* data, size_t size, uint32_t flags = 0) {
+        std::lock_guard<std::mutex> lock(writeLock);
+        long long recordSize = (long long)(HEADER_SIZE + size);
+        if (currentId != 0 && currentSize + recordSize > packSize && !currentEntries.empty()) {
+            if (!CloseCurrent()) {
+                return false;
+            }
+        }
+        if (currentId == 0 && !StartPack()) {
+            return false;
+        }
+        if (!current.IsOpen() && !current.OpenAppend(packDir, PackName(currentId, "pack").c_str())) {
+            return false;
+        }
+
+        char header[HEADER_SIZE];
+        PutU32(header, (uint32_t)size);
+        PutU32(header + 4, flags);
+        memcpy(header + 8, digest.bytes, Digest::SIZE);
+        buffer.append(header, HEADER_SIZE);
+        buffer.append(static_cast<const char*>(data), size);
+
+        Entry entry;
+        entry.digest = digest;
+        entry.location.pack = currentId;
+        entry.location.length = (uint32_t)size;
+        entry.location.flags = flags;
+        entry.location.offset = currentSize + HEADER_SIZE;
+        currentEntries.push_back(entry);
+        currentSize += recordSize;
+        currentChanged = true;
+
+        return buffer.size() < BUFFER_SIZE || FlushBuffer();
+    }
+
+    // Write out what is buffered for the open pack, without closing it.
+    // Until Close writes the index, a crash leaves a pack that Open
+    // recovers by reading its records.
+    bool Flush() {
+        std::lock_guard<std::mutex> lock(writeLock);
+        return FlushBuffer();
+    }
+
+    // Finish the open pack and write its index
+    bool Close() {
+        std::lock_guard<std::mutex> lock(writeLock);
+        return CloseCurrent();
+    }
+
+    // Call f(digest) for every packed blob
+    template <typename Function>
+    void ForEachDigest(Function f) {
+        std::vector<Entry> entries;
+        long long covered;
+        for (uint32_t id : packIds) {
+            if (LoadIndex(id, entries, covered)) {
+                for (const Entry& entry : entries) {
+                    f(entry.digest);
+                }
+            }
+        }
+    }
+
+    // Load every pack index for reading
+    void LoadLocations() {
+        locations.clear();
+        std::vector<Entry> entries;
+        long long covered;
+        for (uint32_t id : packIds) {
+            if (LoadIndex(id, entries, covered)) {
+                for (const Entry& entry : entries) {
+                    locations[entry.digest] = entry.location;
+                }
+            }
+        }
+    }
+
+    bool Find(const Digest& digest, PackLocation& location) const {
+        auto it = locations.find(digest);
+        if (it == locations.end()) {
+            return false;
+        }
+        location = it->second;
+        return true;
+    }
+
+    // Read a packed blob with one pread, as stored (see location.flags)
+    bool Read(const PackLocation& location, std::string& data) {
+        File* file;
+        {
+            std::lock_guard<std::mutex> lock(readLock);
+            file = &readers[location.pack];
+            if (!file->IsOpen() && !file->OpenRead(packDir, PackName(location.pack, "pack").c_str())) {
+                return false;
+            }
+        }
+        data.resize(location.length);
+        return location.length == 0 || file->ReadAt(&data[0], location.length, location.offset);
+    }
+};
+
+#endif
@@ -0,0 +1,159 @@
+#ifndef BACKUP_PARALLEL_WALKER_H
+#define BACKUP_PARALLEL_WALKER_H
+
+// Work-stealing thread pool used to walk directory trees in parallel.
+//
+// Every worker owns a deque of pending tasks. A worker pushes the
+// subdirectories it discovers onto the back of its own deque and pops from
+// the back (depth-first, so few directories are open at once); idle workers
+// steal from the front of other workers' deques, which hands them the
+// largest unexplored subtrees.
+
+#include "filesystem.h"
+#include "path_arena.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+template <typename Task>
+class WorkStealingPool {
+public:
+    typedef std::function<void(Task& task, int worker)> Handler;
+
+private:
+    struct WorkerQueue {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    std::atomic<long long> pending;  // Pushed but not yet finished
+    std::atomic<int> idleWorkers;
+    std::mutex idleLock;
+    std::condition_variable idleSignal;
+    Handler handler;
+
+    // Newest task of our own deque
+    bool PopLocal(int worker, Task& task) {
+        WorkerQueue& queue = *queues[worker];
+        std::lock_guard<std::mutex> lock(queue.lock);
+        if (queue.tasks.empty()) return false;
+        task = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+
+    // Oldest task of another worker's deque
+    bool Steal(int worker, Task& task) {
+        int count = (int)queues.size();
+        for (int i = 1; i < count; i++) {
+            WorkerQueue& queue = *queues[(worker + i) % count];
+            std::lock_guard<std::mutex> lock(queue.lock);
+            if (!queue.tasks.empty()) {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void WorkerLoop(int worker) {
+        for (;;) {
+            Task task;
+            if (PopLocal(worker, task) || Steal(worker, task)) {
+                handler(task, worker);
+                if (pending.fetch_sub(1) == 1) {
+                    // Last task finished - wake everyone so they can exit
+                    std::lock_guard<std::mutex> lock(idleLock);
+                    idleSignal.notify_all();
+                }
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(idleLock);
+            if (pending.load() == 0) return;
+            idleWorkers++;
+            // Pushes notify idle workers; the timeout covers a push that
+            // raced with us going idle
+            idleSignal.wait_for(lock, std::chrono::milliseconds(2));
+            idleWorkers--;
+        }
+    }
+
+public:
+    explicit WorkStealingPool(int threadCount) : pending(0), idleWorkers(0) {
+        threadCount = std::max(1, threadCount);
+        for (int i = 0; i < threadCount; i++) {
+            queues.emplace_back(new WorkerQueue());
+        }
+    }
+
+    int ThreadCount() const { return (int)queues.size(); }
+
+    // True when some worker is waiting for work
+    bool HasIdleWorkers() const { return idleWorkers.load(std::memory_order_relaxed) > 0; }
+
+    // Queue a task on the given worker's deque (call from inside a handler)
+    void Push(int worker, Task task) {
+        pending++;
+        {
+            WorkerQueue& queue = *queues[worker];
+            std::lock_guard<std::mutex> lock(queue.lock);
+            queue.tasks.push_back(std::move(task));
+        }
+        if (idleWorkers.load(std::memory_order_relaxed) > 0) {
+            idleSignal.notify_one();
+        }
+    }
+
+    // Process root and everything it pushes; blocks until all tasks finish.
+    // The calling thread acts as worker 0.
+    void Run(Task root, Handler taskHandler) {
+        handler = taskHandler;
+        pending = 1;
+        queues[0]->tasks.push_back(std::move(root));
+
+        std::vector<std::thread> threads;
+        for (int i = 1; i < ThreadCount(); i++) {
+            threads.emplace_back(&WorkStealingPool::WorkerLoop, this, i);
+        }
+        WorkerLoop(0);
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+};
+
+// One unit of work for the backup walkers: either a directory to enumerate
+// or, when files is non-empty, a batch of files from an already open
+// directory handed off to idle workers.
+struct WalkTask {
+    std::shared_ptr<Directory> sourceParent;  // For the root: the source itself
+    std::shared_ptr<Directory> destParent;    // For the root: the destination itself
+    std::string name;                         // Empty for the root and for file batches
+    PathId directory = PathArena::ROOT;       // The directory, or sourceParent for file batches
+    std::vector<std::string> files;           // File batch (names within sourceParent)
+    std::vector<size_t> fileEntries;          // Per file: an entry the caller matched it to
+};
+
+typedef WorkStealingPool<WalkTask> ParallelWalker;
+
+// Files collected before a batch is offered to idle workers
+const size_t WALK_FILE_BATCH = 64;
+
+// Default worker count: one per hardware thread
+inline int DefaultWorkerCount() {
+    unsigned int count = std::thread::hardware_concurrency();
+    return count > 0 ? (int)count : 1;
+}
+
+#endif
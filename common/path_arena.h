@@ -0,0 +1,165 @@
+#ifndef BACKUP_PATH_ARENA_H
+#define BACKUP_PATH_ARENA_H
+
+// Interned relative directory paths.
+//
+// Each directory is stored once, as the id of its parent and its own name,
+// so a deep tree costs one short name per directory instead of a full
+// path per file. Files are a directory id plus their name; FileKey packs
+// the two into the key the per-file maps use. Full paths are only built
+// where one is needed (console output, saving, restoring).
+//
+// Names live in the arena of the PathMap that interns them. Ids are
+// dense, starting with ROOT for the root itself. Safe to use from several
+// threads.
+
+#include "filesystem.h"
+#include "path_map.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+typedef uint32_t PathId;
+
+class PathArena {
+public:
+    static const PathId ROOT = 0;
+
+private:
+    struct Node {
+        PathId parent;
+        const char* name;  // In the children map's arena
+        uint32_t nameSize;
+    };
+
+    PathMap<PathId> children;  // FileKey(parent, name) -> id
+    std::vector<Node> nodes;
+    mutable std::shared_timed_mutex lock;  // Walker threads intern concurrently
+
+    void AppendPathLocked(PathId id, std::string& out) const {
+        if (id == ROOT) {
+            return;
+        }
+        const Node& node = nodes[id];
+        AppendPathLocked(node.parent, out);
+        out.append(node.name, node.nameSize);
+        out += PATH_SEPARATOR;
+    }
+
+public:
+    PathArena() {
+        Node root = {ROOT, "", 0};
+        nodes.push_back(root);
+    }
+
+    // Key for a file (or child directory) of directory parent: the id in
+    // four little-endian bytes, then the name
+    static void FileKey(PathId parent, const char* name, size_t size, std::string& key) {
+        key.resize(4);
+        for (int i = 0; i < 4; i++) {
+            key[i] = (char)(parent >> (i * 8));
+        }
+        key.append(name, size);
+    }
+
+    // Directory id and name of a key made by FileKey
+    static PathId KeyParent(const char* key) {
+        PathId parent = 0;
+        for (int i = 0; i < 4; i++) {
+            parent |= (PathId)(uint8_t)key[i] << (i * 8);
+        }
+        return parent;
+    }
+
+    static const char* KeyName(const char* key) { return key + 4; }
+
+    // Id of directory name within parent, added if new
+    PathId Intern(PathId parent, const char* name, size_t size) {
+        thread_local std::string key;
+        FileKey(parent, name, size, key);
+        {
+            std::shared_lock<std::shared_timed_mutex> guard(lock);
+            const PathId* id = children.Find(key);
+            if (id) {
+                return *id;
+            }
+        }
+
+        std::lock_guard<std::shared_timed_mutex> guard(lock);
+        PathMap<PathId>::Entry& entry = children.FindOrAdd(key.data(), key.size());
+        if (entry.value == ROOT) {  // New; ROOT is never anyone's child
+            entry.value = (PathId)nodes.size();
+            Node node = {parent, entry.key + 4, (uint32_t)size};
+            nodes.push_back(node);
+        }
+        return entry.value;
+    }
+
+    PathId Intern(PathId parent, const std::string& name) {
+        return Intern(parent, name.data(), name.size());
+    }
+
+    // Id of a relative path's directory part; nameStart receives where the
+    // last component starts. "a/b/c" interns "a/b/".
+    PathId InternParent(const std::string& path, size_t& nameStart) {
+        PathId id = ROOT;
+        size_t start = 0;
+        for (size_t end = path.find(PATH_SEPARATOR); end != std::string::npos;
+             end = path.find(PATH_SEPARATOR, start)) {
+            if (end > start) {
+                id = Intern(id, path.data() + start, end - start);
+            }
+            start = end + 1;
+        }
+        nameStart = start;
+        return id;
+    }
+
+    // Append the directory's path relative to the root, with a trailing
+    // separator (nothing for the root)
+    void AppendPath(PathId id, std::string& out) const {
+        std::shared_lock<std::shared_timed_mutex> guard(lock);
+        AppendPathLocked(id, out);
+    }
+
+    std::string Path(PathId id) const {
+        std::string path;
+        AppendPath(id, path);
+        return path;
+    }
+
+    PathId Parent(PathId id) const {
+        std::shared_lock<std::shared_timed_mutex> guard(lock);
+        return nodes[id].parent;
+    }
+
+    size_t Count() const {
+        std::shared_lock<std::shared_timed_mutex> guard(lock);
+        return nodes.size();
+    }
+
+    // Position of each directory when all are sorted by path; files sorted
+    // by (rank of their directory, name) come out grouped by directory in
+    // a stable order
+    std::vector<uint32_t> Ranks() const {
+        std::shared_lock<std::shared_timed_mutex> guard(lock);
+        std::vector<std::string> paths(nodes.size());
+        std::vector<PathId> order(nodes.size());
+        for (PathId id = 0; id < (PathId)nodes.size(); id++) {
+            AppendPathLocked(id, paths[id]);
+            order[id] = id;
+        }
+        std::sort(order.begin(), order.end(), [&paths](PathId a, PathId b) { return paths[a] < paths[b]; });
+        std::vector<uint32_t> ranks(nodes.size());
+        for (uint32_t rank = 0; rank < (uint32_t)order.size(); rank++) {
+            ranks[order[rank]] = rank;
+        }
+        return ranks;
+    }
+};
+
+#endif
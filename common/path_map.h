@@ -0,0 +1,311 @@
+#ifndef BACKUP_PATH_MAP_H
+#define BACKUP_PATH_MAP_H
+
+// Flat hash map from paths to values, for the per-file indexes.
+//
+// An open-addressing table in the style of Swiss tables: each slot has a
+// control byte holding 7 bits of its key's hash (or marking it empty or
+// deleted), and control bytes are scanned a group of 16 at a time, with
+// one SSE2 compare on x86 (part of every x86-64 CPU, so there is no
+// runtime dispatch) and a plain loop elsewhere. Only slots whose 7 bits
+// match are compared in full. Probing goes from group to group; a group
+// with an empty slot ends the search.
+//
+// Keys are copied into an arena of large blocks and slots point into it,
+// so there is no allocation per entry. Erased keys stay in the arena until
+// Clear. The table grows when 7/8 of its slots are used. Iteration is in
+// table order; Sorted gives the entries in path order for saving. Not
+// thread-safe.
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BACKUP_PATH_MAP_SSE2
+#include <emmintrin.h>
+#endif
+
+template <typename Value>
+class PathMap {
+public:
+    struct Entry {
+        const char* key = nullptr;  // In the arena; not terminated
+        uint32_t keySize = 0;
+        Value value = Value();
+
+        std::string Key() const { return std::string(key, keySize); }
+    };
+
+private:
+    static const size_t GROUP_SIZE = 16;
+    static const size_t MIN_CAPACITY = 64;
+    static const size_t ARENA_BLOCK_SIZE = 1024 * 1024;
+    static const int8_t EMPTY = -128;  // Control bytes with the top bit set
+    static const int8_t DELETED = -2;  // are not in use
+
+    std::vector<int8_t> control;
+    std::vector<Entry> slots;
+    size_t groupMask;
+    size_t count;
+    size_t deleted;  // Tombstones, which lengthen probes until a rehash
+    std::vector<std::unique_ptr<char[]>> arena;
+    char* arenaNext;   // Free space in the last block
+    size_t arenaFree;
+    size_t arenaBytes;
+
+    static uint64_t Mix(uint64_t value) {
+        value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+        return value ^ (value >> 31);
+    }
+
+    // 8 bytes at a time; only used in memory, so byte order does not matter
+    static uint64_t HashKey(const char* key, size_t size) {
+        uint64_t hash = 0x9e3779b97f4a7c15ULL ^ size;
+        size_t i = 0;
+        for (; i + 8 <= size; i += 8) {
+            uint64_t word;
+            memcpy(&word, key + i, 8);
+            hash = (hash ^ word) * 0x9fb21c651e98df25ULL;
+            hash ^= hash >> 29;
+        }
+        uint64_t tail = 0;
+        memcpy(&tail, key + i, size - i);
+        return Mix(hash ^ tail);
+    }
+
+    // Bit i set where control byte i of the group equals value
+    static uint32_t Match(const int8_t* group, int8_t value) {
+#ifdef BACKUP_PATH_MAP_SSE2
+        __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+        return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(value)));
+#else
+        uint32_t bits = 0;
+        for (size_t i = 0; i < GROUP_SIZE; i++) {
+            bits |= (uint32_t)(group[i] == value) << i;
+        }
+        return bits;
+#endif
+    }
+
+    // Bit i set where slot i of the group is empty or deleted
+    static uint32_t MatchFree(const int8_t* group) {
+#ifdef BACKUP_PATH_MAP_SSE2
+        return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+        uint32_t bits = 0;
+        for (size_t i = 0; i < GROUP_SIZE; i++) {
+            bits |= (uint32_t)(group[i] < 0) << i;
+        }
+        return bits;
+#endif
+    }
+
+    static int LowestBit(uint32_t bits) {
+#ifdef _MSC_VER
+        unsigned long index;
+        _BitScanForward(&index, bits);
+        return (int)index;
+#else
+        return __builtin_ctz(bits);
+#endif
+    }
+
+    // Slot holding the key, or SIZE_MAX
+    size_t FindSlot(const char* key, size_t size, uint64_t hash) const {
+        int8_t tag = (int8_t)(hash >> 57);
+        size_t group = (size_t)hash & groupMask;
+        for (size_t step = 1;; step++) {
+            const int8_t* controls = &control[group * GROUP_SIZE];
+            for (uint32_t bits = Match(controls, tag); bits != 0; bits &= bits - 1) {
+                size_t slot = group * GROUP_SIZE + (size_t)LowestBit(bits);
+                const Entry& entry = slots[slot];
+                if (entry.keySize == size && memcmp(entry.key, key, size) == 0) {
+                    return slot;
+                }
+            }
+            if (Match(controls, EMPTY) != 0) {
+                return SIZE_MAX;
+            }
+            group = (group + step) & groupMask;  // Triangular: visits every group
+        }
+    }
+
+    // First free slot on the key's probe sequence
+    size_t FreeSlot(uint64_t hash) const {
+        size_t group = (size_t)hash & groupMask;
+        for (size_t step = 1;; step++) {
+            uint32_t bits = MatchFree(&control[group * GROUP_SIZE]);
+            if (bits != 0) {
+                return group * GROUP_SIZE + (size_t)LowestBit(bits);
+            }
+            group = (group + step) & groupMask;
+        }
+    }
+
+    // Copy a key into the arena
+    const char* StoreKey(const char* key, size_t size) {
+        if (arena.empty() || size > arenaFree) {
+            size_t block = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+            arena.emplace_back(new char[block]);
+            arenaNext = arena.back().get();
+            arenaFree = block;
+            arenaBytes += block;
+        }
+        char* stored = arenaNext;
+        memcpy(stored, key, size);
+        arenaNext += size;
+        arenaFree -= size;
+        return stored;
+    }
+
+    void Rehash(size_t capacity) {
+        std::vector<int8_t> oldControl(capacity, (int8_t)EMPTY);
+        std::vector<Entry> oldSlots(capacity);
+        oldControl.swap(control);
+        oldSlots.swap(slots);
+        groupMask = capacity / GROUP_SIZE - 1;
+        deleted = 0;
+        for (size_t i = 0; i < oldSlots.size(); i++) {
+            if (oldControl[i] >= 0) {
+                uint64_t hash = HashKey(oldSlots[i].key, oldSlots[i].keySize);
+                size_t slot = FreeSlot(hash);
+                control[slot] = (int8_t)(hash >> 57);
+                slots[slot] = std::move(oldSlots[i]);
+            }
+        }
+    }
+
+public:
+    PathMap() { Clear(); }
+
+    size_t Size() const { return count; }
+
+    const Value* Find(const char* key, size_t size) const {
+        size_t slot = FindSlot(key, size, HashKey(key, size));
+        return slot == SIZE_MAX ? nullptr : &slots[slot].value;
+    }
+
+    Value* Find(const char* key, size_t size) {
+        size_t slot = FindSlot(key, size, HashKey(key, size));
+        return slot == SIZE_MAX ? nullptr : &slots[slot].value;
+    }
+
+    const Value* Find(const std::string& key) const { return Find(key.data(), key.size()); }
+    Value* Find(const std::string& key) { return Find(key.data(), key.size()); }
+
+    // Entry of the key, added with a default-constructed value if missing
+    Entry& FindOrAdd(const char* key, size_t size) {
+        uint64_t hash = HashKey(key, size);
+        size_t slot = FindSlot(key, size, hash);
+        if (slot != SIZE_MAX) {
+            return slots[slot];
+        }
+
+        if ((count + deleted + 1) * 8 > control.size() * 7) {
+            // Grow, or only clear tombstones if they are what fills the table
+            Rehash(count * 2 >= control.size() ? control.size() * 2 : control.size());
+        }
+        slot = FreeSlot(hash);
+        if (control[slot] == DELETED) {
+            deleted--;
+        }
+        control[slot] = (int8_t)(hash >> 57);
+        Entry& entry = slots[slot];
+        entry.key = StoreKey(key, size);
+        entry.keySize = (uint32_t)size;
+        count++;
+        return entry;
+    }
+
+    Value& operator[](const std::string& key) {
+        return FindOrAdd(key.data(), key.size()).value;
+    }
+
+    // Remove a key; false if it was not present
+    bool Erase(const std::string& key) {
+        size_t slot = FindSlot(key.data(), key.size(), HashKey(key.data(), key.size()));
+        if (slot == SIZE_MAX) {
+            return false;
+        }
+        // A group with an empty slot never sent a probe on, so the slot can
+        // become empty again; otherwise it must stay a tombstone
+        if (Match(&control[slot / GROUP_SIZE * GROUP_SIZE], EMPTY) != 0) {
+            control[slot] = EMPTY;
+        } else {
+            control[slot] = DELETED;
+            deleted++;
+        }
+        slots[slot] = Entry();
+        count--;
+        return true;
+    }
+
+    // Make room for n entries without rehashing
+    void Reserve(size_t n) {
+        size_t capacity = control.size();
+        while (n * 8 > capacity * 7) {
+            capacity *= 2;
+        }
+        if (capacity != control.size()) {
+            Rehash(capacity);
+        }
+    }
+
+    void Clear() {
+        control.assign(MIN_CAPACITY, (int8_t)EMPTY);
+        slots.assign(MIN_CAPACITY, Entry());
+        groupMask = MIN_CAPACITY / GROUP_SIZE - 1;
+        count = 0;
+        deleted = 0;
+        arena.clear();
+        arenaNext = nullptr;
+        arenaFree = 0;
+        arenaBytes = 0;
+    }
+
+    // Calls visit(entry) for every entry, in table order
+    template <typename Function>
+    void ForEach(Function visit) const {
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (control[i] >= 0) {
+                visit(slots[i]);
+            }
+        }
+    }
+
+    // The entries in the order of less(const Entry*, const Entry*)
+    template <typename Compare>
+    std::vector<const Entry*> Sorted(Compare less) const {
+        std::vector<const Entry*> entries;
+        entries.reserve(count);
+        ForEach([&entries](const Entry& entry) { entries.push_back(&entry); });
+        std::sort(entries.begin(), entries.end(), less);
+        return entries;
+    }
+
+    // The entries in key order (byte order, as std::string compares)
+    std::vector<const Entry*> Sorted() const {
+        return Sorted([](const Entry* a, const Entry* b) {
+            int order = memcmp(a->key, b->key, a->keySize < b->keySize ? a->keySize : b->keySize);
+            return order < 0 || (order == 0 && a->keySize < b->keySize);
+        });
+    }
+
+    // Bytes held by the table and the key arena, not counting memory the
+    // values own
+    size_t MemoryUsage() const {
+        return control.size() * (sizeof(int8_t) + sizeof(Entry)) + arenaBytes;
+    }
+};
+
+#endif
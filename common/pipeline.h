@@ -0,0 +1,246 @@
+#ifndef BACKUP_PIPELINE_H
+#define BACKUP_PIPELINE_H
+
+// Building blocks for multi-stage pipelines: a bounded lock-free MPMC queue
+// with blocking (backpressure) wrappers, and per-stage statistics.
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <thread>
+
+// Monotonic clock in nanoseconds
+inline long long PipelineNowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Bounded multi-producer/multi-consumer queue (Vyukov's array queue).
+// Each cell carries a sequence number that tells producers and consumers
+// whether it is free or filled, so no locks are taken. Capacity is rounded
+// up to a power of two.
+template <typename T>
+class BoundedQueue {
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    char padding0[64];
+    std::atomic<size_t> enqueuePos;
+    char padding1[64];
+    std::atomic<size_t> dequeuePos;
+    char padding2[64];
+    std::atomic<bool> closed;
+
+    // Occupancy samples taken on every push
+    std::atomic<long long> occupancySum;
+    std::atomic<long long> occupancySamples;
+    std::atomic<size_t> occupancyMax;
+    std::atomic<long long> pushStallNs;  // Producers blocked on a full queue
+    std::atomic<long long> popStallNs;   // Consumers blocked on an empty queue
+
+    // Spin, then yield, then sleep while waiting
+    static void Backoff(int& round) {
+        if (round < 16) {
+            round++;
+        } else if (round < 64) {
+            round++;
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+    }
+
+    void SampleOccupancy() {
+        size_t size = Size();
+        occupancySum.fetch_add((long long)size, std::memory_order_relaxed);
+        occupancySamples.fetch_add(1, std::memory_order_relaxed);
+        size_t seen = occupancyMax.load(std::memory_order_relaxed);
+        while (size > seen && !occupancyMax.compare_exchange_weak(seen, size, std::memory_order_relaxed)) {
+        }
+    }
+
+public:
+    explicit BoundedQueue(size_t requestedCapacity)
+        : enqueuePos(0), dequeuePos(0), closed(false), occupancySum(0),
+          occupancySamples(0), occupancyMax(0), pushStallNs(0), popStallNs(0) {
+        size_t capacity = 2;
+        while (capacity < requestedCapacity) capacity <<= 1;
+        cells.reset(new Cell[capacity]);
+        for (size_t i = 0; i < capacity; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        mask = capacity - 1;
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    // Non-blocking push; item is moved from only on success
+    bool TryPush(T& item) {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[pos & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    cell.data = std::move(item);
+                    cell.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;  // Full
+            } else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Non-blocking pop
+    bool TryPop(T& item) {
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        for (;;) {
+            Cell& cell = cells[pos & mask];
+            size_t sequence = cell.sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    item = std::move(cell.data);
+                    cell.data = T();
+                    cell.sequence.store(pos + mask + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;  // Empty
+            } else {
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Blocking push: waits while the queue is full (backpressure)
+    void Push(T item) {
+        if (!TryPush(item)) {
+            long long start = PipelineNowNs();
+            int round = 0;
+            while (!TryPush(item)) {
+                Backoff(round);
+            }
+            pushStallNs.fetch_add(PipelineNowNs() - start, std::memory_order_relaxed);
+        }
+        SampleOccupancy();
+    }
+
+    // Blocking pop: waits while empty; returns false once closed and drained
+    bool Pop(T& item) {
+        if (TryPop(item)) return true;
+        long long start = PipelineNowNs();
+        int round = 0;
+        bool result;
+        for (;;) {
+            if (TryPop(item)) {
+                result = true;
+                break;
+            }
+            if (closed.load(std::memory_order_acquire)) {
+                // Everything pushed before Close() is visible now
+                result = TryPop(item);
+                break;
+            }
+            Backoff(round);
+        }
+        popStallNs.fetch_add(PipelineNowNs() - start, std::memory_order_relaxed);
+        return result;
+    }
+
+    // No more pushes will follow
+    void Close() { closed.store(true, std::memory_order_release); }
+
+    size_t Capacity() const { return mask + 1; }
+
+    size_t Size() const {
+        size_t head = dequeuePos.load(std::memory_order_relaxed);
+        size_t tail = enqueuePos.load(std::memory_order_relaxed);
+        return tail > head ? tail - head : 0;
+    }
+
+    double AverageOccupancy() const {
+        long long samples = occupancySamples.load();
+        return samples > 0 ? (double)occupancySum.load() / samples : 0.0;
+    }
+
+    size_t MaxOccupancy() const { return occupancyMax.load(); }
+    long long PushStallNs() const { return pushStallNs.load(); }
+    long long PopStallNs() const { return popStallNs.load(); }
+};
+
+// Per-stage counters
+struct StageStats {
+    std::string name;
+    int threads = 0;
+    std::atomic<long long> items{0};
+    std::atomic<long long> bytes{0};
+    std::atomic<long long> busyNs{0};  // Summed over the stage's threads
+    long long startNs = 0;
+    long long endNs = 0;
+
+    StageStats(const std::string& stageName, int threadCount) : name(stageName), threads(threadCount) {}
+
+    void Start() { startNs = PipelineNowNs(); }
+    void Stop() { endNs = PipelineNowNs(); }
+
+    double WallSeconds() const { return endNs > startNs ? (endNs - startNs) / 1e9 : 0.0; }
+
+    // Share of the stage's thread time spent doing work
+    double Utilization() const {
+        double capacity = (double)(endNs - startNs) * threads;
+        return capacity > 0 ? busyNs.load() / capacity : 0.0;
+    }
+};
+
+// Measures busy time of one work item
+class StageTimer {
+private:
+    StageStats& stage;
+    long long start;
+
+public:
+    explicit StageTimer(StageStats& stats) : stage(stats), start(PipelineNowNs()) {}
+    ~StageTimer() { stage.busyNs.fetch_add(PipelineNowNs() - start, std::memory_order_relaxed); }
+};
+
+// Print one stage line: throughput and utilisation
+inline void PrintStageReport(std::ostream& out, const StageStats& stage) {
+    double seconds = stage.WallSeconds();
+    char line[160];
+    snprintf(line, sizeof(line), "  %-8s %3d thr  %10lld items  %9.1f items/s  %9.2f MB/s  busy %5.1f%%",
+             stage.name.c_str(), stage.threads, stage.items.load(),
+             seconds > 0 ? stage.items.load() / seconds : 0.0,
+             seconds > 0 ? stage.bytes.load() / seconds / (1024.0 * 1024.0) : 0.0,
+             stage.Utilization() * 100.0);
+    out << line << "\n";
+}
+
+// Print one queue line: occupancy and time producers/consumers were blocked
+template <typename T>
+void PrintQueueReport(std::ostream& out, const char* name, const BoundedQueue<T>& queue) {
+    char line[160];
+    snprintf(line, sizeof(line), "  %-12s cap %6zu  avg fill %5.1f%%  max fill %5.1f%%  producers blocked %.2fs  consumers idle %.2fs",
+             name, queue.Capacity(),
+             queue.AverageOccupancy() * 100.0 / queue.Capacity(),
+             queue.MaxOccupancy() * 100.0 / queue.Capacity(),
+             queue.PushStallNs() / 1e9, queue.PopStallNs() / 1e9);
+    out << line << "\n";
+}
+
+#endif
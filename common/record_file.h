@@ -0,0 +1,180 @@
+#ifndef BACKUP_RECORD_FILE_H
+#define BACKUP_RECORD_FILE_H
+
+// Binary record files for manifests and indexes.
+//
+// A file starts with an 8-byte magic that names its format and version,
+// followed by records made of little-endian integers, length-prefixed
+// strings and raw digests. Readers load the whole file and parse it in
+// memory; every Get fails cleanly on truncated input. RecordBuffer builds
+// the same fields in memory, for journal records.
+
+#include "digest.h"
+#include "filesystem.h"
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <string>
+
+class RecordWriter {
+private:
+    File file;
+    std::string buffer;
+    bool ok = false;
+
+    void Flush() {
+        ok = ok && file.WriteAll(buffer.data(), buffer.size());
+        buffer.clear();
+    }
+
+public:
+    static const size_t BUFFER_SIZE = 256 * 1024;
+
+    bool Open(const std::string& path, const char magic[8]) {
+        ok = file.Create(path);
+        if (!ok) {
+            return false;
+        }
+        buffer.reserve(BUFFER_SIZE);
+        buffer.append(magic, 8);
+        return true;
+    }
+
+    void PutU32(uint32_t value) {
+        for (int i = 0; i < 4; i++) {
+            buffer += (char)(value >> (i * 8));
+        }
+    }
+
+    void PutI64(int64_t value) {
+        uint64_t bits = (uint64_t)value;
+        for (int i = 0; i < 8; i++) {
+            buffer += (char)(bits >> (i * 8));
+        }
+        if (buffer.size() >= BUFFER_SIZE) Flush();
+    }
+
+    void PutString(const std::string& value) {
+        PutString(value.data(), value.size());
+    }
+
+    void PutString(const char* value, size_t size) {
+        PutU32((uint32_t)size);
+        buffer.append(value, size);
+        if (buffer.size() >= BUFFER_SIZE) Flush();
+    }
+
+    void PutDigest(const Digest& digest) {
+        buffer.append((const char*)digest.bytes, Digest::SIZE);
+        if (buffer.size() >= BUFFER_SIZE) Flush();
+    }
+
+    // Write out remaining records, and with sync wait until they are on
+    // the device; false if any write failed
+    bool Close(bool sync = false) {
+        Flush();
+        ok = ok && (!sync || file.Sync());
+        return file.Finish() && ok;
+    }
+};
+
+class RecordBuffer {
+private:
+    std::string data;
+
+public:
+    void Clear() { data.clear(); }
+    const std::string& Data() const { return data; }
+
+    void PutU32(uint32_t value) {
+        for (int i = 0; i < 4; i++) {
+            data += (char)(value >> (i * 8));
+        }
+    }
+
+    void PutI64(int64_t value) {
+        uint64_t bits = (uint64_t)value;
+        for (int i = 0; i < 8; i++) {
+            data += (char)(bits >> (i * 8));
+        }
+    }
+
+    void PutString(const char* value, size_t size) {
+        PutU32((uint32_t)size);
+        data.append(value, size);
+    }
+
+    void PutString(const std::string& value) { PutString(value.data(), value.size()); }
+
+    void PutDigest(const Digest& digest) {
+        data.append((const char*)digest.bytes, Digest::SIZE);
+    }
+};
+
+class RecordReader {
+private:
+    std::string data;
+    size_t pos;
+
+public:
+    RecordReader() : pos(0) {}
+
+    // Load the file and check its magic
+    bool Open(const std::string& path, const char magic[8]) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file.is_open()) {
+            return false;
+        }
+        data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        if (data.size() < 8 || memcmp(data.data(), magic, 8) != 0) {
+            return false;
+        }
+        pos = 8;
+        return true;
+    }
+
+    // Parse records held in memory, such as a journal record (no magic)
+    void Assign(const char* bytes, size_t size) {
+        data.assign(bytes, size);
+        pos = 0;
+    }
+
+    bool AtEnd() const { return pos >= data.size(); }
+
+    bool GetU32(uint32_t& value) {
+        if (data.size() - pos < 4) return false;
+        value = 0;
+        for (int i = 0; i < 4; i++) {
+            value |= (uint32_t)(uint8_t)data[pos++] << (i * 8);
+        }
+        return true;
+    }
+
+    bool GetI64(int64_t& value) {
+        if (data.size() - pos < 8) return false;
+        uint64_t bits = 0;
+        for (int i = 0; i < 8; i++) {
+            bits |= (uint64_t)(uint8_t)data[pos++] << (i * 8);
+        }
+        value = (int64_t)bits;
+        return true;
+    }
+
+    bool GetString(std::string& value) {
+        uint32_t length;
+        if (!GetU32(length) || data.size() - pos < length) return false;
+        value.assign(data, pos, length);
+        pos += length;
+        return true;
+    }
+
+    bool GetDigest(Digest& digest) {
+        if (data.size() - pos < Digest::SIZE) return false;
+        memcpy(digest.bytes, data.data() + pos, Digest::SIZE);
+        pos += Digest::SIZE;
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,297 @@
+#ifndef BACKUP_RUN_PROGRESS_H
+#define BACKUP_RUN_PROGRESS_H
+
+// Progress of a backup run, checkpointed so an interrupted run can be
+// resumed.
+//
+// Every directory counts its outstanding work. Its files are done once
+// its listing has ended and every file it handed out (in a batch or down
+// a pipeline) has been backed up; its tree is done once its files are and
+// the trees of all its subdirectories are. A checkpoint, taken on a
+// background thread at a fixed interval, collects the directories that
+// finished since the last one, calls commit() to make all work so far
+// durable (copies, blobs, journals), and only then appends them to the
+// progress journal (common/journal.h). A directory in the journal so
+// never depends on work a crash could still lose. The cost is one commit
+// per interval plus one small record per directory.
+//
+// A resumed run skips a directory whose tree is done without listing it,
+// and lists a directory whose files are done only for its subdirectories.
+// Files in them that failed, or changed after they were backed up, are
+// picked up by the next run that does not resume. The journal starts with
+// the source path and is only resumed for the same source; a run that
+// gets through the whole tree removes it.
+
+#include "filesystem.h"
+#include "journal.h"
+#include "path_arena.h"
+#include "path_map.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class RunProgress {
+public:
+    enum class State { None, FilesDone, TreeDone };
+
+    static const int DEFAULT_INTERVAL_SECONDS = 60;
+
+private:
+    // Record kinds: one byte, then a relative directory path (with a
+    // trailing separator, empty for the root) or the source path
+    static const char SOURCE = 'S';
+    static const char FILES_DONE = 'F';
+    static const char TREE_DONE = 'T';
+
+    struct Counter {
+        uint32_t files = 1;  // The listing, plus file work handed out
+        uint32_t tree = 1;   // The files, plus subdirectory trees
+    };
+
+    static const char* Magic() { return "BKPROGR1"; }
+
+    PathArena& paths;
+    std::string rootPath;
+    std::string journalName;
+    PathMap<char> resumed;  // Directory path -> FILES_DONE or TREE_DONE; read-only during a run
+    uint64_t loadedLength;  // Journal length Load read, 0 for none
+
+    std::mutex lock;
+    std::unordered_map<PathId, Counter> active;
+    std::vector<std::pair<char, PathId>> finished;  // Since the last checkpoint
+    bool treeDone;  // The root's tree
+    bool running;   // Between Begin and End
+
+    Journal journal;
+    std::function<bool()> commit;
+    std::thread checkpointer;
+    std::condition_variable wake;
+    bool stopping;
+    int intervalSeconds;
+
+    static std::string Record(char kind, const std::string& path) {
+        return std::string(1, kind) + path;
+    }
+
+    // One part of a directory's tree is done; finishing a tree counts as a
+    // part of its parent's. The lock must be held.
+    void TreePartDone(PathId directory) {
+        for (;;) {
+            auto it = active.find(directory);
+            if (it == active.end() || --it->second.tree > 0) {
+                return;
+            }
+            active.erase(it);
+            finished.push_back(std::make_pair((char)TREE_DONE, directory));
+            if (directory == PathArena::ROOT) {
+                treeDone = true;
+                return;
+            }
+            directory = paths.Parent(directory);
+        }
+    }
+
+    void CheckpointLoop() {
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            if (wake.wait_for(guard, std::chrono::seconds(intervalSeconds), [this] { return stopping; })) {
+                return;
+            }
+            guard.unlock();
+            Checkpoint();
+            guard.lock();
+        }
+    }
+
+public:
+    RunProgress(const std::string& backupRoot, const char* name, PathArena& arena)
+        : paths(arena), journalName(name), loadedLength(0), treeDone(false), running(false), stopping(false),
+          intervalSeconds(DEFAULT_INTERVAL_SECONDS) {
+        rootPath = NormalizePath(backupRoot);
+    }
+
+    ~RunProgress() { End(); }
+
+    // Read what an interrupted run of source got done; false if there is
+    // no progress for that source
+    bool Load(const std::string& source) {
+        resumed.Clear();
+        loadedLength = 0;
+        Directory root;
+        if (!root.Open(rootPath)) {
+            return false;
+        }
+        bool sameSource = false;
+        uint64_t length = Journal::Replay(root, journalName.c_str(), Magic(), [&](const char* data, size_t size) {
+            if (size == 0) {
+                return;
+            }
+            std::string path(data + 1, size - 1);
+            if (data[0] == SOURCE) {
+                sameSource = path == source;
+            } else if (sameSource) {
+                char& state = resumed[path];
+                if (state != TREE_DONE) {
+                    state = data[0];
+                }
+            }
+        });
+        if (!sameSource) {
+            resumed.Clear();
+            return false;
+        }
+        loadedLength = length;
+        return true;
+    }
+
+    // Directories an interrupted run finished, after Load
+    size_t ResumedCount() const { return resumed.Size(); }
+
+    // Start tracking and checkpointing a run of source. resume continues
+    // the progress Load read; otherwise it is discarded. commitWork makes
+    // all work done so far durable. interval is in seconds; 0 takes no
+    // checkpoints.
+    bool Begin(const std::string& source, bool resume, int interval, std::function<bool()> commitWork) {
+        Directory root;
+        if (!root.Open(rootPath)) {
+            return false;
+        }
+        if (!resume) {
+            root.RemoveChild(journalName.c_str());
+            resumed.Clear();
+            loadedLength = 0;
+        }
+        running = true;
+        commit = std::move(commitWork);
+        intervalSeconds = interval;
+        if (interval <= 0) {
+            return true;
+        }
+        if (!journal.Open(root, journalName.c_str(), Magic(), loadedLength)) {
+            return false;
+        }
+        if (loadedLength == 0) {
+            journal.Append(Record(SOURCE, source));
+        }
+        stopping = false;
+        checkpointer = std::thread([this] { CheckpointLoop(); });
+        return true;
+    }
+
+    // What the interrupted run got done in a directory
+    State Resumed(PathId directory) const {
+        if (resumed.Size() == 0) {
+            return State::None;
+        }
+        thread_local std::string path;
+        path.clear();
+        paths.AppendPath(directory, path);
+        const char* state = resumed.Find(path);
+        if (!state) {
+            return State::None;
+        }
+        return *state == TREE_DONE ? State::TreeDone : State::FilesDone;
+    }
+
+    // A directory's listing starts
+    void Enter(PathId directory) {
+        std::lock_guard<std::mutex> guard(lock);
+        active[directory] = Counter();
+    }
+
+    // A subdirectory of directory was queued
+    void AddSubdirectory(PathId directory) {
+        std::lock_guard<std::mutex> guard(lock);
+        active[directory].tree++;
+    }
+
+    // Files of directory were handed out
+    void AddFiles(PathId directory) {
+        std::lock_guard<std::mutex> guard(lock);
+        active[directory].files++;
+    }
+
+    // The listing of directory ended, or files it handed out are done
+    void FilesDone(PathId directory) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = active.find(directory);
+        if (it == active.end() || --it->second.files > 0) {
+            return;
+        }
+        finished.push_back(std::make_pair((char)FILES_DONE, directory));
+        TreePartDone(directory);
+    }
+
+    // A directory skipped because its tree was done already
+    void SkipTree(PathId directory) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (directory == PathArena::ROOT) {
+            treeDone = true;
+        } else {
+            TreePartDone(paths.Parent(directory));
+        }
+    }
+
+    // Journal the directories finished since the last checkpoint, once
+    // commit() has made their work durable
+    bool Checkpoint() {
+        std::vector<std::pair<char, PathId>> done;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            done.swap(finished);
+        }
+        if (done.empty() || !journal.IsOpen()) {
+            return true;
+        }
+        if (!commit()) {
+            std::lock_guard<std::mutex> guard(lock);
+            finished.insert(finished.begin(), done.begin(), done.end());
+            return false;
+        }
+        std::string path;
+        for (const std::pair<char, PathId>& item : done) {
+            path.clear();
+            paths.AppendPath(item.second, path);
+            journal.Append(Record(item.first, path));
+        }
+        return journal.Sync();
+    }
+
+    // Stop checkpointing. The progress is removed if the whole tree was
+    // done; otherwise a last checkpoint is taken for a later resume.
+    bool End() {
+        if (checkpointer.joinable()) {
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                stopping = true;
+            }
+            wake.notify_one();
+            checkpointer.join();
+        }
+        if (!running) {
+            return true;
+        }
+        running = false;
+        bool complete;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            complete = treeDone;
+        }
+        if (!complete) {
+            bool ok = Checkpoint();
+            return journal.Close() && ok;
+        }
+        journal.Close();
+        Directory root;
+        return root.Open(rootPath) && (root.RemoveChild(journalName.c_str()) || loadedLength == 0);
+    }
+};
+
+#endif
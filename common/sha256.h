@@ -0,0 +1,402 @@
+#ifndef BACKUP_SHA256_H
+#define BACKUP_SHA256_H
+
+// Self-contained SHA-256 (FIPS 180-4).
+//
+// The block function is picked once at runtime from the best one the CPU
+// supports: x86 SHA extensions, AVX2, or portable scalar code. The choice
+// can be overridden with Sha256::SetEngine (used by the benchmark).
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define BACKUP_SHA256_X86
+#endif
+
+// Round constants
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+inline uint32_t Sha256Rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+inline uint32_t Sha256LoadBE32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+// Portable block function: process whole 64-byte blocks
+inline void Sha256CompressScalar(uint32_t state[8], const uint8_t* data, size_t blocks, const uint32_t* k) {
+    uint32_t w[64];
+    while (blocks--) {
+        for (int i = 0; i < 16; i++) {
+            w[i] = Sha256LoadBE32(data + i * 4);
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = Sha256Rotr(w[i - 15], 7) ^ Sha256Rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = Sha256Rotr(w[i - 2], 17) ^ Sha256Rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+        for (int i = 0; i < 64; i++) {
+            uint32_t s1 = Sha256Rotr(e, 6) ^ Sha256Rotr(e, 11) ^ Sha256Rotr(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = h + s1 + ch + k[i] + w[i];
+            uint32_t s0 = Sha256Rotr(a, 2) ^ Sha256Rotr(a, 13) ^ Sha256Rotr(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = s0 + maj;
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+        data += 64;
+    }
+}
+
+#ifdef BACKUP_SHA256_X86
+#include "sha256_x86.h"
+#endif
+
+// SHA-256 block function implementations
+enum class Sha256Engine {
+    Scalar,
+    Avx2,
+    ShaNi
+};
+
+// Multi-buffer implementations (several messages per call)
+enum class Sha256BatchEngine {
+    Single,  // One message at a time with the active Sha256Engine
+    Avx2,    // 8 lanes
+    Avx512   // 16 lanes
+};
+
+class Sha256 {
+private:
+    typedef void (*CompressFunction)(uint32_t state[8], const uint8_t* data, size_t blocks, const uint32_t* k);
+    typedef void (*MultiCompressFunction)(uint32_t state[8][16], const uint8_t* const* blocks, const uint32_t* k);
+
+    static const int MAX_LANES = 16;
+
+    uint32_t state[8];
+    uint8_t block[64];
+    size_t blockUsed;
+    uint64_t totalBytes;
+
+    static void StoreBE32(uint8_t* p, uint32_t v) {
+        p[0] = (uint8_t)(v >> 24);
+        p[1] = (uint8_t)(v >> 16);
+        p[2] = (uint8_t)(v >> 8);
+        p[3] = (uint8_t)v;
+    }
+
+    static CompressFunction EngineFunction(Sha256Engine engine) {
+        switch (engine) {
+#ifdef BACKUP_SHA256_X86
+        case Sha256Engine::ShaNi: return Sha256CompressShaNi;
+        case Sha256Engine::Avx2: return Sha256CompressAvx2;
+#endif
+        default: return Sha256CompressScalar;
+        }
+    }
+
+    // Engine in use; detected on first use
+    static Sha256Engine& ActiveEngine() {
+        static Sha256Engine engine = BestEngine();
+        return engine;
+    }
+
+    static CompressFunction& ActiveFunction() {
+        static CompressFunction function = EngineFunction(ActiveEngine());
+        return function;
+    }
+
+    void Compress(const uint8_t* data, size_t blocks) {
+        ActiveFunction()(state, data, blocks, SHA256_K);
+    }
+
+    static Sha256BatchEngine& ActiveBatchEngine() {
+        static Sha256BatchEngine engine = BestBatchEngine();
+        return engine;
+    }
+
+    static void InitState(uint32_t target[8]) {
+        static const uint32_t IV[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+        };
+        memcpy(target, IV, sizeof(IV));
+    }
+
+    // Final block(s) of a message: the partial block, padding and length.
+    // Returns the number of blocks written to tail (1 or 2).
+    static size_t BuildTail(const uint8_t* data, size_t size, uint8_t tail[128]) {
+        size_t remainder = size & 63;
+        size_t blocks = remainder + 9 > 64 ? 2 : 1;
+        memset(tail, 0, blocks * 64);
+        memcpy(tail, data + (size - remainder), remainder);
+        tail[remainder] = 0x80;
+        uint64_t bitLength = (uint64_t)size * 8;
+        for (int i = 0; i < 8; i++) {
+            tail[blocks * 64 - 8 + i] = (uint8_t)(bitLength >> (56 - i * 8));
+        }
+        return blocks;
+    }
+
+public:
+    static const size_t DIGEST_SIZE = 32;
+
+    // True if the CPU can run the given engine
+    static bool IsSupported(Sha256Engine engine) {
+#ifdef BACKUP_SHA256_X86
+        static const Sha256CpuFeatures features = Sha256CpuFeatures::Detect();
+        switch (engine) {
+        case Sha256Engine::ShaNi: return features.shaNi;
+        case Sha256Engine::Avx2: return features.avx2;
+        default: return true;
+        }
+#else
+        return engine == Sha256Engine::Scalar;
+#endif
+    }
+
+    // Fastest engine the CPU supports
+    static Sha256Engine BestEngine() {
+        if (IsSupported(Sha256Engine::ShaNi)) return Sha256Engine::ShaNi;
+        if (IsSupported(Sha256Engine::Avx2)) return Sha256Engine::Avx2;
+        return Sha256Engine::Scalar;
+    }
+
+    static Sha256Engine GetEngine() { return ActiveEngine(); }
+
+    // Switch engines; not thread-safe, call before hashing starts
+    static bool SetEngine(Sha256Engine engine) {
+        if (!IsSupported(engine)) return false;
+        ActiveEngine() = engine;
+        ActiveFunction() = EngineFunction(engine);
+        return true;
+    }
+
+    // True if the CPU can run the given batch engine
+    static bool IsSupported(Sha256BatchEngine engine) {
+#ifdef BACKUP_SHA256_X86
+        static const Sha256CpuFeatures features = Sha256CpuFeatures::Detect();
+        switch (engine) {
+        case Sha256BatchEngine::Avx512: return features.avx512;
+        case Sha256BatchEngine::Avx2: return features.avx2;
+        default: return true;
+        }
+#else
+        return engine == Sha256BatchEngine::Single;
+#endif
+    }
+
+    // Widest multi-buffer engine the CPU supports. Eight AVX2 lanes only
+    // beat a single SHA-NI stream by a small margin, so with SHA-NI the
+    // batch engine is used only when AVX-512 is available.
+    static Sha256BatchEngine BestBatchEngine() {
+        if (IsSupported(Sha256BatchEngine::Avx512)) return Sha256BatchEngine::Avx512;
+        if (IsSupported(Sha256BatchEngine::Avx2) && !IsSupported(Sha256Engine::ShaNi)) {
+            return Sha256BatchEngine::Avx2;
+        }
+        return Sha256BatchEngine::Single;
+    }
+
+    static Sha256BatchEngine GetBatchEngine() { return ActiveBatchEngine(); }
+
+    // Switch batch engines; not thread-safe, call before hashing starts
+    static bool SetBatchEngine(Sha256BatchEngine engine) {
+        if (!IsSupported(engine)) return false;
+        ActiveBatchEngine() = engine;
+        return true;
+    }
+
+    static const char* EngineName(Sha256BatchEngine engine) {
+        switch (engine) {
+        case Sha256BatchEngine::Avx512: return "AVX-512 x16";
+        case Sha256BatchEngine::Avx2: return "AVX2 x8";
+        default: return "single";
+        }
+    }
+
+    // Hash count independent messages; digests[i] receives the digest of
+    // data[i]. Messages are spread over the SIMD lanes of the batch
+    // engine; a lane that finishes picks up the next message, and the
+    // last long message is finished with the single-stream engine.
+    static void HashMany(const void* const* data, const size_t* sizes, size_t count,
+                         uint8_t (*digests)[DIGEST_SIZE]) {
+        MultiCompressFunction multi = nullptr;
+        int laneCount = 1;
+#ifdef BACKUP_SHA256_X86
+        switch (ActiveBatchEngine()) {
+        case Sha256BatchEngine::Avx512: multi = Sha256CompressMultiAvx512; laneCount = 16; break;
+        case Sha256BatchEngine::Avx2: multi = Sha256CompressMultiAvx2; laneCount = 8; break;
+        default: break;
+        }
+#endif
+        if (!multi || count < 2) {
+            Sha256 hasher;
+            for (size_t i = 0; i < count; i++) {
+                hasher.Reset();
+                hasher.Update(data[i], sizes[i]);
+                hasher.Final(digests[i]);
+            }
+            return;
+        }
+
+        struct Lane {
+            size_t message;
+            const uint8_t* data;
+            size_t fullBlocks;  // Blocks read straight from data
+            size_t totalBlocks; // Including the tail
+            size_t next;
+            uint8_t tail[128];
+        };
+        Lane lanes[MAX_LANES];
+        uint32_t laneState[8][MAX_LANES];
+        const uint8_t* blocks[MAX_LANES];
+        static const uint8_t idleBlock[64] = {0};
+        size_t nextMessage = 0;
+        int active = 0;
+
+        // Give a lane the next message; false when none are left
+        auto startLane = [&](int lane) {
+            if (nextMessage >= count) return false;
+            Lane& l = lanes[lane];
+            l.message = nextMessage++;
+            l.data = static_cast<const uint8_t*>(data[l.message]);
+            l.fullBlocks = sizes[l.message] / 64;
+            l.totalBlocks = l.fullBlocks + BuildTail(l.data, sizes[l.message], l.tail);
+            l.next = 0;
+            uint32_t initial[8];
+            InitState(initial);
+            for (int i = 0; i < 8; i++) laneState[i][lane] = initial[i];
+            return true;
+        };
+
+        bool busy[MAX_LANES];
+        for (int lane = 0; lane < laneCount; lane++) {
+            busy[lane] = startLane(lane);
+            if (busy[lane]) active++;
+        }
+
+        while (active > 1 || (active == 1 && nextMessage < count)) {
+            for (int lane = 0; lane < laneCount; lane++) {
+                const Lane& l = lanes[lane];
+                blocks[lane] = !busy[lane] ? idleBlock
+                             : l.next < l.fullBlocks ? l.data + l.next * 64
+                             : l.tail + (l.next - l.fullBlocks) * 64;
+            }
+            multi(laneState, blocks, SHA256_K);
+
+            for (int lane = 0; lane < laneCount; lane++) {
+                Lane& l = lanes[lane];
+                if (!busy[lane] || ++l.next < l.totalBlocks) continue;
+                for (int i = 0; i < 8; i++) StoreBE32(digests[l.message] + i * 4, laneState[i][lane]);
+                busy[lane] = startLane(lane);
+                if (!busy[lane]) active--;
+            }
+        }
+
+        // Last message: not worth a full SIMD pass per block
+        for (int lane = 0; lane < laneCount && active > 0; lane++) {
+            if (!busy[lane]) continue;
+            Lane& l = lanes[lane];
+            uint32_t column[8];
+            for (int i = 0; i < 8; i++) column[i] = laneState[i][lane];
+            if (l.next < l.fullBlocks) {
+                ActiveFunction()(column, l.data + l.next * 64, l.fullBlocks - l.next, SHA256_K);
+                l.next = l.fullBlocks;
+            }
+            ActiveFunction()(column, l.tail + (l.next - l.fullBlocks) * 64, l.totalBlocks - l.next, SHA256_K);
+            for (int i = 0; i < 8; i++) StoreBE32(digests[l.message] + i * 4, column[i]);
+            active--;
+        }
+    }
+
+    static const char* EngineName(Sha256Engine engine) {
+        switch (engine) {
+        case Sha256Engine::ShaNi: return "SHA-NI";
+        case Sha256Engine::Avx2: return "AVX2";
+        default: return "scalar";
+        }
+    }
+
+    Sha256() { Reset(); }
+
+    void Reset() {
+        InitState(state);
+        blockUsed = 0;
+        totalBytes = 0;
+    }
+
+    void Update(const void* data, size_t size) {
+        const uint8_t* p = static_cast<const uint8_t*>(data);
+        totalBytes += size;
+
+        if (blockUsed > 0) {
+            size_t take = 64 - blockUsed;
+            if (take > size) take = size;
+            memcpy(block + blockUsed, p, take);
+            blockUsed += take;
+            p += take;
+            size -= take;
+            if (blockUsed < 64) return;
+            Compress(block, 1);
+            blockUsed = 0;
+        }
+
+        if (size >= 64) {
+            Compress(p, size / 64);
+            p += size & ~(size_t)63;
+            size &= 63;
+        }
+
+        if (size > 0) {
+            memcpy(block, p, size);
+            blockUsed = size;
+        }
+    }
+
+    void Final(uint8_t digest[DIGEST_SIZE]) {
+        uint64_t bitLength = totalBytes * 8;
+
+        // Padding: 0x80, zeros, 64-bit big-endian length
+        block[blockUsed++] = 0x80;
+        if (blockUsed > 56) {
+            memset(block + blockUsed, 0, 64 - blockUsed);
+            Compress(block, 1);
+            blockUsed = 0;
+        }
+        memset(block + blockUsed, 0, 56 - blockUsed);
+        for (int i = 0; i < 8; i++) {
+            block[56 + i] = (uint8_t)(bitLength >> (56 - i * 8));
+        }
+        Compress(block, 1);
+        blockUsed = 0;
+
+        for (int i = 0; i < 8; i++) {
+            StoreBE32(digest + i * 4, state[i]);
+        }
+    }
+};
+
+#endif
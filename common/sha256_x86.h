@@ -0,0 +1,420 @@
+#ifndef BACKUP_SHA256_X86_H
+#define BACKUP_SHA256_X86_H
+
+// x86 SHA-256 block functions for sha256.h. Do not include directly.
+//
+// Each function is compiled for its instruction set with a target
+// attribute, so the rest of the program needs no special compiler flags;
+// sha256.h only calls them after checking the CPU at runtime.
+//
+//   SHA-NI  - SHA extensions (sha256rnds2/msg1/msg2), 4 rounds per pair of
+//             instructions. Goldmont, Zen and Ice Lake or newer.
+//   AVX2    - message schedule of two blocks at once in 256-bit registers,
+//             rounds in scalar code with BMI2 rotates (rorx).
+//
+// Multi-buffer functions hash one block of several independent messages
+// at once, one message per 32-bit SIMD lane (8 with AVX2, 16 with
+// AVX-512). They pay off for many small files, where a single stream
+// cannot be sped up further.
+
+#include <cstddef>
+#include <cstdint>
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define BACKUP_TARGET(features) __attribute__((target(features)))
+#define BACKUP_ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define BACKUP_TARGET(features)
+#define BACKUP_ALWAYS_INLINE __forceinline
+#endif
+
+// CPU features relevant to SHA-256
+struct Sha256CpuFeatures {
+    bool shaNi = false;
+    bool avx2 = false;
+    bool avx512 = false;
+
+    static Sha256CpuFeatures Detect() {
+        Sha256CpuFeatures features;
+        unsigned int leaf1[4] = {0, 0, 0, 0};
+        unsigned int leaf7[4] = {0, 0, 0, 0};
+#ifdef _MSC_VER
+        int regs[4];
+        __cpuid(regs, 0);
+        int maxLeaf = regs[0];
+        __cpuid(regs, 1);
+        for (int i = 0; i < 4; i++) leaf1[i] = (unsigned int)regs[i];
+        if (maxLeaf >= 7) {
+            __cpuidex(regs, 7, 0);
+            for (int i = 0; i < 4; i++) leaf7[i] = (unsigned int)regs[i];
+        }
+#else
+        unsigned int maxLeaf = __get_cpuid_max(0, nullptr);
+        __get_cpuid(1, &leaf1[0], &leaf1[1], &leaf1[2], &leaf1[3]);
+        if (maxLeaf >= 7) {
+            __cpuid_count(7, 0, leaf7[0], leaf7[1], leaf7[2], leaf7[3]);
+        }
+#endif
+        bool ssse3 = (leaf1[2] >> 9) & 1;
+        bool sse41 = (leaf1[2] >> 19) & 1;
+        bool osxsave = (leaf1[2] >> 27) & 1;
+        bool avx = (leaf1[2] >> 28) & 1;
+
+        // AVX state must be enabled by the OS (XCR0 bits 1 and 2)
+        bool ymmEnabled = false;
+        bool zmmEnabled = false;
+        if (osxsave && avx) {
+#ifdef _MSC_VER
+            unsigned long long xcr0 = _xgetbv(0);
+#else
+            unsigned int xcr0Low, xcr0High;
+            __asm__ volatile("xgetbv" : "=a"(xcr0Low), "=d"(xcr0High) : "c"(0));
+            unsigned long long xcr0 = ((unsigned long long)xcr0High << 32) | xcr0Low;
+#endif
+            ymmEnabled = (xcr0 & 6) == 6;
+            zmmEnabled = (xcr0 & 0xE6) == 0xE6;  // Also opmask and upper ZMM state
+        }
+
+        features.shaNi = ssse3 && sse41 && ((leaf7[1] >> 29) & 1);
+        features.avx2 = ymmEnabled && ((leaf7[1] >> 5) & 1) && ((leaf7[1] >> 8) & 1);  // AVX2 + BMI2
+        features.avx512 = features.avx2 && zmmEnabled && ((leaf7[1] >> 16) & 1);       // AVX-512F
+        return features;
+    }
+};
+
+// ---------------------------------------------------------------- SHA-NI
+
+// Rounds 4*G .. 4*G+3, interleaved with the message schedule for later
+// groups. msg holds the last four message vectors, indexed by group % 4.
+template <int G>
+BACKUP_TARGET("sha,ssse3,sse4.1") BACKUP_ALWAYS_INLINE
+void Sha256ShaNiGroup(__m128i& abef, __m128i& cdgh, __m128i msg[4],
+                      const uint8_t* data, const uint32_t* k) {
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    if (G < 4) {
+        msg[G] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + G * 16)), byteSwap);
+    }
+
+    __m128i wk = _mm_add_epi32(msg[G & 3], _mm_loadu_si128((const __m128i*)(k + G * 4)));
+    cdgh = _mm_sha256rnds2_epu32(cdgh, abef, wk);
+    if (G >= 3 && G < 15) {
+        // Finish the schedule of the next group
+        __m128i tmp = _mm_alignr_epi8(msg[G & 3], msg[(G + 3) & 3], 4);
+        msg[(G + 1) & 3] = _mm_add_epi32(msg[(G + 1) & 3], tmp);
+        msg[(G + 1) & 3] = _mm_sha256msg2_epu32(msg[(G + 1) & 3], msg[G & 3]);
+    }
+    wk = _mm_shuffle_epi32(wk, 0x0E);
+    abef = _mm_sha256rnds2_epu32(abef, cdgh, wk);
+    if (G >= 1 && G < 13) {
+        // Start the schedule of group G + 3
+        msg[(G + 3) & 3] = _mm_sha256msg1_epu32(msg[(G + 3) & 3], msg[G & 3]);
+    }
+}
+
+BACKUP_TARGET("sha,ssse3,sse4.1")
+inline void Sha256CompressShaNi(uint32_t state[8], const uint8_t* data, size_t blocks, const uint32_t* k) {
+    // The instructions keep the state as ABEF / CDGH
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);  // CDAB
+    __m128i cdgh = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B); // EFGH
+    __m128i abef = _mm_alignr_epi8(tmp, cdgh, 8);
+    cdgh = _mm_blend_epi16(cdgh, tmp, 0xF0);
+
+    while (blocks--) {
+        __m128i abefSave = abef;
+        __m128i cdghSave = cdgh;
+        __m128i msg[4];
+
+        Sha256ShaNiGroup<0>(abef, cdgh, msg, data, k);
+        Sha256ShaNiGroup<1>(abef, cdgh, msg, data, k);
+        Sha256ShaNiGroup<2>(abef, cdgh, msg, data, k);
+        Sha256ShaNiGroup<3>(abef, cdgh, msg, data, k);
+        Sha256ShaNiGroup<4>(abef, cdgh, msg, data, k);
+        Sha256ShaNiGroup<5>(abef, cdgh, msg, data, k);
+        Sha256ShaNiGroup<6>(abef, cdgh, msg, data, k);
+        Sha256ShaNiGroup<7>(abef, cdgh, msg, data, k);
+        Sha256ShaNiGroup<8>(abef, cdgh, msg, data, k);
+        Sha256ShaNiGroup<9>(abef, cdgh, msg, data, k);
+        Sha256ShaNiGroup<10>(abef, cdgh, msg, data, k);
+        Sha256ShaNiGroup<11>(abef, cdgh, msg, data, k);
+        Sha256ShaNiGroup<12>(abef, cdgh, msg, data, k);
+        Sha256ShaNiGroup<13>(abef, cdgh, msg, data, k);
+        Sha256ShaNiGroup<14>(abef, cdgh, msg, data, k);
+        Sha256ShaNiGroup<15>(abef, cdgh, msg, data, k);
+
+        abef = _mm_add_epi32(abef, abefSave);
+        cdgh = _mm_add_epi32(cdgh, cdghSave);
+        data += 64;
+    }
+
+    // Back to ABCD / EFGH
+    tmp = _mm_shuffle_epi32(abef, 0x1B);   // FEBA
+    cdgh = _mm_shuffle_epi32(cdgh, 0xB1);  // DCHG
+    _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(tmp, cdgh, 0xF0));  // DCBA
+    _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(cdgh, tmp, 8));     // HGFE
+}
+
+// ------------------------------------------------------------------ AVX2
+
+BACKUP_TARGET("avx2,bmi2") BACKUP_ALWAYS_INLINE
+__m256i Sha256Avx2Rotr(__m256i x, int n) {
+    return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+// Next four schedule words from the previous sixteen (x0 oldest), for
+// both blocks at once (one per 128-bit lane)
+BACKUP_TARGET("avx2,bmi2") BACKUP_ALWAYS_INLINE
+__m256i Sha256Avx2Schedule(__m256i x0, __m256i x1, __m256i x2, __m256i x3) {
+    // w[i-15..i-12] and w[i-7..i-4]
+    __m256i w15 = _mm256_alignr_epi8(x1, x0, 4);
+    __m256i w7 = _mm256_alignr_epi8(x3, x2, 4);
+    __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(Sha256Avx2Rotr(w15, 7), Sha256Avx2Rotr(w15, 18)),
+                                  _mm256_srli_epi32(w15, 3));
+    __m256i sum = _mm256_add_epi32(_mm256_add_epi32(x0, s0), w7);
+
+    // w[i] and w[i+1] depend on w[i-2] and w[i-1]...
+    __m256i w2 = _mm256_shuffle_epi32(x3, 0xEE);
+    __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(Sha256Avx2Rotr(w2, 17), Sha256Avx2Rotr(w2, 19)),
+                                  _mm256_srli_epi32(w2, 10));
+    const __m256i lowHalf = _mm256_set_epi32(0, 0, -1, -1, 0, 0, -1, -1);
+    sum = _mm256_add_epi32(sum, _mm256_and_si256(s1, lowHalf));
+
+    // ...and w[i+2], w[i+3] on the two words just computed
+    w2 = _mm256_shuffle_epi32(sum, 0x44);
+    s1 = _mm256_xor_si256(_mm256_xor_si256(Sha256Avx2Rotr(w2, 17), Sha256Avx2Rotr(w2, 19)),
+                          _mm256_srli_epi32(w2, 10));
+    return _mm256_add_epi32(sum, _mm256_andnot_si256(lowHalf, s1));
+}
+
+BACKUP_TARGET("avx2,bmi2") BACKUP_ALWAYS_INLINE
+uint32_t Sha256Avx2Ror(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+// 64 rounds with precomputed W[i] + K[i]
+BACKUP_TARGET("avx2,bmi2") BACKUP_ALWAYS_INLINE
+void Sha256Avx2Rounds(uint32_t state[8], const uint32_t wk[64]) {
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (Sha256Avx2Ror(e, 6) ^ Sha256Avx2Ror(e, 11) ^ Sha256Avx2Ror(e, 25)) +
+                      ((e & f) ^ (~e & g)) + wk[i];
+        uint32_t t2 = (Sha256Avx2Ror(a, 2) ^ Sha256Avx2Ror(a, 13) ^ Sha256Avx2Ror(a, 22)) +
+                      ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+BACKUP_TARGET("avx2,bmi2")
+inline void Sha256CompressAvx2(uint32_t state[8], const uint8_t* data, size_t blocks, const uint32_t* k) {
+    const __m256i byteSwap = _mm256_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL,
+                                               0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    alignas(32) uint32_t wk[2][64];
+
+    while (blocks > 0) {
+        // Low lane: this block; high lane: the next one (or this one again)
+        const uint8_t* second = blocks > 1 ? data + 64 : data;
+        __m256i x[4];
+        for (int i = 0; i < 4; i++) {
+            __m256i words = _mm256_inserti128_si256(
+                _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(data + i * 16))),
+                _mm_loadu_si128((const __m128i*)(second + i * 16)), 1);
+            x[i] = _mm256_shuffle_epi8(words, byteSwap);
+        }
+
+        for (int i = 0; i < 64; i += 4) {
+            __m256i kv = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)(k + i)));
+            __m256i sum = _mm256_add_epi32(x[0], kv);
+            _mm_store_si128((__m128i*)&wk[0][i], _mm256_castsi256_si128(sum));
+            _mm_store_si128((__m128i*)&wk[1][i], _mm256_extracti128_si256(sum, 1));
+
+            __m256i next = Sha256Avx2Schedule(x[0], x[1], x[2], x[3]);
+            x[0] = x[1];
+            x[1] = x[2];
+            x[2] = x[3];
+            x[3] = next;
+        }
+
+        Sha256Avx2Rounds(state, wk[0]);
+        if (blocks > 1) {
+            Sha256Avx2Rounds(state, wk[1]);
+            data += 128;
+            blocks -= 2;
+        } else {
+            data += 64;
+            blocks -= 1;
+        }
+    }
+}
+
+// ---------------------------------------------------- Multi-buffer AVX2
+
+// Transpose 8 rows of 8 words, so out[j] holds word j of every row, and
+// convert from big-endian
+BACKUP_TARGET("avx2,bmi2") BACKUP_ALWAYS_INLINE
+void Sha256Avx2Transpose(__m256i r[8]) {
+    const __m256i byteSwap = _mm256_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL,
+                                               0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]), t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+    __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]), t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+    __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]), t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+    __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]), t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+    __m256i u0 = _mm256_unpacklo_epi64(t0, t2), u1 = _mm256_unpackhi_epi64(t0, t2);
+    __m256i u2 = _mm256_unpacklo_epi64(t1, t3), u3 = _mm256_unpackhi_epi64(t1, t3);
+    __m256i u4 = _mm256_unpacklo_epi64(t4, t6), u5 = _mm256_unpackhi_epi64(t4, t6);
+    __m256i u6 = _mm256_unpacklo_epi64(t5, t7), u7 = _mm256_unpackhi_epi64(t5, t7);
+    r[0] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u0, u4, 0x20), byteSwap);
+    r[1] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u1, u5, 0x20), byteSwap);
+    r[2] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u2, u6, 0x20), byteSwap);
+    r[3] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u3, u7, 0x20), byteSwap);
+    r[4] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u0, u4, 0x31), byteSwap);
+    r[5] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u1, u5, 0x31), byteSwap);
+    r[6] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u2, u6, 0x31), byteSwap);
+    r[7] = _mm256_shuffle_epi8(_mm256_permute2x128_si256(u3, u7, 0x31), byteSwap);
+}
+
+// Load words [offset, offset + 8) of eight blocks, transposed
+BACKUP_TARGET("avx2,bmi2") BACKUP_ALWAYS_INLINE
+void Sha256Avx2LoadWords(__m256i out[8], const uint8_t* const* blocks, int offset) {
+    for (int i = 0; i < 8; i++) {
+        out[i] = _mm256_loadu_si256((const __m256i*)(blocks[i] + offset * 4));
+    }
+    Sha256Avx2Transpose(out);
+}
+
+// One block for each of 8 messages. state[word][lane], row stride 16.
+BACKUP_TARGET("avx2,bmi2")
+inline void Sha256CompressMultiAvx2(uint32_t state[8][16], const uint8_t* const* blocks, const uint32_t* k) {
+    __m256i w[16];
+    Sha256Avx2LoadWords(w, blocks, 0);
+    Sha256Avx2LoadWords(w + 8, blocks, 8);
+
+    __m256i v[8];
+    for (int i = 0; i < 8; i++) {
+        v[i] = _mm256_loadu_si256((const __m256i*)state[i]);
+    }
+    __m256i a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];
+
+    for (int t = 0; t < 64; t++) {
+        if (t >= 16) {
+            __m256i w15 = w[(t + 1) & 15];
+            __m256i w2 = w[(t + 14) & 15];
+            __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(Sha256Avx2Rotr(w15, 7), Sha256Avx2Rotr(w15, 18)),
+                                          _mm256_srli_epi32(w15, 3));
+            __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(Sha256Avx2Rotr(w2, 17), Sha256Avx2Rotr(w2, 19)),
+                                          _mm256_srli_epi32(w2, 10));
+            w[t & 15] = _mm256_add_epi32(_mm256_add_epi32(w[t & 15], s0),
+                                         _mm256_add_epi32(w[(t + 9) & 15], s1));
+        }
+
+        __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(Sha256Avx2Rotr(e, 6), Sha256Avx2Rotr(e, 11)),
+                                      Sha256Avx2Rotr(e, 25));
+        __m256i ch = _mm256_xor_si256(_mm256_and_si256(e, f), _mm256_andnot_si256(e, g));
+        __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(h, s1),
+                                      _mm256_add_epi32(ch, _mm256_add_epi32(w[t & 15], _mm256_set1_epi32((int)k[t]))));
+        __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(Sha256Avx2Rotr(a, 2), Sha256Avx2Rotr(a, 13)),
+                                      Sha256Avx2Rotr(a, 22));
+        __m256i maj = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, _mm256_or_si256(a, b)));
+        __m256i t2 = _mm256_add_epi32(s0, maj);
+        h = g;
+        g = f;
+        f = e;
+        e = _mm256_add_epi32(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = _mm256_add_epi32(t1, t2);
+    }
+
+    __m256i out[8] = {a, b, c, d, e, f, g, h};
+    for (int i = 0; i < 8; i++) {
+        _mm256_storeu_si256((__m256i*)state[i], _mm256_add_epi32(v[i], out[i]));
+    }
+}
+
+// -------------------------------------------------- Multi-buffer AVX-512
+
+// GCC 12 warns about the intentionally undefined pass-through operand
+// inside its own AVX-512 intrinsics (GCC bug 105593)
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+#endif
+
+// One block for each of 16 messages. state[word][lane].
+BACKUP_TARGET("avx512f,avx2,bmi2")
+inline void Sha256CompressMultiAvx512(uint32_t state[8][16], const uint8_t* const* blocks, const uint32_t* k) {
+    // Transpose as four 8x8 tiles: lanes 0-7 / 8-15, words 0-7 / 8-15
+    __m512i w[16];
+    for (int half = 0; half < 2; half++) {
+        __m256i low[8], high[8];
+        Sha256Avx2LoadWords(low, blocks, half * 8);
+        Sha256Avx2LoadWords(high, blocks + 8, half * 8);
+        for (int i = 0; i < 8; i++) {
+            w[half * 8 + i] = _mm512_inserti64x4(_mm512_castsi256_si512(low[i]), high[i], 1);
+        }
+    }
+
+    __m512i v[8];
+    for (int i = 0; i < 8; i++) {
+        v[i] = _mm512_loadu_si512(state[i]);
+    }
+    __m512i a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];
+
+    for (int t = 0; t < 64; t++) {
+        if (t >= 16) {
+            __m512i w15 = w[(t + 1) & 15];
+            __m512i w2 = w[(t + 14) & 15];
+            __m512i s0 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(w15, 7), _mm512_ror_epi32(w15, 18),
+                                                   _mm512_srli_epi32(w15, 3), 0x96);
+            __m512i s1 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(w2, 17), _mm512_ror_epi32(w2, 19),
+                                                   _mm512_srli_epi32(w2, 10), 0x96);
+            w[t & 15] = _mm512_add_epi32(_mm512_add_epi32(w[t & 15], s0),
+                                         _mm512_add_epi32(w[(t + 9) & 15], s1));
+        }
+
+        // 0x96: x ^ y ^ z, 0xCA: x ? y : z (choose), 0xE8: majority
+        __m512i s1 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(e, 6), _mm512_ror_epi32(e, 11),
+                                               _mm512_ror_epi32(e, 25), 0x96);
+        __m512i ch = _mm512_ternarylogic_epi32(e, f, g, 0xCA);
+        __m512i t1 = _mm512_add_epi32(_mm512_add_epi32(h, s1),
+                                      _mm512_add_epi32(ch, _mm512_add_epi32(w[t & 15], _mm512_set1_epi32((int)k[t]))));
+        __m512i s0 = _mm512_ternarylogic_epi32(_mm512_ror_epi32(a, 2), _mm512_ror_epi32(a, 13),
+                                               _mm512_ror_epi32(a, 22), 0x96);
+        __m512i maj = _mm512_ternarylogic_epi32(a, b, c, 0xE8);
+        __m512i t2 = _mm512_add_epi32(s0, maj);
+        h = g;
+        g = f;
+        f = e;
+        e = _mm512_add_epi32(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = _mm512_add_epi32(t1, t2);
+    }
+
+    __m512i out[8] = {a, b, c, d, e, f, g, h};
+    for (int i = 0; i < 8; i++) {
+        _mm512_storeu_si512(state[i], _mm512_add_epi32(v[i], out[i]));
+    }
+}
+
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic pop
+#endif
+
+#endif
@@ -0,0 +1,212 @@
+#ifndef BACKUP_STORE_LAYOUT_H
+#define BACKUP_STORE_LAYOUT_H
+
+// Placement of content blobs inside a store directory.
+//
+// A blob is named <hex digest>.bin. With fan-out it lives in nested
+// subdirectories named after the leading digest bytes; two levels give
+// ab/cd/abcd....bin, so no directory holds more than a few hundred
+// entries even with tens of millions of blobs. Blob names are relative
+// paths below the store directory and are passed to the Directory calls
+// as they are.
+
+#include "filesystem.h"
+#include "digest.h"
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+class StoreLayout {
+public:
+    static const int MAX_LEVELS = 2;
+    static const int DEFAULT_LEVELS = 2;
+    static const size_t NAME_SIZE = Digest::HEX_SIZE + 4;  // <hex>.bin
+
+private:
+    int levels;
+    std::unique_ptr<std::atomic<bool>[]> parentReady;  // Per leaf directory
+
+    // Leaf directory of a digest: its first `levels` bytes
+    size_t LeafIndex(const Digest& digest) const {
+        size_t index = 0;
+        for (int i = 0; i < levels; i++) {
+            index = index << 8 | digest.bytes[i];
+        }
+        return index;
+    }
+
+    static bool IsHexDigit(char c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+    }
+
+    // Byte named by a fan-out directory
+    static uint64_t FanoutByte(const std::string& name) {
+        int high = name[0] <= '9' ? name[0] - '0' : name[0] - 'a' + 10;
+        int low = name[1] <= '9' ? name[1] - '0' : name[1] - 'a' + 10;
+        return (uint64_t)(high << 4 | low);
+    }
+
+    static uint64_t Mix(uint64_t value) {
+        value += 0x9e3779b97f4a7c15ULL;
+        value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+        return value ^ (value >> 31);
+    }
+
+    template <typename Function>
+    static void WalkBlobs(const Directory& dir, const std::string& prefix, int depth, Function& f) {
+        DirectoryReader reader(dir);
+        DirEntry entry;
+        Digest digest;
+        std::vector<std::string> subdirs;
+        while (reader.Next(entry)) {
+            if (depth < MAX_LEVELS && IsFanoutName(entry.name, entry.nameLength)) {
+                subdirs.emplace_back(entry.name, entry.nameLength);
+            } else if (ParseBlobName(entry.name, entry.nameLength, digest)) {
+                f(prefix + std::string(entry.name, entry.nameLength), digest);
+            }
+        }
+        for (const std::string& name : subdirs) {
+            Directory child;
+            if (child.OpenChild(dir, name.c_str())) {
+                WalkBlobs(child, prefix + name + PATH_SEPARATOR, depth + 1, f);
+            }
+        }
+    }
+
+    // Sum over the fan-out directories below dir; the order entries are
+    // listed in does not matter. prefix is the byte path of dir.
+    static uint64_t WalkFingerprint(const Directory& dir, uint64_t prefix, int depth) {
+        uint64_t sum = 0;
+        DirectoryReader reader(dir);
+        DirEntry entry;
+        std::vector<std::string> subdirs;
+        while (reader.Next(entry)) {
+            if (IsFanoutName(entry.name, entry.nameLength)) {
+                subdirs.emplace_back(entry.name, entry.nameLength);
+            }
+        }
+        for (const std::string& subdir : subdirs) {
+            uint64_t id = prefix << 8 | FanoutByte(subdir);
+            FileInfo info;
+            if (dir.Stat(subdir.c_str(), info)) {
+                sum += Mix(Mix((uint64_t)info.mtimeNs) ^ (id << 8 | (uint64_t)depth));
+            }
+            Directory child;
+            if (depth < MAX_LEVELS && child.OpenChild(dir, subdir.c_str())) {
+                sum += WalkFingerprint(child, id, depth + 1);
+            }
+        }
+        return sum;
+    }
+
+public:
+    explicit StoreLayout(int fanoutLevels = 0) {
+        levels = fanoutLevels < 0 ? 0 : (fanoutLevels > MAX_LEVELS ? MAX_LEVELS : fanoutLevels);
+        size_t leaves = (size_t)1 << (8 * levels);
+        parentReady.reset(new std::atomic<bool>[leaves]);
+        for (size_t i = 0; i < leaves; i++) {
+            parentReady[i] = false;
+        }
+    }
+
+    int Levels() const { return levels; }
+
+    // Name of a blob relative to the store directory
+    std::string BlobName(const Digest& digest) const {
+        char hex[Digest::HEX_SIZE];
+        digest.ToHex(hex);
+        std::string name;
+        name.reserve(levels * 3 + NAME_SIZE);
+        for (int i = 0; i < levels; i++) {
+            name.append(hex + i * 2, 2);
+            name += PATH_SEPARATOR;
+        }
+        name.append(hex, Digest::HEX_SIZE);
+        name += ".bin";
+        return name;
+    }
+
+    // Create the fan-out directories a blob goes into. Each leaf is
+    // created at most once per run; later calls are a flag check.
+    bool MakeParents(const Directory& storeDir, const Digest& digest) {
+        if (levels == 0) {
+            return true;
+        }
+        std::atomic<bool>& ready = parentReady[LeafIndex(digest)];
+        if (ready.load(std::memory_order_acquire)) {
+            return true;
+        }
+
+        char hex[Digest::HEX_SIZE];
+        digest.ToHex(hex);
+        std::string name;
+        for (int i = 0; i < levels; i++) {
+            if (i > 0) name += PATH_SEPARATOR;
+            name.append(hex + i * 2, 2);
+            MkdirResult result = storeDir.MakeChild(name.c_str());
+            if (result != MkdirResult::Created && result != MkdirResult::AlreadyExists) {
+                return false;
+            }
+        }
+        ready.store(true, std::memory_order_release);
+        return true;
+    }
+
+    // Two lowercase hex digits: a fan-out directory
+    static bool IsFanoutName(const char* name, size_t length) {
+        return length == 2 && IsHexDigit(name[0]) && IsHexDigit(name[1]);
+    }
+
+    // <hex digest>.bin: a blob
+    static bool ParseBlobName(const char* name, size_t length, Digest& digest) {
+        return length == NAME_SIZE && memcmp(name + Digest::HEX_SIZE, ".bin", 4) == 0 &&
+               Digest::FromHex(name, Digest::HEX_SIZE, digest);
+    }
+
+    // Call f(relativeName, digest) for every blob in the store, whatever
+    // layout it is in (stores being migrated hold a mix)
+    template <typename Function>
+    static void ForEachBlob(const Directory& storeDir, Function f) {
+        WalkBlobs(storeDir, "", 0, f);
+    }
+
+    // Remove the empty fan-out directories below level keepLevels, as
+    // left behind by a migration to fewer levels
+    static void RemoveEmptyDirectories(const Directory& dir, int keepLevels, int depth = 1) {
+        DirectoryReader reader(dir);
+        DirEntry entry;
+        std::vector<std::string> subdirs;
+        while (reader.Next(entry)) {
+            if (IsFanoutName(entry.name, entry.nameLength)) {
+                subdirs.emplace_back(entry.name, entry.nameLength);
+            }
+        }
+        for (const std::string& subdir : subdirs) {
+            Directory child;
+            if (depth < MAX_LEVELS && child.OpenChild(dir, subdir.c_str())) {
+                RemoveEmptyDirectories(child, keepLevels, depth + 1);
+            }
+            child.Close();
+            if (depth > keepLevels) {
+                dir.RemoveChildDirectory(subdir.c_str());  // Fails while not empty
+            }
+        }
+    }
+
+    // Combined modification times of the store and its fan-out
+    // directories. Creating, renaming or removing a blob changes the
+    // mtime of the directory holding it, and with it the fingerprint.
+    static uint64_t Fingerprint(const Directory& storeDir, const std::string& storePath) {
+        FileInfo info;
+        if (!FileSystem::GetInfo(storePath, info)) {
+            return 0;
+        }
+        return Mix((uint64_t)info.mtimeNs) + WalkFingerprint(storeDir, 0, 1);
+    }
+};
+
+#endif
@@ -1,23 +1,25 @@
-#include <windows.h>
+#include "common/filesystem.h"
+#include "common/console.h"
+#include "common/parallel_walker.h"
+#include <atomic>
+#include <iomanip>
 #include <iostream>
+#include <memory>
 #include <string>
 #include <vector>
 #include <cstdio>
-
-// MinGW compatibility
-#ifndef INVALID_HANDLE_VALUE
-#define INVALID_HANDLE_VALUE ((HANDLE)(LONG_PTR)-1)
-#endif
+#include <cstdlib>
 
 using namespace std;
 
-// Statistics structure
+// Statistics structure (updated concurrently by the walker threads)
 struct BackupStats {
-    int filesProcessed = 0;
-    int filesCopied = 0;
-    int directoriesCreated = 0;
-    int errors = 0;
-    long long totalBytes = 0;
+    atomic<int> filesProcessed{0};
+    atomic<int> filesCopied{0};
+    atomic<int> directoriesCreated{0};
+    atomic<int> errors{0};
+    atomic<long long> totalBytes{0};
+    atomic<long long> bytesByMethod[COPY_METHOD_COUNT] = {};  // By CopyMethod
 };
 
 class FileBackup {
@@ -25,54 +27,22 @@ private:
     string sourcePath;
     string destPath;
     BackupStats stats;
-
-    // Convert error code to string
-    string GetLastErrorAsString() {
-        DWORD errorCode = GetLastError();
-        if (errorCode == 0) return "No error";
-        
-        LPSTR buffer = nullptr;
-        size_t size = FormatMessageA(
-            FORMAT_MESSAGE_ALLOCATE_BUFFER | FORMAT_MESSAGE_FROM_SYSTEM,
-            NULL, errorCode, MAKELANGID(LANG_NEUTRAL, SUBLANG_DEFAULT),
-            (LPSTR)&buffer, 0, NULL);
-        
-        string message(buffer, size);
-        LocalFree(buffer);
-        return message;
-    }
-
-    // Ensure path ends with backslash
-    string NormalizePath(const string& path) {
-        string normalized = path;
-        if (!normalized.empty() && normalized.back() != '\\') {
-            normalized += '\\';
-        }
-        return normalized;
-    }
+    int threadCount;
+    bool rootAccessible;
 
     // Create destination directory structure
     bool CreateDestDirectory(const string& path) {
-        // Check if directory already exists
-        DWORD attribs = GetFileAttributesA(path.c_str());
-        if (attribs != INVALID_FILE_ATTRIBUTES && 
-            (attribs & FILE_ATTRIBUTE_DIRECTORY)) {
-            return true; // Already exists
-        }
-
-        // Create directory
-        if (CreateDirectoryA(path.c_str(), NULL)) {
+        MkdirResult result = FileSystem::MakeDirectory(path);
+        if (result == MkdirResult::Created) {
             stats.directoriesCreated++;
             return true;
         }
-        
-        DWORD error = GetLastError();
-        if (error == ERROR_ALREADY_EXISTS) {
+        if (result == MkdirResult::AlreadyExists) {
             return true;
         }
         
         // Try to create parent directories recursively
-        if (error == ERROR_PATH_NOT_FOUND) {
+        if (result == MkdirResult::ParentMissing) {
             size_t pos = path.find_last_of("\\/", path.length() - 2);
             if (pos != string::npos) {
                 string parentPath = path.substr(0, pos);
@@ -85,83 +55,136 @@ private:
         return false;
     }
 
+    // Create and open a subdirectory of the destination
+    bool CreateDestChild(const Directory& parent, const char* name, Directory& child) {
+        MkdirResult result = parent.MakeChild(name);
+        if (result == MkdirResult::Created) {
+            stats.directoriesCreated++;
+        } else if (result != MkdirResult::AlreadyExists) {
+            return false;
+        }
+        return child.OpenChild(parent, name);
+    }
+
     // Copy single file
-    bool CopyFileWithProgress(const string& source, const string& dest) {
-        cout << "  Copying: " << source << endl;
+    bool CopyFileWithProgress(const Directory& sourceDir, const Directory& destDir, const char* name) {
+        ConsoleLine(cout) << "  Copying: " << sourceDir.Path() << name << endl;
         
-        if (CopyFileA(source.c_str(), dest.c_str(), FALSE)) {
+        FileInfo info;
+        CopyMethod method;
+        if (FileSystem::Copy(sourceDir, name, destDir, name, &info, &method)) {
+            stats.totalBytes += info.size;
+            stats.bytesByMethod[(int)method] += info.size;
             stats.filesCopied++;
             return true;
         } else {
-            cerr << "  ERROR: Failed to copy - " << GetLastErrorAsString() << endl;
+            ConsoleLine(cerr) << "  ERROR: Failed to copy - " << FileSystem::LastErrorString() << endl;
             stats.errors++;
             return false;
         }
     }
 
-    // Get file size
-    long long GetFileSize(WIN32_FIND_DATAA& findData) {
-        LARGE_INTEGER size;
-        size.LowPart = findData.nFileSizeLow;
-        size.HighPart = findData.nFileSizeHigh;
-        return size.QuadPart;
-    }
+    // Run one walker task: a directory or a batch of files
+    void ProcessTask(ParallelWalker& walker, WalkTask& task, int worker) {
+        if (!task.files.empty()) {
+            for (const string& name : task.files) {
+                CopyFileWithProgress(*task.sourceParent, *task.destParent, name.c_str());
+            }
+            return;
+        }
 
-    // Recursive backup function
-    bool BackupDirectory(const string& sourceDir, const string& destDir) {
-        string searchPath = sourceDir + "*";
-        WIN32_FIND_DATAA findData;
-        HANDLE hFind = FindFirstFileA(searchPath.c_str(), &findData);
-        
-        if (hFind == INVALID_HANDLE_VALUE) {
-            cerr << "ERROR: Cannot access directory: " << sourceDir << endl;
+        // The root task carries the open source/destination directly
+        if (task.name.empty()) {
+            rootAccessible = BackupDirectory(walker, task.sourceParent, task.destParent, worker);
+            return;
+        }
+
+        ConsoleLine(cout) << "\nEntering directory: " << task.sourceParent->Path() << task.name << endl;
+
+        shared_ptr<Directory> sourceDir = make_shared<Directory>();
+        if (!sourceDir->OpenChild(*task.sourceParent, task.name.c_str())) {
+            ConsoleLine(cerr) << "ERROR: Cannot access directory: " << sourceDir->Path() << endl;
             stats.errors++;
-            return false;
+            return;
         }
 
         // Create destination directory
-        if (!CreateDestDirectory(destDir)) {
-            cerr << "ERROR: Cannot create directory: " << destDir << endl;
+        shared_ptr<Directory> destDir = make_shared<Directory>();
+        if (!CreateDestChild(*task.destParent, task.name.c_str(), *destDir)) {
+            ConsoleLine(cerr) << "ERROR: Cannot create directory: " << task.destParent->Path() << task.name << endl;
+            stats.errors++;
+            return;
+        }
+
+        BackupDirectory(walker, sourceDir, destDir, worker);
+    }
+
+    // Back up one directory; subdirectories are queued on the walker
+    bool BackupDirectory(ParallelWalker& walker, const shared_ptr<Directory>& sourceDir,
+                         const shared_ptr<Directory>& destDir, int worker) {
+        DirectoryReader reader(*sourceDir);
+        
+        if (!reader.IsOpen()) {
+            ConsoleLine(cerr) << "ERROR: Cannot access directory: " << sourceDir->Path() << endl;
             stats.errors++;
-            FindClose(hFind);
             return false;
         }
 
-        do {
-            string fileName = findData.cFileName;
-            
+        WalkTask batch;
+        DirEntry entry;
+        while (reader.Next(entry)) {
             // Skip "." and ".."
-            if (fileName == "." || fileName == "..") {
+            if (IsDotEntry(entry.name)) {
                 continue;
             }
 
-            string sourceFullPath = sourceDir + fileName;
-            string destFullPath = destDir + fileName;
-            
             stats.filesProcessed++;
 
+            // Classify from d_type; only stat when the backend cannot tell
+            EntryType type = reader.GetType(entry);
+            if (type == EntryType::Unknown) {
+                ConsoleLine(cerr) << "ERROR: Cannot read attributes: " << sourceDir->Path() << entry.name << endl;
+                stats.errors++;
+                continue;
+            }
+
             // Check if it's a directory
-            if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-                cout << "\nEntering directory: " << sourceFullPath << endl;
-                BackupDirectory(sourceFullPath + "\\", destFullPath + "\\");
-            } else {
-                // It's a file - copy it
-                long long fileSize = GetFileSize(findData);
-                stats.totalBytes += fileSize;
-                
-                if (CopyFileWithProgress(sourceFullPath, destFullPath)) {
-                    // Success
+            if (type == EntryType::Directory) {
+                WalkTask child;
+                child.sourceParent = sourceDir;
+                child.destParent = destDir;
+                child.name.assign(entry.name, entry.nameLength);
+                walker.Push(worker, std::move(child));
+            } else if (type == EntryType::File) {
+                // It's a file - copy it inline, or batch it up for idle workers
+                if (batch.files.empty() && !walker.HasIdleWorkers()) {
+                    CopyFileWithProgress(*sourceDir, *destDir, entry.name);
+                    continue;
                 }
+                batch.files.emplace_back(entry.name, entry.nameLength);
+                if (batch.files.size() >= WALK_FILE_BATCH) {
+                    batch.sourceParent = sourceDir;
+                    batch.destParent = destDir;
+                    walker.Push(worker, std::move(batch));
+                    batch = WalkTask();
+                }
+            } else {
+                ConsoleLine(cout) << "  Skipping special file: " << sourceDir->Path() << entry.name << endl;
             }
-            
-        } while (FindNextFileA(hFind, &findData));
+        }
+
+        if (!batch.files.empty()) {
+            batch.sourceParent = sourceDir;
+            batch.destParent = destDir;
+            walker.Push(worker, std::move(batch));
+        }
 
-        FindClose(hFind);
         return true;
     }
 
 public:
-    FileBackup(const string& src, const string& dst) {
+    FileBackup(const string& src, const string& dst, int threads = DefaultWorkerCount())
+        : threadCount(threads), rootAccessible(true) {
         sourcePath = NormalizePath(src);
         destPath = NormalizePath(dst);
     }
@@ -173,21 +196,40 @@ public:
         cout << "========================================" << endl;
         cout << "Source: " << sourcePath << endl;
         cout << "Destination: " << destPath << endl;
+        cout << "Threads: " << threadCount << endl;
         cout << "========================================\n" << endl;
 
         // Verify source exists
-        DWORD attribs = GetFileAttributesA(sourcePath.c_str());
-        if (attribs == INVALID_FILE_ATTRIBUTES) {
+        FileInfo sourceInfo;
+        if (!FileSystem::GetInfo(sourcePath, sourceInfo)) {
             cerr << "ERROR: Source directory does not exist!" << endl;
             return false;
         }
-        if (!(attribs & FILE_ATTRIBUTE_DIRECTORY)) {
+        if (sourceInfo.type != EntryType::Directory) {
             cerr << "ERROR: Source path is not a directory!" << endl;
             return false;
         }
 
+        WalkTask root;
+        root.sourceParent = make_shared<Directory>();
+        if (!root.sourceParent->Open(sourcePath)) {
+            cerr << "ERROR: Cannot access directory: " << sourcePath << endl;
+            return false;
+        }
+
+        // Create destination directory
+        root.destParent = make_shared<Directory>();
+        if (!CreateDestDirectory(destPath) || !root.destParent->Open(destPath)) {
+            cerr << "ERROR: Cannot create directory: " << destPath << endl;
+            return false;
+        }
+
         // Start backup
-        bool result = BackupDirectory(sourcePath, destPath);
+        ParallelWalker walker(threadCount);
+        walker.Run(std::move(root), [this, &walker](WalkTask& task, int worker) {
+            ProcessTask(walker, task, worker);
+        });
+        bool result = rootAccessible;
         
         // Print statistics
         PrintStats();
@@ -205,9 +247,20 @@ public:
         cout << "Directories created:  " << stats.directoriesCreated << endl;
         cout << "Errors:               " << stats.errors << endl;
         cout << "Total size:           " << FormatBytes(stats.totalBytes) << endl;
+        PrintCopyMethods();
         cout << "========================================" << endl;
     }
 
+    // Bytes copied by each way of copying that was used
+    void PrintCopyMethods() {
+        for (int i = 0; i < COPY_METHOD_COUNT; i++) {
+            if (stats.bytesByMethod[i] > 0) {
+                string label = string("  - ") + CopyMethodName((CopyMethod)i) + ":";
+                cout << left << setw(22) << label << right << FormatBytes(stats.bytesByMethod[i]) << endl;
+            }
+        }
+    }
+
     // Format bytes to human-readable
     string FormatBytes(long long bytes) {
         const char* units[] = {"B", "KB", "MB", "GB", "TB"};
@@ -230,9 +283,19 @@ int main(int argc, char* argv[]) {
     // Simple command-line parsing
     string source, dest;
     
+    int threads = DefaultWorkerCount();
+    
     if (argc >= 3) {
         source = argv[1];
         dest = argv[2];
+
+        // Check for --threads option
+        for (int i = 3; i < argc; i++) {
+            string arg = argv[i];
+            if ((arg == "--threads" || arg == "-j") && i + 1 < argc) {
+                threads = atoi(argv[++i]);
+            }
+        }
     } else {
         // Interactive mode
         cout << "Enter source directory path: ";
@@ -245,13 +308,13 @@ int main(int argc, char* argv[]) {
     // Validate input
     if (source.empty() || dest.empty()) {
         cerr << "ERROR: Source and destination paths are required!" << endl;
-        cout << "\nUsage: backup.exe <source_path> <dest_path>" << endl;
+        cout << "\nUsage: backup.exe <source_path> <dest_path> [--threads N]" << endl;
         cout << "Example: backup.exe C:\\MyDocuments D:\\Backup" << endl;
         return 1;
     }
 
     // Create backup object and start
-    FileBackup backup(source, dest);
+    FileBackup backup(source, dest, threads);
     bool success = backup.StartBackup();
     
     if (success) {
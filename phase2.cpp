@@ -1,201 +1,837 @@
-#include <windows.h>
-#include <wincrypt.h>
+#include "common/filesystem.h"
+#include "common/file_hasher.h"
+#include "common/digest.h"
+#include "common/sha256.h"
+#include "common/record_file.h"
+#include "common/manifest_file.h"
+#include "common/journal.h"
+#include "common/run_progress.h"
+#include "common/change_journal.h"
+#include "common/change_watcher.h"
+#include "common/path_map.h"
+#include "common/path_arena.h"
+#include "common/console.h"
+#include "common/parallel_walker.h"
+#include <atomic>
+#include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <thread>
 #include <string>
-#include <map>
+#include <vector>
+#include <algorithm>
+#include <unordered_map>
 #include <fstream>
 #include <sstream>
 #include <iomanip>
 #include <ctime>
-#ifndef CALG_SHA_256
-#define CALG_SHA_256 (ALG_CLASS_HASH | ALG_TYPE_ANY | ALG_SID_SHA_256)
-#define ALG_SID_SHA_256 12
-#endif
-
-#pragma comment(lib, "advapi32.lib")
+#include <chrono>
+#include <csignal>
 
 using namespace std;
 
-// Statistics structure
+// Statistics structure (updated concurrently by the walker threads)
 struct BackupStats {
-    int filesProcessed = 0;
-    int filesSkipped = 0;
-    int filesCopied = 0;
-    int filesNew = 0;
-    int filesModified = 0;
-    int directoriesCreated = 0;
-    int errors = 0;
-    long long totalBytes = 0;
-    long long bytesCopied = 0;
+    atomic<int> filesProcessed{0};
+    atomic<int> filesSkipped{0};
+    atomic<int> filesCopied{0};
+    atomic<int> filesNew{0};
+    atomic<int> filesModified{0};
+    atomic<int> filesDeleted{0};
+    atomic<int> filesPruned{0};
+    atomic<int> directoriesCreated{0};
+    atomic<int> directoriesResumed{0};   // Passed over as done by the resumed run
+    atomic<int> directoriesUnchanged{0};  // Listed from the manifest instead of read
+    atomic<int> errors{0};
+    atomic<long long> totalBytes{0};
+    atomic<long long> bytesCopied{0};
+    atomic<long long> bytesByMethod[COPY_METHOD_COUNT] = {};  // bytesCopied by CopyMethod
 };
 
 // File metadata structure
 struct FileMetadata {
-    string hash;
+    Digest hash;
     long long size;
     time_t lastModified;
 };
 
-// SHA-256 Hasher Class
-class FileHasher {
+// Manifest Manager Class
+//
+// The manifest is a checkpoint plus a journal of later changes. The
+// checkpoint (.backup_manifest.bin, common/manifest_file.h) stays
+// memory-mapped and is queried in place. The journal
+// (.backup_manifest.journal, common/journal.h) gets one record per file
+// that is new, changed or deleted, so a run writes only what it changed.
+// Records are committed with each progress checkpoint
+// (common/run_progress.h), after the copies they describe, and a crash
+// keeps what was committed. On load the journal is replayed into a sorted
+// list of changes that is read together with the checkpoint. Once the
+// journal is large, a background thread folds the two into a new
+// checkpoint during the run; it replaces the old one at the end and the
+// journal keeps only the run's own records.
+//
+// Each directory's sorted listing is merge-joined against its range of
+// entries, so files are matched to their previous entries without a lookup
+// per file.
+//
+// Files deleted from the source stay listed as tombstones (size TOMBSTONE,
+// mtime the time the deletion was noticed) while the backup copy exists;
+// a mirror run removes the copy and drops the entry.
+//
+// Every directory also has a summary: its mtime, ctime and entry count as
+// the last run saw them, and a Merkle digest of its subtree (its live
+// files' names, sizes, mtimes and digests, then its subdirectories' names
+// and digests). A directory whose mtime and ctime are unchanged has the
+// same entries, so its listing can be taken from the manifest. Digests
+// are derived data: the checkpoint holds them for its own entries, and
+// Load recomputes those of the directories the journal changed.
+class ManifestManager {
 public:
-    // Calculate SHA-256 hash of a file
-    static string CalculateHash(const string& filePath) {
-        HANDLE hFile = CreateFileA(
-            filePath.c_str(),
-            GENERIC_READ,
-            FILE_SHARE_READ,
-            NULL,
-            OPEN_EXISTING,
-            FILE_FLAG_SEQUENTIAL_SCAN,
-            NULL
-        );
-
-        if (hFile == INVALID_HANDLE_VALUE) {
-            return "";
-        }
-
-        HCRYPTPROV hProv = 0;
-        HCRYPTHASH hHash = 0;
-        
-        // Acquire crypto context
-        if (!CryptAcquireContext(&hProv, NULL, NULL, PROV_RSA_AES, CRYPT_VERIFYCONTEXT)) {
-            CloseHandle(hFile);
-            return "";
+    static const size_t NOT_LISTED = SIZE_MAX;  // Entry of a file the manifest lacks
+    static const long long TOMBSTONE = -1;
+    static const long long DROPPED = -2;    // In the journal: the entry is removed
+    static const long long DIRECTORY = -3;  // In the journal: a directory's summary
+
+private:
+    // A journaled change
+    struct Change {
+        string path;
+        FileMetadata meta;
+    };
+
+    struct DirectoryNode {
+        string path;  // Relative, with a trailing separator; empty for the root
+        DirectorySummary summary;
+    };
+
+    // Directories changed this close to the start of the run may change
+    // again within the same timestamp tick, so their times are not kept
+    static const long long RACY_WINDOW_NS = 2000000000LL;
+
+    ManifestFile previous;     // Checkpoint; read-only during a run
+    vector<Change> journaled;  // Changes since the checkpoint, by path; read-only during a run
+    vector<DirectoryNode> directories;  // By path; read-only during a run
+    long long startNs;
+    size_t listed;             // Files listed by the two together
+    bool converted;            // Loaded from an older format
+    Journal journal;           // Changes of this run
+    uint64_t journalLoaded;    // Journal length that journaled covers
+    thread compactor;
+    bool compacted;            // The compactor wrote a new checkpoint
+    string rootPath;
+    string manifestPath;
+    string legacyPath;   // Text manifest written by earlier versions
+
+    static const char* CheckpointName() { return ".backup_manifest.bin"; }
+    static const char* TempName() { return ".backup_manifest.bin.tmp"; }
+    static const char* JournalName() { return ".backup_manifest.journal"; }
+
+    // Journal record: path (u32 length + bytes), digest (32 bytes), size
+    // (i64), mtime (i64); the latest record for a path wins. A directory's
+    // summary has size DIRECTORY, mtime_ns for the mtime, then ctime_ns and
+    // the entry count (i64 each); DROPPED on a directory's path (with its
+    // trailing separator) removes the summary.
+    static const char* JournalMagic() { return "BKMJRNL1"; }
+
+    // Record format of earlier versions: "BKMANIF1", then per file
+    // path (u32 length + bytes), digest (32 bytes), size (i64), mtime (i64)
+    static const char* RecordMagic() { return "BKMANIF1"; }
+
+    // Load a manifest in the old "filepath|hash|size|timestamp" text format
+    bool LoadLegacy(PathMap<FileMetadata>& entries) {
+        ifstream file(legacyPath);
+        if (!file.is_open()) {
+            // Manifest doesn't exist - this is first backup
+            return false;
         }
 
-        // Create hash object
-        if (!CryptCreateHash(hProv, CALG_SHA_256, 0, 0, &hHash)) {
-            CryptReleaseContext(hProv, 0);
-            CloseHandle(hFile);
-            return "";
+        string line;
+        while (getline(file, line)) {
+            if (line.empty()) continue;
+
+            size_t pos1 = line.find('|');
+            size_t pos2 = line.find('|', pos1 + 1);
+            size_t pos3 = line.find('|', pos2 + 1);
+
+            FileMetadata meta;
+            if (pos1 != string::npos && pos2 != string::npos && pos3 != string::npos &&
+                Digest::FromHex(line.data() + pos1 + 1, pos2 - pos1 - 1, meta.hash)) {
+                meta.size = stoll(line.substr(pos2 + 1, pos3 - pos2 - 1));
+                meta.lastModified = stoll(line.substr(pos3 + 1));
+                entries[line.substr(0, pos1)] = meta;
+            }
         }
+        return true;
+    }
 
-        // Read file and hash in chunks
-        const DWORD BUFFER_SIZE = 8192; // 8KB chunks
-        BYTE buffer[BUFFER_SIZE];
-        DWORD bytesRead = 0;
+    // Load a manifest in the BKMANIF1 record format
+    bool LoadRecords(PathMap<FileMetadata>& entries) {
+        RecordReader reader;
+        if (!reader.Open(manifestPath, RecordMagic())) {
+            return false;
+        }
 
-        while (ReadFile(hFile, buffer, BUFFER_SIZE, &bytesRead, NULL) && bytesRead > 0) {
-            if (!CryptHashData(hHash, buffer, bytesRead, 0)) {
-                CryptDestroyHash(hHash);
-                CryptReleaseContext(hProv, 0);
-                CloseHandle(hFile);
-                return "";
+        while (!reader.AtEnd()) {
+            string filepath;
+            FileMetadata meta;
+            int64_t size, timestamp;
+            if (!reader.GetString(filepath) || !reader.GetDigest(meta.hash) ||
+                !reader.GetI64(size) || !reader.GetI64(timestamp)) {
+                cerr << "WARNING: Manifest is truncated, ignoring the rest" << endl;
+                break;
             }
+            meta.size = size;
+            meta.lastModified = (time_t)timestamp;
+            entries[filepath] = meta;
         }
+        return true;
+    }
 
-        // Get hash result
-        BYTE hashResult[32]; // SHA-256 produces 32 bytes
-        DWORD hashLen = 32;
-        
-        if (!CryptGetHashParam(hHash, HP_HASHVAL, hashResult, &hashLen, 0)) {
-            CryptDestroyHash(hHash);
-            CryptReleaseContext(hProv, 0);
-            CloseHandle(hFile);
-            return "";
+    // Replay the journal over entries and directory summaries (dropped
+    // ones get mtime DROPPED); returns its intact length
+    uint64_t ReplayJournal(const Directory& rootDir, PathMap<FileMetadata>& entries,
+                           PathMap<DirectorySummary>& summaries) {
+        RecordReader reader;
+        string filepath;
+        return Journal::Replay(rootDir, JournalName(), JournalMagic(), [&](const char* data, size_t size) {
+            reader.Assign(data, size);
+            FileMetadata meta;
+            int64_t fileSize, timestamp;
+            if (!reader.GetString(filepath) || !reader.GetDigest(meta.hash) || !reader.GetI64(fileSize) ||
+                !reader.GetI64(timestamp)) {
+                return;
+            }
+            if (fileSize == DIRECTORY) {
+                DirectorySummary summary;
+                int64_t ctimeNs, entryCount;
+                if (reader.GetI64(ctimeNs) && reader.GetI64(entryCount)) {
+                    summary.mtimeNs = timestamp;
+                    summary.ctimeNs = ctimeNs;
+                    summary.entries = (uint64_t)entryCount;
+                    summaries[filepath] = summary;
+                }
+            } else if (fileSize == DROPPED && !filepath.empty() && filepath.back() == PATH_SEPARATOR) {
+                summaries[filepath].mtimeNs = DROPPED;
+            } else {
+                meta.size = fileSize;
+                meta.lastModified = (time_t)timestamp;
+                entries[filepath] = meta;
+            }
+        });
+    }
+
+    // Directory part of a path, with its trailing separator: "a/b/x" and
+    // "a/b/x/" give "a/b/", "x" gives ""
+    static string ParentOf(const string& path) {
+        size_t end = path.size() > 1 ? path.rfind(PATH_SEPARATOR, path.size() - 2) : string::npos;
+        return end == string::npos ? string() : path.substr(0, end + 1);
+    }
+
+    // Position of a directory's node, or of where it would go
+    size_t DirectoryPosition(const string& directory) const {
+        return (size_t)(lower_bound(directories.begin(), directories.end(), directory,
+                                    [](const DirectoryNode& node, const string& path) { return node.path < path; }) -
+                        directories.begin());
+    }
+
+    // Merge the checkpoint's directory table with the journaled summaries,
+    // add a node for every directory that has files but no summary, and
+    // compute the digests of the directories whose subtree changed
+    void LoadDirectories(const PathMap<DirectorySummary>& summaries) {
+        directories.clear();
+        bool haveTable = previous.IsOpen() && previous.HasDirectories();
+        vector<DirectoryNode> stored;
+        if (haveTable) {
+            stored.resize(previous.DirectoryCount());
+            for (size_t i = 0; i < stored.size(); i++) {
+                if (!previous.GetDirectory(i, stored[i].path, stored[i].summary)) {
+                    stored.resize(i);
+                    haveTable = false;  // Damaged; rebuild what is missing
+                    break;
+                }
+            }
+        }
+
+        // Directories whose digest changed: journaled summaries and the
+        // directories of changed files. Those with live files need a node;
+        // the parents of dropped directories, tombstones and dropped files
+        // are only recomputed if they still have one.
+        vector<string> live, touched;
+        auto add = [](vector<string>& list, const string& directory) {
+            if (list.empty() || list.back() != directory) {
+                list.push_back(directory);
+            }
+        };
+        size_t next = 0;
+        for (const PathMap<DirectorySummary>::Entry* entry : summaries.Sorted()) {
+            string path = entry->Key();
+            while (next < stored.size() && stored[next].path < path) {
+                directories.push_back(std::move(stored[next++]));
+            }
+            if (next < stored.size() && stored[next].path == path) {
+                next++;
+            }
+            if (entry->value.mtimeNs == DROPPED) {
+                add(touched, ParentOf(path));
+                continue;
+            }
+            DirectoryNode node = {path, entry->value};
+            directories.push_back(std::move(node));
+            add(live, path);
+        }
+        while (next < stored.size()) {
+            directories.push_back(std::move(stored[next++]));
         }
+        for (const Change& change : journaled) {
+            add(change.meta.size >= 0 ? live : touched, ParentOf(change.path));
+        }
+        if (!haveTable) {
+            // An earlier format, or only a journal: every directory
+            for (Cursor cursor(*this); cursor.Valid(); cursor.Next()) {
+                if (!IsTombstone(cursor.Entry())) {
+                    add(live, ParentOf(cursor.Path()));
+                }
+            }
+        }
+
+        // Their ancestors change too
+        auto withAncestors = [](vector<string>& list) {
+            size_t count = list.size();
+            for (size_t i = 0; i < count; i++) {
+                string directory = list[i];
+                while (!directory.empty()) {
+                    directory = ParentOf(directory);
+                    list.push_back(directory);
+                }
+            }
+            sort(list.begin(), list.end());
+            list.erase(unique(list.begin(), list.end()), list.end());
+        };
+        withAncestors(live);
+        withAncestors(touched);
 
-        // Convert to hex string
-        stringstream ss;
-        for (DWORD i = 0; i < hashLen; i++) {
-            ss << hex << setw(2) << setfill('0') << (int)hashResult[i];
+        size_t known = directories.size();
+        for (const string& directory : live) {
+            size_t position = DirectoryPosition(directory);
+            if (position >= known || directories[position].path != directory) {
+                DirectoryNode node = {directory, DirectorySummary()};
+                directories.push_back(std::move(node));
+            }
+        }
+        if (directories.size() > known) {
+            sort(directories.begin(), directories.end(),
+                 [](const DirectoryNode& a, const DirectoryNode& b) { return a.path < b.path; });
         }
 
-        // Cleanup
-        CryptDestroyHash(hHash);
-        CryptReleaseContext(hProv, 0);
-        CloseHandle(hFile);
+        // Children sort after their parent, so going backwards computes
+        // them first
+        for (size_t i = directories.size(); i-- > 0;) {
+            const string& path = directories[i].path;
+            if (binary_search(live.begin(), live.end(), path) || binary_search(touched.begin(), touched.end(), path)) {
+                directories[i].summary.digest = TreeDigest(directories[i].path);
+            }
+        }
+    }
+
+    // Visit a directory's children as the loaded manifest lists them, in
+    // name order: visitFile(name, entry) for its files (tombstones too),
+    // then visitDirectory(node) for its subdirectories. Subdirectories
+    // that have entries but no summary (those of a directory that is
+    // gone) go to visitOrphan(name) instead.
+    template <typename VisitFile, typename VisitOrphan, typename VisitDirectory>
+    void ForEachChild(const string& directory, VisitFile visitFile, VisitOrphan visitOrphan,
+                      VisitDirectory visitDirectory) const {
+        Cursor cursor(*this);
+        bool more = cursor.Seek(directory);
+        string skip;
+        while (more && cursor.Path().compare(0, directory.size(), directory) == 0) {
+            const string& path = cursor.Path();
+            size_t separator = path.find(PATH_SEPARATOR, directory.size());
+            if (separator != string::npos) {
+                skip.assign(path, 0, separator + 1);
+                size_t position = DirectoryPosition(skip);
+                if (position == directories.size() || directories[position].path != skip) {
+                    visitOrphan(skip.substr(directory.size(), separator - directory.size()));
+                }
+                skip.back() = (char)(PATH_SEPARATOR + 1);
+                more = cursor.Seek(skip);
+                continue;
+            }
+            visitFile(path.c_str() + directory.size(), cursor.Entry());
+            more = cursor.Next();
+        }
 
-        return ss.str();
+        for (size_t i = DirectoryPosition(directory); i < directories.size(); i++) {
+            const string& path = directories[i].path;
+            if (path.compare(0, directory.size(), directory) != 0) {
+                break;
+            }
+            if (path.size() > directory.size() && path.find(PATH_SEPARATOR, directory.size()) == path.size() - 1) {
+                visitDirectory(directories[i]);
+            }
+        }
     }
-};
 
-// Manifest Manager Class
-class ManifestManager {
-private:
-    map<string, FileMetadata> manifest;
-    string manifestPath;
+    // Merkle digest of a directory; its subdirectories' digests must be
+    // current
+    Digest TreeDigest(const string& directory) const {
+        Sha256 hasher;
+        RecordBuffer record;
+        ForEachChild(
+            directory,
+            [&](const char* name, size_t entry) {
+                FileMetadata meta = PreviousEntry(entry);
+                if (meta.size == TOMBSTONE) {
+                    return;
+                }
+                record.Clear();
+                record.PutString(name, strlen(name));
+                record.PutDigest(meta.hash);
+                record.PutI64(meta.size);
+                record.PutI64((int64_t)meta.lastModified);
+                hasher.Update("F", 1);
+                hasher.Update(record.Data().data(), record.Data().size());
+            },
+            [](const string&) {},
+            [&](const DirectoryNode& child) {
+                record.Clear();
+                record.PutString(child.path.data() + directory.size(), child.path.size() - directory.size() - 1);
+                record.PutDigest(child.summary.digest);
+                hasher.Update("D", 1);
+                hasher.Update(record.Data().data(), record.Data().size());
+            });
+        Digest digest;
+        hasher.Final(digest.bytes);
+        return digest;
+    }
+
+    FileMetadata PreviousEntry(size_t index) const {
+        if (index >= previous.Count()) {
+            return journaled[index - previous.Count()].meta;
+        }
+        FileMetadata meta;
+        meta.hash = previous.GetDigest(index);
+        meta.size = previous.GetSize(index);
+        meta.lastModified = (time_t)previous.GetMtime(index);
+        return meta;
+    }
+
+    static bool SameMetadata(const FileMetadata& a, const FileMetadata& b) {
+        return a.hash == b.hash && a.size == b.size && a.lastModified == b.lastModified;
+    }
 
 public:
-    ManifestManager(const string& backupRoot) {
-        manifestPath = backupRoot + "\\.backup_manifest.txt";
-        cout << "Saving manifest at: " << manifestPath << endl;
+    // Visits the checkpoint and the journaled changes together in path
+    // order. A change hides the checkpoint's entry for its path, and
+    // dropped entries are skipped. Entries are numbered through the
+    // checkpoint first, then through the changes.
+    class Cursor {
+    private:
+        const ManifestManager& manifest;
+        ManifestFile::Cursor checkpoint;
+        bool checkpointMore;
+        size_t change;    // Next journaled change
+        bool fromChange;  // The current entry is that change
+        bool valid;
+        const string* path;
+        size_t entry;
+
+        // Make the first visible entry at the positions the current one
+        void Settle() {
+            const vector<Change>& changes = manifest.journaled;
+            for (;;) {
+                bool haveChange = change < changes.size();
+                if (!checkpointMore && !haveChange) {
+                    valid = false;
+                    return;
+                }
+                int order = !haveChange ? -1 : !checkpointMore ? 1 : checkpoint.Path().compare(changes[change].path);
+                valid = true;
+                if (order < 0) {
+                    fromChange = false;
+                    path = &checkpoint.Path();
+                    entry = checkpoint.Index();
+                    return;
+                }
+                if (order == 0) {
+                    checkpointMore = checkpoint.Next();  // Hidden by the change
+                }
+                if (changes[change].meta.size != DROPPED) {
+                    fromChange = true;
+                    path = &changes[change].path;
+                    entry = manifest.previous.Count() + change;
+                    return;
+                }
+                change++;
+            }
+        }
+
+    public:
+        explicit Cursor(const ManifestManager& manager)
+            : manifest(manager), checkpoint(manager.previous), change(0), fromChange(false), valid(false),
+              path(nullptr), entry(0) {
+            checkpointMore = checkpoint.Next();
+            Settle();
+        }
+
+        bool Valid() const { return valid; }
+
+        // Advance to the next entry; false at the end
+        bool Next() {
+            if (fromChange) {
+                change++;
+            } else {
+                checkpointMore = checkpoint.Next();
+            }
+            Settle();
+            return valid;
+        }
+
+        // Move to the first entry whose path is >= key; false if there is
+        // none
+        bool Seek(const string& key) {
+            const vector<Change>& changes = manifest.journaled;
+            checkpointMore = checkpoint.Seek(key);
+            change = (size_t)(lower_bound(changes.begin(), changes.end(), key,
+                                          [](const Change& c, const string& k) { return c.path < k; }) -
+                              changes.begin());
+            Settle();
+            return valid;
+        }
+
+        const string& Path() const { return *path; }
+        size_t Entry() const { return entry; }
+    };
+
+private:
+    // Write the checkpoint and the journaled changes as one new checkpoint,
+    // under the temporary name
+    bool WriteCheckpoint() const {
+        size_t count = 0;
+        for (Cursor cursor(*this); cursor.Valid(); cursor.Next()) {
+            count++;
+        }
+        ManifestFileWriter writer;
+        if (!writer.Open(rootPath + TempName(), count, directories.size())) {
+            return false;
+        }
+        for (Cursor cursor(*this); cursor.Valid(); cursor.Next()) {
+            FileMetadata meta = PreviousEntry(cursor.Entry());
+            writer.Add(cursor.Path(), meta.hash, meta.size, meta.lastModified);
+        }
+        for (const DirectoryNode& node : directories) {
+            writer.AddDirectory(node.path, node.summary);
+        }
+        return writer.Close();
     }
 
-    // Load manifest from file
-    bool Load() {
-        ifstream file(manifestPath);
-        if (!file.is_open()) {
-            // Manifest doesn't exist - this is first backup
+    // Replace the checkpoint with the one WriteCheckpoint wrote, then cut
+    // the journal down to the records after what it covered (those up to
+    // journalEnd). The journal must be closed.
+    bool InstallCheckpoint(const Directory& rootDir, uint64_t journalEnd) {
+        previous.Close();  // Windows cannot replace a mapped file
+        if (!rootDir.RenameChild(TempName(), rootDir, CheckpointName())) {
+            rootDir.RemoveChild(TempName());
             return false;
         }
+        return Journal::Rewrite(rootDir, JournalName(), JournalMagic(), journalLoaded, journalEnd);
+    }
 
-        manifest.clear();
-        string line;
-        
-        while (getline(file, line)) {
-            if (line.empty()) continue;
+public:
+    ManifestManager(const string& backupRoot)
+        : listed(0), converted(false), journalLoaded(0), compacted(false) {
+        rootPath = NormalizePath(backupRoot);
+        manifestPath = rootPath + CheckpointName();
+        legacyPath = rootPath + ".backup_manifest.txt";
+        startNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        cout << "Saving manifest at: " << manifestPath << endl;
+    }
 
-            // Parse line: filepath|hash|size|timestamp
-            size_t pos1 = line.find('|');
-            size_t pos2 = line.find('|', pos1 + 1);
-            size_t pos3 = line.find('|', pos2 + 1);
+    ~ManifestManager() {
+        if (compactor.joinable()) {
+            compactor.join();
+        }
+    }
 
-            if (pos1 != string::npos && pos2 != string::npos && pos3 != string::npos) {
-                string filepath = line.substr(0, pos1);
-                string hash = line.substr(pos1 + 1, pos2 - pos1 - 1);
-                long long size = stoll(line.substr(pos2 + 1, pos3 - pos2 - 1));
-                time_t timestamp = stoll(line.substr(pos3 + 1));
+    // Load the manifest: map the checkpoint (or read an older format into
+    // memory), replay the journal over it and bring the directory digests
+    // up to date. False if there is none.
+    bool Load() {
+        previous.Close();
+        journaled.clear();
+        directories.clear();
+        listed = 0;
+        converted = false;
+        journalLoaded = 0;
+
+        Directory rootDir;
+        if (!rootDir.Open(rootPath)) {
+            return false;
+        }
+        PathMap<FileMetadata> changes;
+        PathMap<DirectorySummary> summaries;
+        bool found = previous.Open(manifestPath);
+        if (!found && (LoadRecords(changes) || LoadLegacy(changes))) {
+            found = converted = true;
+        }
+        journalLoaded = ReplayJournal(rootDir, changes, summaries);
+        found = found || journalLoaded > 0;
+        if (journalLoaded < 8) {
+            journalLoaded = 8;  // Past the magic of a new journal
+        }
 
-                FileMetadata meta;
-                meta.hash = hash;
-                meta.size = size;
-                meta.lastModified = timestamp;
-                manifest[filepath] = meta;
+        listed = previous.Count();
+        journaled.reserve(changes.Size());
+        size_t index;
+        for (const PathMap<FileMetadata>::Entry* entry : changes.Sorted()) {
+            Change change = {entry->Key(), entry->value};
+            bool inCheckpoint = previous.IsOpen() && previous.Find(change.path, index);
+            if (change.meta.size == DROPPED) {
+                listed -= inCheckpoint ? 1 : 0;
+            } else {
+                listed += inCheckpoint ? 0 : 1;
             }
+            journaled.push_back(std::move(change));
         }
+        LoadDirectories(summaries);
+        return found;
+    }
 
-        file.close();
+    // Start recording changes; the destination must exist. A manifest in
+    // an older format is converted first. Starts the compactor if the
+    // journal has grown past its threshold, or there is no checkpoint yet
+    // or none with a directory table.
+    bool BeginRun() {
+        Directory rootDir;
+        if (!rootDir.Open(rootPath)) {
+            return false;
+        }
+        if (converted) {
+            if (!WriteCheckpoint() || !InstallCheckpoint(rootDir, journalLoaded)) {
+                cerr << "WARNING: Cannot convert the manifest to the current format" << endl;
+            } else {
+                // The binary manifest supersedes the text one
+                FileSystem::RemoveFile(legacyPath);
+                Load();
+            }
+        }
+        // Written by Sync only, so no record is on the device before the
+        // copy it describes
+        if (!journal.Open(rootDir, JournalName(), JournalMagic(), journalLoaded, false)) {
+            return false;
+        }
+        bool compact = previous.IsOpen() ? !previous.HasDirectories() ||
+                                               Journal::ShouldCompact(journalLoaded, previous.FileSize())
+                                         : journalLoaded > 8;  // Only a journal so far
+        if (!converted && compact) {
+            compactor = thread([this] { compacted = WriteCheckpoint(); });
+        }
         return true;
     }
 
-    // Save manifest to file
+    // Wait until the changes recorded so far are on the device
+    bool Sync() {
+        return journal.Sync();
+    }
+
+    // Commit the run's changes; a finished compaction replaces the
+    // checkpoint. Ends the run.
     bool Save() {
-        ofstream file(manifestPath);
-        if (!file.is_open()) {
-            return false;
+        if (compactor.joinable()) {
+            compactor.join();
+        }
+        uint64_t journalEnd = journal.Size();
+        bool ok = journal.Close();
+        if (ok && compacted) {
+            compacted = false;
+            Directory rootDir;
+            if (!rootDir.Open(rootPath) || !InstallCheckpoint(rootDir, journalEnd)) {
+                cerr << "WARNING: Failed to compact the manifest journal" << endl;
+            }
         }
+        return ok;
+    }
 
-        for (const auto& entry : manifest) {
-            file << entry.first << "|"
-                 << entry.second.hash << "|"
-                 << entry.second.size << "|"
-                 << entry.second.lastModified << "\n";
+    // Match one directory's listing against the previous manifest in a
+    // single pass over its entries. directory is relative to the root with
+    // a trailing separator; fileName(i) gives the files' names and
+    // subdirectories the subdirectories' names, both sorted. entries[i]
+    // receives the entry number of file i, or NOT_LISTED. Listed files
+    // that are gone are passed to goneFile(entry, path): files of the
+    // directory that were not found, and everything under a subdirectory
+    // that no longer exists, whose name goneDirectory(name) receives first.
+    // The entries of subdirectories that do exist are skipped with a seek.
+    template <typename FileName, typename GoneFile, typename GoneDirectory>
+    void MatchDirectory(const string& directory, size_t fileCount, FileName fileName,
+                        const vector<string>& subdirectories, vector<size_t>& entries,
+                        GoneFile goneFile, GoneDirectory goneDirectory) const {
+        entries.assign(fileCount, (size_t)NOT_LISTED);
+        size_t file = 0, subdirectory = 0;
+        Cursor cursor(*this);
+        bool more = cursor.Seek(directory);
+        string skip;
+        while (more && cursor.Path().compare(0, directory.size(), directory) == 0) {
+            const string& path = cursor.Path();
+            size_t separator = path.find(PATH_SEPARATOR, directory.size());
+            if (separator != string::npos) {
+                // Entries under a subdirectory; every path below it sorts
+                // before the name followed by the next character
+                size_t nameSize = separator - directory.size();
+                while (subdirectory < subdirectories.size() &&
+                       path.compare(directory.size(), nameSize, subdirectories[subdirectory]) > 0) {
+                    subdirectory++;
+                }
+                bool exists = subdirectory < subdirectories.size() &&
+                              path.compare(directory.size(), nameSize, subdirectories[subdirectory]) == 0;
+                if (exists) {
+                    skip.assign(path, 0, separator);
+                    skip += (char)(PATH_SEPARATOR + 1);
+                    more = cursor.Seek(skip);
+                    continue;
+                }
+
+                // Gone with its whole subtree, whose entries are adjacent
+                goneDirectory(path.substr(directory.size(), nameSize));
+                skip.assign(path, 0, separator + 1);
+                while (more && cursor.Path().compare(0, skip.size(), skip) == 0) {
+                    goneFile(cursor.Entry(), cursor.Path());
+                    more = cursor.Next();
+                }
+                continue;
+            }
+
+            int order = 1;
+            while (file < fileCount && (order = path.compare(directory.size(), string::npos, fileName(file))) > 0) {
+                file++;  // Not listed: a new file
+            }
+            if (file < fileCount && order == 0) {
+                entries[file++] = cursor.Entry();
+            } else {
+                goneFile(cursor.Entry(), path);
+            }
+            more = cursor.Next();
         }
+    }
 
-        file.close();
-        return true;
+    // Metadata of an entry of the previous manifest
+    FileMetadata GetPrevious(size_t entry) const {
+        return PreviousEntry(entry);
+    }
+
+    bool IsTombstone(size_t entry) const {
+        return entry >= previous.Count() ? journaled[entry - previous.Count()].meta.size == TOMBSTONE
+                                         : previous.GetSize(entry) == TOMBSTONE;
     }
 
-    // Check if file exists in manifest
-    bool HasFile(const string& filepath) {
-        return manifest.find(filepath) != manifest.end();
+    // Keep an entry whose file was deleted from the source as a tombstone
+    void MarkDeleted(const string& filepath, size_t entry) {
+        FileMetadata meta = PreviousEntry(entry);
+        meta.size = TOMBSTONE;
+        meta.lastModified = time(nullptr);
+        UpdateFile(filepath, meta);
     }
 
-    // Get file metadata from manifest
-    FileMetadata GetFileMetadata(const string& filepath) {
-        return manifest[filepath];
+    // Remove an entry from the manifest
+    void DropFile(const string& filepath) {
+        FileMetadata meta;
+        meta.size = DROPPED;
+        meta.lastModified = 0;
+        UpdateFile(filepath, meta);
     }
 
-    // Update/Add file in manifest
+    // Whether a file's metadata matches its entry in the previous manifest
+    bool IsUnchanged(size_t entry, const FileMetadata& meta) const {
+        return entry != NOT_LISTED && SameMetadata(PreviousEntry(entry), meta);
+    }
+
+    // Record a file that is new or differs from its previous entry
     void UpdateFile(const string& filepath, const FileMetadata& meta) {
-        manifest[filepath] = meta;
+        thread_local RecordBuffer record;
+        record.Clear();
+        record.PutString(filepath);
+        record.PutDigest(meta.hash);
+        record.PutI64(meta.size);
+        record.PutI64((int64_t)meta.lastModified);
+        journal.Append(record.Data());
+    }
+
+    // Number of files listed right after Load
+    size_t GetFileCount() {
+        return listed;
+    }
+
+    // Summary of a directory (relative, with a trailing separator), or
+    // null if it has none
+    const DirectorySummary* FindDirectory(const string& directory) const {
+        size_t position = DirectoryPosition(directory);
+        if (position == directories.size() || directories[position].path != directory) {
+            return nullptr;
+        }
+        return &directories[position].summary;
     }
 
-    // Get manifest size
-    int GetFileCount() {
-        return manifest.size();
+    // A directory's listing as the previous manifest has it, in name
+    // order: visitFile(name, entry) for its files, tombstones too, and
+    // visitDirectory(name, summarized) for its subdirectories. Those
+    // holding only tombstones of a directory that is gone are not
+    // summarized, and come first.
+    template <typename VisitFile, typename VisitDirectory>
+    void ListDirectory(const string& directory, VisitFile visitFile, VisitDirectory visitDirectory) const {
+        ForEachChild(
+            directory, visitFile, [&](const string& name) { visitDirectory(name, false); },
+            [&](const DirectoryNode& child) {
+                visitDirectory(child.path.substr(directory.size(), child.path.size() - directory.size() - 1), true);
+            });
+    }
+
+    // Record how a directory was seen: its metadata, read before its
+    // listing, and the files and subdirectories listed. Only an
+    // observation that is complete (every entry classified and every file
+    // recorded) and not racy keeps the times that let the next run trust
+    // the listing.
+    void RecordDirectory(const string& directory, const FileInfo& info, size_t entryCount, bool complete) {
+        DirectorySummary seen;
+        seen.entries = entryCount;
+        if (complete && max(info.mtimeNs, info.ctimeNs) < startNs - RACY_WINDOW_NS) {
+            seen.mtimeNs = info.mtimeNs;
+            seen.ctimeNs = info.ctimeNs;
+        }
+        const DirectorySummary* stored = FindDirectory(directory);
+        if (stored && stored->mtimeNs == seen.mtimeNs && stored->ctimeNs == seen.ctimeNs &&
+            stored->entries == seen.entries) {
+            return;
+        }
+        RecordBuffer record;
+        record.PutString(directory);
+        record.PutDigest(Digest());
+        record.PutI64(DIRECTORY);
+        record.PutI64(seen.mtimeNs);
+        record.PutI64(seen.ctimeNs);
+        record.PutI64((int64_t)seen.entries);
+        journal.Append(record.Data());
+    }
+
+    // Drop the summaries of subdirectories of directory that are not in
+    // subdirectories (sorted), with those of everything under them
+    void DropGoneDirectories(const string& directory, const vector<string>& subdirectories) {
+        for (size_t i = DirectoryPosition(directory); i < directories.size(); i++) {
+            const string& path = directories[i].path;
+            if (path.compare(0, directory.size(), directory) != 0) {
+                break;
+            }
+            size_t separator = path.find(PATH_SEPARATOR, directory.size());
+            if (separator == string::npos ||
+                binary_search(subdirectories.begin(), subdirectories.end(),
+                              path.substr(directory.size(), separator - directory.size()))) {
+                continue;
+            }
+            FileMetadata meta;
+            meta.size = DROPPED;
+            meta.lastModified = 0;
+            UpdateFile(path, meta);
+        }
     }
 };
 
@@ -205,42 +841,56 @@ private:
     string sourcePath;
     string destPath;
     BackupStats stats;
+    PathArena paths;  // Directories under the source root
     ManifestManager manifest;
+    RunProgress progress;  // Finished directories, for --resume
     bool incrementalMode;
+    bool mirrorMode;  // Remove backup copies of deleted files
+    bool resumeMode;  // Continue an interrupted run
+    bool trustDirectories;  // Files in unchanged directories are not stat'ed
+    int checkpointSeconds;
+    int threadCount;
+    bool rootAccessible;
+    Directory destRoot;  // For checkpoints
+    ChangeJournal changes;  // Kept by the change watcher (--watch)
+    bool scanAll;       // Read everything even if the watcher saw all changes
+    bool changesOnly;   // Read only the directories the watcher journaled
+    atomic<unsigned long long> nextPartialId{0};  // For CreatePartial
 
-    string NormalizePath(const string& path) {
-        string normalized = path;
-        if (!normalized.empty() && normalized.back() != '\\') {
-            normalized += '\\';
-        }
-        return normalized;
-    }
+    // What a changes-only run does with a directory
+    enum class Plan {
+        Pass,       // Only go on to the children listed
+        Directory,  // Read it, and go on to the children listed
+        Tree,       // Read it and everything under it
+    };
+    struct PlannedDirectory {
+        Plan plan = Plan::Pass;
+        vector<string> children;  // Names of planned subdirectories
+    };
+    unordered_map<PathId, PlannedDirectory> planned;  // Read-only during a run
 
-    string GetRelativePath(const string& fullPath, const string& basePath) {
-        if (fullPath.find(basePath) == 0) {
-            return fullPath.substr(basePath.length());
-        }
-        return fullPath;
-    }
+    // A directory whose files are still being backed up; its summary is
+    // recorded once the last part (its own pass or a batch) is done
+    struct PendingDirectory {
+        FileInfo info;
+        size_t entryCount;
+        bool complete;
+        int parts;
+    };
+    mutex pendingLock;
+    unordered_map<PathId, PendingDirectory> pending;
 
     bool CreateDestDirectory(const string& path) {
-        DWORD attribs = GetFileAttributesA(path.c_str());
-        if (attribs != INVALID_FILE_ATTRIBUTES && 
-            (attribs & FILE_ATTRIBUTE_DIRECTORY)) {
-            return true;
-        }
-
-        if (CreateDirectoryA(path.c_str(), NULL)) {
+        MkdirResult result = FileSystem::MakeDirectory(path);
+        if (result == MkdirResult::Created) {
             stats.directoriesCreated++;
             return true;
         }
-        
-        DWORD error = GetLastError();
-        if (error == ERROR_ALREADY_EXISTS) {
+        if (result == MkdirResult::AlreadyExists) {
             return true;
         }
         
-        if (error == ERROR_PATH_NOT_FOUND) {
+        if (result == MkdirResult::ParentMissing) {
             size_t pos = path.find_last_of("\\/", path.length() - 2);
             if (pos != string::npos) {
                 string parentPath = path.substr(0, pos);
@@ -253,145 +903,621 @@ private:
         return false;
     }
 
-    long long GetFileSize(WIN32_FIND_DATAA& findData) {
-        LARGE_INTEGER size;
-        size.LowPart = findData.nFileSizeLow;
-        size.HighPart = findData.nFileSizeHigh;
-        return size.QuadPart;
+    bool CreateDestChild(const Directory& parent, const char* name, Directory& child) {
+        MkdirResult result = parent.MakeChild(name);
+        if (result == MkdirResult::Created) {
+            stats.directoriesCreated++;
+        } else if (result != MkdirResult::AlreadyExists) {
+            return false;
+        }
+        return child.OpenChild(parent, name);
     }
 
-    time_t GetFileTime(WIN32_FIND_DATAA& findData) {
-        ULARGE_INTEGER ull;
-        ull.LowPart = findData.ftLastWriteTime.dwLowDateTime;
-        ull.HighPart = findData.ftLastWriteTime.dwHighDateTime;
-        return ull.QuadPart / 10000000ULL - 11644473600ULL;
+    // Remove a directory of the destination with everything in it
+    bool RemoveDestTree(const Directory& parent, const char* name) {
+        Directory dir;
+        if (!dir.OpenChild(parent, name)) {
+            return false;
+        }
+        {
+            DirectoryReader reader(dir);
+            DirEntry entry;
+            while (reader.Next(entry)) {
+                if (IsDotEntry(entry.name)) {
+                    continue;
+                }
+                if (reader.GetType(entry) == EntryType::Directory) {
+                    RemoveDestTree(dir, entry.name);
+                } else {
+                    dir.RemoveChild(entry.name);
+                }
+            }
+        }
+        return parent.RemoveChildDirectory(name);
     }
 
-    bool ShouldCopyFile(const string& sourceFile, const string& relativePath, 
-                       long long fileSize, time_t fileTime, string& currentHash) {
+    // Decide whether a file must be copied; label receives its status tag
+    bool ShouldCopyFile(size_t entry, long long fileSize, time_t fileTime,
+                        FileMetadata& oldMeta, const char*& label) {
         
         // If not in incremental mode, copy everything
+        label = "";
         if (!incrementalMode) {
-            currentHash = FileHasher::CalculateHash(sourceFile);
             return true;
         }
 
         // Check if file exists in manifest
-        if (!manifest.HasFile(relativePath)) {
-            // New file - must copy
-            cout << "  [NEW] ";
-            currentHash = FileHasher::CalculateHash(sourceFile);
-            stats.filesNew++;
+        if (entry == ManifestManager::NOT_LISTED || manifest.IsTombstone(entry)) {
+            // New file (or one that was deleted before) - must copy
+            label = "  [NEW] ";
             return true;
         }
+        oldMeta = manifest.GetPrevious(entry);
 
         // File exists in manifest - check if changed
-        FileMetadata oldMeta = manifest.GetFileMetadata(relativePath);
 
         // Quick check: if size or time different, likely changed
+        // (the hash taken while copying confirms it)
         if (oldMeta.size != fileSize || oldMeta.lastModified != fileTime) {
-            // Calculate hash to confirm
-            currentHash = FileHasher::CalculateHash(sourceFile);
-            
-            if (currentHash != oldMeta.hash) {
-                // File actually changed
-                cout << "  [MODIFIED] ";
-                stats.filesModified++;
-                return true;
-            }
-        } else {
-            // Size and time same - assume unchanged (optimization)
-            currentHash = oldMeta.hash;
+            label = "  [MODIFIED] ";
+            return true;
         }
 
-        // File unchanged - skip
-        cout << "  [SKIP] ";
-        stats.filesSkipped++;
+        // Size and time same - assume unchanged (optimization)
+        label = "  [SKIP] ";
         return false;
     }
 
-    bool BackupDirectory(const string& sourceDir, const string& destDir) {
-        string searchPath = sourceDir + "*";
-        WIN32_FIND_DATAA findData;
-        HANDLE hFind = FindFirstFileA(searchPath.c_str(), &findData);
-        
-        if (hFind == INVALID_HANDLE_VALUE) {
-            cerr << "ERROR: Cannot access directory: " << sourceDir << endl;
+    // Record a file in the manifest. Only files that differ from their
+    // previous entry are recorded, so the path is built just for those.
+    void RecordFile(PathId directory, const char* fileName, size_t entry, const FileMetadata& meta) {
+        if (manifest.IsUnchanged(entry, meta)) {
+            return;
+        }
+        thread_local string relativePath;
+        relativePath.clear();
+        paths.AppendPath(directory, relativePath);
+        relativePath += fileName;
+        manifest.UpdateFile(relativePath, meta);
+    }
+
+    // Create an empty file under a temporary name in destDir: dot-prefixed,
+    // with the process id and a counter, and created exclusively, so it
+    // never takes over a file that is there already (such as the copy of
+    // a source file that happens to have that name)
+    bool CreatePartial(const Directory& destDir, string& name) {
+        for (int attempt = 0; attempt < 16; attempt++) {
+            name = ".backup-partial." + to_string(FileSystem::ProcessId()) + "." + to_string(nextPartialId++);
+            File file;
+            if (file.CreateNew(destDir, name.c_str())) {
+                return file.Finish();
+            }
+        }
+        return false;
+    }
+
+    // Back up a single file whose metadata is known; entry is its entry in
+    // the previous manifest. False if it could not be copied.
+    bool BackupFile(const Directory& sourceDir, const Directory& destDir, const char* fileName,
+                    PathId directory, size_t entry, const FileInfo& info) {
+        long long fileSize = info.size;
+        time_t fileTime = (time_t)(info.mtimeNs / 1000000000LL);
+        stats.totalBytes += fileSize;
+
+        FileMetadata meta;
+        meta.size = fileSize;
+        meta.lastModified = fileTime;
+
+        FileMetadata oldMeta;
+        const char* label;
+        if (!ShouldCopyFile(entry, fileSize, fileTime, oldMeta, label)) {
+            ConsoleLine(cout) << label << sourceDir.Path() << fileName << endl;
+            stats.filesSkipped++;
+
+            // File skipped but update manifest (in case metadata changed)
+            meta.hash = oldMeta.hash;
+            RecordFile(directory, fileName, entry, meta);
+            return true;
+        }
+
+        // Copy and hash in one pass. A possibly modified file goes to a
+        // temporary name first, so an unchanged backup copy survives if the
+        // content turns out to be the same.
+        bool confirmChange = !oldMeta.hash.IsEmpty();
+        string copyName = fileName;
+        if (confirmChange && !CreatePartial(destDir, copyName)) {
+            ConsoleLine(cout) << label << sourceDir.Path() << fileName << endl;
+            ConsoleLine(cerr) << "  ERROR: Failed to copy file (" << FileSystem::LastErrorString() << ")" << endl;
             stats.errors++;
             return false;
         }
-
-        if (!CreateDestDirectory(destDir)) {
-            cerr << "ERROR: Cannot create directory: " << destDir << endl;
+        CopyMethod method;
+        meta.hash = FileHasher::CopyAndHash(sourceDir, fileName, destDir, copyName.c_str(), nullptr, &method);
+        if (meta.hash.IsEmpty()) {
+            ConsoleLine(cout) << label << sourceDir.Path() << fileName << endl;
+            ConsoleLine(cerr) << "  ERROR: Failed to copy file" << endl;
             stats.errors++;
-            FindClose(hFind);
             return false;
         }
 
-        do {
-            string fileName = findData.cFileName;
-            
-            if (fileName == "." || fileName == "..") {
-                continue;
+        if (confirmChange) {
+            if (meta.hash == oldMeta.hash) {
+                // Only the metadata changed - keep the existing copy
+                destDir.RemoveChild(copyName.c_str());
+                ConsoleLine(cout) << "  [SKIP] " << sourceDir.Path() << fileName << endl;
+                stats.filesSkipped++;
+                RecordFile(directory, fileName, entry, meta);
+                return true;
             }
+            if (!destDir.RenameChild(copyName.c_str(), destDir, fileName)) {
+                destDir.RemoveChild(copyName.c_str());
+                ConsoleLine(cout) << label << sourceDir.Path() << fileName << endl;
+                ConsoleLine(cerr) << "  ERROR: Failed to copy file" << endl;
+                stats.errors++;
+                return false;
+            }
+            stats.filesModified++;
+        } else if (incrementalMode) {
+            stats.filesNew++;
+        }
 
-            string sourceFullPath = sourceDir + fileName;
-            string destFullPath = destDir + fileName;
-            string relativePath = GetRelativePath(sourceFullPath, sourcePath);
-            
-            stats.filesProcessed++;
+        ConsoleLine(cout) << label << sourceDir.Path() << fileName << endl;
+        stats.filesCopied++;
+        stats.bytesCopied += fileSize;
+        stats.bytesByMethod[(int)method] += fileSize;
 
-            if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-                cout << "\nEntering directory: " << sourceFullPath << endl;
-                BackupDirectory(sourceFullPath + "\\", destFullPath + "\\");
-            } else {
-                long long fileSize = GetFileSize(findData);
-                time_t fileTime = GetFileTime(findData);
-                stats.totalBytes += fileSize;
-
-                string fileHash;
-                if (ShouldCopyFile(sourceFullPath, relativePath, fileSize, fileTime, fileHash)) {
-                    cout << sourceFullPath << endl;
-                    
-                    if (CopyFileA(sourceFullPath.c_str(), destFullPath.c_str(), FALSE)) {
-                        stats.filesCopied++;
-                        stats.bytesCopied += fileSize;
-
-                        // Update manifest
-                        FileMetadata meta;
-                        meta.hash = fileHash;
-                        meta.size = fileSize;
-                        meta.lastModified = fileTime;
-                        manifest.UpdateFile(relativePath, meta);
-                    } else {
-                        cerr << "  ERROR: Failed to copy file" << endl;
-                        stats.errors++;
+        // Update manifest
+        RecordFile(directory, fileName, entry, meta);
+        return true;
+    }
+
+    // Count a part of a directory's files as done; the last one records
+    // the directory's summary
+    void DirectoryPartDone(PathId directory, bool ok) {
+        PendingDirectory done;
+        {
+            lock_guard<mutex> guard(pendingLock);
+            auto it = pending.find(directory);
+            if (it == pending.end()) {
+                return;
+            }
+            it->second.complete = it->second.complete && ok;
+            if (--it->second.parts > 0) {
+                return;
+            }
+            done = it->second;
+            pending.erase(it);
+        }
+        manifest.RecordDirectory(paths.Path(directory), done.info, done.entryCount, done.complete);
+    }
+
+    // Run one walker task: a directory or a batch of files
+    void ProcessTask(ParallelWalker& walker, WalkTask& task, int worker) {
+        if (!task.files.empty()) {
+            bool ok = true;
+            for (size_t i = 0; i < task.files.size(); i++) {
+                // Classified as a file already, so follow symlinks to the target
+                const string& name = task.files[i];
+                FileInfo info;
+                if (!task.sourceParent->Stat(name.c_str(), info, true)) {
+                    ConsoleLine(cerr) << "ERROR: Cannot read attributes: " << task.sourceParent->Path() << name << endl;
+                    stats.errors++;
+                    ok = false;
+                    continue;
+                }
+                ok = BackupFile(*task.sourceParent, *task.destParent, name.c_str(), task.directory,
+                                task.fileEntries[i], info) && ok;
+            }
+            DirectoryPartDone(task.directory, ok);
+            progress.FilesDone(task.directory);
+            return;
+        }
+
+        // Done by the run being resumed
+        if (progress.Resumed(task.directory) == RunProgress::State::TreeDone) {
+            progress.SkipTree(task.directory);
+            stats.directoriesResumed++;
+            return;
+        }
+
+        // The root task carries the open source/destination directly
+        if (task.name.empty()) {
+            rootAccessible = BackupDirectory(walker, task.sourceParent, task.destParent, PathArena::ROOT, worker);
+            return;
+        }
+
+        ConsoleLine(cout) << "\nEntering directory: " << task.sourceParent->Path() << task.name << endl;
+
+        shared_ptr<Directory> sourceDir = make_shared<Directory>();
+        if (!sourceDir->OpenChild(*task.sourceParent, task.name.c_str())) {
+            ConsoleLine(cerr) << "ERROR: Cannot access directory: " << sourceDir->Path() << endl;
+            stats.errors++;
+            return;
+        }
+
+        shared_ptr<Directory> destDir = make_shared<Directory>();
+        if (!CreateDestChild(*task.destParent, task.name.c_str(), *destDir)) {
+            ConsoleLine(cerr) << "ERROR: Cannot create directory: " << task.destParent->Path() << task.name << endl;
+            stats.errors++;
+            return;
+        }
+
+        BackupDirectory(walker, sourceDir, destDir, task.directory, worker);
+    }
+
+    // File of the directory being read
+    struct ListedFile {
+        string name;
+        FileInfo info;
+        bool hasInfo;  // Otherwise stat it when it is backed up
+    };
+
+    // Plan a changes-only run from the watcher's records: the directories
+    // journaled, and the ones on the way to them, which are passed through
+    // without being read. Directories under a TREE are read with it.
+    // Returns how many directories are read first-hand.
+    size_t PlanChanges(const vector<pair<char, string>>& records) {
+        planned.clear();
+        planned[(PathId)PathArena::ROOT];
+        for (const pair<char, string>& record : records) {
+            const string& path = record.second;
+            PathId id = PathArena::ROOT;
+            size_t start = 0;
+            for (size_t end = path.find(PATH_SEPARATOR); end != string::npos; end = path.find(PATH_SEPARATOR, start)) {
+                if (end > start) {
+                    PathId child = paths.Intern(id, path.data() + start, end - start);
+                    if (planned.find(child) == planned.end()) {
+                        planned[id].children.push_back(path.substr(start, end - start));
+                        planned[child];
                     }
+                    id = child;
+                }
+                start = end + 1;
+            }
+            Plan plan = record.first == ChangeJournal::TREE ? Plan::Tree : Plan::Directory;
+            PlannedDirectory& node = planned[id];
+            if (plan > node.plan) {
+                node.plan = plan;
+            }
+        }
+
+        vector<PathId> covered;
+        for (const auto& node : planned) {
+            for (PathId id = node.first; id != PathArena::ROOT;) {
+                id = paths.Parent(id);
+                auto parent = planned.find(id);
+                if (parent != planned.end() && parent->second.plan == Plan::Tree) {
+                    covered.push_back(node.first);
+                    break;
+                }
+            }
+        }
+        for (PathId id : covered) {
+            planned.erase(id);
+        }
+        size_t read = 0;
+        for (const auto& node : planned) {
+            read += node.second.plan == Plan::Pass ? 0 : 1;
+        }
+        return read;
+    }
+
+    // What this run does with a directory
+    Plan PlanFor(PathId directory) const {
+        if (!changesOnly) {
+            return Plan::Tree;
+        }
+        auto it = planned.find(directory);
+        return it == planned.end() ? Plan::Tree : it->second.plan;
+    }
+
+    // Queue a subdirectory of directory on the walker; with plannedOnly,
+    // only if it was planned
+    void QueueSubdirectory(ParallelWalker& walker, const shared_ptr<Directory>& sourceDir,
+                           const shared_ptr<Directory>& destDir, PathId directory, string name, int worker,
+                           bool plannedOnly = false) {
+        WalkTask child;
+        child.sourceParent = sourceDir;
+        child.destParent = destDir;
+        child.name = std::move(name);
+        child.directory = paths.Intern(directory, child.name);
+        if (plannedOnly && planned.find(child.directory) == planned.end()) {
+            return;
+        }
+        progress.AddSubdirectory(directory);
+        walker.Push(worker, std::move(child));
+    }
+
+    // Take an unchanged directory's listing from the manifest: its mtime
+    // and ctime match its summary, so no entry was added, removed or
+    // renamed. False (and nothing listed) if the summary does not match, or
+    // the manifest's entries do not add up to the count it recorded.
+    bool ListUnchanged(const string& directoryPath, const FileInfo& info, vector<ListedFile>& files,
+                       vector<size_t>& entries, vector<string>& subdirectories) {
+        const DirectorySummary* summary = manifest.FindDirectory(directoryPath);
+        if (!summary || summary->mtimeNs == 0 || summary->mtimeNs != info.mtimeNs ||
+            summary->ctimeNs != info.ctimeNs) {
+            return false;
+        }
+        bool tombstones = false;
+        manifest.ListDirectory(
+            directoryPath,
+            [&](const char* name, size_t entry) {
+                if (manifest.IsTombstone(entry)) {
+                    tombstones = true;
+                    return;
+                }
+                ListedFile file;
+                file.name = name;
+                file.hasInfo = false;
+                files.push_back(std::move(file));
+                entries.push_back(entry);
+            },
+            [&](const string& name, bool summarized) {
+                if (summarized) {
+                    subdirectories.push_back(name);
                 } else {
-                    cout << sourceFullPath << endl;
-                    
-                    // File skipped but update manifest (in case metadata changed)
-                    FileMetadata meta;
-                    meta.hash = fileHash;
-                    meta.size = fileSize;
-                    meta.lastModified = fileTime;
-                    manifest.UpdateFile(relativePath, meta);
+                    tombstones = true;
+                }
+            });
+        // A mirror run reads the listing to drop tombstones
+        if (files.size() + subdirectories.size() != summary->entries || (tombstones && mirrorMode)) {
+            files.clear();
+            entries.clear();
+            subdirectories.clear();
+            return false;
+        }
+        return true;
+    }
+
+    // Go through a directory of a changes-only run without reading it, on
+    // to its planned subdirectories. One that is gone was removed after it
+    // changed, and its parent's record covers that.
+    void PassDirectory(ParallelWalker& walker, const shared_ptr<Directory>& sourceDir,
+                       const shared_ptr<Directory>& destDir, PathId directory, int worker) {
+        progress.Enter(directory);
+        for (const string& name : planned.find(directory)->second.children) {
+            FileInfo info;
+            if (sourceDir->Stat(name.c_str(), info) && info.type == EntryType::Directory) {
+                QueueSubdirectory(walker, sourceDir, destDir, directory, name, worker);
+            }
+        }
+        progress.FilesDone(directory);
+    }
+
+    // Back up one directory; subdirectories are queued on the walker. The
+    // files are collected and sorted first, so they can be matched against
+    // the previous manifest in one pass. A directory that is unchanged
+    // since the last run is not read: its listing comes from the manifest,
+    // and with trustDirectories its files are taken as unchanged too.
+    // Files the resumed run backed up already are passed over. A
+    // changes-only run reads only what it planned.
+    bool BackupDirectory(ParallelWalker& walker, const shared_ptr<Directory>& sourceDir,
+                         const shared_ptr<Directory>& destDir, PathId directory, int worker) {
+        Plan plan = PlanFor(directory);
+        if (plan == Plan::Pass) {
+            PassDirectory(walker, sourceDir, destDir, directory, worker);
+            return true;
+        }
+        bool plannedOnly = plan == Plan::Directory;
+
+        // Stat the directory before it is read, so a change made meanwhile
+        // shows on the next run
+        FileInfo dirInfo;
+        bool haveInfo = sourceDir->GetInfo(dirInfo);
+        string directoryPath = paths.Path(directory);
+
+        vector<ListedFile> files;
+        vector<size_t> entries;
+        vector<string> subdirectories;
+        bool unchanged = haveInfo && incrementalMode && ListUnchanged(directoryPath, dirInfo, files, entries,
+                                                                      subdirectories);
+        unique_ptr<DirectoryReader> reader;
+        if (!unchanged) {
+            reader.reset(new DirectoryReader(*sourceDir));
+            if (!reader->IsOpen()) {
+                ConsoleLine(cerr) << "ERROR: Cannot access directory: " << sourceDir->Path() << endl;
+                stats.errors++;
+                return false;
+            }
+        }
+
+        progress.Enter(directory);
+        bool filesDone = progress.Resumed(directory) == RunProgress::State::FilesDone;
+        if (filesDone) {
+            stats.directoriesResumed++;
+        }
+
+        bool complete = true;  // Every entry was classified
+        if (unchanged) {
+            stats.directoriesUnchanged++;
+            stats.filesProcessed += (int)(subdirectories.size() + (filesDone ? 0 : files.size()));
+            for (const string& name : subdirectories) {
+                QueueSubdirectory(walker, sourceDir, destDir, directory, name, worker, plannedOnly);
+            }
+            if (trustDirectories && !filesDone) {
+                for (size_t i = 0; i < files.size(); i++) {
+                    stats.totalBytes += manifest.GetPrevious(entries[i]).size;
                 }
+                stats.filesSkipped += (int)files.size();
+                ConsoleLine(cout) << "  [UNCHANGED] " << sourceDir->Path() << " (" << files.size() << " files)"
+                                  << endl;
+                filesDone = true;
             }
-            
-        } while (FindNextFileA(hFind, &findData));
+        } else {
+            bool batching = false;
+            DirEntry entry;
+            while (reader->Next(entry)) {
+                if (IsDotEntry(entry.name)) {
+                    continue;
+                }
 
-        FindClose(hFind);
+                EntryType type = reader->GetType(entry);
+                if (filesDone && type != EntryType::Directory) {
+                    continue;
+                }
+                stats.filesProcessed++;
+
+                if (type == EntryType::Unknown) {
+                    ConsoleLine(cerr) << "ERROR: Cannot read attributes: " << sourceDir->Path() << entry.name << endl;
+                    stats.errors++;
+                    complete = false;
+                    continue;
+                }
+
+                if (type == EntryType::Directory) {
+                    string name(entry.name, entry.nameLength);
+                    subdirectories.push_back(name);
+                    QueueSubdirectory(walker, sourceDir, destDir, directory, std::move(name), worker, plannedOnly);
+                } else if (type == EntryType::File) {
+                    // Size and mtime drive the skip decision, so files need a
+                    // stat; files for idle workers are stat'ed in their batch
+                    ListedFile file;
+                    file.name.assign(entry.name, entry.nameLength);
+                    batching = batching || walker.HasIdleWorkers();
+                    file.hasInfo = !batching && reader->GetInfo(entry, file.info);
+                    files.push_back(std::move(file));
+                } else {
+                    ConsoleLine(cout) << "  Skipping special file: " << sourceDir->Path() << entry.name << endl;
+                }
+            }
+            reader.reset();
+        }
+
+        if (filesDone) {
+            progress.FilesDone(directory);
+            return true;
+        }
+
+        if (!unchanged) {
+            sort(files.begin(), files.end(),
+                 [](const ListedFile& a, const ListedFile& b) { return a.name < b.name; });
+            sort(subdirectories.begin(), subdirectories.end());
+            // Files that are gone become tombstones, or with mirroring are
+            // removed from the destination. Nothing is taken as gone if the
+            // listing had errors.
+            manifest.MatchDirectory(
+                directoryPath, files.size(), [&files](size_t i) -> const string& { return files[i].name; },
+                subdirectories, entries,
+                [&](size_t gone, const string& path) {
+                    if (!complete) {
+                        return;
+                    }
+                    const char* name = path.c_str() + directoryPath.size();
+                    bool tombstone = manifest.IsTombstone(gone);
+                    if (!tombstone) {
+                        ConsoleLine(cout) << "  [DELETED] " << sourceDir->Path() << name << endl;
+                        stats.filesDeleted++;
+                    }
+                    if (mirrorMode) {
+                        // Files under a gone subdirectory go with its tree
+                        if (path.find(PATH_SEPARATOR, directoryPath.size()) == string::npos) {
+                            ConsoleLine(cout) << "  [PRUNED] " << destDir->Path() << name << endl;
+                            destDir->RemoveChild(name);
+                        }
+                        manifest.DropFile(path);
+                        stats.filesPruned++;
+                    } else if (!tombstone) {
+                        manifest.MarkDeleted(path, gone);
+                    }
+                },
+                [&](const string& name) {
+                    if (complete && mirrorMode) {
+                        ConsoleLine(cout) << "  [PRUNED] " << destDir->Path() << name << endl;
+                        RemoveDestTree(*destDir, name.c_str());
+                    }
+                });
+            if (complete) {
+                manifest.DropGoneDirectories(directoryPath, subdirectories);
+            }
+        }
+
+        // Files without metadata go to idle workers in batches; the
+        // directory's summary is recorded once they are all done
+        size_t batched = 0;
+        if (unchanged) {
+            bool batching = false;
+            for (ListedFile& file : files) {
+                batching = batching || walker.HasIdleWorkers();
+                file.hasInfo = !batching && sourceDir->Stat(file.name.c_str(), file.info, true);
+            }
+        }
+        for (const ListedFile& file : files) {
+            batched += file.hasInfo ? 0 : 1;
+        }
+        {
+            PendingDirectory scan;
+            scan.info = dirInfo;
+            scan.entryCount = files.size() + subdirectories.size();
+            scan.complete = haveInfo && complete;
+            scan.parts = 1 + (int)((batched + WALK_FILE_BATCH - 1) / WALK_FILE_BATCH);
+            lock_guard<mutex> guard(pendingLock);
+            pending[directory] = scan;
+        }
+
+        bool ok = true;
+        WalkTask batch;
+        for (size_t i = 0; i < files.size(); i++) {
+            if (files[i].hasInfo) {
+                ok = BackupFile(*sourceDir, *destDir, files[i].name.c_str(), directory, entries[i], files[i].info) &&
+                     ok;
+                continue;
+            }
+            batch.files.push_back(std::move(files[i].name));
+            batch.fileEntries.push_back(entries[i]);
+            if (batch.files.size() >= WALK_FILE_BATCH) {
+                batch.sourceParent = sourceDir;
+                batch.destParent = destDir;
+                batch.directory = directory;
+                progress.AddFiles(directory);
+                walker.Push(worker, std::move(batch));
+                batch = WalkTask();
+            }
+        }
+
+        if (!batch.files.empty()) {
+            batch.sourceParent = sourceDir;
+            batch.destParent = destDir;
+            batch.directory = directory;
+            progress.AddFiles(directory);
+            walker.Push(worker, std::move(batch));
+        }
+
+        DirectoryPartDone(directory, ok);
+        progress.FilesDone(directory);
         return true;
     }
 
 public:
-    IncrementalBackup(const string& src, const string& dst, bool incremental = true) 
-        : manifest(dst), incrementalMode(incremental) {
+    IncrementalBackup(const string& src, const string& dst, bool incremental = true,
+                      int threads = DefaultWorkerCount(), bool mirror = false)
+        : manifest(dst), progress(dst, ".backup_progress.journal", paths), incrementalMode(incremental),
+          mirrorMode(mirror), resumeMode(false), trustDirectories(false), checkpointSeconds(RunProgress::DEFAULT_INTERVAL_SECONDS),
+          threadCount(threads), rootAccessible(true), changes(dst), scanAll(false), changesOnly(false) {
         sourcePath = NormalizePath(src);
         destPath = NormalizePath(dst);
     }
 
+    // Continue an interrupted run, and how often to checkpoint (0: never);
+    // call before StartBackup
+    void SetResume(bool resume, int intervalSeconds) {
+        resumeMode = resume;
+        checkpointSeconds = intervalSeconds;
+    }
+
+    // Take the files of unchanged directories as unchanged without a stat.
+    // Only safe where files are replaced (written elsewhere and renamed
+    // into place) rather than modified in place, since modifying a file
+    // does not change its directory's times.
+    void SetTrustDirectories(bool trust) {
+        trustDirectories = trust;
+    }
+
+    // Read every directory even if the change watcher saw all changes
+    void SetScanAll(bool scan) {
+        scanAll = scan;
+    }
+
     bool StartBackup() {
         cout << "========================================" << endl;
         cout << "  FILE BACKUP TOOL - Phase 2" << endl;
@@ -408,27 +1534,91 @@ public:
             cout << "Mode: FULL (no previous backup found)" << endl;
             incrementalMode = false;
         }
+        cout << "Threads: " << threadCount << endl;
+        if (mirrorMode) {
+            cout << "Mirror: deleted files are removed from the destination" << endl;
+        }
+        if (trustDirectories && incrementalMode) {
+            cout << "Trust: files of unchanged directories are not checked" << endl;
+        }
+        if (resumeMode && progress.Load(sourcePath)) {
+            cout << "Resume: " << progress.ResumedCount() << " directories done by the interrupted run" << endl;
+        } else if (resumeMode) {
+            cout << "Resume: no interrupted run of this source; backing up everything" << endl;
+        }
+
+        // Changes the watcher journaled since the last run. A resumed run
+        // and a full backup read everything anyway, which also covers them.
+        // The watcher is matched by the canonical source path, as it was
+        // claimed, not by how this run was given it.
+        vector<pair<char, string>> changed;
+        string reason;
+        ChangeJournal::Result watched = changes.Take(FileSystem::CanonicalPath(sourcePath), changed, reason);
+        if (watched == ChangeJournal::Result::Changes && incrementalMode && !resumeMode && !scanAll) {
+            size_t count = PlanChanges(changed);
+            changesOnly = true;
+            cout << "Changes: reading only the " << count << " directories changed since the last run" << endl;
+        } else if (watched == ChangeJournal::Result::FullScan && incrementalMode) {
+            cout << "Changes: reading everything, since " << reason << endl;
+        }
         
         cout << "========================================\n" << endl;
 
         // Verify source exists
-        DWORD attribs = GetFileAttributesA(sourcePath.c_str());
-        if (attribs == INVALID_FILE_ATTRIBUTES) {
+        FileInfo sourceInfo;
+        if (!FileSystem::GetInfo(sourcePath, sourceInfo)) {
             cerr << "ERROR: Source directory does not exist!" << endl;
             return false;
         }
-        if (!(attribs & FILE_ATTRIBUTE_DIRECTORY)) {
+        if (sourceInfo.type != EntryType::Directory) {
             cerr << "ERROR: Source path is not a directory!" << endl;
             return false;
         }
 
+        WalkTask root;
+        root.sourceParent = make_shared<Directory>();
+        if (!root.sourceParent->Open(sourcePath)) {
+            cerr << "ERROR: Cannot access directory: " << sourcePath << endl;
+            return false;
+        }
+
+        root.destParent = make_shared<Directory>();
+        if (!CreateDestDirectory(destPath) || !root.destParent->Open(destPath)) {
+            cerr << "ERROR: Cannot create directory: " << destPath << endl;
+            return false;
+        }
+        if (!manifest.BeginRun()) {
+            cerr << "WARNING: Cannot open the manifest journal; changes will not be saved" << endl;
+        }
+        // A checkpoint flushes the copies, then commits the manifest
+        // records for them, before directories are recorded as done
+        // (not for a changes-only run, which leaves most directories out;
+        // if it is interrupted, the next run reads its changes again)
+        destRoot.Open(destPath);
+        if (!progress.Begin(sourcePath, resumeMode, changesOnly ? 0 : checkpointSeconds,
+                            [this] { return destRoot.SyncFileSystem() && manifest.Sync(); })) {
+            cerr << "WARNING: Cannot open the progress journal; this run cannot be resumed" << endl;
+        }
+
         // Start backup
-        bool result = BackupDirectory(sourcePath, destPath);
-        
+        ParallelWalker walker(threadCount);
+        walker.Run(std::move(root), [this, &walker](WalkTask& task, int worker) {
+            ProcessTask(walker, task, worker);
+        });
+        bool result = rootAccessible;
+
         // Save updated manifest
-        if (!manifest.Save()) {
+        if (!progress.End()) {
+            cerr << "WARNING: Failed to checkpoint progress" << endl;
+        }
+        bool saved = manifest.Save();
+        if (!saved) {
             cerr << "WARNING: Failed to save manifest file" << endl;
         }
+        // The watcher's changes are done with once a run got through them
+        if (watched != ChangeJournal::Result::None && result && saved && stats.errors == 0) {
+            changes.Finish();
+        }
 
         // Print statistics
         PrintStats();
@@ -447,12 +1637,23 @@ public:
             cout << "  - New files:        " << stats.filesNew << endl;
             cout << "  - Modified files:   " << stats.filesModified << endl;
             cout << "Files skipped:        " << stats.filesSkipped << endl;
+            cout << "Files deleted:        " << stats.filesDeleted << endl;
+        }
+        if (mirrorMode) {
+            cout << "Files pruned:         " << stats.filesPruned << endl;
         }
         
         cout << "Directories created:  " << stats.directoriesCreated << endl;
+        if (incrementalMode) {
+            cout << "Directories unchanged: " << stats.directoriesUnchanged << endl;
+        }
+        if (resumeMode) {
+            cout << "Directories resumed:  " << stats.directoriesResumed << endl;
+        }
         cout << "Errors:               " << stats.errors << endl;
         cout << "Total size:           " << FormatBytes(stats.totalBytes) << endl;
         cout << "Bytes copied:         " << FormatBytes(stats.bytesCopied) << endl;
+        PrintCopyMethods();
         
         if (stats.totalBytes > 0) {
             double savedPercent = ((stats.totalBytes - stats.bytesCopied) * 100.0) / stats.totalBytes;
@@ -463,6 +1664,16 @@ public:
         cout << "========================================" << endl;
     }
 
+    // Bytes copied by each way of copying that was used
+    void PrintCopyMethods() {
+        for (int i = 0; i < COPY_METHOD_COUNT; i++) {
+            if (stats.bytesByMethod[i] > 0) {
+                string label = string("  - ") + CopyMethodName((CopyMethod)i) + ":";
+                cout << left << setw(22) << label << right << FormatBytes(stats.bytesByMethod[i]) << endl;
+            }
+        }
+    }
+
     string FormatBytes(long long bytes) {
         const char* units[] = {"B", "KB", "MB", "GB", "TB"};
         int unitIndex = 0;
@@ -479,20 +1690,195 @@ public:
     }
 };
 
+// Compare what two backups hold, going only into directories whose
+// digests differ. Returns 0 if they hold the same files.
+int CompareBackups(const string& firstPath, const string& secondPath) {
+    ManifestManager first(firstPath), second(secondPath);
+    if (!first.Load() || !second.Load()) {
+        cerr << "ERROR: Both paths must hold a backup with a manifest" << endl;
+        return 1;
+    }
+
+    // A directory's live files and its subdirectories, in name order
+    struct Listing {
+        vector<pair<string, FileMetadata>> files;
+        vector<string> subdirectories;
+    };
+    auto list = [](const ManifestManager& manifest, const string& directory, Listing& listing) {
+        manifest.ListDirectory(
+            directory,
+            [&](const char* name, size_t entry) {
+                if (!manifest.IsTombstone(entry)) {
+                    listing.files.push_back(make_pair(string(name), manifest.GetPrevious(entry)));
+                }
+            },
+            [&](const string& name, bool summarized) {
+                if (summarized) {
+                    listing.subdirectories.push_back(name);
+                }
+            });
+    };
+
+    int added = 0, removed = 0, changed = 0, identical = 0;
+    vector<string> directories(1, string());
+    while (!directories.empty()) {
+        string directory = std::move(directories.back());
+        directories.pop_back();
+        const DirectorySummary* a = first.FindDirectory(directory);
+        const DirectorySummary* b = second.FindDirectory(directory);
+        if (a && b && a->digest == b->digest) {
+            identical++;
+            continue;
+        }
+
+        Listing left, right;
+        list(first, directory, left);
+        list(second, directory, right);
+        size_t i = 0, j = 0;
+        while (i < left.files.size() || j < right.files.size()) {
+            int order = i == left.files.size() ? 1 : j == right.files.size() ? -1
+                                                   : left.files[i].first.compare(right.files[j].first);
+            if (order < 0) {
+                cout << "  [REMOVED] " << directory << left.files[i++].first << endl;
+                removed++;
+            } else if (order > 0) {
+                cout << "  [ADDED] " << directory << right.files[j++].first << endl;
+                added++;
+            } else {
+                const FileMetadata& x = left.files[i].second;
+                const FileMetadata& y = right.files[j].second;
+                if (x.hash != y.hash || x.size != y.size) {
+                    cout << "  [CHANGED] " << directory << left.files[i].first << endl;
+                    changed++;
+                }
+                i++;
+                j++;
+            }
+        }
+        i = j = 0;
+        while (i < left.subdirectories.size() || j < right.subdirectories.size()) {
+            int order = i == left.subdirectories.size() ? 1 : j == right.subdirectories.size() ? -1
+                                                             : left.subdirectories[i].compare(right.subdirectories[j]);
+            if (order < 0) {
+                cout << "  [REMOVED] " << directory << left.subdirectories[i++] << PATH_SEPARATOR << endl;
+                removed++;
+            } else if (order > 0) {
+                cout << "  [ADDED] " << directory << right.subdirectories[j++] << PATH_SEPARATOR << endl;
+                added++;
+            } else {
+                directories.push_back(directory + left.subdirectories[i] + PATH_SEPARATOR);
+                i++;
+                j++;
+            }
+        }
+    }
+
+    cout << "\nAdded: " << added << ", removed: " << removed << ", changed: " << changed
+         << " (" << identical << " directories identical)" << endl;
+    return added + removed + changed == 0 ? 0 : 1;
+}
+
+static volatile sig_atomic_t stopWatching = 0;
+
+static void StopWatching(int) {
+    stopWatching = 1;
+}
+
+// Journal the directories that change under source for the backups of it
+// in dest, so their runs read only those; runs until interrupted
+int WatchSource(const string& source, const string& dest) {
+    string sourcePath = FileSystem::CanonicalPath(NormalizePath(source));
+    ChangeJournal changes(dest);
+    if (!changes.Claim(sourcePath)) {
+        cerr << "ERROR: Cannot journal changes into " << dest
+             << " (it must hold a backup, and no other watcher may be running)" << endl;
+        return 1;
+    }
+    ChangeWatcher watcher;
+    cout << "Adding watches under " << sourcePath << endl;
+    if (!watcher.Open(sourcePath)) {
+        cerr << "ERROR: Cannot watch " << sourcePath << endl;
+        return 1;
+    }
+    if (!watcher.Complete()) {
+        cerr << "WARNING: Some directories cannot be watched (on Linux, raise fs.inotify.max_user_watches);"
+             << " backups will read everything" << endl;
+    }
+    signal(SIGINT, StopWatching);
+    signal(SIGTERM, StopWatching);
+    cout << "Watching " << sourcePath << " for the backup in " << NormalizePath(dest) << " (Ctrl+C to stop)"
+         << endl;
+
+    // Changes are journaled in groups, one fsync per group interval
+    auto report = [&changes](char kind, const string& path) { changes.Add(kind, path); };
+    const chrono::milliseconds interval((int)Journal::GROUP_INTERVAL_MS);
+    auto nextFlush = chrono::steady_clock::now();
+    bool failing = false;
+    while (!stopWatching) {
+        auto now = chrono::steady_clock::now();
+        if (now >= nextFlush) {
+            changes.SetIncomplete(!watcher.Complete());
+            bool ok = changes.Flush();
+            if (!ok && !failing) {
+                cerr << "WARNING: Cannot write the change journal; retrying" << endl;
+            }
+            failing = !ok;
+            nextFlush = now + interval;
+        }
+        watcher.Poll((int)chrono::duration_cast<chrono::milliseconds>(nextFlush - now).count(), report);
+    }
+    changes.SetIncomplete(!watcher.Complete());
+    if (!changes.Flush()) {
+        cerr << "ERROR: Cannot write the change journal" << endl;
+        return 1;
+    }
+    cout << "Stopped watching" << endl;
+    return 0;
+}
+
 int main(int argc, char* argv[]) {
     string source, dest;
     bool incremental = true;
+    int threads = DefaultWorkerCount();
+    bool mirror = false;
+    bool resume = false;
+    bool trust = false;
+    bool scan = false;
+    int checkpointSeconds = RunProgress::DEFAULT_INTERVAL_SECONDS;
+
+    // backup.exe --compare <backup_a> <backup_b>
+    if (argc >= 4 && string(argv[1]) == "--compare") {
+        return CompareBackups(argv[2], argv[3]);
+    }
+
+    // backup.exe --watch <source_path> <dest_path>
+    if (argc >= 4 && string(argv[1]) == "--watch") {
+        return WatchSource(argv[2], argv[3]);
+    }
     
     if (argc >= 3) {
         source = argv[1];
         dest = argv[2];
         
-        // Check for --full flag
+        // Check for --full, --mirror, --resume, --trust-directories and
+        // --scan flags and --threads and --checkpoint-interval options
         for (int i = 3; i < argc; i++) {
             string arg = argv[i];
             if (arg == "--full" || arg == "-f") {
                 incremental = false;
                 cout << "Full backup mode enabled.\n" << endl;
+            } else if (arg == "--mirror") {
+                mirror = true;
+            } else if (arg == "--resume") {
+                resume = true;
+            } else if (arg == "--trust-directories") {
+                trust = true;
+            } else if (arg == "--scan") {
+                scan = true;
+            } else if ((arg == "--threads" || arg == "-j") && i + 1 < argc) {
+                threads = atoi(argv[++i]);
+            } else if (arg == "--checkpoint-interval" && i + 1 < argc) {
+                checkpointSeconds = atoi(argv[++i]);
             }
         }
     } else {
@@ -510,13 +1896,21 @@ int main(int argc, char* argv[]) {
 
     if (source.empty() || dest.empty()) {
         cerr << "ERROR: Source and destination paths are required!" << endl;
-        cout << "\nUsage: backup.exe <source_path> <dest_path> [--full]" << endl;
+        cout << "\nUsage: backup.exe <source_path> <dest_path> [--full] [--mirror] [--threads N]" << endl;
+        cout << "       [--resume] [--checkpoint-interval SECONDS (0 = none)] [--trust-directories] [--scan]" << endl;
+        cout << "       backup.exe --compare <backup_a> <backup_b>" << endl;
+        cout << "       backup.exe --watch <source_path> <dest_path>" << endl;
         cout << "Example: backup.exe C:\\MyDocuments D:\\Backup" << endl;
         cout << "         backup.exe C:\\MyDocuments D:\\Backup --full" << endl;
+        cout << "         backup.exe C:\\MyDocuments D:\\Backup --mirror" << endl;
+        cout << "         backup.exe C:\\MyDocuments D:\\Backup --resume" << endl;
         return 1;
     }
 
-    IncrementalBackup backup(source, dest, incremental);
+    IncrementalBackup backup(source, dest, incremental, threads, mirror);
+    backup.SetResume(resume, checkpointSeconds);
+    backup.SetTrustDirectories(trust);
+    backup.SetScanAll(scan);
     bool success = backup.StartBackup();
     
     if (success) {
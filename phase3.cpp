@@ -1,195 +1,575 @@
-#include <windows.h>
-#include <wincrypt.h>
+#include "common/filesystem.h"
+#include "common/file_hasher.h"
+#include "common/digest.h"
+#include "common/record_file.h"
+#include "common/journal.h"
+#include "common/run_progress.h"
+#include "common/hash_cache.h"
+#include "common/digest_set.h"
+#include "common/store_layout.h"
+#include "common/pack_store.h"
+#include "common/chunker.h"
+#include "common/compression.h"
+#include "common/path_map.h"
+#include "common/path_arena.h"
+#include "common/console.h"
+#include "common/parallel_walker.h"
+#include "common/pipeline.h"
+#include <atomic>
+#include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <vector>
 #include <string>
-#include <map>
+#include <unordered_map>
 #include <fstream>
 #include <sstream>
 #include <iomanip>
+#include <algorithm>
 #include <ctime>
 
-#pragma comment(lib, "advapi32.lib")
-
-#ifndef CALG_SHA_256
-#define CALG_SHA_256 (ALG_CLASS_HASH | ALG_TYPE_ANY | ALG_SID_SHA_256)
-#define ALG_SID_SHA_256 12
-#endif
-
 using namespace std;
 
-// Statistics structure
+// Statistics structure (updated concurrently by the walker threads)
 struct BackupStats {
-    int filesProcessed = 0;
-    int filesSkipped = 0;
-    int filesCopied = 0;
-    int filesNew = 0;
-    int filesModified = 0;
-    int filesDeduped = 0;  // Files that shared existing content
-    int directoriesCreated = 0;
-    int errors = 0;
-    long long totalBytes = 0;
-    long long bytesCopied = 0;
-    long long bytesDeduplicated = 0;  // Space saved by deduplication
+    atomic<int> filesProcessed{0};
+    atomic<int> filesSkipped{0};
+    atomic<int> filesCopied{0};
+    atomic<int> filesNew{0};
+    atomic<int> filesModified{0};
+    atomic<int> filesDeduped{0};  // Files that shared existing content
+    atomic<int> filesUnchanged{0};  // Digest reused from the hash cache
+    atomic<int> filesPacked{0};  // New content appended to a pack file
+    atomic<int> filesChunked{0};  // Stored as content-defined chunks
+    atomic<int> directoriesCreated{0};
+    atomic<int> directoriesResumed{0};  // Passed over as done by the resumed run
+    atomic<int> errors{0};
+    atomic<long long> totalBytes{0};
+    atomic<long long> bytesCopied{0};
+    atomic<long long> bytesDeduplicated{0};  // Space saved by deduplication
+    atomic<long long> bytesByMethod[COPY_METHOD_COUNT] = {};  // bytesCopied by CopyMethod
 };
 
 // File metadata structure
 struct FileMetadata {
-    string hash;
+    Digest hash;
     long long size;
     time_t lastModified;
 };
 
-// SHA-256 Hasher Class
-class FileHasher {
-public:
-    static string CalculateHash(const string& filePath) {
-        HANDLE hFile = CreateFileA(
-            filePath.c_str(),
-            GENERIC_READ,
-            FILE_SHARE_READ,
-            NULL,
-            OPEN_EXISTING,
-            FILE_FLAG_SEQUENTIAL_SCAN,
-            NULL
-        );
-
-        if (hFile == INVALID_HANDLE_VALUE) {
-            return "";
-        }
-
-        HCRYPTPROV hProv = 0;
-        HCRYPTHASH hHash = 0;
-        
-        if (!CryptAcquireContext(&hProv, NULL, NULL, PROV_RSA_AES, CRYPT_VERIFYCONTEXT)) {
-            CloseHandle(hFile);
-            return "";
+// File found by the scanner, waiting to be hashed
+struct HashJob {
+    shared_ptr<Directory> sourceDir;
+    string fileName;
+    PathId directory = PathArena::ROOT;  // Relative to the source root
+};
+
+// What the store stage does with a hashed file
+enum class StoreKind {
+    Unchanged,  // Hash cache hit: the content is stored already
+    Staged,     // Commit the copy in the staging directory
+    Packed,     // Append the file's content to a pack
+    Chunked     // Chunks were stored while hashing; only index the file
+};
+
+// Hashed file waiting to be stored or referenced
+struct StoreJob {
+    shared_ptr<Directory> sourceDir;
+    string fileName;
+    PathId directory = PathArena::ROOT;
+    StoreKind kind = StoreKind::Unchanged;
+    Digest hash;         // Of the content, or of the chunk list if chunked
+    string stagingName;  // Copy of the content in the store's staging directory
+    CopyMethod method = CopyMethod::Buffered;  // How the staged copy was made
+    string content;      // Content of a file that goes into a pack
+    vector<Digest> chunks;    // Chunk list of a chunked file
+    long long newBytes = 0;   // Chunk bytes this file added to the store
+    long long size = 0;
+    HashCacheKey cacheKey;
+};
+
+// Queue capacities between the pipeline stages
+const size_t HASH_QUEUE_CAPACITY = 4096;
+const size_t STORE_QUEUE_CAPACITY = 1024;
+
+// Outcome of committing staged content to the store
+enum class StoreResult {
+    Stored,         // New content
+    AlreadyStored,  // Duplicate of existing content
+    Failed
+};
+
+// Deduplication Store Class
+class DeduplicationStore {
+private:
+    string rootPath;   // Backup root
+    string storePath;  // Path to .dedup_store folder
+    string stagingPath;  // .dedup_store/.staging, for content being written
+    string catalogPath;  // .dedup_catalog.bin, digests present in the store
+    Directory rootDir;
+    Directory storeDir;
+    Directory stagingDir;
+    unordered_map<Digest, int> referenceCount;  // Track how many files point to each hash
+    atomic<long long> nextStagingId;
+    mutex storeLock;
+    DigestSet contents;  // Digests present in .dedup_store
+    shared_timed_mutex contentsLock;  // Hashers look up, writers insert
+    StoreLayout layout;
+    bool migrationPending;
+    PackStore packs;  // .dedup_store/packs, for small blobs
+    mutex packLock;   // Orders the existence check before a pack append
+    Codec codec;      // For new packed content
+    int compressionLevel;
+    atomic<long long> compressedInput;   // Packed content that was compressed...
+    atomic<long long> compressedOutput;  // ...and what it took up in the pack
+
+    // Catalog format: "BKCATLG2", store fingerprint (i64), then one
+    // 32-byte digest per stored blob. Any blob created, renamed or removed
+    // changes the mtime of its directory and so the fingerprint, so a
+    // catalog whose fingerprint still matches describes the store exactly.
+    // Packs are covered by the mtime of the pack directory, which every
+    // new pack or rewritten index changes.
+    static const char* CatalogMagic() { return "BKCATLG2"; }
+
+    // Layout file format: "BKLAYOT1", fan-out levels (u32), migration in
+    // progress (u32)
+    static const char* LayoutMagic() { return "BKLAYOT1"; }
+
+    bool LoadLayout(uint32_t& levels, uint32_t& migrating) {
+        RecordReader reader;
+        return reader.Open(storePath + ".layout", LayoutMagic()) &&
+               reader.GetU32(levels) && reader.GetU32(migrating);
+    }
+
+    bool SaveLayout(uint32_t levels, bool migrating) {
+        RecordWriter writer;
+        if (!writer.Open(storePath + ".layout", LayoutMagic())) {
+            return false;
         }
+        writer.PutU32(levels);
+        writer.PutU32(migrating ? 1 : 0);
+        return writer.Close();
+    }
 
-        if (!CryptCreateHash(hProv, CALG_SHA_256, 0, 0, &hHash)) {
-            CryptReleaseContext(hProv, 0);
-            CloseHandle(hFile);
-            return "";
+    // Whether the store holds any blob or fan-out directory yet
+    bool HasBlobs() {
+        DirectoryReader reader(storeDir);
+        DirEntry entry;
+        Digest digest;
+        while (reader.Next(entry)) {
+            if (StoreLayout::IsFanoutName(entry.name, entry.nameLength) ||
+                StoreLayout::ParseBlobName(entry.name, entry.nameLength, digest)) {
+                return true;
+            }
         }
+        return false;
+    }
 
-        const DWORD BUFFER_SIZE = 8192;
-        BYTE buffer[BUFFER_SIZE];
-        DWORD bytesRead = 0;
+    uint64_t Fingerprint() {
+        FileInfo info;
+        uint64_t packsTime = FileSystem::GetInfo(storePath + "packs", info) ? (uint64_t)info.mtimeNs : 0;
+        return StoreLayout::Fingerprint(storeDir, storePath) ^ (packsTime * 0x9e3779b97f4a7c15ULL);
+    }
+
+    bool LoadCatalog() {
+        RecordReader reader;
+        int64_t fingerprint;
+        if (!reader.Open(catalogPath, CatalogMagic()) || !reader.GetI64(fingerprint) ||
+            (uint64_t)fingerprint != Fingerprint()) {
+            return false;
+        }
+
+        Digest digest;
+        while (!reader.AtEnd()) {
+            if (!reader.GetDigest(digest)) {
+                contents.Clear();
+                return false;
+            }
+            contents.Insert(digest);
+        }
+        return true;
+    }
 
-        while (ReadFile(hFile, buffer, BUFFER_SIZE, &bytesRead, NULL) && bytesRead > 0) {
-            if (!CryptHashData(hHash, buffer, bytesRead, 0)) {
-                CryptDestroyHash(hHash);
-                CryptReleaseContext(hProv, 0);
-                CloseHandle(hFile);
-                return "";
+    // Rebuild the set from the blob file names and the pack indexes
+    void ScanStore() {
+        contents.Clear();
+        DigestSet& set = contents;
+        StoreLayout::ForEachBlob(storeDir, [&set](const string&, const Digest& digest) {
+            set.Insert(digest);
+        });
+        packs.ForEachDigest([&set](const Digest& digest) { set.Insert(digest); });
+    }
+
+    // Remove staged files left behind by an interrupted run
+    void ClearStaging() {
+        DirectoryReader reader(stagingDir);
+        DirEntry entry;
+        while (reader.Next(entry)) {
+            if (!IsDotEntry(entry.name)) {
+                stagingDir.RemoveChild(entry.name);
             }
         }
+    }
 
-        BYTE hashResult[32];
-        DWORD hashLen = 32;
+public:
+    DeduplicationStore(const string& backupRoot)
+        : nextStagingId(0), migrationPending(false), codec(Codec::None),
+          compressionLevel(Compressor::DEFAULT_ZSTD_LEVEL), compressedInput(0), compressedOutput(0) {
+        // Ensure backupRoot ends with a separator
+        rootPath = NormalizePath(backupRoot);
+        storePath = rootPath + ".dedup_store" + PATH_SEPARATOR;
+        stagingPath = storePath + ".staging" + PATH_SEPARATOR;
+        catalogPath = rootPath + ".dedup_catalog.bin";
+    }
+
+    // Initialize store - create .dedup_store folder if needed. A new store
+    // gets fanoutLevels levels of fan-out (-1: the default); an existing
+    // one keeps its layout until it is migrated. New packs are started
+    // once the current one reaches packSize bytes.
+    bool Initialize(int fanoutLevels = -1, long long packSize = PackStore::DEFAULT_PACK_SIZE) {
+        // First, make sure the backup root exists
+        MkdirResult parentResult = FileSystem::MakeDirectory(rootPath);
+        if (parentResult != MkdirResult::Created && parentResult != MkdirResult::AlreadyExists) {
+            cerr << "ERROR: Cannot create parent directory: " << rootPath << endl;
+            return false;
+        }
         
-        if (!CryptGetHashParam(hHash, HP_HASHVAL, hashResult, &hashLen, 0)) {
-            CryptDestroyHash(hHash);
-            CryptReleaseContext(hProv, 0);
-            CloseHandle(hFile);
-            return "";
+        // Create .dedup_store directory
+        MkdirResult result = FileSystem::MakeDirectory(storePath);
+        if (result != MkdirResult::Created && result != MkdirResult::AlreadyExists) {
+            cerr << "ERROR: Cannot create dedup store: " << storePath
+                 << " (" << FileSystem::LastErrorString() << ")" << endl;
+            return false;
         }
 
-        stringstream ss;
-        for (DWORD i = 0; i < hashLen; i++) {
-            ss << hex << setw(2) << setfill('0') << (int)hashResult[i];
+        if (!storeDir.Open(storePath)) {
+            cerr << "ERROR: Cannot open dedup store: " << storePath << endl;
+            return false;
         }
 
-        CryptDestroyHash(hHash);
-        CryptReleaseContext(hProv, 0);
-        CloseHandle(hFile);
+        // Staging lives inside the store so commits are same-volume renames
+        result = FileSystem::MakeDirectory(stagingPath);
+        if ((result != MkdirResult::Created && result != MkdirResult::AlreadyExists) ||
+            !stagingDir.Open(stagingPath)) {
+            cerr << "ERROR: Cannot create staging directory: " << stagingPath
+                 << " (" << FileSystem::LastErrorString() << ")" << endl;
+            return false;
+        }
+        ClearStaging();
 
-        return ss.str();
-    }
-};
+        if (!rootDir.Open(rootPath)) {
+            cerr << "ERROR: Cannot open backup root: " << rootPath << endl;
+            return false;
+        }
 
-// Deduplication Store Class
-class DeduplicationStore {
-private:
-    string storePath;  // Path to .dedup_store folder
-    map<string, int> referenceCount;  // Track how many files point to each hash
+        if (!packs.Open(storePath + "packs", packSize)) {
+            cerr << "ERROR: Cannot open pack directory: " << storePath << "packs"
+                 << " (" << FileSystem::LastErrorString() << ")" << endl;
+            return false;
+        }
 
-public:
-    DeduplicationStore(const string& backupRoot) {
-        // Ensure backupRoot ends with backslash
-        string root = backupRoot;
-        if (!root.empty() && root.back() != '\\') {
-            root += '\\';
+        uint32_t levels, migrating = 0;
+        if (!LoadLayout(levels, migrating)) {
+            // Stores from before fan-out are flat
+            levels = HasBlobs() ? 0 : (fanoutLevels < 0 ? StoreLayout::DEFAULT_LEVELS : fanoutLevels);
+            if (!SaveLayout(levels, false)) {
+                cerr << "ERROR: Cannot write store layout: " << storePath << ".layout" << endl;
+                return false;
+            }
+        }
+        layout = StoreLayout((int)levels);
+        migrationPending = migrating != 0;
+        if (fanoutLevels >= 0 && fanoutLevels != layout.Levels()) {
+            cout << "NOTE: Store uses " << layout.Levels() << " fan-out levels; "
+                 << "run --migrate-store to change it" << endl;
         }
-        storePath = root + ".dedup_store\\";
+
+        return true;
     }
 
-    // Initialize store - create .dedup_store folder if needed
-    bool Initialize() {
-        // First, check if parent directory exists
-        string parentPath = storePath.substr(0, storePath.length() - 14); // Remove ".dedup_store\"
-        
-        DWORD parentAttribs = GetFileAttributesA(parentPath.c_str());
-        if (parentAttribs == INVALID_FILE_ATTRIBUTES) {
-            // Parent directory doesn't exist - create it
-            if (!CreateDirectoryA(parentPath.c_str(), NULL)) {
-                DWORD error = GetLastError();
-                if (error != ERROR_ALREADY_EXISTS) {
-                    cerr << "ERROR: Cannot create parent directory: " << parentPath << endl;
-                    return false;
-                }
-            }
+    // Load the set of stored digests from the catalog, or from the blob
+    // directories if the catalog is missing or out of date
+    void LoadContents() {
+        if (!LoadCatalog()) {
+            cout << "Rebuilding store catalog from " << storePath << endl;
+            ScanStore();
         }
-        
-        // Check if .dedup_store already exists
-        DWORD attribs = GetFileAttributesA(storePath.c_str());
-        if (attribs != INVALID_FILE_ATTRIBUTES && (attribs & FILE_ATTRIBUTE_DIRECTORY)) {
-            return true;  // Already exists
+    }
+
+    // An interrupted migration must be finished before the store is used
+    bool IsMigrationPending() const {
+        return migrationPending;
+    }
+
+    int GetFanoutLevels() const {
+        return layout.Levels();
+    }
+
+    // Move every blob to where a layout with `levels` fan-out levels puts
+    // it, in place. The layout file marks the migration as in progress
+    // until every blob has moved, so an interrupted migration is simply
+    // run again.
+    bool MigrateLayout(int levels, size_t& moved) {
+        StoreLayout target(levels);
+        if (!SaveLayout(target.Levels(), true)) {
+            cerr << "ERROR: Cannot write store layout: " << storePath << ".layout" << endl;
+            return false;
         }
+        migrationPending = true;
+
+        vector<pair<string, Digest>> blobs;
+        StoreLayout::ForEachBlob(storeDir, [&blobs](const string& name, const Digest& digest) {
+            blobs.emplace_back(name, digest);
+        });
+
+        contents.Clear();
+        int errors = 0;
+        for (const auto& blob : blobs) {
+            contents.Insert(blob.second);
+            string name = target.BlobName(blob.second);
+            if (name == blob.first) {
+                continue;
+            }
 
-        // Create .dedup_store directory
-        if (!CreateDirectoryA(storePath.c_str(), NULL)) {
-            DWORD error = GetLastError();
-            if (error == ERROR_ALREADY_EXISTS) {
-                return true;  // That's okay
+            RenameResult result = target.MakeParents(storeDir, blob.second)
+                ? storeDir.RenameChildNoReplace(blob.first.c_str(), storeDir, name.c_str())
+                : RenameResult::Failed;
+            if (result == RenameResult::Renamed) {
+                moved++;
+            } else if (result == RenameResult::TargetExists) {
+                // Same name, same content: the copy in place wins
+                storeDir.RemoveChild(blob.first.c_str());
+            } else {
+                cerr << "ERROR: Cannot move " << storePath << blob.first
+                     << " (" << FileSystem::LastErrorString() << ")" << endl;
+                errors++;
             }
-            cerr << "ERROR: Cannot create dedup store: " << storePath << " (Error: " << error << ")" << endl;
+        }
+        DigestSet& set = contents;
+        packs.ForEachDigest([&set](const Digest& digest) { set.Insert(digest); });
+        StoreLayout::RemoveEmptyDirectories(storeDir, target.Levels());
+
+        if (errors > 0 || !SaveLayout(target.Levels(), false)) {
             return false;
         }
+        layout = std::move(target);
+        migrationPending = false;
+        return SaveCatalog();
+    }
 
+    // Write the catalog for the next run. Written to a temporary name
+    // first so an interrupted save leaves no partial catalog behind.
+    bool SaveCatalog() {
+        string tempName = ".dedup_catalog.bin.tmp";
+        RecordWriter writer;
+        if (!writer.Open(rootPath + tempName, CatalogMagic())) {
+            return false;
+        }
+        shared_lock<shared_timed_mutex> lock(contentsLock);
+        writer.PutI64((int64_t)Fingerprint());
+        contents.ForEach([&writer](const Digest& digest) { writer.PutDigest(digest); });
+        if (!writer.Close() || !rootDir.RenameChild(tempName.c_str(), rootDir, ".dedup_catalog.bin")) {
+            rootDir.RemoveChild(tempName.c_str());
+            return false;
+        }
         return true;
     }
 
+    // Get file name for content, relative to the store directory
+    string GetContentName(const Digest& hash) {
+        return layout.BlobName(hash);
+    }
+
     // Get path for storing content by hash
-    string GetContentPath(const string& hash) {
-        return storePath + hash + ".bin";
+    string GetContentPath(const Digest& hash) {
+        return storePath + GetContentName(hash);
     }
 
-    // Check if content already exists
-    bool ContentExists(const string& hash) {
-        string contentPath = GetContentPath(hash);
-        DWORD attribs = GetFileAttributesA(contentPath.c_str());
-        return (attribs != INVALID_FILE_ATTRIBUTES && !(attribs & FILE_ATTRIBUTE_DIRECTORY));
+    // Check if content already exists (in memory, no filesystem access)
+    bool ContentExists(const Digest& hash) {
+        shared_lock<shared_timed_mutex> lock(contentsLock);
+        return contents.Contains(hash);
     }
 
-    // Store file content by hash (copy file to .dedup_store)
-    bool StoreContent(const string& sourceFile, const string& hash) {
-        string destPath = GetContentPath(hash);
+    size_t GetContentCount() {
+        shared_lock<shared_timed_mutex> lock(contentsLock);
+        return contents.Size();
+    }
 
-        if (CopyFileA(sourceFile.c_str(), destPath.c_str(), FALSE)) {
-            referenceCount[hash] = 1;
-            return true;
+    // Directory that new content is written to before it is committed
+    const Directory& GetStagingDir() const {
+        return stagingDir;
+    }
+
+    // Unique file name within the staging directory
+    string CreateStagingName() {
+        return to_string(nextStagingId++) + ".tmp";
+    }
+
+    // Move a staged file to its content name. If the content is already
+    // stored (by an earlier run or another thread) the staged copy is
+    // dropped and the existing content gets a new reference.
+    StoreResult CommitContent(const string& stagingName, const Digest& hash) {
+        RenameResult result = layout.MakeParents(storeDir, hash)
+            ? stagingDir.RenameChildNoReplace(stagingName.c_str(), storeDir, GetContentName(hash).c_str())
+            : RenameResult::Failed;
+        if (result != RenameResult::Renamed) {
+            stagingDir.RemoveChild(stagingName.c_str());
+        }
+        if (result == RenameResult::Failed) {
+            return StoreResult::Failed;
         }
 
-        return false;
+        {
+            lock_guard<shared_timed_mutex> lock(contentsLock);
+            contents.Insert(hash);
+        }
+        lock_guard<mutex> lock(storeLock);
+        referenceCount[hash]++;
+        return result == RenameResult::Renamed ? StoreResult::Stored : StoreResult::AlreadyStored;
+    }
+
+    // Compress content appended to packs from now on; not thread-safe,
+    // call before the backup starts
+    void SetCompression(Codec newCodec, int level) {
+        codec = newCodec;
+        compressionLevel = level;
+    }
+
+    bool IsCompressing() const {
+        return codec != Codec::None;
+    }
+
+    Codec GetCodec() const { return codec; }
+
+    long long GetCompressedInput() const { return compressedInput; }
+    long long GetCompressedOutput() const { return compressedOutput; }
+
+    // Append the content of a small file or a chunk to a pack, unless it
+    // is stored already. With compression on, content that does not look
+    // compressed already is compressed first, outside the pack lock; the
+    // codec goes into the record's flags.
+    StoreResult CommitPacked(const Digest& hash, const void* data, size_t size) {
+        StoreResult result = StoreResult::AlreadyStored;
+        thread_local string compressed;
+        bool isCompressed = codec != Codec::None && !ContentExists(hash) &&
+                            !Compressor::LooksCompressed(data, size) &&
+                            Compressor::Compress(codec, compressionLevel, data, size, compressed);
+        {
+            lock_guard<mutex> lock(packLock);
+            if (!ContentExists(hash)) {
+                bool appended = isCompressed
+                    ? packs.Append(hash, compressed.data(), compressed.size(), (uint32_t)codec)
+                    : packs.Append(hash, data, size);
+                if (!appended) {
+                    return StoreResult::Failed;
+                }
+                lock_guard<shared_timed_mutex> contentsGuard(contentsLock);
+                contents.Insert(hash);
+                result = StoreResult::Stored;
+            }
+        }
+        if (result == StoreResult::Stored && isCompressed) {
+            compressedInput += (long long)size;
+            compressedOutput += (long long)compressed.size();
+        }
+        lock_guard<mutex> lock(storeLock);
+        referenceCount[hash]++;
+        return result;
+    }
+
+    // Write out the open pack and its index; before SaveCatalog, whose
+    // fingerprint covers the pack directory
+    bool FlushPacks() {
+        return packs.Close();
+    }
+
+    // Write out buffered pack data, so a sync of the filesystem covers it
+    bool FlushPackBuffer() {
+        return packs.Flush();
+    }
+
+    // Write stored content to a new file, from a pack or a blob file.
+    // LoadPackLocations must have been called.
+    bool RestoreContent(const Digest& hash, const Directory& targetDir, const char* name) {
+        PackLocation location;
+        if (!packs.Find(hash, location)) {
+            return FileSystem::Copy(storeDir, GetContentName(hash).c_str(), targetDir, name);
+        }
+
+        string data;
+        File target;
+        if (!ReadPacked(location, data) || !target.Create(targetDir, name)) {
+            return false;
+        }
+        bool ok = target.WriteAll(data.data(), data.size());
+        ok = target.Finish() && ok;
+        if (!ok) {
+            targetDir.RemoveChild(name);
+        }
+        return ok;
+    }
+
+    // Write a chunked file by concatenating its chunks
+    bool RestoreChunks(const vector<Digest>& chunks, const Directory& targetDir, const char* name) {
+        File target;
+        if (!target.Create(targetDir, name)) {
+            return false;
+        }
+        string data;
+        bool ok = true;
+        for (size_t i = 0; ok && i < chunks.size(); i++) {
+            ok = ReadContent(chunks[i], data) && target.WriteAll(data.data(), data.size());
+        }
+        ok = target.Finish() && ok;
+        if (!ok) {
+            targetDir.RemoveChild(name);
+        }
+        return ok;
+    }
+
+    // Read packed content and undo its compression
+    bool ReadPacked(const PackLocation& location, string& data) {
+        if (location.flags == 0) {
+            return packs.Read(location, data);
+        }
+        thread_local string stored;
+        return packs.Read(location, stored) &&
+               Compressor::Decompress((Codec)location.flags, stored.data(), stored.size(), data);
+    }
+
+    // Read stored content into memory, from a pack or a blob file
+    bool ReadContent(const Digest& hash, string& data) {
+        PackLocation location;
+        if (packs.Find(hash, location)) {
+            return ReadPacked(location, data);
+        }
+
+        File file;
+        FileInfo info;
+        if (!file.OpenRead(storeDir, GetContentName(hash).c_str()) || !file.GetInfo(info)) {
+            return false;
+        }
+        data.resize((size_t)info.size);
+        return info.size == 0 || file.ReadAt(&data[0], data.size(), 0);
+    }
+
+    void LoadPackLocations() {
+        packs.LoadLocations();
     }
 
     // Increment reference count (file points to this hash)
-    void IncrementReference(const string& hash) {
+    void IncrementReference(const Digest& hash) {
+        lock_guard<mutex> lock(storeLock);
         referenceCount[hash]++;
     }
 
     // Get reference count for a hash
-    int GetReferenceCount(const string& hash) {
+    int GetReferenceCount(const Digest& hash) {
+        lock_guard<mutex> lock(storeLock);
         auto it = referenceCount.find(hash);
         if (it != referenceCount.end()) {
             return it->second;
@@ -197,12 +577,21 @@ public:
         return 0;
     }
 
-    // Load reference counts from store
-    void LoadReferenceCountsFromIndex(const map<string, string>& fileHashMap) {
+    // Load reference counts from store. Chunked files reference their
+    // chunks rather than their own digest.
+    void LoadReferenceCountsFromIndex(const PathMap<Digest>& fileHashMap,
+                                      const PathMap<vector<Digest>>& fileChunks) {
         referenceCount.clear();
-        for (const auto& entry : fileHashMap) {
-            referenceCount[entry.second]++;
-        }
+        fileHashMap.ForEach([&](const PathMap<Digest>::Entry& entry) {
+            const vector<Digest>* chunks = fileChunks.Find(entry.key, entry.keySize);
+            if (!chunks) {
+                referenceCount[entry.value]++;
+                return;
+            }
+            for (const Digest& chunk : *chunks) {
+                referenceCount[chunk]++;
+            }
+        });
     }
 
     // Get store path for public use
@@ -214,86 +603,294 @@ public:
 // Deduplication Index Class
 class DeduplicationIndex {
 private:
-    map<string, string> fileHashMap;  // filepath → hash
+    PathArena& paths;  // Directories of the indexed files
+    PathMap<Digest> fileHashMap;  // FileKey(directory, name) → hash
+    PathMap<vector<Digest>> fileChunks;  // FileKey(directory, name) → chunks, for chunked files
+    string rootPath;
     string indexPath;
+    string legacyPath;  // Text index written by earlier versions
+    mutex indexLock;  // Walker threads add files concurrently
+    Journal journal;  // Files added or changed since the index file was written
+    uint64_t journalLoaded;
+    bool rewrite;  // The index file must be rewritten (an older format)
+
+    // Key of a file in the calling thread's buffer
+    static const string& Key(PathId directory, const string& name) {
+        thread_local string key;
+        PathArena::FileKey(directory, name.data(), name.size(), key);
+        return key;
+    }
 
-public:
-    DeduplicationIndex(const string& backupRoot) {
-        // Ensure backupRoot ends with backslash
-        string root = backupRoot;
-        if (!root.empty() && root.back() != '\\') {
-            root += '\\';
+    // Key of a file listed by its path relative to the source root
+    const string& KeyOfPath(const string& filepath) {
+        size_t nameStart;
+        PathId directory = paths.InternParent(filepath, nameStart);
+        thread_local string key;
+        PathArena::FileKey(directory, filepath.data() + nameStart, filepath.size() - nameStart, key);
+        return key;
+    }
+
+    // Binary format: "BKDINDX2", then per file
+    // path (u32 length + bytes), digest (32 bytes), chunk count (u32),
+    // chunk digests (32 bytes each; none unless the file is chunked).
+    // "BKDINDX1" indexes lack the chunk count.
+    static const char* Magic() { return "BKDINDX2"; }
+    static const char* MagicVersion1() { return "BKDINDX1"; }
+
+    // Journal records have the layout of BKDINDX2 entries
+    static const char* JournalName() { return ".dedup_index.journal"; }
+    static const char* JournalMagic() { return "BKDJRNL1"; }
+
+    // Read one entry; chunks is left empty for a file stored whole
+    static bool GetEntry(RecordReader& reader, bool hasChunks, string& filepath, Digest& hash,
+                         vector<Digest>& chunks) {
+        uint32_t chunkCount = 0;
+        bool ok = reader.GetString(filepath) && reader.GetDigest(hash) && (!hasChunks || reader.GetU32(chunkCount));
+        chunks.resize(ok ? chunkCount : 0);
+        for (uint32_t i = 0; ok && i < chunkCount; i++) {
+            ok = reader.GetDigest(chunks[i]);
         }
-        indexPath = root + ".dedup_index.txt";
+        return ok;
     }
 
-    // Load index from file
-    bool Load() {
-        ifstream file(indexPath);
+    void SetEntry(const string& key, const Digest& hash, const vector<Digest>& chunks) {
+        fileHashMap[key] = hash;
+        if (chunks.empty()) {
+            fileChunks.Erase(key);
+        } else {
+            fileChunks[key] = chunks;
+        }
+    }
+
+    // Write the whole index under a temporary name and rename it over the
+    // index file
+    bool WriteIndex() {
+        string tempPath = indexPath + ".tmp";
+        RecordWriter writer;
+        if (!writer.Open(tempPath, Magic())) {
+            return false;
+        }
+
+        string path;
+        for (const PathMap<Digest>::Entry* entry : GetSortedFiles()) {
+            path.clear();
+            paths.AppendPath(PathArena::KeyParent(entry->key), path);
+            path.append(PathArena::KeyName(entry->key), entry->keySize - 4);
+            writer.PutString(path.data(), path.size());
+            writer.PutDigest(entry->value);
+            const vector<Digest>* chunks = fileChunks.Find(entry->key, entry->keySize);
+            if (!chunks) {
+                writer.PutU32(0);
+                continue;
+            }
+            writer.PutU32((uint32_t)chunks->size());
+            for (const Digest& chunk : *chunks) {
+                writer.PutDigest(chunk);
+            }
+        }
+
+        Directory root;
+        if (!writer.Close(true) || !root.Open(rootPath) ||
+            !root.RenameChild(".dedup_index.bin.tmp", root, ".dedup_index.bin")) {
+            FileSystem::RemoveFile(tempPath);
+            return false;
+        }
+        return true;
+    }
+
+    // Load an index in the old "filepath|hash" text format
+    bool LoadLegacy() {
+        ifstream file(legacyPath);
         if (!file.is_open()) {
             return false;
         }
 
-        fileHashMap.clear();
         string line;
-
         while (getline(file, line)) {
             if (line.empty()) continue;
 
             size_t pos = line.find('|');
-            if (pos != string::npos) {
-                string filepath = line.substr(0, pos);
-                string hash = line.substr(pos + 1);
-                fileHashMap[filepath] = hash;
+            Digest hash;
+            if (pos != string::npos && Digest::FromHex(line.data() + pos + 1, line.size() - pos - 1, hash)) {
+                fileHashMap[KeyOfPath(line.substr(0, pos))] = hash;
             }
         }
-
-        file.close();
         return true;
     }
 
-    // Save index to file
+public:
+    DeduplicationIndex(const string& backupRoot, PathArena& pathArena)
+        : paths(pathArena), journalLoaded(0), rewrite(false) {
+        rootPath = NormalizePath(backupRoot);
+        indexPath = rootPath + ".dedup_index.bin";
+        legacyPath = rootPath + ".dedup_index.txt";
+    }
+
+    // Load the index file, then replay the journal over it
+    bool Load() {
+        fileHashMap.Clear();
+        fileChunks.Clear();
+        journalLoaded = 0;
+        rewrite = false;
+
+        RecordReader reader;
+        bool hasChunks = reader.Open(indexPath, Magic());
+        bool found = true;
+        if (!hasChunks && !reader.Open(indexPath, MagicVersion1())) {
+            found = LoadLegacy();
+            rewrite = found;
+        } else {
+            rewrite = !hasChunks;
+            string filepath;
+            Digest hash;
+            vector<Digest> chunks;
+            while (!reader.AtEnd()) {
+                if (!GetEntry(reader, hasChunks, filepath, hash, chunks)) {
+                    cerr << "WARNING: Index is truncated, ignoring the rest" << endl;
+                    break;
+                }
+                SetEntry(KeyOfPath(filepath), hash, chunks);
+            }
+        }
+
+        Directory root;
+        if (root.Open(rootPath)) {
+            string filepath;
+            Digest hash;
+            vector<Digest> chunks;
+            journalLoaded = Journal::Replay(root, JournalName(), JournalMagic(), [&](const char* data, size_t size) {
+                reader.Assign(data, size);
+                if (GetEntry(reader, true, filepath, hash, chunks)) {
+                    SetEntry(KeyOfPath(filepath), hash, chunks);
+                }
+            });
+        }
+        return found || journalLoaded > 0;
+    }
+
+    // Start journaling changes; the destination must exist. Records are
+    // written by Sync only, so none is on the device before the content
+    // it refers to.
+    bool BeginRun() {
+        Directory root;
+        return root.Open(rootPath) && journal.Open(root, JournalName(), JournalMagic(), journalLoaded, false);
+    }
+
+    // Wait until the changes recorded so far are on the device
+    bool Sync() {
+        return journal.Sync();
+    }
+
+    // Commit the journal. The index file is rewritten (and the journal
+    // emptied) when the journal has grown past its threshold or the index
+    // is in an older format; the index is in memory by then, so this is
+    // the one full write.
     bool Save() {
-        ofstream file(indexPath);
-        if (!file.is_open()) {
+        uint64_t journalBytes = journal.Size();
+        if (!journal.Close()) {
             return false;
         }
-
-        for (const auto& entry : fileHashMap) {
-            file << entry.first << "|" << entry.second << "\n";
+        FileInfo info;
+        uint64_t indexBytes = FileSystem::GetInfo(indexPath, info) ? (uint64_t)info.size : 0;
+        if (!rewrite && !Journal::ShouldCompact(journalBytes, indexBytes) && (indexBytes > 0 || journalBytes <= 8)) {
+            return true;
         }
 
-        file.close();
+        Directory root;
+        if (!WriteIndex() || !root.Open(rootPath) || !Journal::Rewrite(root, JournalName(), JournalMagic(), 8, 8)) {
+            return false;
+        }
+        rewrite = false;
+        // The binary index supersedes the text one
+        FileSystem::RemoveFile(legacyPath);
         return true;
     }
 
-    // Add file to index
-    void AddFile(const string& filepath, const string& hash) {
-        fileHashMap[filepath] = hash;
+    // Add file to index, with its chunk list if it is chunked. A file
+    // whose entry is unchanged is not journaled again.
+    void AddFile(PathId directory, const string& name, const Digest& hash,
+                 const vector<Digest>& chunks = vector<Digest>()) {
+        const string& key = Key(directory, name);
+        {
+            lock_guard<mutex> lock(indexLock);
+            const Digest* previous = fileHashMap.Find(key);
+            const vector<Digest>* previousChunks = fileChunks.Find(key);
+            if (previous && *previous == hash &&
+                (previousChunks ? *previousChunks == chunks : chunks.empty())) {
+                return;
+            }
+            SetEntry(key, hash, chunks);
+        }
+
+        thread_local RecordBuffer record;
+        thread_local string path;
+        path.clear();
+        paths.AppendPath(directory, path);
+        path += name;
+        record.Clear();
+        record.PutString(path);
+        record.PutDigest(hash);
+        record.PutU32((uint32_t)chunks.size());
+        for (const Digest& chunk : chunks) {
+            record.PutDigest(chunk);
+        }
+        journal.Append(record.Data());
     }
 
-    // Get hash for file
-    string GetHash(const string& filepath) {
-        auto it = fileHashMap.find(filepath);
-        if (it != fileHashMap.end()) {
-            return it->second;
+    // Chunk list of a chunked file; false if the file is not indexed or
+    // is stored whole
+    bool GetChunks(PathId directory, const string& name, vector<Digest>& chunks) {
+        const string& key = Key(directory, name);
+        lock_guard<mutex> lock(indexLock);
+        const vector<Digest>* found = fileChunks.Find(key);
+        if (!found) {
+            return false;
         }
-        return "";
+        chunks = *found;
+        return true;
+    }
+
+    // Get hash for file; empty if the file is not indexed
+    Digest GetHash(PathId directory, const string& name) {
+        const string& key = Key(directory, name);
+        lock_guard<mutex> lock(indexLock);
+        const Digest* hash = fileHashMap.Find(key);
+        return hash ? *hash : Digest();
     }
 
     // Check if file exists in index
-    bool HasFile(const string& filepath) {
-        return fileHashMap.find(filepath) != fileHashMap.end();
+    bool HasFile(PathId directory, const string& name) {
+        const string& key = Key(directory, name);
+        lock_guard<mutex> lock(indexLock);
+        return fileHashMap.Find(key) != nullptr;
     }
 
     // Get all files (for loading reference counts)
-    const map<string, string>& GetAllFiles() {
+    const PathMap<Digest>& GetAllFiles() {
         return fileHashMap;
     }
 
+    const PathMap<vector<Digest>>& GetAllChunkLists() {
+        return fileChunks;
+    }
+
+    // Files in path order, grouped by directory (keys are FileKeys)
+    vector<const PathMap<Digest>::Entry*> GetSortedFiles() {
+        vector<uint32_t> ranks = paths.Ranks();
+        return fileHashMap.Sorted([&ranks](const PathMap<Digest>::Entry* a, const PathMap<Digest>::Entry* b) {
+            uint32_t rankA = ranks[PathArena::KeyParent(a->key)], rankB = ranks[PathArena::KeyParent(b->key)];
+            if (rankA != rankB) {
+                return rankA < rankB;
+            }
+            size_t sizeA = a->keySize - 4, sizeB = b->keySize - 4;
+            int order = memcmp(PathArena::KeyName(a->key), PathArena::KeyName(b->key), sizeA < sizeB ? sizeA : sizeB);
+            return order < 0 || (order == 0 && sizeA < sizeB);
+        });
+    }
+
     // Get file count
     int GetFileCount() {
-        return fileHashMap.size();
+        return (int)fileHashMap.Size();
     }
 };
 
@@ -303,42 +900,40 @@ private:
     string sourcePath;
     string destPath;
     BackupStats stats;
+    PathArena paths;  // Directories under the source root
     DeduplicationStore store;
     DeduplicationIndex index;
-
-    string NormalizePath(const string& path) {
-        string normalized = path;
-        if (!normalized.empty() && normalized.back() != '\\') {
-            normalized += '\\';
-        }
-        return normalized;
-    }
-
-    string GetRelativePath(const string& fullPath, const string& basePath) {
-        if (fullPath.find(basePath) == 0) {
-            return fullPath.substr(basePath.length());
-        }
-        return fullPath;
-    }
+    HashCache hashCache;
+    RunProgress progress;  // Finished directories, for --resume
+    bool resumeMode;  // Continue an interrupted run
+    int checkpointSeconds;
+    Directory destRoot;  // For checkpoints
+    int scanThreads;
+    int hashThreads;
+    int storeThreads;
+    int fanoutLevels;  // For a new store; -1 = default
+    long long packSize;
+    Chunker chunking;  // Chunk sizes; each hash thread works on a copy
+    bool rootAccessible;
+
+    // Scan -> hash -> store pipeline
+    BoundedQueue<HashJob> hashQueue;
+    BoundedQueue<StoreJob> storeQueue;
+    StageStats scanStage;
+    StageStats hashStage;
+    StageStats storeStage;
 
     bool CreateDestDirectory(const string& path) {
-        DWORD attribs = GetFileAttributesA(path.c_str());
-        if (attribs != INVALID_FILE_ATTRIBUTES && 
-            (attribs & FILE_ATTRIBUTE_DIRECTORY)) {
-            return true;
-        }
-
-        if (CreateDirectoryA(path.c_str(), NULL)) {
+        MkdirResult result = FileSystem::MakeDirectory(path);
+        if (result == MkdirResult::Created) {
             stats.directoriesCreated++;
             return true;
         }
-        
-        DWORD error = GetLastError();
-        if (error == ERROR_ALREADY_EXISTS) {
+        if (result == MkdirResult::AlreadyExists) {
             return true;
         }
         
-        if (error == ERROR_PATH_NOT_FOUND) {
+        if (result == MkdirResult::ParentMissing) {
             size_t pos = path.find_last_of("\\/", path.length() - 2);
             if (pos != string::npos) {
                 string parentPath = path.substr(0, pos);
@@ -351,101 +946,411 @@ private:
         return false;
     }
 
-    long long GetFileSize(WIN32_FIND_DATAA& findData) {
-        LARGE_INTEGER size;
-        size.LowPart = findData.nFileSizeLow;
-        size.HighPart = findData.nFileSizeHigh;
-        return size.QuadPart;
+    bool CreateDestChild(const Directory& parent, const char* name, Directory& child) {
+        MkdirResult result = parent.MakeChild(name);
+        if (result == MkdirResult::Created) {
+            stats.directoriesCreated++;
+        } else if (result != MkdirResult::AlreadyExists) {
+            return false;
+        }
+        return child.OpenChild(parent, name);
     }
 
-    time_t GetFileTime(WIN32_FIND_DATAA& findData) {
-        ULARGE_INTEGER ull;
-        ull.LowPart = findData.ftLastWriteTime.dwLowDateTime;
-        ull.HighPart = findData.ftLastWriteTime.dwHighDateTime;
-        return ull.QuadPart / 10000000ULL - 11644473600ULL;
+    // Whether content the hash cache reports for a file is still stored.
+    // Files above the maximum chunk size are chunked, and are only taken
+    // as unchanged if the index lists them as chunked with that digest.
+    bool IsStored(PathId directory, const string& fileName, const FileInfo& info,
+                  const Digest& hash, const Chunker& chunker, vector<Digest>& chunks) {
+        if (info.size <= (long long)chunker.MaxSize()) {
+            return store.ContentExists(hash);
+        }
+        if (index.GetHash(directory, fileName) != hash || !index.GetChunks(directory, fileName, chunks)) {
+            return false;
+        }
+        for (const Digest& chunk : chunks) {
+            if (!store.ContentExists(chunk)) {
+                return false;
+            }
+        }
+        return true;
     }
 
-    bool BackupDirectory(const string& sourceDir, const string& destDir) {
-        string searchPath = sourceDir + "*";
-        WIN32_FIND_DATAA findData;
-        HANDLE hFind = FindFirstFileA(searchPath.c_str(), &findData);
-        
-        if (hFind == INVALID_HANDLE_VALUE) {
-            cerr << "ERROR: Cannot access directory: " << sourceDir << endl;
+    // Hash a file too large for a batch: split it into chunks that are
+    // stored right away, or, with compression on, read it into memory for
+    // a pack, or else copy it into staging. false (with the error
+    // reported) if it could not be read.
+    bool HashWhole(StoreJob& result, bool chunked, Chunker& chunker) {
+        const Directory& sourceDir = *result.sourceDir;
+        const char* name = result.fileName.c_str();
+        // Key the cache on the metadata of the file as it was read
+        FileInfo info;
+        if (chunked) {
+            result.kind = StoreKind::Chunked;
+            result.hash = FileHasher::ChunkAndHash(
+                sourceDir, name, chunker, result.chunks, &info,
+                [&](const Digest& chunk, const uint8_t* data, size_t size) {
+                    StoreResult stored = store.CommitPacked(chunk, data, size);
+                    if (stored == StoreResult::Stored) {
+                        result.newBytes += (long long)size;
+                    }
+                    return stored != StoreResult::Failed;
+                });
+        } else if (store.IsCompressing()) {
+            // Packed compressed rather than copied as a blob file
+            result.kind = StoreKind::Packed;
+            result.hash = FileHasher::ReadAndHash(sourceDir, name, result.content, &info);
+        } else {
+            result.kind = StoreKind::Staged;
+            result.stagingName = store.CreateStagingName();
+            result.hash = FileHasher::CopyAndHash(sourceDir, name, store.GetStagingDir(), result.stagingName.c_str(),
+                                                  &info, &result.method);
+        }
+        if (result.hash.IsEmpty()) {
+            const char* action = chunked ? "chunk" : (result.kind == StoreKind::Packed ? "read" : "copy");
+            ConsoleLine(cerr) << "  ERROR: Failed to " << action << " and hash " << sourceDir.Path() << name
+                              << " (" << FileSystem::LastErrorString() << ")" << endl;
             stats.errors++;
+            progress.FilesDone(result.directory);
             return false;
         }
 
-        if (!CreateDestDirectory(destDir)) {
-            cerr << "ERROR: Cannot create directory: " << destDir << endl;
-            stats.errors++;
-            FindClose(hFind);
-            return false;
+        result.cacheKey = HashCacheKey::FromInfo(info);
+        result.size = info.size;
+        stats.totalBytes += result.size;
+        hashStage.items++;
+        hashStage.bytes += result.size;
+        return true;
+    }
+
+    // Hasher stage: copy one file into staging while hashing it, so the
+    // source is read once. Small files are collected in batch and hashed
+    // together, and the rest go through HashWhole and are passed on to
+    // the store stage. Files the hash cache knows as unchanged are not
+    // read at all. identified says whether info holds the file's metadata.
+    void HashFile(HashJob& job, bool identified, const FileInfo& info, FileHashBatch& batch,
+                  vector<StoreJob>& batchJobs, Chunker& chunker) {
+        StoreJob result;
+        result.sourceDir = std::move(job.sourceDir);
+        result.fileName = std::move(job.fileName);
+        result.directory = job.directory;
+        bool batched = false;
+        {
+            StageTimer timer(hashStage);
+
+            if (identified && hashCache.Lookup(HashCacheKey::FromInfo(info), result.hash) &&
+                IsStored(result.directory, result.fileName, info, result.hash, chunker, result.chunks)) {
+                result.cacheKey = HashCacheKey::FromInfo(info);
+                result.size = info.size;
+                stats.totalBytes += result.size;
+                hashStage.items++;
+            } else if (info.size <= FileHashBatch::SMALL_FILE_SIZE) {
+                // Also taken when the file could not be identified; the
+                // batch reports the error
+                batch.Add(*result.sourceDir, result.fileName.c_str(), identified ? &info : nullptr);
+                result.hash.Clear();
+                result.kind = StoreKind::Packed;
+                batchJobs.push_back(std::move(result));
+                batched = true;
+            } else {
+                result.hash.Clear();
+                if (!HashWhole(result, info.size > (long long)chunker.MaxSize(), chunker)) {
+                    return;
+                }
+            }
         }
 
-        do {
-            string fileName = findData.cFileName;
-            
-            if (fileName == "." || fileName == "..") {
+        if (batched) {
+            if (batch.IsFull()) {
+                FlushBatch(batch, batchJobs, chunker);
+            }
+            return;
+        }
+        storeQueue.Push(std::move(result));
+    }
+
+    // Read and hash the collected small files, then pass them on with
+    // their content. A file that grew past the batch limit since it was
+    // identified goes through HashWhole instead.
+    void FlushBatch(FileHashBatch& batch, vector<StoreJob>& batchJobs, Chunker& chunker) {
+        if (batch.Size() == 0) {
+            return;
+        }
+
+        {
+            StageTimer timer(hashStage);
+            batch.Flush();
+        }
+
+        for (size_t i = 0; i < batch.Size(); i++) {
+            StoreJob& result = batchJobs[i];
+            FileHashBatch::Status status = batch.Result(i);
+            if (status == FileHashBatch::Status::TooLarge) {
+                StageTimer timer(hashStage);
+                if (HashWhole(result, batch.Info(i).size > (long long)chunker.MaxSize(), chunker)) {
+                    storeQueue.Push(std::move(result));
+                }
+                continue;
+            }
+            if (status == FileHashBatch::Status::Failed) {
+                ConsoleLine(cerr) << "  ERROR: Failed to read and hash " << result.sourceDir->Path()
+                                  << result.fileName << " (" << FileSystem::LastErrorString() << ")" << endl;
+                stats.errors++;
+                progress.FilesDone(result.directory);
                 continue;
             }
 
-            string sourceFullPath = sourceDir + fileName;
-            string destFullPath = destDir + fileName;
-            string relativePath = GetRelativePath(sourceFullPath, sourcePath);
-            
-            stats.filesProcessed++;
+            result.hash = batch.Hash(i);
+            result.content = batch.TakeContent(i);
+            result.cacheKey = HashCacheKey::FromInfo(batch.Info(i));
+            result.size = batch.Info(i).size;
+            stats.totalBytes += result.size;
+            hashStage.items++;
+            hashStage.bytes += result.size;
+            storeQueue.Push(std::move(result));
+        }
+
+        batch.Clear();
+        batchJobs.clear();
+    }
+
+    // Store stage: commit new content or reference existing content
+    void StoreFile(StoreJob& job) {
+        StageTimer timer(storeStage);
+        storeStage.items++;
 
-            if (findData.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-                cout << "\nEntering directory: " << sourceFullPath << endl;
-                BackupDirectory(sourceFullPath + "\\", destFullPath + "\\");
+        // Unchanged since the last run: its content is stored already
+        if (job.kind == StoreKind::Unchanged) {
+            if (job.chunks.empty()) {
+                store.IncrementReference(job.hash);
+            }
+            for (const Digest& chunk : job.chunks) {
+                store.IncrementReference(chunk);
+            }
+            ConsoleLine(cout) << "  [UNCHANGED] " << job.sourceDir->Path() << job.fileName << endl;
+            stats.filesUnchanged++;
+            stats.bytesDeduplicated += job.size;
+            hashCache.Record(job.cacheKey, job.hash);
+            index.AddFile(job.directory, job.fileName, job.hash, job.chunks);
+            return;
+        }
+
+        // Chunks are in the store already; count what they added
+        if (job.kind == StoreKind::Chunked) {
+            if (job.newBytes > 0) {
+                ConsoleLine(cout) << "  [NEW] " << job.sourceDir->Path() << job.fileName << " ("
+                                  << job.chunks.size() << " chunks, " << job.newBytes << " bytes new)" << endl;
+                stats.filesCopied++;
             } else {
-                long long fileSize = GetFileSize(findData);
-                stats.totalBytes += fileSize;
-
-                // Calculate hash
-                string fileHash = FileHasher::CalculateHash(sourceFullPath);
-                if (fileHash.empty()) {
-                    cerr << "  ERROR: Failed to calculate hash" << endl;
-                    stats.errors++;
-                    continue;
-                }
+                ConsoleLine(cout) << "  [DEDUP] " << job.sourceDir->Path() << job.fileName << " ("
+                                  << job.chunks.size() << " chunks, all stored)" << endl;
+                stats.filesDeduped++;
+            }
+            stats.filesChunked++;
+            stats.bytesCopied += job.newBytes;
+            stats.bytesByMethod[(int)CopyMethod::Buffered] += job.newBytes;
+            stats.bytesDeduplicated += job.size - job.newBytes;
+            storeStage.bytes += job.newBytes;
+            hashCache.Record(job.cacheKey, job.hash);
+            index.AddFile(job.directory, job.fileName, job.hash, job.chunks);
+            return;
+        }
 
-                // Check if content already exists in store
-                if (store.ContentExists(fileHash)) {
-                    // Content already stored - just reference it
-                    cout << "  [DEDUP] " << sourceFullPath << " (already stored)" << endl;
-                    stats.filesDeduped++;
-                    stats.bytesDeduplicated += fileSize;
-                    store.IncrementReference(fileHash);
-                } else {
-                    // New content - store it
-                    cout << "  [NEW] " << sourceFullPath << endl;
-                    if (store.StoreContent(sourceFullPath, fileHash)) {
-                        stats.filesCopied++;
-                        stats.bytesCopied += fileSize;
-                    } else {
-                        cerr << "  ERROR: Failed to store content" << endl;
-                        stats.errors++;
-                        continue;
-                    }
+        // Append small files to a pack; commit the staged copy of others.
+        // Either is dropped if the content is already stored.
+        StoreResult result = job.kind == StoreKind::Packed
+            ? store.CommitPacked(job.hash, job.content.data(), job.content.size())
+            : store.CommitContent(job.stagingName, job.hash);
+        if (result == StoreResult::AlreadyStored) {
+            ConsoleLine(cout) << "  [DEDUP] " << job.sourceDir->Path() << job.fileName << " (already stored)" << endl;
+            stats.filesDeduped++;
+            stats.bytesDeduplicated += job.size;
+        } else if (result == StoreResult::Stored) {
+            ConsoleLine(cout) << "  [NEW] " << job.sourceDir->Path() << job.fileName << endl;
+            stats.filesCopied++;
+            stats.bytesCopied += job.size;
+            stats.bytesByMethod[(int)job.method] += job.size;
+            storeStage.bytes += job.size;
+            if (job.kind == StoreKind::Packed) {
+                stats.filesPacked++;
+            }
+        } else {
+            ConsoleLine(cerr) << "  ERROR: Failed to store content" << endl;
+            stats.errors++;
+            return;
+        }
+
+        // Add to index
+        hashCache.Record(job.cacheKey, job.hash);
+        index.AddFile(job.directory, job.fileName, job.hash);
+    }
+
+    // Take files off the hash queue as many at a time as are queued, up
+    // to a ring's batch, and stat them together for the hash cache
+    void HashWorker() {
+        FileHashBatch batch;
+        vector<StoreJob> batchJobs;
+        Chunker chunker = chunking;
+        vector<HashJob> jobs(IoRing::MAX_BATCH);
+        const Directory* dirs[IoRing::MAX_BATCH];
+        const char* names[IoRing::MAX_BATCH];
+        FileInfo infos[IoRing::MAX_BATCH];
+        bool identified[IoRing::MAX_BATCH];
+        for (;;) {
+            if (!hashQueue.TryPop(jobs[0])) {
+                // Nothing queued: don't hold small files back while waiting
+                FlushBatch(batch, batchJobs, chunker);
+                if (!hashQueue.Pop(jobs[0])) {
+                    break;
+                }
+            }
+            size_t count = 1;
+            while (count < jobs.size() && hashQueue.TryPop(jobs[count])) {
+                count++;
+            }
+            {
+                StageTimer timer(hashStage);
+                for (size_t i = 0; i < count; i++) {
+                    dirs[i] = jobs[i].sourceDir.get();
+                    infos[i] = FileInfo();
+                    names[i] = jobs[i].fileName.c_str();
                 }
+                HashCache::IdentifyMany(batch.Ring(), dirs, names, count, infos, identified);
+            }
+            for (size_t i = 0; i < count; i++) {
+                HashFile(jobs[i], identified[i], infos[i], batch, batchJobs, chunker);
+            }
+        }
+        FlushBatch(batch, batchJobs, chunker);
+    }
+
+    void StoreWorker() {
+        StoreJob job;
+        while (storeQueue.Pop(job)) {
+            StoreFile(job);
+            progress.FilesDone(job.directory);
+        }
+    }
 
-                // Add to index
-                index.AddFile(relativePath, fileHash);
+    // Scanner stage: run one walker task (a directory)
+    void ProcessTask(ParallelWalker& walker, WalkTask& task, int worker) {
+        StageTimer timer(scanStage);
+
+        // Done by the run being resumed
+        if (progress.Resumed(task.directory) == RunProgress::State::TreeDone) {
+            progress.SkipTree(task.directory);
+            stats.directoriesResumed++;
+            return;
+        }
+
+        // The root task carries the open source/destination directly
+        if (task.name.empty()) {
+            rootAccessible = BackupDirectory(walker, task.sourceParent, task.destParent, PathArena::ROOT, worker);
+            return;
+        }
+
+        ConsoleLine(cout) << "\nEntering directory: " << task.sourceParent->Path() << task.name << endl;
+
+        shared_ptr<Directory> sourceDir = make_shared<Directory>();
+        if (!sourceDir->OpenChild(*task.sourceParent, task.name.c_str())) {
+            ConsoleLine(cerr) << "ERROR: Cannot access directory: " << sourceDir->Path() << endl;
+            stats.errors++;
+            return;
+        }
+
+        shared_ptr<Directory> destDir = make_shared<Directory>();
+        if (!CreateDestChild(*task.destParent, task.name.c_str(), *destDir)) {
+            ConsoleLine(cerr) << "ERROR: Cannot create directory: " << task.destParent->Path() << task.name << endl;
+            stats.errors++;
+            return;
+        }
+
+        BackupDirectory(walker, sourceDir, destDir, task.directory, worker);
+    }
+
+    // Scan one directory: files go to the hash queue, subdirectories are
+    // queued on the walker. Files the resumed run backed up already are
+    // passed over.
+    bool BackupDirectory(ParallelWalker& walker, const shared_ptr<Directory>& sourceDir,
+                         const shared_ptr<Directory>& destDir, PathId directory, int worker) {
+        DirectoryReader reader(*sourceDir);
+        
+        if (!reader.IsOpen()) {
+            ConsoleLine(cerr) << "ERROR: Cannot access directory: " << sourceDir->Path() << endl;
+            stats.errors++;
+            return false;
+        }
+
+        progress.Enter(directory);
+        bool filesDone = progress.Resumed(directory) == RunProgress::State::FilesDone;
+        if (filesDone) {
+            stats.directoriesResumed++;
+        }
+
+        DirEntry entry;
+        while (reader.Next(entry)) {
+            if (IsDotEntry(entry.name)) {
+                continue;
             }
-            
-        } while (FindNextFileA(hFind, &findData));
 
-        FindClose(hFind);
+            EntryType type = reader.GetType(entry);
+            if (filesDone && type != EntryType::Directory) {
+                continue;
+            }
+            stats.filesProcessed++;
+            scanStage.items++;
+
+            if (type == EntryType::Unknown) {
+                ConsoleLine(cerr) << "ERROR: Cannot read attributes: " << sourceDir->Path() << entry.name << endl;
+                stats.errors++;
+                continue;
+            }
+
+            if (type == EntryType::Directory) {
+                WalkTask child;
+                child.sourceParent = sourceDir;
+                child.destParent = destDir;
+                child.name.assign(entry.name, entry.nameLength);
+                child.directory = paths.Intern(directory, child.name);
+                progress.AddSubdirectory(directory);
+                walker.Push(worker, std::move(child));
+            } else if (type == EntryType::File) {
+                // Hand the file to the hasher pool (blocks while the queue is full)
+                HashJob job;
+                job.sourceDir = sourceDir;
+                job.fileName.assign(entry.name, entry.nameLength);
+                job.directory = directory;
+                progress.AddFiles(directory);
+                hashQueue.Push(std::move(job));
+            } else {
+                ConsoleLine(cout) << "  Skipping special file: " << sourceDir->Path() << entry.name << endl;
+            }
+        }
+
+        progress.FilesDone(directory);
         return true;
     }
 
 public:
-    DeduplicationBackup(const string& src, const string& dst)
-        : store(dst), index(dst) {
+    DeduplicationBackup(const string& src, const string& dst, int scanners, int hashers, int writers,
+                        int fanout = -1, long long packBytes = PackStore::DEFAULT_PACK_SIZE,
+                        const Chunker& chunkSizes = Chunker(), Codec codec = Codec::None,
+                        int compressionLevel = Compressor::DEFAULT_ZSTD_LEVEL)
+        : store(dst), index(dst, paths), hashCache(dst), progress(dst, ".dedup_progress.journal", paths),
+          resumeMode(false), checkpointSeconds(RunProgress::DEFAULT_INTERVAL_SECONDS), scanThreads(max(1, scanners)), hashThreads(max(1, hashers)), storeThreads(max(1, writers)),
+          fanoutLevels(fanout), packSize(packBytes), chunking(chunkSizes),
+          rootAccessible(true),
+          hashQueue(HASH_QUEUE_CAPACITY), storeQueue(STORE_QUEUE_CAPACITY),
+          scanStage("scan", scanThreads), hashStage("hash", hashThreads), storeStage("store", storeThreads) {
         sourcePath = NormalizePath(src);
         destPath = NormalizePath(dst);
+        store.SetCompression(codec, compressionLevel);
+    }
+
+    // Continue an interrupted run, and how often to checkpoint (0: never);
+    // call before StartBackup
+    void SetResume(bool resume, int intervalSeconds) {
+        resumeMode = resume;
+        checkpointSeconds = intervalSeconds;
     }
 
     bool StartBackup() {
@@ -458,38 +1363,124 @@ public:
         cout << "========================================\n" << endl;
 
         // Initialize deduplication store
-        if (!store.Initialize()) {
+        if (!store.Initialize(fanoutLevels, packSize)) {
             cerr << "ERROR: Failed to initialize deduplication store" << endl;
             return false;
         }
+        if (store.IsMigrationPending()) {
+            cerr << "ERROR: A store layout migration was interrupted; run --migrate-store again" << endl;
+            return false;
+        }
+        store.LoadContents();
 
         // Load existing index
         bool hasIndex = index.Load();
         if (hasIndex) {
-            store.LoadReferenceCountsFromIndex(index.GetAllFiles());
+            store.LoadReferenceCountsFromIndex(index.GetAllFiles(), index.GetAllChunkLists());
             cout << "Loaded existing index with " << index.GetFileCount() << " files" << endl;
         }
+        if (hashCache.Load()) {
+            cout << "Loaded hash cache with " << hashCache.PreviousCount() << " files" << endl;
+        }
+        if (resumeMode && progress.Load(sourcePath)) {
+            cout << "Resume: " << progress.ResumedCount() << " directories done by the interrupted run" << endl;
+        } else if (resumeMode) {
+            cout << "Resume: no interrupted run of this source; backing up everything" << endl;
+        }
 
-        cout << "Dedup store: " << store.GetStorePath() << "\n" << endl;
+        cout << "Dedup store: " << store.GetStorePath() << " (" << store.GetContentCount() << " blobs)" << endl;
+        cout << "Threads: " << scanThreads << " scan, " << hashThreads << " hash, "
+             << storeThreads << " store" << endl;
+        cout << "Small files: " << (IoRing::Available() ? "read in io_uring batches" : "read one at a time")
+             << "\n" << endl;
 
         // Verify source exists
-        DWORD attribs = GetFileAttributesA(sourcePath.c_str());
-        if (attribs == INVALID_FILE_ATTRIBUTES) {
+        FileInfo sourceInfo;
+        if (!FileSystem::GetInfo(sourcePath, sourceInfo)) {
             cerr << "ERROR: Source directory does not exist!" << endl;
             return false;
         }
-        if (!(attribs & FILE_ATTRIBUTE_DIRECTORY)) {
+        if (sourceInfo.type != EntryType::Directory) {
             cerr << "ERROR: Source path is not a directory!" << endl;
             return false;
         }
 
-        // Start backup
-        bool result = BackupDirectory(sourcePath, destPath);
-        
+        WalkTask root;
+        root.sourceParent = make_shared<Directory>();
+        if (!root.sourceParent->Open(sourcePath)) {
+            cerr << "ERROR: Cannot access directory: " << sourcePath << endl;
+            return false;
+        }
+
+        root.destParent = make_shared<Directory>();
+        if (!CreateDestDirectory(destPath) || !root.destParent->Open(destPath)) {
+            cerr << "ERROR: Cannot create directory: " << destPath << endl;
+            return false;
+        }
+        if (!index.BeginRun() || !hashCache.BeginRun(resumeMode)) {
+            cerr << "WARNING: Cannot open the index journals; changes will not be saved" << endl;
+        }
+        // A checkpoint flushes the stored content, then commits the index
+        // and hash cache records for it, before directories are recorded
+        // as done
+        destRoot.Open(destPath);
+        if (!progress.Begin(sourcePath, resumeMode, checkpointSeconds, [this] {
+                return store.FlushPackBuffer() && destRoot.SyncFileSystem() && index.Sync() &&
+                       hashCache.Checkpoint();
+            })) {
+            cerr << "WARNING: Cannot open the progress journal; this run cannot be resumed" << endl;
+        }
+
+        // Start the hasher and writer pools, then scan on this thread
+        vector<thread> hashers, writers;
+        hashStage.Start();
+        for (int i = 0; i < hashThreads; i++) {
+            hashers.emplace_back(&DeduplicationBackup::HashWorker, this);
+        }
+        storeStage.Start();
+        for (int i = 0; i < storeThreads; i++) {
+            writers.emplace_back(&DeduplicationBackup::StoreWorker, this);
+        }
+
+        scanStage.Start();
+        ParallelWalker walker(scanThreads);
+        walker.Run(std::move(root), [this, &walker](WalkTask& task, int worker) {
+            ProcessTask(walker, task, worker);
+        });
+        scanStage.Stop();
+        // Time blocked on a full hash queue is backpressure, not scanning
+        scanStage.busyNs -= hashQueue.PushStallNs();
+
+        // Drain the pipeline stage by stage
+        hashQueue.Close();
+        for (auto& worker : hashers) {
+            worker.join();
+        }
+        hashStage.Stop();
+        storeQueue.Close();
+        for (auto& worker : writers) {
+            worker.join();
+        }
+        storeStage.Stop();
+        bool result = rootAccessible;
+
         // Save updated index
+        if (!progress.End()) {
+            cerr << "WARNING: Failed to checkpoint progress" << endl;
+        }
         if (!index.Save()) {
             cerr << "WARNING: Failed to save index file" << endl;
         }
+        if (!hashCache.Save()) {
+            cerr << "WARNING: Failed to save hash cache" << endl;
+        }
+        if (!store.FlushPacks()) {
+            cerr << "ERROR: Failed to write pack files (" << FileSystem::LastErrorString() << ")" << endl;
+            result = false;
+        }
+        if (!store.SaveCatalog()) {
+            cerr << "WARNING: Failed to save store catalog" << endl;
+        }
 
         // Print statistics
         PrintStats();
@@ -502,15 +1493,28 @@ public:
         cout << "  BACKUP COMPLETE" << endl;
         cout << "========================================" << endl;
         cout << "Files processed:      " << stats.filesProcessed << endl;
-        cout << "Files copied:         " << stats.filesCopied << " (new content)" << endl;
+        cout << "Files copied:         " << stats.filesCopied << " (new content, "
+             << stats.filesPacked << " packed)" << endl;
         cout << "Files deduplicated:   " << stats.filesDeduped << " (shared content)" << endl;
+        cout << "Files unchanged:      " << stats.filesUnchanged << " (hash cache)" << endl;
+        cout << "Files chunked:        " << stats.filesChunked << " (over " << chunking.MaxSize() / 1024
+             << " KiB)" << endl;
         cout << "Directories created:  " << stats.directoriesCreated << endl;
+        if (resumeMode) {
+            cout << "Directories resumed:  " << stats.directoriesResumed << endl;
+        }
         cout << "Errors:               " << stats.errors << endl;
         
         cout << "\nStorage Analysis:" << endl;
         cout << "Total source size:    " << FormatBytes(stats.totalBytes) << endl;
         cout << "Actual data stored:   " << FormatBytes(stats.bytesCopied) << endl;
+        PrintCopyMethods();
         cout << "Space saved (dedup):  " << FormatBytes(stats.bytesDeduplicated) << endl;
+        if (store.IsCompressing()) {
+            cout << "Compressed:           " << FormatBytes(store.GetCompressedInput()) << " -> "
+                 << FormatBytes(store.GetCompressedOutput()) << " (" << Compressor::Name(store.GetCodec()) << ")"
+                 << endl;
+        }
         
         if (stats.totalBytes > 0) {
             double dedupePercent = (stats.bytesDeduplicated * 100.0) / stats.totalBytes;
@@ -518,10 +1522,28 @@ public:
             cout << "Deduplication rate:   " << fixed << setprecision(1) << dedupePercent << "%" << endl;
             cout << "Compression ratio:    " << compressionRatio << "%" << endl;
         }
+
+        cout << "\nPipeline:" << endl;
+        PrintStageReport(cout, scanStage);
+        PrintStageReport(cout, hashStage);
+        PrintStageReport(cout, storeStage);
+        PrintQueueReport(cout, "scan->hash", hashQueue);
+        PrintQueueReport(cout, "hash->store", storeQueue);
         
         cout << "========================================" << endl;
     }
 
+    // Bytes stored by each way of copying that was used; packed and
+    // chunked content is written through user space
+    void PrintCopyMethods() {
+        for (int i = 0; i < COPY_METHOD_COUNT; i++) {
+            if (stats.bytesByMethod[i] > 0) {
+                string label = string("  - ") + CopyMethodName((CopyMethod)i) + ":";
+                cout << left << setw(22) << label << right << FormatBytes(stats.bytesByMethod[i]) << endl;
+            }
+        }
+    }
+
     string FormatBytes(long long bytes) {
         const char* units[] = {"B", "KB", "MB", "GB", "TB"};
         int unitIndex = 0;
@@ -538,12 +1560,187 @@ public:
     }
 };
 
+// Convert the store of a backup to another fan-out layout in place
+int MigrateStore(const string& dest, int levels) {
+    DeduplicationStore store(dest);
+    if (!store.Initialize()) {
+        cerr << "ERROR: Failed to initialize deduplication store" << endl;
+        return 1;
+    }
+
+    cout << "Migrating " << store.GetStorePath() << " from " << store.GetFanoutLevels()
+         << " to " << levels << " fan-out levels" << endl;
+    size_t moved = 0;
+    bool success = store.MigrateLayout(levels, moved);
+    cout << "Blobs moved: " << moved << endl;
+    if (!success) {
+        cout << "\nMigration incomplete; run it again to finish" << endl;
+        return 1;
+    }
+    cout << "\nMigration completed successfully!" << endl;
+    return 0;
+}
+
+// Write every file in a backup's index to target, from the blob files
+// and packs of its store
+int RestoreBackup(const string& dest, const string& target) {
+    PathArena paths;
+    DeduplicationStore store(dest);
+    DeduplicationIndex index(dest, paths);
+    if (!store.Initialize()) {
+        cerr << "ERROR: Failed to initialize deduplication store" << endl;
+        return 1;
+    }
+    if (!index.Load()) {
+        cerr << "ERROR: No backup index in " << NormalizePath(dest) << endl;
+        return 1;
+    }
+    store.LoadPackLocations();
+
+    string targetPath = NormalizePath(target);
+    MkdirResult result = FileSystem::MakeDirectory(targetPath);
+    Directory targetDir;
+    if ((result != MkdirResult::Created && result != MkdirResult::AlreadyExists) || !targetDir.Open(targetPath)) {
+        cerr << "ERROR: Cannot create restore directory: " << targetPath << endl;
+        return 1;
+    }
+
+    cout << "Restoring " << index.GetFileCount() << " files to " << targetPath << endl;
+    vector<bool> created(paths.Count());
+    created[PathArena::ROOT] = true;
+    int restored = 0, errors = 0;
+    string path;
+    for (const PathMap<Digest>::Entry* entry : index.GetSortedFiles()) {
+        PathId directory = PathArena::KeyParent(entry->key);
+        string name(PathArena::KeyName(entry->key), entry->keySize - 4);
+
+        // Create the directory and its parents, each once
+        vector<PathId> missing;
+        for (PathId id = directory; !created[id]; id = paths.Parent(id)) {
+            missing.push_back(id);
+        }
+        for (size_t i = missing.size(); i-- > 0;) {
+            string parent = paths.Path(missing[i]);
+            parent.pop_back();
+            targetDir.MakeChild(parent.c_str());
+            created[missing[i]] = true;
+        }
+
+        path.clear();
+        paths.AppendPath(directory, path);
+        path += name;
+        vector<Digest> chunks;
+        bool ok = index.GetChunks(directory, name, chunks) ? store.RestoreChunks(chunks, targetDir, path.c_str())
+                                                : store.RestoreContent(entry->value, targetDir, path.c_str());
+        if (ok) {
+            restored++;
+        } else {
+            cerr << "  ERROR: Cannot restore " << targetPath << path
+                 << " (" << FileSystem::LastErrorString() << ")" << endl;
+            errors++;
+        }
+    }
+
+    cout << "Files restored: " << restored << endl;
+    cout << "Errors:         " << errors << endl;
+    return errors == 0 ? 0 : 1;
+}
+
 int main(int argc, char* argv[]) {
     string source, dest;
-    
+    int threads = DefaultWorkerCount();
+    int scanners = 0, hashers = 0, writers = 0;  // 0 = derive from threads
+    int fanout = -1;
+    long long packSize = PackStore::DEFAULT_PACK_SIZE;
+    Chunker chunkSizes;
+    Codec codec = Codec::None;
+    int compressionLevel = Compressor::DEFAULT_ZSTD_LEVEL;
+    bool resume = false;
+    int checkpointSeconds = RunProgress::DEFAULT_INTERVAL_SECONDS;
+
+    // backup.exe --migrate-store <dest_path> [--fanout N]
+    if (argc >= 3 && string(argv[1]) == "--migrate-store") {
+        int levels = StoreLayout::DEFAULT_LEVELS;
+        if (argc >= 5 && string(argv[3]) == "--fanout") {
+            levels = atoi(argv[4]);
+        }
+        if (levels < 0 || levels > StoreLayout::MAX_LEVELS) {
+            cerr << "ERROR: --fanout must be between 0 and " << StoreLayout::MAX_LEVELS << endl;
+            return 1;
+        }
+        return MigrateStore(argv[2], levels);
+    }
+
+    // backup.exe --restore <dest_path> <target_path>
+    if (argc >= 4 && string(argv[1]) == "--restore") {
+        return RestoreBackup(argv[2], argv[3]);
+    }
+
     if (argc >= 3) {
         source = argv[1];
         dest = argv[2];
+
+        // Check for thread options
+        for (int i = 3; i < argc; i++) {
+            string arg = argv[i];
+            if (arg == "--resume") {
+                resume = true;
+            } else if ((arg == "--threads" || arg == "-j") && i + 1 < argc) {
+                threads = atoi(argv[++i]);
+            } else if (arg == "--checkpoint-interval" && i + 1 < argc) {
+                checkpointSeconds = atoi(argv[++i]);
+            } else if (arg == "--scan-threads" && i + 1 < argc) {
+                scanners = atoi(argv[++i]);
+            } else if (arg == "--hash-threads" && i + 1 < argc) {
+                hashers = atoi(argv[++i]);
+            } else if (arg == "--store-threads" && i + 1 < argc) {
+                writers = atoi(argv[++i]);
+            } else if (arg == "--fanout" && i + 1 < argc) {
+                fanout = atoi(argv[++i]);
+                if (fanout < 0 || fanout > StoreLayout::MAX_LEVELS) {
+                    cerr << "ERROR: --fanout must be between 0 and " << StoreLayout::MAX_LEVELS << endl;
+                    return 1;
+                }
+            } else if (arg == "--chunk-sizes" && i + 1 < argc) {
+                // MIN,AVG,MAX in KiB
+                char* next = argv[++i];
+                size_t sizes[3] = {0, 0, 0};
+                for (int k = 0; k < 3 && *next; k++) {
+                    sizes[k] = (size_t)strtoul(next, &next, 10) * 1024;
+                    if (*next == ',') next++;
+                }
+                if (!Chunker::ValidSizes(sizes[0], sizes[1], sizes[2])) {
+                    cerr << "ERROR: --chunk-sizes takes MIN,AVG,MAX in KiB, with MIN <= AVG <= MAX <= "
+                         << Chunker::LARGEST_MAX_SIZE / 1024 << endl;
+                    return 1;
+                }
+                chunkSizes = Chunker(sizes[0], sizes[1], sizes[2]);
+            } else if (arg == "--pack-size" && i + 1 < argc) {
+                packSize = atoll(argv[++i]) << 20;
+                if (packSize < PackStore::MIN_PACK_SIZE || packSize > PackStore::MAX_PACK_SIZE) {
+                    cerr << "ERROR: --pack-size must be between " << (PackStore::MIN_PACK_SIZE >> 20)
+                         << " and " << (PackStore::MAX_PACK_SIZE >> 20) << " MiB" << endl;
+                    return 1;
+                }
+            } else if (arg == "--compress" && i + 1 < argc) {
+                // none, lz4 or zstd[:LEVEL]
+                string value = argv[++i];
+                size_t colon = value.find(':');
+                if (colon != string::npos) {
+                    compressionLevel = atoi(value.c_str() + colon + 1);
+                    value.resize(colon);
+                }
+                if (!Compressor::Parse(value, codec)) {
+                    cerr << "ERROR: --compress takes none, lz4 or zstd[:LEVEL]" << endl;
+                    return 1;
+                }
+                if (!Compressor::IsAvailable(codec)) {
+                    cerr << "ERROR: This build has no " << value << " support (build with -DBACKUP_WITH_ZSTD -lzstd)"
+                         << endl;
+                    return 1;
+                }
+            }
+        }
     } else {
         cout << "Enter source directory path: ";
         getline(cin, source);
@@ -554,12 +1751,25 @@ int main(int argc, char* argv[]) {
 
     if (source.empty() || dest.empty()) {
         cerr << "ERROR: Source and destination paths are required!" << endl;
-        cout << "\nUsage: backup.exe <source_path> <dest_path>" << endl;
+        cout << "\nUsage: backup.exe <source_path> <dest_path> [--threads N]" << endl;
+        cout << "       [--scan-threads N] [--hash-threads N] [--store-threads N] [--fanout 0-2]" << endl;
+        cout << "       [--pack-size MiB] [--chunk-sizes MIN,AVG,MAX (KiB)] [--compress none|lz4|zstd[:LEVEL]]"
+             << endl;
+        cout << "       [--resume] [--checkpoint-interval SECONDS (0 = none)]" << endl;
+        cout << "       backup.exe --migrate-store <dest_path> [--fanout 0-2]" << endl;
+        cout << "       backup.exe --restore <dest_path> <target_path>" << endl;
         cout << "Example: backup.exe C:\\MyDocuments D:\\Backup" << endl;
         return 1;
     }
 
-    DeduplicationBackup backup(source, dest);
+    // Hashing is the CPU-bound stage; scanning and storing need fewer threads
+    if (scanners <= 0) scanners = max(1, threads / 4);
+    if (hashers <= 0) hashers = max(1, threads);
+    if (writers <= 0) writers = max(1, threads / 2);
+
+    DeduplicationBackup backup(source, dest, scanners, hashers, writers, fanout, packSize, chunkSizes,
+                               codec, compressionLevel);
+    backup.SetResume(resume, checkpointSeconds);
     bool success = backup.StartBackup();
     
     if (success) {